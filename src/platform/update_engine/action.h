@@ -8,6 +8,7 @@
 #include <stdio.h>
 #include <tr1/memory>
 #include <iostream>
+#include <vector>
 #include "base/basictypes.h"
 #include "chromeos/obsolete_logging.h"
 #include "update_engine/action_processor.h"
@@ -67,7 +68,7 @@ namespace chromeos_update_engine {
 // It is handy to have a non-templated base class of all Actions.
 class AbstractAction {
  public:
-  AbstractAction() : processor_(NULL) {}
+  AbstractAction() : processor_(NULL), bytes_in_(0), bytes_out_(0) {}
 
   // Begin performing the action. Since this code is asynchronous, when this
   // method returns, it means only that the action has started, not necessarily
@@ -91,11 +92,24 @@ class AbstractAction {
     processor_ = processor;
   }
 
-  // Returns true iff the action is the current action of its ActionProcessor.
+  // Returns true iff the action is one of the running actions of its
+  // ActionProcessor.
   bool IsRunning() const {
     if (!processor_)
       return false;
-    return processor_->current_action() == this;
+    return processor_->IsActionRunning(this);
+  }
+
+  // Makes this Action wait for prerequisite to complete when its
+  // ActionProcessor runs Actions concurrently. ActionPipe::Bond() calls this,
+  // so it's only needed for ordering that no pipe expresses.
+  void AddDependency(AbstractAction* prerequisite) {
+    dependencies_.push_back(prerequisite);
+  }
+
+  // The Actions this one waits for.
+  const std::vector<AbstractAction*>& dependencies() const {
+    return dependencies_;
   }
 
   // Called on asynchronous actions if canceled. Actions may implement if
@@ -111,9 +125,24 @@ class AbstractAction {
   // Type() would return "DownloadAction".
   virtual std::string Type() const = 0;
 
+  // How many bytes this Action has read and written, for ActionStats.
+  uint64 bytes_in() const { return bytes_in_; }
+  uint64 bytes_out() const { return bytes_out_; }
+
  protected:
+  // Actions that move data call these as they go. They may be called from a
+  // helper thread, as long as the action completes on the main thread
+  // afterwards.
+  void AddBytesIn(uint64 count) { bytes_in_ += count; }
+  void AddBytesOut(uint64 count) { bytes_out_ += count; }
+
   // A weak pointer to the processor that owns this Action.
   ActionProcessor* processor_;
+
+ private:
+  uint64 bytes_in_;
+  uint64 bytes_out_;
+  std::vector<AbstractAction*> dependencies_;
 };
 
 // Forward declare a couple classes we use.
@@ -167,6 +196,16 @@ class Action : public AbstractAction {
     return in_pipe_->contents();
   }
 
+  // Moves the object in the input pipe into *in_obj without copying it (see
+  // ActionPipe::swap_contents()), leaving the pipe with *in_obj's old value.
+  // For objects that are expensive to copy; the input object can't be read
+  // from the pipe again afterwards.
+  void MoveInputObject(
+      typename ActionTraits<SubClass>::InputObjectType* in_obj) {
+    CHECK(HasInputObject());
+    in_pipe_->swap_contents(in_obj);
+  }
+
   // Returns true iff there's an output pipe.
   bool HasOutputPipe() const {
     return out_pipe_.get();
@@ -181,6 +220,14 @@ class Action : public AbstractAction {
     out_pipe_->set_contents(out_obj);
   }
 
+  // Like SetOutputObject(), but moves *out_obj into the output pipe without
+  // copying it, leaving *out_obj with the pipe's old contents.
+  void MoveOutputObject(
+      typename ActionTraits<SubClass>::OutputObjectType* out_obj) {
+    CHECK(HasOutputPipe());
+    out_pipe_->swap_contents(out_obj);
+  }
+
   // Returns a reference to the object sitting in the output pipe.
   const typename ActionTraits<SubClass>::OutputObjectType& GetOutputObject() {
     CHECK(HasOutputPipe());
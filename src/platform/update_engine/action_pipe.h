@@ -6,6 +6,7 @@
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_PIPE_H__
 
 #include <stdio.h>
+#include <algorithm>
 #include <iostream>
 #include <map>
 #include <string>
@@ -28,6 +29,12 @@
 // An ActionPipe is generally created with the Bond() method and owned by
 // the two Action objects. a shared_ptr is used so that when the last Action
 // pointing to an ActionPipe dies, the ActionPipe dies, too.
+//
+// Objects that are expensive to copy can be moved through a pipe with
+// swap_contents() (see Action::MoveInputObject() and MoveOutputObject()),
+// as long as their swap() is cheap. Large objects that several Actions
+// read, such as a parsed DeltaArchiveManifest, can instead be passed as a
+// std::tr1::shared_ptr<const T>, so that only the pointer is copied.
 
 namespace chromeos_update_engine {
 
@@ -42,7 +49,7 @@ template<typename ObjectType>
 class ActionPipe {
  public:
   virtual ~ActionPipe() {
-    LOG(INFO) << "ActionPipe died";
+    DLOG(INFO) << "ActionPipe died";
   }
 
   // This should be called by an Action on its input pipe.
@@ -53,6 +60,15 @@ class ActionPipe {
   // Stores a copy of the passed object in this pipe.
   void set_contents(const ObjectType& contents) { contents_ = contents; }
 
+  // Exchanges the stored object with *contents, which moves an object into
+  // or out of this pipe without copying it if ObjectType has a cheap swap():
+  // std::string, the standard containers and std::tr1::shared_ptr do, and
+  // other types can provide one that argument-dependent lookup finds.
+  void swap_contents(ObjectType* contents) {
+    using std::swap;
+    swap(contents_, *contents);
+  }
+
   // Bonds two Actions together with a new ActionPipe. The ActionPipe is
   // jointly owned by the two Actions and will be automatically destroyed
   // when the last Action is destroyed.
@@ -65,6 +81,9 @@ class ActionPipe {
     to->set_in_pipe(pipe);  // If you get an error on this line, then
     // it most likely means that the From object's OutputObjectType is
     // different from the To object's InputObjectType.
+
+    // The input isn't there until from has run.
+    to->AddDependency(from);
   }
 
  private:
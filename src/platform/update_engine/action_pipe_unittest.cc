@@ -2,12 +2,20 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <algorithm>
 #include <string>
+#include <tr1/memory>
+#include <vector>
 #include <gtest/gtest.h>
 #include "update_engine/action.h"
 #include "update_engine/action_pipe.h"
+#include "update_engine/action_processor.h"
+#include "update_engine/install_plan.h"
+#include "update_engine/update_metadata.pb.h"
 
 using std::string;
+using std::tr1::shared_ptr;
+using std::vector;
 
 namespace chromeos_update_engine {
 
@@ -43,4 +51,147 @@ TEST(ActionPipeTest, SimpleTest) {
   EXPECT_EQ("foo", b.in_pipe()->contents());
 }
 
+namespace {
+// Counts how many times objects of this type are copied. swap() doesn't
+// copy them.
+struct CopyCountingObject {
+  CopyCountingObject() : hops(0) {}
+  CopyCountingObject(const CopyCountingObject& that)
+      : data(that.data), hops(that.hops) {
+    copies++;
+  }
+  CopyCountingObject& operator=(const CopyCountingObject& that) {
+    data = that.data;
+    hops = that.hops;
+    copies++;
+    return *this;
+  }
+  vector<char> data;
+  // How many Actions have handled the object.
+  int hops;
+  static int copies;
+};
+int CopyCountingObject::copies = 0;
+
+void swap(CopyCountingObject& a, CopyCountingObject& b) {
+  a.data.swap(b.data);
+  std::swap(a.hops, b.hops);
+}
+}  // namespace {}
+
+template<typename T>
+class ForwardingAction;
+
+template<typename T>
+class ActionTraits<ForwardingAction<T> > {
+ public:
+  typedef T InputObjectType;
+  typedef T OutputObjectType;
+};
+
+// Passes its input object on to its output pipe, either by moving it or by
+// copying it. The first Action of a pipeline passes on object_.
+template<typename T>
+class ForwardingAction : public Action<ForwardingAction<T> > {
+ public:
+  typedef T InputObjectType;
+  typedef T OutputObjectType;
+  explicit ForwardingAction(bool move) : move_(move) {}
+  void PerformAction() {
+    if (this->HasInputObject()) {
+      if (move_)
+        this->MoveInputObject(&object_);
+      else
+        object_ = this->GetInputObject();
+    }
+    Touch(&object_);
+    if (this->HasOutputPipe()) {
+      if (move_)
+        this->MoveOutputObject(&object_);
+      else
+        this->SetOutputObject(object_);
+    }
+    this->processor_->ActionComplete(this, true);
+  }
+  string Type() const { return "ForwardingAction"; }
+  T object_;
+
+ private:
+  static void Touch(CopyCountingObject* object) { object->hops++; }
+  template<typename U>
+  static void Touch(U* object) {}
+
+  const bool move_;
+};
+
+namespace {
+// Runs kPipelineLength ForwardingActions, each bonded to the next, and
+// returns the last one. The first one starts out with first_object.
+template<typename T>
+shared_ptr<ForwardingAction<T> > RunPipeline(const T& first_object,
+                                             bool move) {
+  const int kPipelineLength = 20;
+  vector<shared_ptr<ForwardingAction<T> > > actions;
+  ActionProcessor processor;
+  for (int i = 0; i < kPipelineLength; i++) {
+    actions.push_back(
+        shared_ptr<ForwardingAction<T> >(new ForwardingAction<T>(move)));
+    processor.EnqueueAction(actions.back().get());
+    if (i > 0)
+      BondActions(actions[i - 1].get(), actions[i].get());
+  }
+  actions[0]->object_ = first_object;
+  processor.StartProcessing();
+  EXPECT_FALSE(processor.IsRunning());
+  return actions.back();
+}
+}  // namespace {}
+
+TEST(ActionPipeTest, MoveTest) {
+  CopyCountingObject object;
+  object.data.resize(1024 * 1024, 'x');
+
+  // Each Action updates the object that the previous one moved to it, and
+  // it's never copied on the way.
+  CopyCountingObject::copies = 0;
+  shared_ptr<ForwardingAction<CopyCountingObject> > last =
+      RunPipeline(object, true);
+  EXPECT_EQ(1, CopyCountingObject::copies);  // Just first_object.
+  EXPECT_EQ(20, last->object_.hops);
+  EXPECT_TRUE(last->object_.data == object.data);
+
+  // Copying, by contrast, copies it in and out of every pipe.
+  CopyCountingObject::copies = 0;
+  last = RunPipeline(object, false);
+  EXPECT_EQ(1 + 2 * 19, CopyCountingObject::copies);
+  EXPECT_EQ(20, last->object_.hops);
+}
+
+TEST(ActionPipeTest, SharedTest) {
+  // A big manifest that every Action reads is shared, not copied.
+  shared_ptr<DeltaArchiveManifest> manifest(new DeltaArchiveManifest);
+  for (int i = 0; i < 10000; i++)
+    manifest->add_install_operations()->set_data_offset(i);
+  shared_ptr<const DeltaArchiveManifest> const_manifest(manifest);
+  shared_ptr<ForwardingAction<shared_ptr<const DeltaArchiveManifest> > >
+      last = RunPipeline(const_manifest, false);
+  EXPECT_EQ(manifest.get(), last->object_.get());
+  EXPECT_EQ(10000, last->object_->install_operations_size());
+}
+
+TEST(ActionPipeTest, InstallPlanSwapTest) {
+  InstallPlan a(true, "http://example.com/some/long/url", "hash", "path");
+  a.install_size = 1;
+  a.install_hash = "install_hash";
+  const InstallPlan a_copy(a);
+  InstallPlan b(false, "url2", "", "path2");
+  const InstallPlan b_copy(b);
+  const char* url_data = a.download_url.data();
+  swap(a, b);
+  EXPECT_TRUE(a == b_copy);
+  EXPECT_TRUE(b == a_copy);
+  // The strings' buffers were exchanged, not copied.
+  EXPECT_EQ(url_data, b.download_url.data());
+}
+
 }  // namespace chromeos_update_engine
@@ -3,16 +3,22 @@
 // found in the LICENSE file.
 
 #include "update_engine/action_processor.h"
+#include <algorithm>
 #include <string>
 #include "chromeos/obsolete_logging.h"
 #include "update_engine/action.h"
 
+using std::find;
 using std::string;
+using std::vector;
 
 namespace chromeos_update_engine {
 
 ActionProcessor::ActionProcessor()
-    : current_action_(NULL), delegate_(NULL) {}
+    : max_concurrent_actions_(1),
+      processing_(false),
+      delegate_(NULL),
+      send_metrics_(false) {}
 
 ActionProcessor::~ActionProcessor() {
   if (IsRunning()) {
@@ -29,59 +35,166 @@ void ActionProcessor::EnqueueAction(AbstractAction* action) {
   action->SetProcessor(this);
 }
 
+bool ActionProcessor::IsActionRunning(const AbstractAction* action) const {
+  for (vector<RunningAction>::const_iterator it = running_actions_.begin();
+       it != running_actions_.end(); ++it) {
+    if (it->action == action)
+      return true;
+  }
+  return false;
+}
+
 void ActionProcessor::StartProcessing() {
   CHECK(!IsRunning());
+  action_stats_.clear();
   if (!actions_.empty()) {
-    current_action_ = actions_.front();
     LOG(INFO) << "ActionProcessor::StartProcessing: "
-              << current_action_->Type();
-    actions_.pop_front();
-    current_action_->PerformAction();
+              << actions_.front()->Type();
+    processing_ = true;
+    StartReadyActions();
   }
 }
 
 void ActionProcessor::StopProcessing() {
   CHECK(IsRunning());
-  CHECK(current_action_);
-  current_action_->TerminateProcessing();
-  CHECK(current_action_);
-  current_action_->SetProcessor(NULL);
-  LOG(INFO) << "ActionProcessor::StopProcessing: aborted "
-            << current_action_->Type();
-  current_action_ = NULL;
+  TerminateRunningActions();
+  processing_ = false;
+  ReportActionStats();
   if (delegate_)
     delegate_->ProcessingStopped(this);
 }
 
 void ActionProcessor::ActionComplete(AbstractAction* actionptr,
                                      bool success) {
-  CHECK_EQ(actionptr, current_action_);
+  CHECK(IsActionRunning(actionptr));
+  FinishAction(actionptr, success);
   if (delegate_)
     delegate_->ActionCompleted(this, actionptr, success);
-  string old_type = current_action_->Type();
-  current_action_->SetProcessor(NULL);
-  current_action_ = NULL;
-  if (actions_.empty()) {
-    LOG(INFO) << "ActionProcessor::ActionComplete: finished last action of"
-                 " type " << old_type;
-  } else if (!success) {
-    LOG(INFO) << "ActionProcessor::ActionComplete: " << old_type
-              << " action failed. Aborting processing.";
-    actions_.clear();
+  string old_type = actionptr->Type();
+  actionptr->SetProcessor(NULL);
+  if (!success) {
+    if (!actions_.empty() || IsRunning()) {
+      LOG(INFO) << "ActionProcessor::ActionComplete: " << old_type
+                << " action failed. Aborting processing.";
+      for (std::deque<AbstractAction*>::iterator it = actions_.begin();
+           it != actions_.end(); ++it) {
+        (*it)->SetProcessor(NULL);
+      }
+      actions_.clear();
+      TerminateRunningActions();
+    }
+    ProcessingDone(false);
+    return;
   }
-  if (actions_.empty()) {
+  if (actions_.empty() && !IsRunning()) {
     LOG(INFO) << "ActionProcessor::ActionComplete: finished last action of"
                  " type " << old_type;
-    if (delegate_) {
-      delegate_->ProcessingDone(this, success);
-    }
+    ProcessingDone(true);
     return;
   }
-  current_action_ = actions_.front();
-  actions_.pop_front();
-  LOG(INFO) << "ActionProcessor::ActionComplete: finished " << old_type
-            << ", starting " << current_action_->Type();
-  current_action_->PerformAction();
+  LOG(INFO) << "ActionProcessor::ActionComplete: finished " << old_type;
+  StartReadyActions();
+}
+
+bool ActionProcessor::IsReady(const AbstractAction* action) const {
+  const vector<AbstractAction*>& dependencies = action->dependencies();
+  for (vector<AbstractAction*>::const_iterator it = dependencies.begin();
+       it != dependencies.end(); ++it) {
+    if (IsActionRunning(*it) ||
+        find(actions_.begin(), actions_.end(), *it) != actions_.end())
+      return false;
+  }
+  return true;
+}
+
+void ActionProcessor::StartReadyActions() {
+  // An Action may complete inside PerformAction(), which calls back into
+  // here, so look at the queue afresh for each Action started.
+  while (processing_ && !actions_.empty() &&
+         running_actions_.size() <
+         static_cast<size_t>(max_concurrent_actions_)) {
+    std::deque<AbstractAction*>::iterator it = actions_.begin();
+    if (max_concurrent_actions_ > 1) {
+      while (it != actions_.end() && !IsReady(*it))
+        ++it;
+      if (it == actions_.end())
+        break;
+    }
+    AbstractAction* action = *it;
+    actions_.erase(it);
+    StartAction(action);
+  }
+  // Every queued Action waits on another, and nothing is running that could
+  // break the cycle.
+  if (processing_ && !IsRunning() && !actions_.empty()) {
+    LOG(ERROR) << "ActionProcessor: the queued actions depend on each other. "
+                  "Aborting processing.";
+    for (std::deque<AbstractAction*>::iterator it = actions_.begin();
+         it != actions_.end(); ++it) {
+      (*it)->SetProcessor(NULL);
+    }
+    actions_.clear();
+    ProcessingDone(false);
+  }
+}
+
+void ActionProcessor::StartAction(AbstractAction* action) {
+  LOG(INFO) << "ActionProcessor: starting " << action->Type();
+  RunningAction running_action;
+  running_action.action = action;
+  running_action.start_bytes_in = action->bytes_in();
+  running_action.start_bytes_out = action->bytes_out();
+  running_action.start = TakeResourceSample();
+  running_actions_.push_back(running_action);
+  action->PerformAction();
+}
+
+void ActionProcessor::FinishAction(AbstractAction* action, bool success) {
+  vector<RunningAction>::iterator it = running_actions_.begin();
+  while (it->action != action)
+    ++it;
+  const ResourceSample now = TakeResourceSample();
+  ActionStats stats;
+  stats.type = action->Type();
+  stats.start_time_us = it->start.wall_time_us;
+  stats.wall_time_us = now.wall_time_us - it->start.wall_time_us;
+  stats.cpu_time_us = now.cpu_time_us - it->start.cpu_time_us;
+  stats.bytes_in = action->bytes_in() - it->start_bytes_in;
+  stats.bytes_out = action->bytes_out() - it->start_bytes_out;
+  stats.peak_rss_kib = now.peak_rss_kib;
+  stats.success = success;
+  running_actions_.erase(it);
+  action_stats_.push_back(stats);
+  LOG(INFO) << "ActionProcessor: " << stats.type << " took "
+            << stats.wall_time_us / 1000 << " ms (" << stats.cpu_time_us / 1000
+            << " ms CPU), " << stats.bytes_in << " bytes in, "
+            << stats.bytes_out << " bytes out, peak RSS "
+            << stats.peak_rss_kib << " KiB";
+}
+
+void ActionProcessor::TerminateRunningActions() {
+  while (!running_actions_.empty()) {
+    AbstractAction* action = running_actions_.back().action;
+    action->TerminateProcessing();
+    FinishAction(action, false);
+    action->SetProcessor(NULL);
+    LOG(INFO) << "ActionProcessor: aborted " << action->Type();
+  }
+}
+
+void ActionProcessor::ProcessingDone(bool success) {
+  processing_ = false;
+  ReportActionStats();
+  if (delegate_)
+    delegate_->ProcessingDone(this, success);
+}
+
+void ActionProcessor::ReportActionStats() {
+  if (!trace_path_.empty() &&
+      !action_stats::WriteChromeTrace(action_stats_, trace_path_))
+    LOG(ERROR) << "Unable to write the action trace to " << trace_path_;
+  if (send_metrics_)
+    action_stats::SendMetrics(action_stats_);
 }
 
 }  // namespace chromeos_update_engine
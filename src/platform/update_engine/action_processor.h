@@ -6,8 +6,12 @@
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_ACTION_PROCESSOR_H__
 
 #include <deque>
+#include <string>
+#include <vector>
 
 #include "base/basictypes.h"
+#include "chromeos/obsolete_logging.h"
+#include "update_engine/action_stats.h"
 
 // The structure of these classes (Action, ActionPipe, ActionProcessor, etc.)
 // is based on the KSAction* classes from the Google Update Engine code at
@@ -18,6 +22,9 @@
 // See action.h for an overview of this class and other other Action* classes.
 
 // An ActionProcessor keeps a queue of Actions and processes them in order.
+// It can also run Actions concurrently: an Action depends on the Actions
+// bonded to its input pipe (and on any added with AddDependency()), and once
+// those have completed it may start while other Actions are still running.
 
 namespace chromeos_update_engine {
 
@@ -30,18 +37,32 @@ class ActionProcessor {
 
   ~ActionProcessor();
 
-  // Starts processing the first Action in the queue. If there's a delegate,
-  // when all processing is complete, ProcessingDone() will be called on the
-  // delegate.
+  // Starts processing the first Action in the queue, or, if more than one
+  // Action may run at a time, every Action in the queue whose dependencies
+  // aren't queued. If there's a delegate, when all processing is complete,
+  // ProcessingDone() will be called on the delegate.
   void StartProcessing();
 
-  // Aborts processing. If an Action is running, it will have
-  // TerminateProcessing() called on it. The Action that was running
-  // will be lost and must be re-enqueued if this Processor is to use it.
+  // Aborts processing. Every Action that's running will have
+  // TerminateProcessing() called on it. The Actions that were running
+  // will be lost and must be re-enqueued if this Processor is to use them.
   void StopProcessing();
 
   // Returns true iff an Action is currently processing.
-  bool IsRunning() const { return NULL != current_action_; }
+  bool IsRunning() const { return !running_actions_.empty(); }
+
+  // Returns true iff action is one of the Actions currently processing.
+  bool IsActionRunning(const AbstractAction* action) const;
+
+  // Sets how many Actions may run at once. With the default of 1, Actions
+  // run one after another in the order in which they were enqueued, whatever
+  // their dependencies. Otherwise, queued Actions start in order as soon as
+  // every Action they depend on that was enqueued here has completed. If an
+  // Action fails, the others that are running are terminated.
+  void set_max_concurrent_actions(int max_concurrent_actions) {
+    CHECK_GT(max_concurrent_actions, 0);
+    max_concurrent_actions_ = max_concurrent_actions;
+  }
 
   // Adds another Action to the end of the queue.
   void EnqueueAction(AbstractAction* action);
@@ -51,24 +72,83 @@ class ActionProcessor {
     delegate_ = delegate;
   }
 
-  // Returns a pointer to the current Action that's processing.
+  // Returns a pointer to the current Action that's processing. If several
+  // are, returns the one that started first.
   AbstractAction* current_action() const {
-    return current_action_;
+    return running_actions_.empty() ? NULL : running_actions_.front().action;
   }
 
   // Called by an action to notify processor that it's done. Caller passes self.
   void ActionComplete(AbstractAction* actionptr, bool success);
 
+  // The stats of the Actions run since processing last started, in the order
+  // in which they finished. An Action that was stopped is included, marked
+  // as failed.
+  const std::vector<ActionStats>& action_stats() const {
+    return action_stats_;
+  }
+
+  // If set, a Chrome trace of action_stats() is written to path whenever
+  // processing is done or stopped.
+  void set_trace_path(const std::string& path) { trace_path_ = path; }
+
+  // If true, action_stats() are sent as metrics whenever processing is done
+  // or stopped.
+  void set_send_metrics(bool send_metrics) { send_metrics_ = send_metrics; }
+
  private:
+  // An Action that's processing, and what it had used when it started.
+  struct RunningAction {
+    AbstractAction* action;
+    ResourceSample start;
+    uint64 start_bytes_in;
+    uint64 start_bytes_out;
+  };
+
+  // Returns true iff action may start: nothing it depends on is waiting in
+  // actions_ or running.
+  bool IsReady(const AbstractAction* action) const;
+
+  // Starts queued Actions that are ready, as long as fewer than
+  // max_concurrent_actions_ are running.
+  void StartReadyActions();
+
+  // Performs action.
+  void StartAction(AbstractAction* action);
+
+  // Removes action from running_actions_, adding its stats to
+  // action_stats_.
+  void FinishAction(AbstractAction* action, bool success);
+
+  // Terminates all running Actions.
+  void TerminateRunningActions();
+
+  // Reports the stats and calls ProcessingDone() on the delegate.
+  void ProcessingDone(bool success);
+
+  // Writes the trace and sends metrics, if requested.
+  void ReportActionStats();
+
   // Actions that have not yet begun processing, in the order in which
   // they'll be processed.
   std::deque<AbstractAction*> actions_;
 
-  // A pointer to the currrently processing Action, if any.
-  AbstractAction* current_action_;
+  // The currently processing Actions, in the order in which they started.
+  std::vector<RunningAction> running_actions_;
+
+  int max_concurrent_actions_;
+
+  // True from StartProcessing() until ProcessingDone() or
+  // ProcessingStopped() is called on the delegate.
+  bool processing_;
 
   // A pointer to the delegate, or NULL if none.
   ActionProcessorDelegate *delegate_;
+
+  std::vector<ActionStats> action_stats_;
+  std::string trace_path_;
+  bool send_metrics_;
+
   DISALLOW_COPY_AND_ASSIGN(ActionProcessor);
 };
 
@@ -2,10 +2,12 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <unistd.h>
 #include <string>
 #include <gtest/gtest.h>
 #include "update_engine/action.h"
 #include "update_engine/action_processor.h"
+#include "update_engine/utils.h"
 
 using std::string;
 
@@ -26,15 +28,27 @@ class ActionTraits<ActionProcessorTestAction> {
 struct ActionProcessorTestAction : public Action<ActionProcessorTestAction> {
   typedef string InputObjectType;
   typedef string OutputObjectType;
+  ActionProcessorTestAction() : performed(false), terminated(false) {}
   ActionPipe<string>* in_pipe() { return in_pipe_.get(); }
   ActionPipe<string>* out_pipe() { return out_pipe_.get(); }
   ActionProcessor* processor() { return processor_; }
-  void PerformAction() {}
+  void PerformAction() { performed = true; }
+  void TerminateProcessing() { terminated = true; }
   void CompleteAction() {
     ASSERT_TRUE(processor());
     processor()->ActionComplete(this, true);
   }
+  void FailAction() {
+    ASSERT_TRUE(processor());
+    processor()->ActionComplete(this, false);
+  }
+  void Transfer(uint64 bytes_in, uint64 bytes_out) {
+    AddBytesIn(bytes_in);
+    AddBytesOut(bytes_out);
+  }
   string Type() const { return "ActionProcessorTestAction"; }
+  bool performed;
+  bool terminated;
 };
 
 class ActionProcessorTest : public ::testing::Test { };
@@ -150,6 +164,175 @@ TEST(ActionProcessorTest, DtorTest) {
   EXPECT_FALSE(action2.IsRunning());
 }
 
+TEST(ActionProcessorTest, ActionStatsTest) {
+  const string kTracePath("/tmp/ActionProcessorTest.trace.json");
+  ActionProcessorTestAction action1, action2;
+  ActionProcessor action_processor;
+  action_processor.set_trace_path(kTracePath);
+  action_processor.EnqueueAction(&action1);
+  action_processor.EnqueueAction(&action2);
+  // Bytes from before the action started don't count.
+  action1.Transfer(1, 1);
+  action_processor.StartProcessing();
+  action1.Transfer(10, 20);
+  action1.Transfer(5, 0);
+  action1.CompleteAction();
+  action_processor.StopProcessing();
+
+  const std::vector<ActionStats>& stats = action_processor.action_stats();
+  ASSERT_EQ(2, stats.size());
+  EXPECT_EQ("ActionProcessorTestAction", stats[0].type);
+  EXPECT_TRUE(stats[0].success);
+  EXPECT_EQ(15, stats[0].bytes_in);
+  EXPECT_EQ(20, stats[0].bytes_out);
+  EXPECT_GE(stats[0].wall_time_us, 0);
+  EXPECT_GE(stats[0].cpu_time_us, 0);
+  EXPECT_GT(stats[0].peak_rss_kib, 0);
+  EXPECT_FALSE(stats[1].success);
+  EXPECT_EQ(0, stats[1].bytes_in);
+  EXPECT_GE(stats[1].start_time_us,
+            stats[0].start_time_us + stats[0].wall_time_us);
+
+  string trace;
+  EXPECT_TRUE(utils::ReadFileToString(kTracePath, &trace));
+  EXPECT_EQ(action_stats::ChromeTraceJson(stats), trace);
+  EXPECT_NE(string::npos, trace.find(
+      "\"name\":\"ActionProcessorTestAction\",\"cat\":\"action\","
+      "\"ph\":\"X\""));
+  EXPECT_NE(string::npos, trace.find("\"ts\":0,"));
+  EXPECT_NE(string::npos, trace.find("\"bytes_out\":20,"));
+  EXPECT_NE(string::npos, trace.find("\"success\":false}"));
+  EXPECT_EQ(0, unlink(kTracePath.c_str()));
+
+  // Starting again clears the old stats.
+  action_processor.EnqueueAction(&action1);
+  action_processor.StartProcessing();
+  action1.CompleteAction();
+  EXPECT_EQ(1, action_processor.action_stats().size());
+  EXPECT_EQ(0, unlink(kTracePath.c_str()));
+}
+
+namespace {
+class CountingActionProcessorDelegate : public ActionProcessorDelegate {
+ public:
+  CountingActionProcessorDelegate()
+      : processing_done_count_(0), success_(false), actions_completed_(0) {}
+  virtual void ProcessingDone(const ActionProcessor* processor, bool success) {
+    processing_done_count_++;
+    success_ = success;
+  }
+  virtual void ActionCompleted(ActionProcessor* processor,
+                               AbstractAction* action,
+                               bool success) {
+    actions_completed_++;
+  }
+  int processing_done_count_;
+  bool success_;
+  int actions_completed_;
+};
+}  // namespace {}
+
+TEST(ActionProcessorTest, ConcurrentActionsTest) {
+  // b takes a's output; c stands alone; d waits for c without a pipe.
+  ActionProcessorTestAction a, b, c, d;
+  BondActions(&a, &b);
+  d.AddDependency(&c);
+  ActionProcessor action_processor;
+  CountingActionProcessorDelegate delegate;
+  action_processor.set_delegate(&delegate);
+  action_processor.set_max_concurrent_actions(3);
+  action_processor.EnqueueAction(&a);
+  action_processor.EnqueueAction(&b);
+  action_processor.EnqueueAction(&c);
+  action_processor.EnqueueAction(&d);
+  action_processor.StartProcessing();
+  EXPECT_TRUE(a.IsRunning());
+  EXPECT_FALSE(b.performed);
+  EXPECT_TRUE(c.IsRunning());
+  EXPECT_FALSE(d.performed);
+  EXPECT_EQ(&a, action_processor.current_action());
+
+  c.CompleteAction();
+  EXPECT_TRUE(d.IsRunning());
+  EXPECT_FALSE(b.performed);
+  a.CompleteAction();
+  EXPECT_TRUE(b.IsRunning());
+  EXPECT_EQ(&d, action_processor.current_action());
+  d.CompleteAction();
+  EXPECT_EQ(0, delegate.processing_done_count_);
+  b.CompleteAction();
+  EXPECT_EQ(1, delegate.processing_done_count_);
+  EXPECT_TRUE(delegate.success_);
+  EXPECT_EQ(4, delegate.actions_completed_);
+  EXPECT_EQ(4, action_processor.action_stats().size());
+  EXPECT_FALSE(action_processor.IsRunning());
+  action_processor.set_delegate(NULL);
+}
+
+TEST(ActionProcessorTest, BoundedConcurrencyTest) {
+  ActionProcessorTestAction a, b, c;
+  ActionProcessor action_processor;
+  action_processor.set_max_concurrent_actions(2);
+  action_processor.EnqueueAction(&a);
+  action_processor.EnqueueAction(&b);
+  action_processor.EnqueueAction(&c);
+  action_processor.StartProcessing();
+  EXPECT_TRUE(a.IsRunning());
+  EXPECT_TRUE(b.IsRunning());
+  EXPECT_FALSE(c.performed);
+  b.CompleteAction();
+  EXPECT_TRUE(c.IsRunning());
+  a.CompleteAction();
+  c.CompleteAction();
+  EXPECT_FALSE(action_processor.IsRunning());
+}
+
+TEST(ActionProcessorTest, ConcurrentFailureTest) {
+  // When one action fails, the others are terminated and nothing else
+  // starts.
+  ActionProcessorTestAction a, b, c;
+  BondActions(&a, &b);
+  ActionProcessor action_processor;
+  CountingActionProcessorDelegate delegate;
+  action_processor.set_delegate(&delegate);
+  action_processor.set_max_concurrent_actions(2);
+  action_processor.EnqueueAction(&a);
+  action_processor.EnqueueAction(&b);
+  action_processor.EnqueueAction(&c);
+  action_processor.StartProcessing();
+  EXPECT_TRUE(c.IsRunning());
+  a.FailAction();
+  EXPECT_TRUE(c.terminated);
+  EXPECT_FALSE(b.performed);
+  EXPECT_EQ(NULL, b.processor());
+  EXPECT_EQ(NULL, c.processor());
+  EXPECT_FALSE(action_processor.IsRunning());
+  EXPECT_EQ(1, delegate.processing_done_count_);
+  EXPECT_FALSE(delegate.success_);
+  // Only a is reported as completed.
+  EXPECT_EQ(1, delegate.actions_completed_);
+  action_processor.set_delegate(NULL);
+}
+
+TEST(ActionProcessorTest, DependencyCycleTest) {
+  ActionProcessorTestAction a, b;
+  a.AddDependency(&b);
+  b.AddDependency(&a);
+  ActionProcessor action_processor;
+  CountingActionProcessorDelegate delegate;
+  action_processor.set_delegate(&delegate);
+  action_processor.set_max_concurrent_actions(2);
+  action_processor.EnqueueAction(&a);
+  action_processor.EnqueueAction(&b);
+  action_processor.StartProcessing();
+  EXPECT_FALSE(a.performed);
+  EXPECT_FALSE(b.performed);
+  EXPECT_EQ(1, delegate.processing_done_count_);
+  EXPECT_FALSE(delegate.success_);
+  EXPECT_EQ(NULL, a.processor());
+  action_processor.set_delegate(NULL);
+}
+
 TEST(ActionProcessorTest, DefaultDelegateTest) {
   // Just make sure it doesn't crash
   ActionProcessorTestAction action;
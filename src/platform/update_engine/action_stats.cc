@@ -0,0 +1,115 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/action_stats.h"
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include "base/string_util.h"
+#include "chromeos/obsolete_logging.h"
+#include "metrics_collection/metrics_library.h"
+#include "update_engine/utils.h"
+
+using std::max;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+int64 TimevalToMicroseconds(const struct timeval& tv) {
+  return static_cast<int64>(tv.tv_sec) * 1000000 + tv.tv_usec;
+}
+
+string Int64ToDecimal(int64 value) {
+  return StringPrintf("%lld", static_cast<long long>(value));
+}
+
+// Action types are identifiers, but don't let one break the JSON.
+string JsonEscape(const string& str) {
+  string ret;
+  for (string::const_iterator it = str.begin(); it != str.end(); ++it) {
+    if (*it == '"' || *it == '\\')
+      ret += '\\';
+    if (static_cast<unsigned char>(*it) >= 0x20)
+      ret += *it;
+  }
+  return ret;
+}
+
+void SendMetric(const string& name, int64 value) {
+  MetricsLibrary::SendToChrome(name, Int64ToDecimal(value), -1);
+}
+}  // namespace {}
+
+ResourceSample TakeResourceSample() {
+  ResourceSample sample;
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  sample.wall_time_us = TimevalToMicroseconds(now);
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0) {
+    sample.cpu_time_us = TimevalToMicroseconds(usage.ru_utime) +
+        TimevalToMicroseconds(usage.ru_stime);
+    sample.peak_rss_kib = usage.ru_maxrss;
+  } else {
+    sample.cpu_time_us = 0;
+    sample.peak_rss_kib = 0;
+  }
+  return sample;
+}
+
+namespace action_stats {
+
+string ChromeTraceJson(const vector<ActionStats>& stats) {
+  const string pid = Int64ToDecimal(getpid());
+  string ret = "{\"traceEvents\":[\n"
+      "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + pid +
+      ",\"tid\":1,\"args\":{\"name\":\"update_engine\"}}";
+  const int64 origin_us = stats.empty() ? 0 : stats[0].start_time_us;
+  for (vector<ActionStats>::const_iterator it = stats.begin();
+       it != stats.end(); ++it) {
+    ret += ",\n{\"name\":\"" + JsonEscape(it->type) +
+        "\",\"cat\":\"action\",\"ph\":\"X\",\"pid\":" + pid +
+        ",\"tid\":1,\"ts\":" + Int64ToDecimal(it->start_time_us - origin_us) +
+        ",\"dur\":" + Int64ToDecimal(it->wall_time_us) +
+        ",\"args\":{\"cpu_time_us\":" + Int64ToDecimal(it->cpu_time_us) +
+        ",\"bytes_in\":" + Int64ToDecimal(it->bytes_in) +
+        ",\"bytes_out\":" + Int64ToDecimal(it->bytes_out) +
+        ",\"peak_rss_kib\":" + Int64ToDecimal(it->peak_rss_kib) +
+        ",\"success\":" + (it->success ? "true" : "false") + "}}";
+  }
+  ret += "\n],\"displayTimeUnit\":\"ms\"}\n";
+  return ret;
+}
+
+bool WriteChromeTrace(const vector<ActionStats>& stats, const string& path) {
+  const string json = ChromeTraceJson(stats);
+  TEST_AND_RETURN_FALSE(utils::WriteFileAtomically(path, json.data(),
+                                                   json.size()));
+  return true;
+}
+
+void SendMetrics(const vector<ActionStats>& stats) {
+  int64 total_wall_time_us = 0;
+  for (vector<ActionStats>::const_iterator it = stats.begin();
+       it != stats.end(); ++it) {
+    const string prefix = "UpdateEngine." + it->type + ".";
+    SendMetric(prefix + "WallTimeMs", it->wall_time_us / 1000);
+    SendMetric(prefix + "CpuTimeMs", it->cpu_time_us / 1000);
+    SendMetric(prefix + "BytesIn", it->bytes_in);
+    SendMetric(prefix + "BytesOut", it->bytes_out);
+    SendMetric(prefix + "PeakRssKiB", it->peak_rss_kib);
+    total_wall_time_us = max(total_wall_time_us,
+                             it->start_time_us + it->wall_time_us -
+                             stats[0].start_time_us);
+  }
+  if (!stats.empty())
+    SendMetric("UpdateEngine.TotalWallTimeMs", total_wall_time_us / 1000);
+}
+
+}  // namespace action_stats
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,76 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_ACTION_STATS_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_ACTION_STATS_H__
+
+#include <string>
+#include <vector>
+#include "base/basictypes.h"
+
+// ActionProcessor measures each Action it runs and keeps the results as
+// ActionStats, so we can tell which stage of an update takes the time. The
+// functions here export a run's stats as a Chrome trace (load it in
+// about:tracing) and as metrics.
+
+namespace chromeos_update_engine {
+
+// The process's clocks and memory use at some point in time.
+struct ResourceSample {
+  // Wall clock time, in microseconds since the epoch.
+  int64 wall_time_us;
+  // User plus system CPU time of the whole process, including helper
+  // threads, in microseconds.
+  int64 cpu_time_us;
+  // The largest resident set size the process has had so far, in KiB.
+  int64 peak_rss_kib;
+};
+
+// Returns the current ResourceSample.
+ResourceSample TakeResourceSample();
+
+struct ActionStats {
+  ActionStats()
+      : start_time_us(0), wall_time_us(0), cpu_time_us(0), bytes_in(0),
+        bytes_out(0), peak_rss_kib(0), success(false) {}
+
+  // AbstractAction::Type() of the action.
+  std::string type;
+  // When the action started, in microseconds since the epoch.
+  int64 start_time_us;
+  // How long the action ran.
+  int64 wall_time_us;
+  // CPU time the process used while the action ran. If other actions ran at
+  // the same time, this includes their share.
+  int64 cpu_time_us;
+  // What the action reported through AbstractAction::AddBytesIn() and
+  // AddBytesOut().
+  uint64 bytes_in;
+  uint64 bytes_out;
+  // The process's peak RSS when the action finished. The kernel only keeps
+  // the high-water mark, so an action raised the peak iff this is larger
+  // than the previous action's.
+  int64 peak_rss_kib;
+  bool success;
+};
+
+namespace action_stats {
+
+// Returns stats as a Chrome trace event JSON document, with one complete
+// ("X") event per action. Timestamps are relative to the first action.
+std::string ChromeTraceJson(const std::vector<ActionStats>& stats);
+
+// Writes ChromeTraceJson(stats) to path. Returns true on success.
+bool WriteChromeTrace(const std::vector<ActionStats>& stats,
+                      const std::string& path);
+
+// Sends wall time, CPU time, bytes and peak RSS of each action, plus the
+// total wall time, through the metrics library.
+void SendMetrics(const std::vector<ActionStats>& stats);
+
+}  // namespace action_stats
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_ACTION_STATS_H__
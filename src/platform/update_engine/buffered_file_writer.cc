@@ -0,0 +1,143 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/buffered_file_writer.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+
+using std::min;
+
+namespace chromeos_update_engine {
+
+namespace {
+// O_DIRECT needs the buffer, the file offset and the length of each write to
+// be aligned. A page is enough for any block device we write to.
+const size_t kAlignment = 4096;
+}  // namespace {}
+
+BufferedFileWriter::BufferedFileWriter(size_t buffer_size, bool use_o_direct)
+    : buffer_size_(buffer_size),
+      use_o_direct_(use_o_direct),
+      fd_(-1),
+      o_direct_(false),
+      buffer_(NULL),
+      buffered_(0),
+      write_calls_(0) {
+  CHECK_GT(buffer_size_, 0);
+  CHECK_EQ(buffer_size_ % kAlignment, 0);
+  void* buffer = NULL;
+  CHECK_EQ(posix_memalign(&buffer, kAlignment, buffer_size_), 0);
+  buffer_ = reinterpret_cast<char*>(buffer);
+}
+
+BufferedFileWriter::~BufferedFileWriter() {
+  free(buffer_);
+}
+
+int BufferedFileWriter::Open(const char* path, int flags, mode_t mode) {
+  CHECK_EQ(fd_, -1);
+  buffered_ = 0;
+  o_direct_ = false;
+  if (use_o_direct_) {
+    fd_ = open(path, flags | O_DIRECT, mode);
+    if (fd_ >= 0) {
+      o_direct_ = true;
+      return 0;
+    }
+    if (errno != EINVAL)
+      return -errno;
+    LOG(INFO) << path << " doesn't support O_DIRECT; writing through the "
+              << "page cache.";
+  }
+  fd_ = open(path, flags, mode);
+  if (fd_ < 0)
+    return -errno;
+  return 0;
+}
+
+int BufferedFileWriter::Write(const void* bytes, size_t count) {
+  CHECK_GE(fd_, 0);
+  const char* char_bytes = reinterpret_cast<const char*>(bytes);
+  size_t offset = 0;
+  // Whole buffers' worth of data are written straight from the caller's
+  // memory when nothing is buffered, as long as O_DIRECT can use it.
+  if (buffered_ == 0 && count >= buffer_size_ &&
+      (!o_direct_ || reinterpret_cast<uintptr_t>(bytes) % kAlignment == 0)) {
+    offset = count - count % buffer_size_;
+    int rc = WriteToFile(char_bytes, offset);
+    if (rc < 0)
+      return rc;
+  }
+  while (offset < count) {
+    const size_t length = min(count - offset, buffer_size_ - buffered_);
+    memcpy(buffer_ + buffered_, char_bytes + offset, length);
+    buffered_ += length;
+    offset += length;
+    int rc = WriteBufferIfFull();
+    if (rc < 0)
+      return rc;
+  }
+  return count;
+}
+
+int BufferedFileWriter::Close() {
+  CHECK_GE(fd_, 0);
+  int rc = 0;
+  if (buffered_ > 0) {
+    if (o_direct_) {
+      // The tail is shorter than a block, which O_DIRECT can't write.
+      int flags = fcntl(fd_, F_GETFL);
+      if (flags < 0 || fcntl(fd_, F_SETFL, flags & ~O_DIRECT) < 0)
+        rc = -errno;
+    }
+    if (rc == 0)
+      rc = WriteToFile(buffer_, buffered_);
+    buffered_ = 0;
+  }
+  if (close(fd_) < 0 && rc == 0)
+    rc = -errno;
+  // Like DirectFileWriter, make sure this FileWriter isn't used again.
+  fd_ = -2;
+  return rc;
+}
+
+int BufferedFileWriter::GetBuffer(char** buffer, size_t* size) {
+  CHECK_GE(fd_, 0);
+  int rc = WriteBufferIfFull();
+  if (rc < 0)
+    return rc;
+  *buffer = buffer_ + buffered_;
+  *size = buffer_size_ - buffered_;
+  return 0;
+}
+
+int BufferedFileWriter::CommitBuffer(size_t count) {
+  CHECK_LE(count, buffer_size_ - buffered_);
+  buffered_ += count;
+  return WriteBufferIfFull();
+}
+
+int BufferedFileWriter::WriteToFile(const char* bytes, size_t count) {
+  size_t bytes_written = 0;
+  while (bytes_written < count) {
+    ssize_t rc = write(fd_, bytes + bytes_written, count - bytes_written);
+    write_calls_++;
+    if (rc < 0)
+      return -errno;
+    bytes_written += rc;
+  }
+  return 0;
+}
+
+int BufferedFileWriter::WriteBufferIfFull() {
+  if (buffered_ < buffer_size_)
+    return 0;
+  buffered_ = 0;
+  return WriteToFile(buffer_, buffer_size_);
+}
+
+}  // namespace chromeos_update_engine
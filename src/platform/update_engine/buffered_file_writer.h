@@ -0,0 +1,80 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_BUFFERED_FILE_WRITER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_BUFFERED_FILE_WRITER_H__
+
+#include "base/basictypes.h"
+#include "update_engine/file_writer.h"
+
+// BufferedFileWriter is a FileWriter that collects small writes in a large,
+// page aligned buffer and writes the file one full buffer at a time. It can
+// open the file with O_DIRECT, which keeps a whole partition's worth of data
+// out of the page cache. Since every write but the last is a whole buffer,
+// O_DIRECT's alignment rules are met; the last, partial block is written
+// after O_DIRECT has been turned off again.
+//
+// Producers such as GzipDecompressingFileWriter can also fill the buffer in
+// place with GetBuffer() and CommitBuffer(), which saves a copy.
+
+namespace chromeos_update_engine {
+
+class BufferedFileWriter : public FileWriter {
+ public:
+  static const size_t kDefaultBufferSize = 1024 * 1024;
+
+  // buffer_size must be a multiple of the page size.
+  BufferedFileWriter(size_t buffer_size, bool use_o_direct);
+  virtual ~BufferedFileWriter();
+
+  // If the file can't be opened with O_DIRECT (e.g., tmpfs doesn't support
+  // it), it is opened without.
+  virtual int Open(const char* path, int flags, mode_t mode);
+  virtual int Write(const void* bytes, size_t count);
+
+  // Writes out what's left in the buffer and closes the file.
+  virtual int Close();
+
+  // Sets *buffer to the free part of the buffer and *size to its size,
+  // which is never 0. Data placed there is written by a later
+  // CommitBuffer(count). Returns 0 on success or -errno on error.
+  int GetBuffer(char** buffer, size_t* size);
+
+  // Adds count bytes that were placed in the buffer returned by
+  // GetBuffer(). Returns 0 on success or -errno on error.
+  int CommitBuffer(size_t count);
+
+  // The number of write() system calls made so far.
+  uint64 write_calls() const { return write_calls_; }
+
+  // True if the file was opened with O_DIRECT.
+  bool o_direct() const { return o_direct_; }
+
+ private:
+  // Writes count bytes at bytes to the file. Returns 0 on success or -errno
+  // on error.
+  int WriteToFile(const char* bytes, size_t count);
+
+  // Writes the buffer out once it's full.
+  int WriteBufferIfFull();
+
+  const size_t buffer_size_;
+  const bool use_o_direct_;
+  int fd_;
+  bool o_direct_;
+
+  // Page aligned, buffer_size_ bytes long.
+  char* buffer_;
+
+  // How much of buffer_ is in use.
+  size_t buffered_;
+
+  uint64 write_calls_;
+
+  DISALLOW_COPY_AND_ASSIGN(BufferedFileWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_BUFFERED_FILE_WRITER_H__
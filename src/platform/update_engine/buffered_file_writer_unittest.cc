@@ -0,0 +1,122 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/buffered_file_writer.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class BufferedFileWriterTest : public ::testing::Test { };
+
+namespace {
+const char* const kPath = "/tmp/BufferedFileWriterTest";
+const size_t kBufferSize = 64 * 1024;
+
+vector<char> TestData(size_t size) {
+  vector<char> data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = static_cast<char>(i * 13 + i / 4096);
+  return data;
+}
+
+void ExpectFileContents(const vector<char>& expected) {
+  vector<char> actual;
+  EXPECT_TRUE(utils::ReadFile(kPath, &actual));
+  EXPECT_TRUE(expected == actual);
+}
+}  // namespace {}
+
+TEST(BufferedFileWriterTest, SmallWritesTest) {
+  // Not a whole number of buffers, so Close() has a tail to write.
+  const vector<char> data = TestData(kBufferSize * 3 + 1234);
+  BufferedFileWriter writer(kBufferSize, false);
+  ASSERT_EQ(0, writer.Open(kPath, O_CREAT | O_LARGEFILE | O_TRUNC | O_WRONLY,
+                           0644));
+  for (size_t offset = 0; offset < data.size(); offset += 1000) {
+    const size_t count = std::min(static_cast<size_t>(1000),
+                                  data.size() - offset);
+    ASSERT_EQ(count, writer.Write(&data[offset], count));
+  }
+  EXPECT_EQ(3, writer.write_calls());
+  EXPECT_EQ(0, writer.Close());
+  EXPECT_EQ(4, writer.write_calls());
+  ExpectFileContents(data);
+  unlink(kPath);
+}
+
+TEST(BufferedFileWriterTest, LargeWriteTest) {
+  const vector<char> data = TestData(kBufferSize * 5 / 2);
+  BufferedFileWriter writer(kBufferSize, false);
+  ASSERT_EQ(0, writer.Open(kPath, O_CREAT | O_LARGEFILE | O_TRUNC | O_WRONLY,
+                           0644));
+  // The first two buffers' worth are written without being copied.
+  ASSERT_EQ(data.size(), writer.Write(&data[0], data.size()));
+  EXPECT_EQ(1, writer.write_calls());
+  ASSERT_EQ(7, writer.Write("abcdefg", 7));
+  ASSERT_EQ(data.size(), writer.Write(&data[0], data.size()));
+  EXPECT_EQ(0, writer.Close());
+  vector<char> expected(data);
+  expected.insert(expected.end(), "abcdefg", "abcdefg" + 7);
+  expected.insert(expected.end(), data.begin(), data.end());
+  ExpectFileContents(expected);
+  unlink(kPath);
+}
+
+TEST(BufferedFileWriterTest, ODirectTest) {
+  // Some filesystems don't support O_DIRECT; the data must come out the same
+  // either way.
+  const vector<char> data = TestData(kBufferSize * 4 + 517);
+  BufferedFileWriter writer(kBufferSize, true);
+  ASSERT_EQ(0, writer.Open(kPath, O_CREAT | O_LARGEFILE | O_TRUNC | O_WRONLY,
+                           0644));
+  LOG(INFO) << "O_DIRECT: " << writer.o_direct();
+  ASSERT_EQ(data.size(), writer.Write(&data[0], data.size()));
+  EXPECT_EQ(0, writer.Close());
+  ExpectFileContents(data);
+  unlink(kPath);
+}
+
+TEST(BufferedFileWriterTest, GetBufferTest) {
+  const vector<char> data = TestData(kBufferSize * 2 + 10);
+  BufferedFileWriter writer(kBufferSize, false);
+  ASSERT_EQ(0, writer.Open(kPath, O_CREAT | O_LARGEFILE | O_TRUNC | O_WRONLY,
+                           0644));
+  size_t offset = 0;
+  while (offset < data.size()) {
+    char* buffer = NULL;
+    size_t size = 0;
+    ASSERT_EQ(0, writer.GetBuffer(&buffer, &size));
+    ASSERT_GT(size, 0);
+    // Fill only part of the space, to exercise partly filled buffers.
+    size = std::min(std::min(size, static_cast<size_t>(10000)),
+                    data.size() - offset);
+    memcpy(buffer, &data[offset], size);
+    ASSERT_EQ(0, writer.CommitBuffer(size));
+    offset += size;
+  }
+  EXPECT_EQ(0, writer.Close());
+  EXPECT_EQ(3, writer.write_calls());
+  ExpectFileContents(data);
+  unlink(kPath);
+}
+
+TEST(BufferedFileWriterTest, ErrorTest) {
+  BufferedFileWriter writer(kBufferSize, true);
+  EXPECT_EQ(-ENOENT, writer.Open("/tmp/ENOENT/BufferedFileWriterTest",
+                                 O_CREAT | O_LARGEFILE | O_TRUNC | O_WRONLY,
+                                 0644));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,75 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/bzip.h"
+#include <string.h>
+#include <bzlib.h>
+#include "chromeos/obsolete_logging.h"
+#include "update_engine/utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// The same compression level that the bzip2 tool uses by default.
+const int kBlockSize100k = 9;
+}
+
+bool BzipCompress(const vector<char>& in, vector<char>* out) {
+  TEST_AND_RETURN_FALSE(out);
+  // The bzip2 documentation says the output is guaranteed to fit in the
+  // input size plus 1% plus 600 bytes.
+  unsigned int out_size = in.size() + in.size() / 100 + 600;
+  out->resize(out_size);
+  int rc = BZ2_bzBuffToBuffCompress(
+      &(*out)[0],
+      &out_size,
+      const_cast<char*>(in.empty() ? "" : &in[0]),
+      in.size(),
+      kBlockSize100k,
+      0,  // verbosity
+      0);  // default work factor
+  TEST_AND_RETURN_FALSE(rc == BZ_OK);
+  out->resize(out_size);
+  return true;
+}
+
+bool BzipDecompress(const vector<char>& in, vector<char>* out) {
+  TEST_AND_RETURN_FALSE(out);
+  out->clear();
+  if (in.empty())
+    return true;
+  bz_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  TEST_AND_RETURN_FALSE(BZ2_bzDecompressInit(&stream,
+                                             0,  // verbosity
+                                             0) == BZ_OK);  // full memory
+  stream.next_in = const_cast<char*>(&in[0]);
+  stream.avail_in = in.size();
+  // Guess that the output will be roughly triple the input size. If it isn't
+  // large enough, grow it and carry on decompressing where we left off.
+  out->resize(in.size() * 3);
+  size_t out_length = 0;
+  for (;;) {
+    stream.next_out = &(*out)[out_length];
+    stream.avail_out = out->size() - out_length;
+    int rc = BZ2_bzDecompress(&stream);
+    out_length = out->size() - stream.avail_out;
+    if (rc == BZ_STREAM_END)
+      break;
+    if (rc != BZ_OK || (stream.avail_in == 0 && stream.avail_out > 0)) {
+      LOG(ERROR) << "BZ2_bzDecompress() error:" << rc;
+      BZ2_bzDecompressEnd(&stream);
+      return false;
+    }
+    if (stream.avail_out == 0)
+      out->resize(out->size() * 2);
+  }
+  BZ2_bzDecompressEnd(&stream);
+  out->resize(out_length);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,55 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/bzip.h"
+#include "update_engine/test_utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class BzipTest : public ::testing::Test { };
+
+TEST(BzipTest, SimpleTest) {
+  const string in_string(10000, 'x');
+  const vector<char> in(in_string.begin(), in_string.end());
+  vector<char> out;
+  EXPECT_TRUE(BzipCompress(in, &out));
+  EXPECT_LT(out.size(), in.size());
+  EXPECT_GT(out.size(), 0);
+  vector<char> decompressed;
+  EXPECT_TRUE(BzipDecompress(out, &decompressed));
+  EXPECT_TRUE(in == decompressed);
+}
+
+TEST(BzipTest, PoorCompressionTest) {
+  const vector<char> in(kRandomString, kRandomString + sizeof(kRandomString));
+  vector<char> out;
+  EXPECT_TRUE(BzipCompress(in, &out));
+  EXPECT_GT(out.size(), in.size());
+  vector<char> decompressed;
+  EXPECT_TRUE(BzipDecompress(out, &decompressed));
+  EXPECT_TRUE(in == decompressed);
+}
+
+TEST(BzipTest, MalformedBzipTest) {
+  const vector<char> in(kRandomString, kRandomString + sizeof(kRandomString));
+  vector<char> out;
+  EXPECT_FALSE(BzipDecompress(in, &out));
+}
+
+TEST(BzipTest, EmptyInputsTest) {
+  vector<char> out;
+  EXPECT_TRUE(BzipCompress(vector<char>(), &out));
+  vector<char> decompressed;
+  EXPECT_TRUE(BzipDecompress(out, &decompressed));
+  EXPECT_TRUE(decompressed.empty());
+}
+
+}  // namespace chromeos_update_engine
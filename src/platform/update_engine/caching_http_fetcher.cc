@@ -0,0 +1,305 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/caching_http_fetcher.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <utime.h>
+#include <algorithm>
+#include <utility>
+#include "chromeos/obsolete_logging.h"
+#include "update_engine/utils.h"
+
+using std::make_pair;
+using std::pair;
+using std::sort;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// How much of a cache entry is passed to the delegate at a time.
+const size_t kReadSize = 128 * 1024;
+
+// Entries are written under their name with this suffix until they're
+// complete.
+const char kPartialSuffix[] = ".partial";
+}  // namespace {}
+
+const int CachingHttpFetcher::kMaxEntries;
+
+CachingHttpFetcher::CachingHttpFetcher(const string& cache_dir,
+                                       HttpFetcher* base_fetcher)
+    : cache_dir_(cache_dir),
+      base_fetcher_(base_fetcher),
+      cache_hit_(false),
+      read_fd_(-1),
+      read_buffer_(kReadSize),
+      read_source_id_(0) {}
+
+CachingHttpFetcher::~CachingHttpFetcher() {
+  if (read_source_id_)
+    g_source_remove(read_source_id_);
+  if (read_fd_ >= 0)
+    close(read_fd_);
+  if (writer_.get()) {
+    writer_->Close();
+    unlink((write_path_ + kPartialSuffix).c_str());
+  }
+}
+
+string CachingHttpFetcher::EntryName(const string& hash) {
+  string name(hash);
+  for (string::iterator it = name.begin(); it != name.end(); ++it) {
+    if (*it == '/')
+      *it = '_';
+    else if (*it == '+')
+      *it = '-';
+  }
+  return name;
+}
+
+void CachingHttpFetcher::BeginTransfer(const string& url) {
+  CHECK_LT(read_fd_, 0);
+  CHECK(!writer_.get());
+  cache_hit_ = false;
+  http_response_code_ = 0;
+  etag_.clear();
+  hash_calculator_.reset();
+
+  OmahaHashCalculator::Algorithm algorithm;
+  if (!content_hash_.empty() &&
+      OmahaHashCalculator::AlgorithmForHash(content_hash_, &algorithm)) {
+    const string path = cache_dir_ + "/" + EntryName(content_hash_);
+    if (BeginCacheRead(path, algorithm))
+      return;
+    // A transfer that starts part way through can't be checked, so it isn't
+    // cached.
+    if (offset_ == 0)
+      BeginCacheWrite(path, algorithm);
+  }
+
+  base_fetcher_->set_delegate(this);
+  if (post_data_set_)
+    base_fetcher_->SetPostData(post_data_.empty() ? NULL : &post_data_[0],
+                               post_data_.size());
+  base_fetcher_->SetOffset(offset_);
+  base_fetcher_->SetIfNoneMatch(if_none_match_);
+  base_fetcher_->SetContentHash(content_hash_);
+  base_fetcher_->BeginTransfer(url);
+}
+
+void CachingHttpFetcher::TerminateTransfer() {
+  if (read_fd_ >= 0) {
+    if (read_source_id_) {
+      g_source_remove(read_source_id_);
+      read_source_id_ = 0;
+    }
+    close(read_fd_);
+    read_fd_ = -1;
+    hash_calculator_.reset();
+    return;
+  }
+  base_fetcher_->TerminateTransfer();
+  EndCacheWrite(false);
+}
+
+void CachingHttpFetcher::Pause() {
+  if (read_fd_ < 0) {
+    base_fetcher_->Pause();
+    return;
+  }
+  if (read_source_id_) {
+    g_source_remove(read_source_id_);
+    read_source_id_ = 0;
+  }
+}
+
+void CachingHttpFetcher::Unpause() {
+  if (read_fd_ < 0) {
+    base_fetcher_->Unpause();
+    return;
+  }
+  if (!read_source_id_)
+    read_source_id_ = g_idle_add(StaticReadCallback, this);
+}
+
+void CachingHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
+                                       const char* bytes,
+                                       int length) {
+  if (writer_.get()) {
+    int rc = writer_->Write(bytes, length);
+    if (rc < 0) {
+      LOG(ERROR) << "Unable to write to the cache: "
+                 << utils::ErrnoNumberAsString(-rc);
+      EndCacheWrite(false);
+    } else {
+      hash_calculator_->Update(bytes, length);
+    }
+  }
+  if (delegate_)
+    delegate_->ReceivedBytes(this, bytes, length);
+}
+
+void CachingHttpFetcher::TransferComplete(HttpFetcher* fetcher,
+                                          bool successful) {
+  http_response_code_ = base_fetcher_->http_response_code();
+  etag_ = base_fetcher_->etag();
+  EndCacheWrite(successful);
+  if (delegate_)
+    delegate_->TransferComplete(this, successful);
+}
+
+bool CachingHttpFetcher::BeginCacheRead(
+    const string& path, OmahaHashCalculator::Algorithm algorithm) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat stbuf;
+  if (fstat(fd, &stbuf) != 0 || offset_ > stbuf.st_size ||
+      lseek(fd, offset_, SEEK_SET) != offset_) {
+    close(fd);
+    return false;
+  }
+  LOG(INFO) << "Reading " << path << " from the cache";
+  // The entry is now the most recently used.
+  utime(path.c_str(), NULL);
+  cache_hit_ = true;
+  http_response_code_ = 200;
+  read_fd_ = fd;
+  read_path_ = path;
+  if (offset_ == 0)
+    hash_calculator_.reset(new OmahaHashCalculator(algorithm));
+  read_source_id_ = g_idle_add(StaticReadCallback, this);
+  return true;
+}
+
+bool CachingHttpFetcher::ReadCallback() {
+  ssize_t rc = read(read_fd_, &read_buffer_[0], read_buffer_.size());
+  if (rc < 0 && errno == EINTR)
+    return true;
+  if (rc <= 0) {
+    if (rc < 0)
+      LOG(ERROR) << "Unable to read " << read_path_ << ": "
+                 << utils::ErrnoNumberAsString(errno);
+    read_source_id_ = 0;
+    EndCacheRead(rc == 0);
+    return false;
+  }
+  if (hash_calculator_.get())
+    hash_calculator_->Update(&read_buffer_[0], rc);
+  // The delegate may pause or end the transfer, which removes this source,
+  // and may then resume it, which adds a new one.
+  const guint source_id = read_source_id_;
+  if (delegate_)
+    delegate_->ReceivedBytes(this, &read_buffer_[0], rc);
+  return read_source_id_ == source_id;
+}
+
+void CachingHttpFetcher::EndCacheRead(bool successful) {
+  close(read_fd_);
+  read_fd_ = -1;
+  if (successful && hash_calculator_.get()) {
+    hash_calculator_->Finalize();
+    if (hash_calculator_->hash() != content_hash_) {
+      LOG(ERROR) << read_path_ << " has the wrong hash. Removing it from the "
+                 << "cache.";
+      unlink(read_path_.c_str());
+      successful = false;
+    }
+  }
+  hash_calculator_.reset();
+  if (delegate_)
+    delegate_->TransferComplete(this, successful);
+}
+
+void CachingHttpFetcher::BeginCacheWrite(
+    const string& path, OmahaHashCalculator::Algorithm algorithm) {
+  if (mkdir(cache_dir_.c_str(), 0755) != 0 && errno != EEXIST) {
+    LOG(ERROR) << "Unable to create " << cache_dir_ << ": "
+               << utils::ErrnoNumberAsString(errno);
+    return;
+  }
+  writer_.reset(new DirectFileWriter);
+  const string partial_path = path + kPartialSuffix;
+  int rc = writer_->Open(partial_path.c_str(),
+                         O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (rc < 0) {
+    LOG(ERROR) << "Unable to open " << partial_path << ": "
+               << utils::ErrnoNumberAsString(-rc);
+    writer_.reset();
+    return;
+  }
+  write_path_ = path;
+  hash_calculator_.reset(new OmahaHashCalculator(algorithm));
+}
+
+void CachingHttpFetcher::EndCacheWrite(bool successful) {
+  if (!writer_.get())
+    return;
+  const string partial_path = write_path_ + kPartialSuffix;
+  int rc = writer_->Close();
+  writer_.reset();
+  if (rc < 0) {
+    LOG(ERROR) << "Unable to close " << partial_path << ": "
+               << utils::ErrnoNumberAsString(-rc);
+    successful = false;
+  }
+  if (successful) {
+    hash_calculator_->Finalize();
+    if (hash_calculator_->hash() != content_hash_) {
+      LOG(ERROR) << "Not caching the download: it has hash "
+                 << hash_calculator_->hash() << " instead of "
+                 << content_hash_;
+      successful = false;
+    }
+  }
+  hash_calculator_.reset();
+  if (successful) {
+    if (rename(partial_path.c_str(), write_path_.c_str()) == 0) {
+      LOG(INFO) << "Added " << write_path_ << " to the cache";
+      EvictEntries();
+      return;
+    }
+    LOG(ERROR) << "Unable to rename " << partial_path << ": "
+               << utils::ErrnoNumberAsString(errno);
+  }
+  unlink(partial_path.c_str());
+}
+
+void CachingHttpFetcher::EvictEntries() {
+  DIR* dir = opendir(cache_dir_.c_str());
+  if (!dir) {
+    LOG(ERROR) << "Unable to open " << cache_dir_ << ": "
+               << utils::ErrnoNumberAsString(errno);
+    return;
+  }
+  // Every other file, including anything left over from an interrupted
+  // write, is a candidate, oldest first.
+  vector<pair<time_t, string> > entries;
+  struct dirent* dir_entry;
+  while ((dir_entry = readdir(dir))) {
+    if (dir_entry->d_name[0] == '.')
+      continue;
+    const string path = cache_dir_ + "/" + dir_entry->d_name;
+    struct stat stbuf;
+    if (path == write_path_ || lstat(path.c_str(), &stbuf) != 0 ||
+        !S_ISREG(stbuf.st_mode))
+      continue;
+    entries.push_back(make_pair(stbuf.st_mtime, path));
+  }
+  closedir(dir);
+  sort(entries.begin(), entries.end());
+  for (size_t i = 0; i + kMaxEntries - 1 < entries.size(); i++) {
+    LOG(INFO) << "Removing " << entries[i].second << " from the cache";
+    unlink(entries[i].second.c_str());
+  }
+}
+
+}  // namespace chromeos_update_engine
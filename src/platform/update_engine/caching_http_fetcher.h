@@ -0,0 +1,120 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_CACHING_HTTP_FETCHER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_CACHING_HTTP_FETCHER_H__
+
+#include <string>
+#include <vector>
+#include <glib.h>
+#include "base/basictypes.h"
+#include "base/scoped_ptr.h"
+#include "update_engine/file_writer.h"
+#include "update_engine/http_fetcher.h"
+#include "update_engine/omaha_hash_calculator.h"
+
+// CachingHttpFetcher is an HttpFetcher that keeps the resources it fetches
+// in a local cache directory, named by their hashes, as given by
+// SetContentHash(). A resource that's in the cache is read from disk and
+// passed to the delegate just as if it had been downloaded; one that isn't
+// is fetched with another HttpFetcher and, if it has the expected hash,
+// added to the cache for next time. Only the kMaxEntries most recently used
+// resources are kept.
+//
+// Without a content hash, or when starting part way through a resource
+// that isn't cached, this just passes the transfer through.
+//
+// test_http_server serves the files in its cache directory under /cache/,
+// so that machines on a LAN can fetch payloads that one of them already
+// has: see EntryName().
+
+namespace chromeos_update_engine {
+
+class CachingHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
+ public:
+  // How many resources the cache keeps.
+  static const int kMaxEntries = 2;
+
+  // Uses base_fetcher, which it takes ownership of, for resources that
+  // aren't in cache_dir. cache_dir is created if need be.
+  CachingHttpFetcher(const std::string& cache_dir, HttpFetcher* base_fetcher);
+
+  // Cleans up all internal state. Does not notify delegate
+  ~CachingHttpFetcher();
+
+  virtual void BeginTransfer(const std::string& url);
+  virtual void TerminateTransfer();
+  virtual void Pause();
+  virtual void Unpause();
+
+  // HttpFetcherDelegate methods, called by base_fetcher_:
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes,
+                             int length);
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful);
+
+  // The name of the file that the resource with the given hash is cached
+  // in. It's the hash with the characters that can't be in a file name
+  // replaced, so it's also safe in a URL.
+  static std::string EntryName(const std::string& hash);
+
+  // True iff the last transfer was read from the cache.
+  bool cache_hit() const { return cache_hit_; }
+
+ private:
+  // Starts reading the transfer from the cache entry at path, if it's
+  // there. Returns false if it isn't.
+  bool BeginCacheRead(const std::string& path,
+                      OmahaHashCalculator::Algorithm algorithm);
+
+  // Passes the next chunk of the cache entry to the delegate.
+  bool ReadCallback();
+  static gboolean StaticReadCallback(gpointer data) {
+    return reinterpret_cast<CachingHttpFetcher*>(data)->ReadCallback();
+  }
+
+  // Ends a transfer that was read from the cache.
+  void EndCacheRead(bool successful);
+
+  // Starts writing what base_fetcher_ fetches to a new cache entry for the
+  // resource, to be found at path once it's complete.
+  void BeginCacheWrite(const std::string& path,
+                       OmahaHashCalculator::Algorithm algorithm);
+
+  // Adds the entry that's been written to the cache if successful is true
+  // and it has the right hash, and otherwise deletes it.
+  void EndCacheWrite(bool successful);
+
+  // Deletes the least recently used entries beyond kMaxEntries.
+  void EvictEntries();
+
+  const std::string cache_dir_;
+  scoped_ptr<HttpFetcher> base_fetcher_;
+
+  bool cache_hit_;
+
+  // The entry being read, while the transfer is from the cache.
+  int read_fd_;
+  std::string read_path_;
+  std::vector<char> read_buffer_;
+  // The main loop source that runs ReadCallback(); 0 if it's not scheduled,
+  // e.g. because the transfer is paused.
+  guint read_source_id_;
+
+  // The entry being written, if any, while base_fetcher_ fetches the
+  // resource. The entry is written under a temporary name and renamed to
+  // write_path_ once it's complete.
+  scoped_ptr<DirectFileWriter> writer_;
+  std::string write_path_;
+
+  // Checks the hash of what's read or written, unless the transfer didn't
+  // start at the beginning of the resource.
+  scoped_ptr<OmahaHashCalculator> hash_calculator_;
+
+  DISALLOW_COPY_AND_ASSIGN(CachingHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_CACHING_HTTP_FETCHER_H__
@@ -0,0 +1,238 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/types.h>
+#include <utime.h>
+#include <string>
+#include <glib.h>
+#include <gtest/gtest.h>
+#include "update_engine/caching_http_fetcher.h"
+#include "update_engine/mock_http_fetcher.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class CachingHttpFetcherTest : public ::testing::Test { };
+
+namespace {
+const char* const kTestDir = "caching_http_fetcher-test";
+
+// Several chunks' worth of data.
+string TestData() {
+  string data;
+  for (int i = 0; i < 200000; i++)
+    data.push_back('a' + (i * 7 % 26));
+  return data;
+}
+
+string EntryPath(const string& hash) {
+  return string(kTestDir) + "/" + CachingHttpFetcher::EntryName(hash);
+}
+
+class CachingHttpFetcherTestDelegate : public HttpFetcherDelegate {
+ public:
+  CachingHttpFetcherTestDelegate()
+      : fetcher_(NULL), pause_(false), paused_(false), successful_(false),
+        loop_(NULL) {}
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes, int length) {
+    EXPECT_FALSE(paused_);
+    data_.append(bytes, length);
+    if (pause_) {
+      paused_ = true;
+      fetcher->Pause();
+    }
+  }
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful) {
+    successful_ = successful;
+    g_main_loop_quit(loop_);
+  }
+  HttpFetcher* fetcher_;
+  // If true, pauses after each chunk until UnpauseCallback() runs.
+  bool pause_;
+  bool paused_;
+  string data_;
+  bool successful_;
+  GMainLoop* loop_;
+};
+
+gboolean UnpauseCallback(gpointer data) {
+  CachingHttpFetcherTestDelegate* delegate =
+      reinterpret_cast<CachingHttpFetcherTestDelegate*>(data);
+  if (delegate->paused_) {
+    delegate->paused_ = false;
+    delegate->fetcher_->Unpause();
+  }
+  return TRUE;
+}
+
+// Fetches the resource with the given hash through a CachingHttpFetcher
+// whose base fetcher would send base_data.
+void Fetch(const string& hash, const string& base_data, off_t offset,
+           bool pause, CachingHttpFetcherTestDelegate* delegate,
+           bool* cache_hit) {
+  GMainLoop* loop = g_main_loop_new(g_main_context_default(), FALSE);
+  CachingHttpFetcher fetcher(kTestDir,
+                             new MockHttpFetcher(base_data.data(),
+                                                 base_data.size()));
+  delegate->fetcher_ = &fetcher;
+  delegate->pause_ = pause;
+  delegate->loop_ = loop;
+  fetcher.set_delegate(delegate);
+  fetcher.SetContentHash(hash);
+  fetcher.SetOffset(offset);
+  guint unpause_id = g_timeout_add(1, UnpauseCallback, delegate);
+  fetcher.BeginTransfer("http://fake/url");
+  g_main_loop_run(loop);
+  g_source_remove(unpause_id);
+  g_main_loop_unref(loop);
+  *cache_hit = fetcher.cache_hit();
+}
+
+void ExpectFileContents(const string& path, const string& expected) {
+  string contents;
+  ASSERT_TRUE(utils::ReadFileToString(path, &contents));
+  EXPECT_TRUE(contents == expected);
+}
+}  // namespace {}
+
+TEST(CachingHttpFetcherTest, EntryNameTest) {
+  EXPECT_EQ("ab_cd-ef==", CachingHttpFetcher::EntryName("ab/cd+ef=="));
+}
+
+TEST(CachingHttpFetcherTest, MissThenHitTest) {
+  ASSERT_EQ(0, System(string("rm -rf ") + kTestDir));
+  const string data = TestData();
+  const string hash = OmahaHashCalculator::OmahaHashOfString(data);
+
+  // The first fetch goes to the network and fills the cache.
+  CachingHttpFetcherTestDelegate miss_delegate;
+  bool cache_hit = true;
+  Fetch(hash, data, 0, false, &miss_delegate, &cache_hit);
+  EXPECT_TRUE(miss_delegate.successful_);
+  EXPECT_FALSE(cache_hit);
+  EXPECT_TRUE(miss_delegate.data_ == data);
+  ExpectFileContents(EntryPath(hash), data);
+  EXPECT_FALSE(utils::FileExists((EntryPath(hash) + ".partial").c_str()));
+
+  // The second is served from the cache; the base fetcher would send
+  // something else.
+  CachingHttpFetcherTestDelegate hit_delegate;
+  Fetch(hash, "not the data", 0, false, &hit_delegate, &cache_hit);
+  EXPECT_TRUE(hit_delegate.successful_);
+  EXPECT_TRUE(cache_hit);
+  EXPECT_TRUE(hit_delegate.data_ == data);
+
+  // As is part of it.
+  CachingHttpFetcherTestDelegate offset_delegate;
+  Fetch(hash, "not the data", 12345, false, &offset_delegate, &cache_hit);
+  EXPECT_TRUE(offset_delegate.successful_);
+  EXPECT_TRUE(cache_hit);
+  EXPECT_TRUE(offset_delegate.data_ == data.substr(12345));
+
+  EXPECT_EQ(0, System(string("rm -rf ") + kTestDir));
+}
+
+TEST(CachingHttpFetcherTest, PauseTest) {
+  ASSERT_EQ(0, System(string("rm -rf ") + kTestDir));
+  const string data = TestData();
+  const string hash = OmahaHashCalculator::OmahaHashOfString(data);
+  bool cache_hit = false;
+  CachingHttpFetcherTestDelegate miss_delegate;
+  Fetch(hash, data, 0, true, &miss_delegate, &cache_hit);
+  EXPECT_TRUE(miss_delegate.successful_);
+  EXPECT_TRUE(miss_delegate.data_ == data);
+
+  CachingHttpFetcherTestDelegate hit_delegate;
+  Fetch(hash, "", 0, true, &hit_delegate, &cache_hit);
+  EXPECT_TRUE(hit_delegate.successful_);
+  EXPECT_TRUE(cache_hit);
+  EXPECT_TRUE(hit_delegate.data_ == data);
+  EXPECT_EQ(0, System(string("rm -rf ") + kTestDir));
+}
+
+TEST(CachingHttpFetcherTest, WrongHashTest) {
+  ASSERT_EQ(0, System(string("rm -rf ") + kTestDir));
+  const string data = TestData();
+  const string hash = OmahaHashCalculator::OmahaHashOfString("other data");
+
+  // What the network sends is passed on, but not cached.
+  CachingHttpFetcherTestDelegate delegate;
+  bool cache_hit = true;
+  Fetch(hash, data, 0, false, &delegate, &cache_hit);
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_FALSE(cache_hit);
+  EXPECT_TRUE(delegate.data_ == data);
+  EXPECT_FALSE(utils::FileExists(EntryPath(hash).c_str()));
+  EXPECT_FALSE(utils::FileExists((EntryPath(hash) + ".partial").c_str()));
+  EXPECT_EQ(0, System(string("rm -rf ") + kTestDir));
+}
+
+TEST(CachingHttpFetcherTest, CorruptEntryTest) {
+  ASSERT_EQ(0, System(string("rm -rf ") + kTestDir));
+  ASSERT_EQ(0, System(string("mkdir -p ") + kTestDir));
+  const string data = TestData();
+  const string hash = OmahaHashCalculator::OmahaHashOfString(data);
+  ASSERT_TRUE(WriteFileString(EntryPath(hash), "corrupt"));
+
+  // A bad entry fails the transfer and is thrown away...
+  CachingHttpFetcherTestDelegate hit_delegate;
+  bool cache_hit = false;
+  Fetch(hash, data, 0, false, &hit_delegate, &cache_hit);
+  EXPECT_FALSE(hit_delegate.successful_);
+  EXPECT_TRUE(cache_hit);
+  EXPECT_FALSE(utils::FileExists(EntryPath(hash).c_str()));
+
+  // ...so that the next try goes to the network.
+  CachingHttpFetcherTestDelegate miss_delegate;
+  Fetch(hash, data, 0, false, &miss_delegate, &cache_hit);
+  EXPECT_TRUE(miss_delegate.successful_);
+  EXPECT_FALSE(cache_hit);
+  ExpectFileContents(EntryPath(hash), data);
+  EXPECT_EQ(0, System(string("rm -rf ") + kTestDir));
+}
+
+TEST(CachingHttpFetcherTest, EvictionTest) {
+  ASSERT_EQ(0, System(string("rm -rf ") + kTestDir));
+  ASSERT_EQ(0, System(string("mkdir -p ") + kTestDir));
+  ASSERT_EQ(2, CachingHttpFetcher::kMaxEntries);
+  const string old_path = string(kTestDir) + "/old";
+  const string older_path = string(kTestDir) + "/older";
+  ASSERT_TRUE(WriteFileString(old_path, "old"));
+  ASSERT_TRUE(WriteFileString(older_path, "older"));
+  struct utimbuf times;
+  times.actime = times.modtime = 2000;
+  ASSERT_EQ(0, utime(old_path.c_str(), &times));
+  times.actime = times.modtime = 1000;
+  ASSERT_EQ(0, utime(older_path.c_str(), &times));
+
+  const string data = TestData();
+  const string hash = OmahaHashCalculator::OmahaHashOfString(data);
+  CachingHttpFetcherTestDelegate delegate;
+  bool cache_hit = true;
+  Fetch(hash, data, 0, false, &delegate, &cache_hit);
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_TRUE(utils::FileExists(EntryPath(hash).c_str()));
+  EXPECT_TRUE(utils::FileExists(old_path.c_str()));
+  EXPECT_FALSE(utils::FileExists(older_path.c_str()));
+  EXPECT_EQ(0, System(string("rm -rf ") + kTestDir));
+}
+
+TEST(CachingHttpFetcherTest, NoHashTest) {
+  ASSERT_EQ(0, System(string("rm -rf ") + kTestDir));
+  const string data = TestData();
+  CachingHttpFetcherTestDelegate delegate;
+  bool cache_hit = true;
+  Fetch("", data, 0, false, &delegate, &cache_hit);
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_FALSE(cache_hit);
+  EXPECT_TRUE(delegate.data_ == data);
+  EXPECT_FALSE(utils::FileExists(kTestDir));
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,229 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <glib.h>
+#include "chromeos/obsolete_logging.h"
+#include "update_engine/bzip.h"
+#include "update_engine/compressing_file_writer.h"
+#include "update_engine/decompressing_file_writer.h"
+#include "update_engine/file_writer.h"
+#include "update_engine/gzip.h"
+#include "update_engine/utils.h"
+
+// This file contains a simple program that compresses and decompresses a
+// file in each of the ways update_engine can, and reports the throughput and
+// peak memory use of each. Every mode runs in its own process so that the
+// peak RSS reported is that mode's alone.
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+const char* const kGzipPath = "/tmp/codec_benchmark.gz";
+const char* const kBzipPath = "/tmp/codec_benchmark.bz2";
+// How much of the input file is passed to each Write() in streaming modes.
+const size_t kChunkSize = 1024 * 1024;
+
+void usage(const char* argv0) {
+  printf("usage: %s input_file [threads]\n", argv0);
+  exit(1);
+}
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Streams the file at path through writer in kChunkSize pieces.
+bool StreamFile(const string& path, FileWriter* writer) {
+  int fd = open(path.c_str(), O_RDONLY | O_LARGEFILE, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  vector<char> buffer(kChunkSize);
+  for (;;) {
+    ssize_t bytes_read = read(fd, &buffer[0], buffer.size());
+    TEST_AND_RETURN_FALSE_ERRNO(bytes_read >= 0);
+    if (bytes_read == 0)
+      return true;
+    TEST_AND_RETURN_FALSE(writer->Write(&buffer[0], bytes_read) ==
+                          bytes_read);
+  }
+}
+
+bool StreamFileTo(const string& in, FileWriter* writer, const string& out) {
+  TEST_AND_RETURN_FALSE(writer->Open(out.c_str(),
+                                     O_CREAT | O_LARGEFILE | O_TRUNC |
+                                     O_WRONLY, 0644) == 0);
+  bool success = StreamFile(in, writer);
+  TEST_AND_RETURN_FALSE(writer->Close() == 0);
+  return success;
+}
+
+// Each mode reads from input and returns whether it succeeded.
+struct Mode {
+  const char* name;
+  bool (*run)(const string& input, int threads);
+};
+
+bool GzipInMemory(const string& input, int threads) {
+  vector<char> in, out;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(input, &in));
+  return GzipCompress(in, &out);
+}
+
+bool GzipStream(const string& input, int level, int threads,
+                const string& output) {
+  DirectFileWriter file_writer;
+  GzipCompressingFileWriter gzip_writer(&file_writer, level, threads);
+  return StreamFileTo(input, &gzip_writer, output);
+}
+
+bool Gzip9Stream(const string& input, int threads) {
+  return GzipStream(input, 9, 1, "/dev/null");
+}
+
+bool Gzip6Stream(const string& input, int threads) {
+  return GzipStream(input, 6, 1, "/dev/null");
+}
+
+bool Gzip6Parallel(const string& input, int threads) {
+  // Leaves the compressed file behind for the decompression modes.
+  return GzipStream(input, 6, threads, kGzipPath);
+}
+
+bool GunzipInMemory(const string& input, int threads) {
+  vector<char> in, out;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(kGzipPath, &in));
+  return GzipDecompress(in, &out);
+}
+
+bool GunzipStream(const string& input, int threads) {
+  DirectFileWriter file_writer;
+  GzipDecompressingFileWriter gunzip_writer(&file_writer);
+  return StreamFileTo(kGzipPath, &gunzip_writer, "/dev/null");
+}
+
+bool BzipInMemory(const string& input, int threads) {
+  vector<char> in, out;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(input, &in));
+  return BzipCompress(in, &out);
+}
+
+bool BzipStream(const string& input, int threads) {
+  DirectFileWriter file_writer;
+  BzipCompressingFileWriter bzip_writer(&file_writer);
+  return StreamFileTo(input, &bzip_writer, kBzipPath);
+}
+
+bool BunzipInMemory(const string& input, int threads) {
+  vector<char> in, out;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(kBzipPath, &in));
+  return BzipDecompress(in, &out);
+}
+
+// The decompression modes read what the compression modes before them
+// wrote.
+const Mode kModes[] = {
+  { "gzip -9, in memory", GzipInMemory },
+  { "gzip -9, streaming", Gzip9Stream },
+  { "gzip -6, streaming", Gzip6Stream },
+  { "gzip -6, parallel", Gzip6Parallel },
+  { "gunzip, in memory", GunzipInMemory },
+  { "gunzip, streaming", GunzipStream },
+  { "bzip2, in memory", BzipInMemory },
+  { "bzip2, streaming", BzipStream },
+  { "bunzip2, in memory", BunzipInMemory },
+};
+
+// Runs mode in a child process. Returns false if it failed; otherwise sets
+// *seconds to how long it took and *peak_rss_kib to the child's peak RSS.
+bool RunMode(const Mode& mode, const string& input, int threads,
+             double* seconds, long* peak_rss_kib) {
+  int fds[2];
+  TEST_AND_RETURN_FALSE_ERRNO(pipe(fds) == 0);
+  pid_t pid = fork();
+  TEST_AND_RETURN_FALSE_ERRNO(pid >= 0);
+  if (pid == 0) {
+    close(fds[0]);
+    const double start = Now();
+    double elapsed = -1;
+    if ((*mode.run)(input, threads))
+      elapsed = Now() - start;
+    // The pipe can take far more than this without blocking.
+    _exit(write(fds[1], &elapsed, sizeof(elapsed)) == sizeof(elapsed) ?
+          0 : 1);
+  }
+  close(fds[1]);
+  double elapsed = -1;
+  bool success = read(fds[0], &elapsed, sizeof(elapsed)) == sizeof(elapsed);
+  close(fds[0]);
+  int status = 0;
+  struct rusage usage;
+  TEST_AND_RETURN_FALSE_ERRNO(wait4(pid, &status, 0, &usage) == pid);
+  TEST_AND_RETURN_FALSE(success && WIFEXITED(status) &&
+                        WEXITSTATUS(status) == 0 && elapsed >= 0);
+  *seconds = elapsed;
+  *peak_rss_kib = usage.ru_maxrss;
+  return true;
+}
+
+int Main(int argc, char** argv) {
+  g_thread_init(NULL);
+  if (argc != 2 && argc != 3) {
+    usage(argv[0]);
+  }
+  const string input = argv[1];
+  const int threads = argc == 3 ? atoi(argv[2]) : 4;
+  if (threads < 1) {
+    usage(argv[0]);
+  }
+  struct stat stbuf;
+  if (stat(input.c_str(), &stbuf) != 0) {
+    perror(input.c_str());
+    return 1;
+  }
+  const double input_mib = stbuf.st_size / (1024.0 * 1024.0);
+  printf("%s: %.1f MiB, %d threads in parallel mode\n", input.c_str(),
+         input_mib, threads);
+  int rc = 0;
+  for (size_t i = 0; i < arraysize(kModes); i++) {
+    double seconds = 0;
+    long peak_rss_kib = 0;
+    if (!RunMode(kModes[i], input, threads, &seconds, &peak_rss_kib)) {
+      printf("%-20s failed\n", kModes[i].name);
+      rc = 1;
+      continue;
+    }
+    // Throughput is always in terms of the uncompressed data.
+    printf("%-20s %8.1f MB/s %10ld KiB peak RSS\n", kModes[i].name,
+           seconds > 0 ? input_mib / seconds : 0, peak_rss_kib);
+  }
+  unlink(kGzipPath);
+  unlink(kBzipPath);
+  return rc;
+}
+
+}  // namespace {}
+
+}  // namespace chromeos_update_engine
+
+int main(int argc, char** argv) {
+  return chromeos_update_engine::Main(argc, argv);
+}
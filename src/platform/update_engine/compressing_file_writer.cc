@@ -0,0 +1,358 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/compressing_file_writer.h"
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+using std::min;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// How much is compressed at once.
+const size_t kOutputBufferSize = 128 * 1024;
+
+// In parallel mode, the size of each block of input, as in pigz, and the
+// size of the dictionary that each block gets from the one before: the
+// full deflate window.
+const size_t kBlockSize = 128 * 1024;
+const size_t kDictionarySize = 32 * 1024;
+
+// How many blocks per thread may be queued or waiting to be written out.
+// This is what bounds memory use.
+const size_t kBlocksPerThread = 2;
+
+// The fixed gzip header: deflate, no name or timestamp, Unix.
+const unsigned char kGzipHeader[] = {
+  0x1f, 0x8b, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x03
+};
+
+// Writes count bytes to next. Returns 0 on success or -errno on error.
+int WriteAll(FileWriter* next, const void* bytes, size_t count) {
+  if (count == 0)
+    return 0;
+  int rc = next->Write(bytes, count);
+  if (rc < 0)
+    return rc;
+  return static_cast<size_t>(rc) == count ? 0 : -EIO;
+}
+
+void PutLittleEndian32(uint32 value, char* out) {
+  for (int i = 0; i < 4; i++)
+    out[i] = static_cast<char>((value >> (8 * i)) & 0xff);
+}
+}  // namespace {}
+
+GzipCompressingFileWriter::GzipCompressingFileWriter(FileWriter* next,
+                                                     int level,
+                                                     int num_threads)
+    : next_(next),
+      level_(level),
+      num_threads_(num_threads),
+      stream_initialized_(false),
+      current_(NULL),
+      crc_(0),
+      total_in_(0),
+      mutex_(g_mutex_new()),
+      work_available_(g_cond_new()),
+      work_done_(g_cond_new()),
+      closing_(false) {
+  CHECK(next_);
+  memset(&stream_, 0, sizeof(stream_));
+}
+
+GzipCompressingFileWriter::~GzipCompressingFileWriter() {
+  StopThreads();
+  if (stream_initialized_)
+    deflateEnd(&stream_);
+  g_cond_free(work_done_);
+  g_cond_free(work_available_);
+  g_mutex_free(mutex_);
+}
+
+int GzipCompressingFileWriter::Open(const char* path, int flags,
+                                    mode_t mode) {
+  CHECK(!stream_initialized_ && threads_.empty()) << "Already open";
+  int rc = next_->Open(path, flags, mode);
+  if (rc < 0)
+    return rc;
+  if (num_threads_ <= 1) {
+    memset(&stream_, 0, sizeof(stream_));
+    if (deflateInit2(&stream_, level_, Z_DEFLATED, 16 + MAX_WBITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK)
+      return -ENOMEM;
+    stream_initialized_ = true;
+    buffer_.resize(kOutputBufferSize);
+    return 0;
+  }
+  crc_ = crc32(0, NULL, 0);
+  total_in_ = 0;
+  closing_ = false;
+  current_ = new Block;
+  current_->input.reserve(kBlockSize);
+  for (int i = 0; i < num_threads_; i++) {
+    GThread* thread = g_thread_create(&StaticWorkerMain, this, TRUE, NULL);
+    CHECK(thread);
+    threads_.push_back(thread);
+  }
+  return WriteAll(next_, kGzipHeader, sizeof(kGzipHeader));
+}
+
+int GzipCompressingFileWriter::Write(const void* bytes, size_t count) {
+  if (stream_initialized_) {
+    stream_.next_in =
+        const_cast<Bytef*>(reinterpret_cast<const Bytef*>(bytes));
+    stream_.avail_in = count;
+    int rc = Deflate(Z_NO_FLUSH);
+    return rc < 0 ? rc : count;
+  }
+  CHECK(current_) << "Not open";
+  const char* char_bytes = reinterpret_cast<const char*>(bytes);
+  size_t offset = 0;
+  while (offset < count) {
+    const size_t length = min(count - offset,
+                              kBlockSize - current_->input.size());
+    current_->input.insert(current_->input.end(), char_bytes + offset,
+                           char_bytes + offset + length);
+    offset += length;
+    if (current_->input.size() == kBlockSize) {
+      int rc = SubmitBlock(false);
+      if (rc < 0)
+        return rc;
+    }
+  }
+  return count;
+}
+
+int GzipCompressingFileWriter::Close() {
+  int rc = 0;
+  if (stream_initialized_) {
+    stream_.avail_in = 0;
+    rc = Deflate(Z_FINISH);
+    deflateEnd(&stream_);
+    stream_initialized_ = false;
+  } else if (current_) {
+    // The last block may be empty; it still ends the deflate stream.
+    rc = SubmitBlock(true);
+    while (rc == 0 && !blocks_.empty())
+      rc = WriteOldestBlock();
+    if (rc == 0) {
+      char trailer[8];
+      PutLittleEndian32(crc_, trailer);
+      PutLittleEndian32(total_in_, trailer + 4);
+      rc = WriteAll(next_, trailer, sizeof(trailer));
+    }
+    StopThreads();
+  }
+  int close_rc = next_->Close();
+  return rc < 0 ? rc : close_rc;
+}
+
+int GzipCompressingFileWriter::Deflate(int flush) {
+  for (;;) {
+    stream_.next_out = reinterpret_cast<Bytef*>(&buffer_[0]);
+    stream_.avail_out = buffer_.size();
+    int retcode = deflate(&stream_, flush);
+    if (retcode != Z_OK && retcode != Z_STREAM_END &&
+        retcode != Z_BUF_ERROR) {
+      LOG(ERROR) << "zlib deflate() error:" << retcode;
+      return -EINVAL;
+    }
+    int rc = WriteAll(next_, &buffer_[0], buffer_.size() - stream_.avail_out);
+    if (rc < 0)
+      return rc;
+    // deflate() is done with this call once it has room to spare.
+    if (flush == Z_FINISH ? retcode == Z_STREAM_END : stream_.avail_out > 0)
+      return 0;
+  }
+}
+
+void GzipCompressingFileWriter::CompressBlock(Block* block) const {
+  block->crc = crc32(0, NULL, 0);
+  if (!block->input.empty())
+    block->crc = crc32(block->crc,
+                       reinterpret_cast<const Bytef*>(&block->input[0]),
+                       block->input.size());
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // Raw deflate; the gzip header and trailer are written by the writer.
+  if (deflateInit2(&stream, level_, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    block->error = -ENOMEM;
+    return;
+  }
+  if (!block->dictionary.empty())
+    deflateSetDictionary(
+        &stream, reinterpret_cast<const Bytef*>(&block->dictionary[0]),
+        block->dictionary.size());
+  // Every block but the last ends with an empty stored block, which
+  // byte-aligns the output so the next block can simply be appended.
+  const int flush = block->last ? Z_FINISH : Z_SYNC_FLUSH;
+  block->output.resize(deflateBound(&stream, block->input.size()) + 16);
+  stream.next_in = block->input.empty() ? NULL :
+      reinterpret_cast<Bytef*>(&block->input[0]);
+  stream.avail_in = block->input.size();
+  stream.next_out = reinterpret_cast<Bytef*>(&block->output[0]);
+  stream.avail_out = block->output.size();
+  for (;;) {
+    int retcode = deflate(&stream, flush);
+    if (retcode != Z_OK && retcode != Z_STREAM_END &&
+        retcode != Z_BUF_ERROR) {
+      LOG(ERROR) << "zlib deflate() error:" << retcode;
+      block->error = -EINVAL;
+      break;
+    }
+    if (flush == Z_FINISH ? retcode == Z_STREAM_END : stream.avail_out > 0)
+      break;
+    // Shouldn't happen given deflateBound(), but make room anyway.
+    const size_t used = block->output.size() - stream.avail_out;
+    block->output.resize(block->output.size() * 2);
+    stream.next_out = reinterpret_cast<Bytef*>(&block->output[used]);
+    stream.avail_out = block->output.size() - used;
+  }
+  block->output.resize(block->output.size() - stream.avail_out);
+  deflateEnd(&stream);
+}
+
+int GzipCompressingFileWriter::SubmitBlock(bool last) {
+  Block* block = current_;
+  block->last = last;
+  block->done = false;
+  block->error = 0;
+  current_ = NULL;
+  if (!last) {
+    current_ = new Block;
+    current_->input.reserve(kBlockSize);
+    const size_t dictionary_size = min(kDictionarySize, block->input.size());
+    current_->dictionary.assign(block->input.end() - dictionary_size,
+                                block->input.end());
+  }
+
+  // Bound the memory in use before adding another block.
+  const size_t max_blocks = kBlocksPerThread * num_threads_;
+  int rc = 0;
+  while (rc == 0 && blocks_.size() >= max_blocks)
+    rc = WriteOldestBlock();
+
+  g_mutex_lock(mutex_);
+  blocks_.push_back(block);
+  pending_.push_back(block);
+  g_cond_signal(work_available_);
+  g_mutex_unlock(mutex_);
+  return rc;
+}
+
+int GzipCompressingFileWriter::WriteOldestBlock() {
+  g_mutex_lock(mutex_);
+  CHECK(!blocks_.empty());
+  Block* block = blocks_.front();
+  while (!block->done)
+    g_cond_wait(work_done_, mutex_);
+  blocks_.pop_front();
+  g_mutex_unlock(mutex_);
+
+  int rc = block->error;
+  if (rc == 0)
+    rc = WriteAll(next_, block->output.empty() ? NULL : &block->output[0],
+                  block->output.size());
+  if (rc == 0) {
+    crc_ = crc32_combine(crc_, block->crc, block->input.size());
+    total_in_ += block->input.size();
+  }
+  delete block;
+  return rc;
+}
+
+gpointer GzipCompressingFileWriter::StaticWorkerMain(gpointer data) {
+  reinterpret_cast<GzipCompressingFileWriter*>(data)->WorkerMain();
+  return NULL;
+}
+
+void GzipCompressingFileWriter::WorkerMain() {
+  g_mutex_lock(mutex_);
+  for (;;) {
+    while (pending_.empty() && !closing_)
+      g_cond_wait(work_available_, mutex_);
+    if (pending_.empty())
+      break;
+    Block* block = pending_.front();
+    pending_.pop_front();
+    g_mutex_unlock(mutex_);
+    CompressBlock(block);
+    g_mutex_lock(mutex_);
+    block->done = true;
+    g_cond_broadcast(work_done_);
+  }
+  g_mutex_unlock(mutex_);
+}
+
+void GzipCompressingFileWriter::StopThreads() {
+  g_mutex_lock(mutex_);
+  closing_ = true;
+  // Blocks that haven't been started won't be written out anyway.
+  pending_.clear();
+  g_cond_broadcast(work_available_);
+  g_mutex_unlock(mutex_);
+  for (vector<GThread*>::iterator it = threads_.begin();
+       it != threads_.end(); ++it)
+    g_thread_join(*it);
+  threads_.clear();
+  for (std::deque<Block*>::iterator it = blocks_.begin();
+       it != blocks_.end(); ++it)
+    delete *it;
+  blocks_.clear();
+  delete current_;
+  current_ = NULL;
+}
+
+BzipCompressingFileWriter::BzipCompressingFileWriter(FileWriter* next)
+    : next_(next),
+      buffer_(kOutputBufferSize) {
+  CHECK(next_);
+  memset(&stream_, 0, sizeof(stream_));
+  // Block size 9, as the bzip2 tool uses by default.
+  CHECK_EQ(BZ2_bzCompressInit(&stream_, 9, 0, 0), BZ_OK);
+}
+
+BzipCompressingFileWriter::~BzipCompressingFileWriter() {
+  BZ2_bzCompressEnd(&stream_);
+}
+
+int BzipCompressingFileWriter::Write(const void* bytes, size_t count) {
+  stream_.next_in = const_cast<char*>(reinterpret_cast<const char*>(bytes));
+  stream_.avail_in = count;
+  int rc = Compress(BZ_RUN);
+  return rc < 0 ? rc : count;
+}
+
+int BzipCompressingFileWriter::Close() {
+  stream_.avail_in = 0;
+  int rc = Compress(BZ_FINISH);
+  int close_rc = next_->Close();
+  return rc < 0 ? rc : close_rc;
+}
+
+int BzipCompressingFileWriter::Compress(int action) {
+  for (;;) {
+    stream_.next_out = &buffer_[0];
+    stream_.avail_out = buffer_.size();
+    int retcode = BZ2_bzCompress(&stream_, action);
+    if (retcode != BZ_RUN_OK && retcode != BZ_FINISH_OK &&
+        retcode != BZ_STREAM_END) {
+      LOG(ERROR) << "BZ2_bzCompress() error:" << retcode;
+      return -EINVAL;
+    }
+    int rc = WriteAll(next_, &buffer_[0], buffer_.size() - stream_.avail_out);
+    if (rc < 0)
+      return rc;
+    if (action == BZ_FINISH ? retcode == BZ_STREAM_END :
+        stream_.avail_in == 0)
+      return 0;
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,141 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_COMPRESSING_FILE_WRITER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_COMPRESSING_FILE_WRITER_H__
+
+#include <deque>
+#include <vector>
+#include <bzlib.h>
+#include <glib.h>
+#include <zlib.h>
+#include "base/basictypes.h"
+#include "update_engine/file_writer.h"
+
+// These FileWriters compress everything passed to Write() onto another
+// FileWriter, which is responsible for actually writing the data out. Calls
+// to Open and Close are passed through to the other FileWriter; Close()
+// first writes out the end of the compressed stream. Memory use doesn't
+// depend on how much data is compressed.
+
+namespace chromeos_update_engine {
+
+// GzipCompressingFileWriter writes a gzip stream. With more than one
+// thread it works like pigz: the input is cut into blocks which are
+// deflated in parallel, each primed with the end of the block before it as
+// its dictionary, and the results are joined into a single gzip member
+// that plain zlib can decompress.
+class GzipCompressingFileWriter : public FileWriter {
+ public:
+  // level is a zlib compression level, 1-9. Up to num_threads blocks are
+  // compressed at once.
+  GzipCompressingFileWriter(FileWriter* next, int level, int num_threads);
+  virtual ~GzipCompressingFileWriter();
+
+  virtual int Open(const char* path, int flags, mode_t mode);
+  virtual int Write(const void* bytes, size_t count);
+  virtual int Close();
+
+ private:
+  // A block of input that's compressed by itself in parallel mode.
+  struct Block {
+    std::vector<char> input;
+    // The end of the previous block's input.
+    std::vector<char> dictionary;
+    // True for the final block of the stream.
+    bool last;
+    // Raw deflate data, which continues the stream from the previous block.
+    std::vector<char> output;
+    // The CRC-32 of input.
+    uLong crc;
+    // Set by the worker thread once output and crc are filled in.
+    bool done;
+    // 0, or -errno if the block couldn't be compressed.
+    int error;
+  };
+
+  // Runs deflate() on stream_ with flush, passing all output to next_.
+  // Returns 0 on success or -errno on error.
+  int Deflate(int flush);
+
+  // Compresses block->input into block->output.
+  void CompressBlock(Block* block) const;
+
+  // Queues current_ for compression and starts a new block. If too many
+  // blocks are queued, first waits for the oldest one and writes it out.
+  // Returns 0 on success or -errno on error.
+  int SubmitBlock(bool last);
+
+  // Waits until the oldest queued block is compressed and writes it to
+  // next_. Returns 0 on success or -errno on error.
+  int WriteOldestBlock();
+
+  static gpointer StaticWorkerMain(gpointer data);
+  void WorkerMain();
+
+  // Waits for the worker threads to exit and frees all blocks.
+  void StopThreads();
+
+  FileWriter* const next_;
+  const int level_;
+  const int num_threads_;
+
+  // Single threaded mode.
+  z_stream stream_;
+  bool stream_initialized_;
+  // Where data is deflated to. It's kept around in our class to avoid
+  // repeated calls to malloc().
+  std::vector<char> buffer_;
+
+  // Parallel mode.
+  // The block being filled by Write().
+  Block* current_;
+  // CRC-32 and length of all data written out so far.
+  uLong crc_;
+  uint32 total_in_;
+
+  // Protects everything below.
+  GMutex* mutex_;
+  // Signaled when a block is queued or the workers should exit.
+  GCond* work_available_;
+  // Signaled when a block has been compressed.
+  GCond* work_done_;
+  // All blocks that haven't been written out, oldest first.
+  std::deque<Block*> blocks_;
+  // Blocks that no worker has started on yet, oldest first.
+  std::deque<Block*> pending_;
+  bool closing_;
+  std::vector<GThread*> threads_;
+
+  DISALLOW_COPY_AND_ASSIGN(GzipCompressingFileWriter);
+};
+
+// BzipCompressingFileWriter writes a bzip2 stream.
+class BzipCompressingFileWriter : public FileWriter {
+ public:
+  explicit BzipCompressingFileWriter(FileWriter* next);
+  virtual ~BzipCompressingFileWriter();
+
+  virtual int Open(const char* path, int flags, mode_t mode) {
+    return next_->Open(path, flags, mode);
+  }
+  virtual int Write(const void* bytes, size_t count);
+  virtual int Close();
+
+ private:
+  // Runs BZ2_bzCompress() with action until it has consumed all input (or,
+  // for BZ_FINISH, ended the stream), passing all output to next_. Returns 0
+  // on success or -errno on error.
+  int Compress(int action);
+
+  FileWriter* const next_;
+  bz_stream stream_;
+  std::vector<char> buffer_;
+
+  DISALLOW_COPY_AND_ASSIGN(BzipCompressingFileWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_COMPRESSING_FILE_WRITER_H__
@@ -0,0 +1,140 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/bzip.h"
+#include "update_engine/compressing_file_writer.h"
+#include "update_engine/decompressing_file_writer.h"
+#include "update_engine/file_writer.h"
+#include "update_engine/gzip.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class CompressingFileWriterTest : public ::testing::Test { };
+
+namespace {
+// The size of the blocks that the parallel gzip writer cuts its input into.
+const size_t kBlockSize = 128 * 1024;
+
+// Returns size bytes that compress somewhat, but not trivially.
+vector<char> MakeData(size_t size) {
+  vector<char> data(size);
+  unsigned int seed = 1;
+  for (size_t i = 0; i < size; i++) {
+    // Runs of text with random bytes mixed in.
+    data[i] = (i % 7 == 0) ? static_cast<char>(rand_r(&seed)) :
+        "the quick brown fox "[i % 20];
+  }
+  return data;
+}
+
+// Compresses data with writer, which must write into *compressed, passing it
+// in pieces of write_size bytes.
+void CompressWith(FileWriter* writer, const vector<char>& data,
+                  size_t write_size) {
+  ASSERT_EQ(0, writer->Open("unused", O_WRONLY, 0644));
+  for (size_t offset = 0; offset < data.size(); offset += write_size) {
+    const size_t count = std::min(write_size, data.size() - offset);
+    ASSERT_EQ(count, writer->Write(&data[offset], count));
+  }
+  ASSERT_EQ(0, writer->Close());
+}
+
+void GzipRoundTrip(size_t size, int num_threads, size_t write_size) {
+  const vector<char> data = MakeData(size);
+  vector<char> compressed;
+  VectorFileWriter vector_writer(&compressed);
+  GzipCompressingFileWriter gzip_writer(&vector_writer, 6, num_threads);
+  CompressWith(&gzip_writer, data, write_size);
+  EXPECT_GT(compressed.size(), 0);
+
+  // Plain zlib, both all at once and as a stream.
+  vector<char> decompressed;
+  EXPECT_TRUE(GzipDecompress(compressed, &decompressed));
+  EXPECT_TRUE(data == decompressed) << "size " << size;
+
+  decompressed.clear();
+  VectorFileWriter decompressed_writer(&decompressed);
+  GzipDecompressingFileWriter gunzip_writer(&decompressed_writer);
+  EXPECT_EQ(compressed.size(),
+            gunzip_writer.Write(&compressed[0], compressed.size()));
+  EXPECT_TRUE(data == decompressed) << "size " << size;
+}
+}  // namespace {}
+
+TEST(CompressingFileWriterTest, GzipSingleThreadTest) {
+  GzipRoundTrip(0, 1, 1024);
+  GzipRoundTrip(1, 1, 1024);
+  GzipRoundTrip(kBlockSize, 1, 1000);
+  GzipRoundTrip(3 * 1024 * 1024 + 17, 1, 64 * 1024);
+}
+
+TEST(CompressingFileWriterTest, GzipParallelTest) {
+  GzipRoundTrip(0, 4, 1024);
+  GzipRoundTrip(1, 4, 1024);
+  GzipRoundTrip(kBlockSize - 1, 4, 1000);
+  GzipRoundTrip(kBlockSize, 4, 1000);
+  GzipRoundTrip(kBlockSize + 1, 4, kBlockSize + 1);
+  GzipRoundTrip(3 * 1024 * 1024 + 17, 4, 64 * 1024);
+  // More blocks than are allowed in flight, with a single huge write.
+  GzipRoundTrip(5 * 1024 * 1024, 2, 5 * 1024 * 1024);
+}
+
+TEST(CompressingFileWriterTest, GzipParallelCompressesTest) {
+  // Priming each block with its predecessor's data keeps the ratio close to
+  // single threaded compression.
+  const vector<char> data = MakeData(2 * 1024 * 1024);
+  vector<char> single, parallel;
+  VectorFileWriter single_writer(&single), parallel_writer(&parallel);
+  GzipCompressingFileWriter single_gzip(&single_writer, 6, 1);
+  GzipCompressingFileWriter parallel_gzip(&parallel_writer, 6, 4);
+  CompressWith(&single_gzip, data, 64 * 1024);
+  CompressWith(&parallel_gzip, data, 64 * 1024);
+  EXPECT_LT(parallel.size(), single.size() + single.size() / 50);
+}
+
+TEST(CompressingFileWriterTest, GzipToolTest) {
+  // The gzip tool reads what the parallel writer writes.
+  const string kPath("/tmp/CompressingFileWriterTest");
+  const vector<char> data = MakeData(kBlockSize * 3 + 5);
+  DirectFileWriter file_writer;
+  GzipCompressingFileWriter gzip_writer(&file_writer, 9, 3);
+  ASSERT_EQ(0, gzip_writer.Open((kPath + ".gz").c_str(),
+                                O_CREAT | O_LARGEFILE | O_TRUNC | O_WRONLY,
+                                0644));
+  ASSERT_EQ(data.size(), gzip_writer.Write(&data[0], data.size()));
+  ASSERT_EQ(0, gzip_writer.Close());
+  EXPECT_EQ(0, System(string("gzip -t ") + kPath + ".gz"));
+  EXPECT_EQ(0, System(string("gzip -dc ") + kPath + ".gz > " + kPath));
+  vector<char> decompressed;
+  EXPECT_TRUE(utils::ReadFile(kPath, &decompressed));
+  EXPECT_TRUE(data == decompressed);
+  unlink(kPath.c_str());
+  unlink((kPath + ".gz").c_str());
+}
+
+TEST(CompressingFileWriterTest, BzipTest) {
+  const size_t kSizes[] = { 0, 1, 1024 * 1024 + 3 };
+  for (size_t i = 0; i < arraysize(kSizes); i++) {
+    const vector<char> data = MakeData(kSizes[i]);
+    vector<char> compressed;
+    VectorFileWriter vector_writer(&compressed);
+    BzipCompressingFileWriter bzip_writer(&vector_writer);
+    CompressWith(&bzip_writer, data, 10000);
+    vector<char> decompressed;
+    EXPECT_TRUE(BzipDecompress(compressed, &decompressed));
+    EXPECT_TRUE(data == decompressed) << "size " << kSizes[i];
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,279 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/curl_multi_driver.h"
+#include <algorithm>
+#include "chromeos/obsolete_logging.h"
+
+using std::make_pair;
+using std::max;
+
+namespace chromeos_update_engine {
+
+CurlMultiDriver::~CurlMultiDriver() {
+  Detach();
+}
+
+void CurlMultiDriver::Attach(CURLM* multi_handle) {
+  CHECK(!multi_handle_);
+  CHECK(multi_handle);
+  multi_handle_ = multi_handle;
+  if (use_socket_callbacks_) {
+    CHECK_EQ(curl_multi_setopt(multi_handle_, CURLMOPT_SOCKETFUNCTION,
+                               StaticSocketCallback), CURLM_OK);
+    CHECK_EQ(curl_multi_setopt(multi_handle_, CURLMOPT_SOCKETDATA, this),
+             CURLM_OK);
+    CHECK_EQ(curl_multi_setopt(multi_handle_, CURLMOPT_TIMERFUNCTION,
+                               StaticTimerCallback), CURLM_OK);
+    CHECK_EQ(curl_multi_setopt(multi_handle_, CURLMOPT_TIMERDATA, this),
+             CURLM_OK);
+  }
+}
+
+void CurlMultiDriver::Detach() {
+  if (multi_handle_ && use_socket_callbacks_) {
+    // Removing handles later makes libcurl call these, so unhook them.
+    CHECK_EQ(curl_multi_setopt(multi_handle_, CURLMOPT_SOCKETFUNCTION, NULL),
+             CURLM_OK);
+    CHECK_EQ(curl_multi_setopt(multi_handle_, CURLMOPT_TIMERFUNCTION, NULL),
+             CURLM_OK);
+  }
+  RemoveMainloopSources();
+  multi_handle_ = NULL;
+}
+
+void CurlMultiDriver::PerformOnce() {
+  CHECK(multi_handle_);
+  int running_handles = 0;
+  if (use_socket_callbacks_) {
+    // Acting on the timeout lets libcurl look at all of its handles. It
+    // updates our watches and timer through the callbacks as it goes.
+    running_handles = SocketAction(CURL_SOCKET_TIMEOUT, 0);
+  } else {
+    CURLMcode retcode = CURLM_CALL_MULTI_PERFORM;
+
+    // libcurl may request that we immediately call curl_multi_perform after
+    // it returns, so we do. libcurl promises that curl_multi_perform will not
+    // block.
+    while (CURLM_CALL_MULTI_PERFORM == retcode) {
+      retcode = curl_multi_perform(multi_handle_, &running_handles);
+    }
+    if (running_handles > 0)
+      SetupMainloopSources();
+    else
+      RemoveMainloopSources();
+  }
+  // The delegate may detach us, or even delete us, so this must come last.
+  delegate_->CurlMultiPerformed(running_handles);
+}
+
+int CurlMultiDriver::SocketAction(curl_socket_t fd, int ev_bitmask) {
+  int running_handles = 0;
+  CURLMcode retcode = CURLM_CALL_MULTI_PERFORM;
+  while (CURLM_CALL_MULTI_PERFORM == retcode) {
+    retcode = curl_multi_socket_action(multi_handle_, fd, ev_bitmask,
+                                       &running_handles);
+  }
+  CHECK_EQ(retcode, CURLM_OK);
+  return running_handles;
+}
+
+int CurlMultiDriver::SocketCallback(curl_socket_t fd, int what) {
+  RemoveWatch(fd);
+  if (what == CURL_POLL_REMOVE || what == CURL_POLL_NONE)
+    return 0;
+  int condition = G_IO_ERR | G_IO_HUP;
+  if (what & CURL_POLL_IN)
+    condition |= G_IO_IN | G_IO_PRI;
+  if (what & CURL_POLL_OUT)
+    condition |= G_IO_OUT;
+  GIOChannel *io_channel = g_io_channel_unix_new(fd);
+  guint tag = g_io_add_watch(io_channel,
+                             static_cast<GIOCondition>(condition),
+                             &StaticSocketReadyCallback,
+                             this);
+  io_channels_[fd] = make_pair(io_channel, tag);
+  return 0;
+}
+
+int CurlMultiDriver::TimerCallback(long timeout_ms) {
+  if (timeout_source_) {
+    g_source_destroy(timeout_source_);
+    timeout_source_ = NULL;
+  }
+  if (timeout_ms < 0)
+    return 0;
+  // libcurl must not be called from its own callback, so even a timeout of
+  // 0 goes through the main loop.
+  timeout_source_ = g_timeout_source_new(timeout_ms);
+  CHECK(timeout_source_);
+  g_source_set_callback(timeout_source_, StaticTimerFiredCallback, this,
+                        NULL);
+  g_source_attach(timeout_source_, NULL);
+  return 0;
+}
+
+bool CurlMultiDriver::SocketReadyCallback(GIOChannel *source,
+                                          GIOCondition condition) {
+  wakeups_++;
+  int ev_bitmask = 0;
+  if (condition & (G_IO_IN | G_IO_PRI))
+    ev_bitmask |= CURL_CSELECT_IN;
+  if (condition & G_IO_OUT)
+    ev_bitmask |= CURL_CSELECT_OUT;
+  if (condition & (G_IO_ERR | G_IO_HUP))
+    ev_bitmask |= CURL_CSELECT_ERR;
+  int running_handles = SocketAction(g_io_channel_unix_get_fd(source),
+                                     ev_bitmask);
+  delegate_->CurlMultiPerformed(running_handles);
+  // The watch stays until libcurl removes it through SocketCallback().
+  return true;
+}
+
+bool CurlMultiDriver::TimerFiredCallback() {
+  wakeups_++;
+  // glib destroys the source when we return false; libcurl may set a new
+  // timer in the meantime.
+  timeout_source_ = NULL;
+  int running_handles = SocketAction(CURL_SOCKET_TIMEOUT, 0);
+  delegate_->CurlMultiPerformed(running_handles);
+  return false;
+}
+
+// This method sets up callbacks with the glib main loop.
+void CurlMultiDriver::SetupMainloopSources() {
+  fd_set fd_read;
+  fd_set fd_write;
+  fd_set fd_exec;
+
+  FD_ZERO(&fd_read);
+  FD_ZERO(&fd_write);
+  FD_ZERO(&fd_exec);
+
+  int fd_max = 0;
+
+  // Ask libcurl for the set of file descriptors we should track on its
+  // behalf.
+  CHECK_EQ(curl_multi_fdset(multi_handle_, &fd_read, &fd_write,
+                            &fd_exec, &fd_max), CURLM_OK);
+
+  // We should iterate through all file descriptors up to libcurl's fd_max or
+  // the highest one we're tracking, whichever is larger
+  if (!io_channels_.empty())
+    fd_max = max(fd_max, io_channels_.rbegin()->first);
+
+  // For each fd, if we're not tracking it, track it. If we are tracking it,
+  // but libcurl doesn't care about it anymore, stop tracking it.
+  // After this loop, there should be exactly as many GIOChannel objects
+  // in io_channels_ as there are fds that we're tracking.
+  for (int i = 0; i <= fd_max; i++) {
+    if (!(FD_ISSET(i, &fd_read) || FD_ISSET(i, &fd_write) ||
+          FD_ISSET(i, &fd_exec))) {
+      // if we have an outstanding io_channel, remove it
+      if (io_channels_.find(i) != io_channels_.end()) {
+        g_source_remove(io_channels_[i].second);
+        g_io_channel_unref(io_channels_[i].first);
+        io_channels_.erase(io_channels_.find(i));
+      }
+      continue;
+    }
+    // If we are already tracking this fd, continue.
+    if (io_channels_.find(i) != io_channels_.end())
+      continue;
+
+    // We must track a new fd
+    GIOChannel *io_channel = g_io_channel_unix_new(i);
+    guint tag = g_io_add_watch(
+        io_channel,
+        static_cast<GIOCondition>(G_IO_IN | G_IO_OUT | G_IO_PRI |
+                                  G_IO_ERR | G_IO_HUP),
+        &StaticFDCallback,
+        this);
+    io_channels_[i] = make_pair(io_channel, tag);
+  }
+
+  // Set up a timeout callback for libcurl
+  long ms = 0;
+  CHECK_EQ(curl_multi_timeout(multi_handle_, &ms), CURLM_OK);
+  if (ms < 0) {
+    // From http://curl.haxx.se/libcurl/c/curl_multi_timeout.html:
+    //     if libcurl returns a -1 timeout here, it just means that libcurl
+    //     currently has no stored timeout value. You must not wait too long
+    //     (more than a few seconds perhaps) before you call
+    //     curl_multi_perform() again.
+    ms = idle_ms_;
+  }
+  if (timeout_source_) {
+    g_source_destroy(timeout_source_);
+    timeout_source_ = NULL;
+  }
+  timeout_source_ = g_timeout_source_new(ms);
+  CHECK(timeout_source_);
+  g_source_set_callback(timeout_source_, StaticTimeoutCallback, this,
+                        NULL);
+  g_source_attach(timeout_source_, NULL);
+}
+
+void CurlMultiDriver::RemoveWatch(int fd) {
+  IOChannels::iterator it = io_channels_.find(fd);
+  if (it == io_channels_.end())
+    return;
+  g_source_remove(it->second.second);
+  g_io_channel_unref(it->second.first);
+  io_channels_.erase(it);
+}
+
+void CurlMultiDriver::RemoveMainloopSources() {
+  if (timeout_source_) {
+    g_source_destroy(timeout_source_);
+    timeout_source_ = NULL;
+  }
+
+  for (IOChannels::iterator it = io_channels_.begin();
+       it != io_channels_.end(); ++it) {
+    g_source_remove(it->second.second);
+    g_io_channel_unref(it->second.first);
+  }
+  io_channels_.clear();
+}
+
+bool CurlMultiDriver::FDCallback(GIOChannel *source,
+                                 GIOCondition condition) {
+  wakeups_++;
+  // Figure out which source it was; hopefully there aren't too many b/c
+  // this is a linear scan of our channels
+  bool found_in_set = false;
+  for (IOChannels::iterator it = io_channels_.begin();
+       it != io_channels_.end(); ++it) {
+    if (it->second.first == source) {
+      // We will return false from this method, meaning that we shouldn't keep
+      // this g_io_channel around. So we remove it now from our collection of
+      // g_io_channels so that the other code in this class doens't mess with
+      // this (doomed) GIOChannel.
+      // TODO(adlr): optimize by seeing if we should reuse this GIOChannel
+      g_source_remove(it->second.second);
+      g_io_channel_unref(it->second.first);
+      io_channels_.erase(it);
+      found_in_set = true;
+      break;
+    }
+  }
+  CHECK(found_in_set);
+  PerformOnce();
+  return false;
+}
+
+bool CurlMultiDriver::TimeoutCallback() {
+  wakeups_++;
+  // Since we will return false from this function, which tells glib to
+  // destroy the timeout callback, we must NULL it out here. This way, when
+  // setting up callback sources again, we won't try to delete this (doomed)
+  // timeout callback then.
+  // TODO(adlr): optimize by checking if we can keep this timeout callback.
+  timeout_source_ = NULL;
+  PerformOnce();
+  return false;
+}
+
+}  // namespace chromeos_update_engine
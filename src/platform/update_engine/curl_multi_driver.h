@@ -0,0 +1,172 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_CURL_MULTI_DRIVER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_CURL_MULTI_DRIVER_H__
+
+#include <map>
+#include <utility>
+#include <curl/curl.h>
+#include <glib.h>
+#include "base/basictypes.h"
+#include "chromeos/obsolete_logging.h"
+
+// CurlMultiDriver runs a libcurl multi handle from the glib main loop. It
+// watches the file descriptors libcurl is interested in, as well as
+// libcurl's timeout, and calls into libcurl when any of them fire. After
+// each round of work the delegate is told, so it can look for finished
+// transfers.
+//
+// By default libcurl tells us which sockets to watch and when to time out
+// through CURLMOPT_SOCKETFUNCTION and CURLMOPT_TIMERFUNCTION, the watches
+// persist across calls, and only the socket that is ready is handed to
+// curl_multi_socket_action(). The older mode, which asks libcurl for all
+// of its fds with curl_multi_fdset() and rebuilds the watches after every
+// curl_multi_perform(), can still be selected for comparison.
+
+namespace chromeos_update_engine {
+
+class CurlMultiDriverDelegate {
+ public:
+  virtual ~CurlMultiDriverDelegate() {}
+
+  // Called after curl_multi_perform() has done some work. running_handles
+  // is the number of transfers still in progress. The delegate may call
+  // Detach() from here, and may also add handles to the multi handle and
+  // call PerformOnce() again.
+  virtual void CurlMultiPerformed(int running_handles) = 0;
+};
+
+class CurlMultiDriver {
+ public:
+  explicit CurlMultiDriver(CurlMultiDriverDelegate* delegate)
+      : delegate_(delegate), multi_handle_(NULL), use_socket_callbacks_(true),
+        timeout_source_(NULL), idle_ms_(1000), wakeups_(0) {}
+  ~CurlMultiDriver();
+
+  // Starts driving multi_handle, which the caller still owns. Call
+  // PerformOnce() to get things going.
+  void Attach(CURLM* multi_handle);
+
+  // Stops driving the multi handle and removes all main loop sources. Must
+  // be called before the multi handle is cleaned up.
+  void Detach();
+
+  bool attached() const { return multi_handle_ != NULL; }
+
+  // Lets libcurl do whatever work it can right now, makes sure the main loop
+  // will call us for the next round, and then tells the delegate. Does not
+  // block.
+  void PerformOnce();
+
+  // Selects between libcurl's socket and timer callbacks (the default) and
+  // polling with curl_multi_fdset(). Must be called while detached.
+  void set_use_socket_callbacks(bool use_socket_callbacks) {
+    CHECK(!multi_handle_);
+    use_socket_callbacks_ = use_socket_callbacks;
+  }
+
+  // The number of times the main loop has called us because a socket was
+  // ready or a timer fired.
+  uint64 wakeups() const { return wakeups_; }
+
+  // How long to wait before calling libcurl again when it doesn't say. Only
+  // used when polling.
+  // From http://curl.haxx.se/libcurl/c/curl_multi_timeout.html:
+  //     if libcurl returns a -1 timeout here, it just means that libcurl
+  //     currently has no stored timeout value. You must not wait too long
+  //     (more than a few seconds perhaps) before you call
+  //     curl_multi_perform() again.
+  void set_idle_ms(long ms) {
+    idle_ms_ = ms;
+  }
+
+ private:
+  // Sets up glib main loop sources as needed by libcurl. This is generally
+  // the file descriptor of the socket and a timer in case nothing happens
+  // on the fds.
+  void SetupMainloopSources();
+
+  // Removes all main loop sources.
+  void RemoveMainloopSources();
+
+  // Removes the watch on fd, if there is one.
+  void RemoveWatch(int fd);
+
+  // Calls curl_multi_socket_action() and returns the number of running
+  // handles.
+  int SocketAction(curl_socket_t fd, int ev_bitmask);
+
+  // Called by libcurl with the events it wants on a socket, or
+  // CURL_POLL_REMOVE when it no longer cares about it.
+  int SocketCallback(curl_socket_t fd, int what);
+  static int StaticSocketCallback(CURL* easy, curl_socket_t fd, int what,
+                                  void* userp, void* socketp) {
+    return reinterpret_cast<CurlMultiDriver*>(userp)->SocketCallback(fd,
+                                                                     what);
+  }
+
+  // Called by libcurl when it wants to be called back in timeout_ms, or
+  // never if timeout_ms is -1.
+  int TimerCallback(long timeout_ms);
+  static int StaticTimerCallback(CURLM* multi, long timeout_ms, void* userp) {
+    return reinterpret_cast<CurlMultiDriver*>(userp)->TimerCallback(
+        timeout_ms);
+  }
+
+  // Main loop callbacks for the watches and the timer set up by
+  // SocketCallback() and TimerCallback().
+  bool SocketReadyCallback(GIOChannel *source, GIOCondition condition);
+  static gboolean StaticSocketReadyCallback(GIOChannel *source,
+                                            GIOCondition condition,
+                                            gpointer data) {
+    return reinterpret_cast<CurlMultiDriver*>(data)->SocketReadyCallback(
+        source, condition);
+  }
+  bool TimerFiredCallback();
+  static gboolean StaticTimerFiredCallback(gpointer data) {
+    return reinterpret_cast<CurlMultiDriver*>(data)->TimerFiredCallback();
+  }
+
+  // These two methods are for glib main loop callbacks. They are called
+  // when either a file descriptor is ready for work or when a timer
+  // has fired. The static versions are shims for glib which has a C API.
+  bool FDCallback(GIOChannel *source, GIOCondition condition);
+  static gboolean StaticFDCallback(GIOChannel *source,
+                                   GIOCondition condition,
+                                   gpointer data) {
+    return reinterpret_cast<CurlMultiDriver*>(data)->FDCallback(source,
+                                                                condition);
+  }
+  bool TimeoutCallback();
+  static gboolean StaticTimeoutCallback(gpointer data) {
+    return reinterpret_cast<CurlMultiDriver*>(data)->TimeoutCallback();
+  }
+
+  CurlMultiDriverDelegate* delegate_;
+
+  // The multi handle being driven, or NULL if detached.
+  CURLM* multi_handle_;
+
+  bool use_socket_callbacks_;
+
+  // a list of all file descriptors that we're waiting on from the
+  // glib main loop
+  typedef std::map<int, std::pair<GIOChannel*, guint> > IOChannels;
+  IOChannels io_channels_;
+
+  // if non-NULL, a timer we're waiting on. glib main loop will call us back
+  // when it fires.
+  GSource* timeout_source_;
+
+  long idle_ms_;
+
+  uint64 wakeups_;
+
+  DISALLOW_COPY_AND_ASSIGN(CurlMultiDriver);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_CURL_MULTI_DRIVER_H__
@@ -27,6 +27,11 @@ namespace chromeos_update_engine {
 //      uLong   reserved;   /* reserved for future use */
 //  } z_stream;
 
+namespace {
+// How much to inflate at once when next_ isn't a BufferedFileWriter.
+const size_t kOutputBufferSize = 128 * 1024;
+}  // namespace {}
+
 int GzipDecompressingFileWriter::Write(const void* bytes, size_t count) {
   // Steps:
   // put the data on next_in
@@ -41,32 +46,32 @@ int GzipDecompressingFileWriter::Write(const void* bytes, size_t count) {
     LOG(ERROR) << "Have data already. Bailing";
     return -1;
   }
-  char buf[1024];
-
-  buffer_.reserve(count);
-  buffer_.clear();
-  CHECK_GE(buffer_.capacity(), count);
-  const char* char_bytes = reinterpret_cast<const char*>(bytes);
-  buffer_.insert(buffer_.end(), char_bytes, char_bytes + count);
 
-  stream_.next_in = reinterpret_cast<Bytef*>(&buffer_[0]);
+  // All of the input is consumed before we return, so zlib can read it
+  // where it is.
+  stream_.next_in =
+      const_cast<Bytef*>(reinterpret_cast<const Bytef*>(bytes));
   stream_.avail_in = count;
-  int retcode = Z_OK;
 
-  while (Z_OK == retcode) {
-    stream_.next_out = reinterpret_cast<Bytef*>(buf);
-    stream_.avail_out = sizeof(buf);
+  for (;;) {
+    int rc = SetUpOutput();
+    if (rc < 0)
+      return rc;
+    const size_t output_size = stream_.avail_out;
     int retcode = inflate(&stream_, Z_NO_FLUSH);
     // check for Z_STREAM_END, Z_OK, or Z_BUF_ERROR (which is non-fatal)
     if (Z_STREAM_END != retcode && Z_OK != retcode && Z_BUF_ERROR != retcode) {
       LOG(ERROR) << "zlib inflate() error:" << retcode;
       if (stream_.msg)
         LOG(ERROR) << "message:" << stream_.msg;
+      stream_.avail_in = 0;
       return 0;
     }
-    int count_received = sizeof(buf) - stream_.avail_out;
+    const size_t count_received = output_size - stream_.avail_out;
     if (count_received > 0) {
-      next_->Write(buf, count_received);
+      rc = WriteOutput(count_received);
+      if (rc < 0)
+        return rc;
     } else {
       // Inflate returned no data; we're done for now. Make sure no
       // input data remain.
@@ -77,4 +82,28 @@ int GzipDecompressingFileWriter::Write(const void* bytes, size_t count) {
   return count;
 }
 
+int GzipDecompressingFileWriter::SetUpOutput() {
+  if (buffered_next_) {
+    char* buffer = NULL;
+    size_t size = 0;
+    int rc = buffered_next_->GetBuffer(&buffer, &size);
+    if (rc < 0)
+      return rc;
+    stream_.next_out = reinterpret_cast<Bytef*>(buffer);
+    stream_.avail_out = size;
+    return 0;
+  }
+  buffer_.resize(kOutputBufferSize);
+  stream_.next_out = reinterpret_cast<Bytef*>(&buffer_[0]);
+  stream_.avail_out = buffer_.size();
+  return 0;
+}
+
+int GzipDecompressingFileWriter::WriteOutput(size_t count) {
+  if (buffered_next_)
+    return buffered_next_->CommitBuffer(count);
+  int rc = next_->Write(&buffer_[0], count);
+  return rc < 0 ? rc : 0;
+}
+
 }  // namespace chromeos_update_engine
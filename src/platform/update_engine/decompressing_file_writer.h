@@ -5,22 +5,30 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_DECOMPRESSING_FILE_WRITER_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_DECOMPRESSING_FILE_WRITER_H__
 
+#include <vector>
 #include <zlib.h>
 #include "base/basictypes.h"
+#include "update_engine/buffered_file_writer.h"
 #include "update_engine/file_writer.h"
 
 // GzipDecompressingFileWriter is an implementation of FileWriter. It will
 // gzip decompress all data that is passed via Write() onto another FileWriter,
 // which is responsible for actually writing the data out. Calls to
-// Open and Close are passed through to the other FileWriter.
+// Open and Close are passed through to the other FileWriter. If the other
+// FileWriter is a BufferedFileWriter, data is inflated straight into its
+// buffer.
 
 namespace chromeos_update_engine {
 
 class GzipDecompressingFileWriter : public FileWriter {
  public:
-  explicit GzipDecompressingFileWriter(FileWriter* next) : next_(next) {
-    memset(&stream_, 0, sizeof(stream_));
-    CHECK_EQ(inflateInit2(&stream_, 16 + MAX_WBITS), Z_OK);
+  explicit GzipDecompressingFileWriter(FileWriter* next)
+      : next_(next), buffered_next_(NULL) {
+    Init();
+  }
+  explicit GzipDecompressingFileWriter(BufferedFileWriter* next)
+      : next_(next), buffered_next_(next) {
+    Init();
   }
   virtual ~GzipDecompressingFileWriter() {
     inflateEnd(&stream_);
@@ -42,14 +50,30 @@ class GzipDecompressingFileWriter : public FileWriter {
     return next_->Close();
   }
  private:
+  void Init() {
+    memset(&stream_, 0, sizeof(stream_));
+    CHECK_EQ(inflateInit2(&stream_, 16 + MAX_WBITS), Z_OK);
+  }
+
+  // Points zlib at the next place to inflate into. Returns 0 on success or
+  // -errno on error.
+  int SetUpOutput();
+
+  // Passes the count bytes zlib inflated since SetUpOutput() on to next_.
+  // Returns 0 on success or -errno on error.
+  int WriteOutput(size_t count);
+
   // The FileWriter that we write all uncompressed data to
   FileWriter* next_;
 
+  // next_, if it's a BufferedFileWriter; NULL otherwise.
+  BufferedFileWriter* buffered_next_;
+
   // The zlib state
   z_stream stream_;
 
-  // This is for an optimization in Write(). We can keep this buffer around
-  // in our class to avoid repeated calls to malloc().
+  // Where data is inflated to when next_ isn't a BufferedFileWriter. It's
+  // kept around in our class to avoid repeated calls to malloc().
   std::vector<char> buffer_;
 
   DISALLOW_COPY_AND_ASSIGN(GzipDecompressingFileWriter);
@@ -4,12 +4,14 @@
 
 #include <string.h>
 #include <unistd.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <gtest/gtest.h>
 #include "update_engine/decompressing_file_writer.h"
 #include "update_engine/mock_file_writer.h"
 #include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
 
 using std::string;
 using std::vector;
@@ -104,4 +106,46 @@ TEST(GzipDecompressingFileWriterTest, LargeTest) {
   unlink(kPathgz.c_str());
 }
 
+TEST(GzipDecompressingFileWriterTest, BufferedFileWriterTest) {
+  const string kPath("/tmp/GzipDecompressingFileWriterTest");
+  const string kPathgz(kPath + ".gz");
+  const unsigned int kUncompressedFileSize = 3 * 1024 * 1024 + 77;
+  {
+    vector<char> data(kUncompressedFileSize);
+    for (unsigned int i = 0; i < data.size(); i++)
+      data[i] = '0' + (i % 10);
+    ASSERT_TRUE(WriteFileVector(kPath, data));
+  }
+  EXPECT_EQ(0, system((string("gzip -c ") + kPath + " > " + kPathgz).c_str()));
+  vector<char> compressed;
+  ASSERT_TRUE(utils::ReadFile(kPathgz, &compressed));
+
+  // Inflate into the BufferedFileWriter's own buffer, which overwrites
+  // kPath with the same data.
+  BufferedFileWriter buffered_file_writer(
+      BufferedFileWriter::kDefaultBufferSize, false);
+  GzipDecompressingFileWriter decompressing_file_writer(
+      &buffered_file_writer);
+  ASSERT_EQ(0, decompressing_file_writer.Open(
+      kPath.c_str(), O_CREAT | O_LARGEFILE | O_TRUNC | O_WRONLY, 0644));
+  for (size_t offset = 0; offset < compressed.size(); offset += 100) {
+    const size_t count = std::min(static_cast<size_t>(100),
+                                  compressed.size() - offset);
+    ASSERT_EQ(count, decompressing_file_writer.Write(&compressed[offset],
+                                                     count));
+  }
+  EXPECT_EQ(0, decompressing_file_writer.Close());
+  // Three full buffers and the tail.
+  EXPECT_EQ(4, buffered_file_writer.write_calls());
+
+  vector<char> actual;
+  ASSERT_TRUE(utils::ReadFile(kPath, &actual));
+  ASSERT_EQ(kUncompressedFileSize, actual.size());
+  for (unsigned int i = 0; i < kUncompressedFileSize; i++) {
+    ASSERT_EQ(actual[i], '0' + (i % 10)) << "i = " << i;
+  }
+  unlink(kPath.c_str());
+  unlink(kPathgz.c_str());
+}
+
 }  // namespace chromeos_update_engine
@@ -3,3 +3,584 @@
 // found in the LICENSE file.
 
 #include "update_engine/delta_diff_generator.h"
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+#include <glib.h>
+#include "chromeos/obsolete_logging.h"
+#include "update_engine/bzip.h"
+#include "update_engine/delta_performer.h"
+#include "update_engine/extent_mapper.h"
+#include "update_engine/extent_writer.h"
+#include "update_engine/file_writer.h"
+#include "update_engine/filesystem_iterator.h"
+#include "update_engine/graph_utils.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/partition_verifier_action.h"
+#include "update_engine/subprocess.h"
+#include "update_engine/tarjan.h"
+#include "update_engine/update_metadata.pb.h"
+#include "update_engine/utils.h"
+
+using std::make_pair;
+using std::max;
+using std::min;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+typedef DeltaArchiveManifest_InstallOperation_Type OperationType;
+
+namespace {
+const uint32 kBlockSize = 4096;
+const char kBsdiffPath[] = "/usr/bin/bsdiff";
+
+// Blocks of the new image that aren't part of any regular file are sent in
+// operations of at most this many blocks, so that the client never has to
+// hold much more than this in memory.
+const uint64 kChunkBlocks = 1024;  // 4 MiB
+
+// The data blobs are written to a temporary file as they're generated, in
+// whatever order the worker threads finish. Thread safe.
+class BlobFile {
+ public:
+  explicit BlobFile(int fd) : fd_(fd), size_(0), mutex_(g_mutex_new()) {}
+  ~BlobFile() { g_mutex_free(mutex_); }
+
+  // Appends blob to the file and records where it is in op.
+  bool StoreBlob(const vector<char>& blob,
+                 DeltaArchiveManifest_InstallOperation* op) {
+    g_mutex_lock(mutex_);
+    const off_t offset = size_;
+    size_ += blob.size();
+    g_mutex_unlock(mutex_);
+    op->set_data_offset(offset);
+    op->set_data_length(blob.size());
+    return blob.empty() || WriteAt(&blob[0], blob.size(), offset);
+  }
+
+ private:
+  bool WriteAt(const char* data, size_t count, off_t offset) {
+    size_t bytes_written = 0;
+    while (bytes_written < count) {
+      ssize_t rc = pwrite(fd_, data + bytes_written, count - bytes_written,
+                          offset + bytes_written);
+      TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
+      bytes_written += rc;
+    }
+    return true;
+  }
+
+  int fd_;
+  off_t size_;
+  GMutex* mutex_;
+  DISALLOW_COPY_AND_ASSIGN(BlobFile);
+};
+
+// One unit of work for the thread pool: computes the operation that
+// writes a regular file of the new filesystem, or a chunk of the new image.
+struct DiffJob {
+  DiffJob() : image_chunk(false), op(NULL), blob_file(NULL), noop(false),
+              success(false) {}
+  // The file in the old filesystem to diff against. Empty if there is none.
+  string old_path;
+  // The file in the new filesystem, or the new image if image_chunk is set.
+  string new_path;
+  // If set, the data to send is the op's dst_extents of new_path, rather
+  // than all of new_path.
+  bool image_chunk;
+  DeltaArchiveManifest_InstallOperation* op;
+  BlobFile* blob_file;
+  // Set if the file is unchanged and stays put, so no operation is needed.
+  bool noop;
+  bool success;
+};
+
+void StoreExtents(const vector<Extent>& extents,
+                  google::protobuf::RepeatedPtrField<Extent>* out) {
+  for (vector<Extent>::const_iterator it = extents.begin();
+       it != extents.end(); ++it) {
+    *out->Add() = *it;
+  }
+}
+
+bool ExtentsEqual(const google::protobuf::RepeatedPtrField<Extent>& a,
+                  const google::protobuf::RepeatedPtrField<Extent>& b) {
+  if (a.size() != b.size())
+    return false;
+  for (int i = 0; i < a.size(); i++) {
+    if (a.Get(i).start_block() != b.Get(i).start_block() ||
+        a.Get(i).num_blocks() != b.Get(i).num_blocks())
+      return false;
+  }
+  return true;
+}
+
+// Reads the blocks in extents of the file at path into *out.
+bool ReadExtents(const string& path,
+                 const google::protobuf::RepeatedPtrField<Extent>& extents,
+                 vector<char>* out) {
+  int fd = open(path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  out->clear();
+  for (int i = 0; i < extents.size(); i++) {
+    const Extent& extent = extents.Get(i);
+    const size_t bytes = extent.num_blocks() * kBlockSize;
+    const size_t offset = out->size();
+    out->resize(offset + bytes);
+    if (extent.start_block() == kSparseHole)
+      continue;
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(fd, &(*out)[offset], bytes,
+                                          extent.start_block() * kBlockSize,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(bytes));
+  }
+  return true;
+}
+
+// Reads the data that job's operation has to write into *out.
+bool ReadNewData(const DiffJob& job, vector<char>* out) {
+  if (job.image_chunk)
+    return ReadExtents(job.new_path, job.op->dst_extents(), out);
+  return utils::ReadFile(job.new_path, out);
+}
+
+// Sets *out to the smaller of data and data bzip2 compressed, and *type to
+// the matching operation type.
+bool ReplaceBlobForData(const vector<char>& data,
+                        vector<char>* out,
+                        OperationType* type) {
+  TEST_AND_RETURN_FALSE(BzipCompress(data, out));
+  *type = DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ;
+  if (out->size() >= data.size()) {
+    *out = data;
+    *type = DeltaArchiveManifest_InstallOperation_Type_REPLACE;
+  }
+  return true;
+}
+
+// Runs bsdiff on old_path and new_path and puts the patch in *out.
+bool BsdiffFiles(const string& old_path,
+                 const string& new_path,
+                 vector<char>* out) {
+  string patch_path;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("/tmp/delta.patch.XXXXXX", &patch_path, NULL));
+  ScopedPathUnlinker patch_path_unlinker(patch_path);
+
+  vector<string> cmd;
+  cmd.push_back(kBsdiffPath);
+  cmd.push_back(old_path);
+  cmd.push_back(new_path);
+  cmd.push_back(patch_path);
+  int return_code = 0;
+  TEST_AND_RETURN_FALSE(Subprocess::SynchronousExec(cmd, &return_code));
+  TEST_AND_RETURN_FALSE(return_code == 0);
+  TEST_AND_RETURN_FALSE(utils::ReadFile(patch_path, out));
+  return true;
+}
+
+// Fills in job->op, and stores its data blob. Returns true on success.
+bool RunDiffJob(DiffJob* job) {
+  DeltaArchiveManifest_InstallOperation* op = job->op;
+  vector<char> new_data;
+  TEST_AND_RETURN_FALSE(ReadNewData(*job, &new_data));
+  op->set_dst_length(new_data.size());
+
+  vector<char> old_data;
+  if (!job->old_path.empty()) {
+    TEST_AND_RETURN_FALSE(utils::ReadFile(job->old_path, &old_data));
+    if (old_data == new_data) {
+      if (ExtentsEqual(op->src_extents(), op->dst_extents())) {
+        job->noop = true;
+        return true;
+      }
+      op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+      op->set_src_length(old_data.size());
+      return true;
+    }
+  }
+
+  vector<char> blob;
+  OperationType type;
+  TEST_AND_RETURN_FALSE(ReplaceBlobForData(new_data, &blob, &type));
+  if (!old_data.empty()) {
+    vector<char> patch;
+    TEST_AND_RETURN_FALSE(BsdiffFiles(job->old_path, job->new_path, &patch));
+    if (patch.size() < blob.size()) {
+      blob.swap(patch);
+      type = DeltaArchiveManifest_InstallOperation_Type_BSDIFF;
+      op->set_src_length(old_data.size());
+    }
+  }
+  if (type != DeltaArchiveManifest_InstallOperation_Type_BSDIFF)
+    op->clear_src_extents();
+  op->set_type(type);
+  return job->blob_file->StoreBlob(blob, op);
+}
+
+// Thread pool entry point.
+void RunDiffJobInPool(gpointer data, gpointer user_data) {
+  DiffJob* job = reinterpret_cast<DiffJob*>(data);
+  job->success = RunDiffJob(job);
+  if (!job->success)
+    LOG(ERROR) << "Failed to generate operation for " << job->new_path;
+}
+
+// Runs all jobs, in parallel on all cores. Returns true if they all
+// succeeded.
+bool RunDiffJobs(vector<DiffJob>* jobs) {
+  const long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  const gint num_threads = max(num_cpus, 1L);
+  LOG(INFO) << "Generating " << jobs->size() << " operations on "
+            << num_threads << " threads.";
+  GError* err = NULL;
+  GThreadPool* pool = g_thread_pool_new(&RunDiffJobInPool,
+                                        NULL,
+                                        num_threads,
+                                        TRUE,  // exclusive
+                                        &err);
+  TEST_AND_RETURN_FALSE(pool);
+  for (vector<DiffJob>::iterator it = jobs->begin(); it != jobs->end(); ++it)
+    g_thread_pool_push(pool, &(*it), NULL);
+  // Waits for all the jobs to finish.
+  g_thread_pool_free(pool, FALSE, TRUE);
+  for (vector<DiffJob>::const_iterator it = jobs->begin();
+       it != jobs->end(); ++it) {
+    TEST_AND_RETURN_FALSE(it->success);
+  }
+  return true;
+}
+
+// Creates a job for each regular file in new_root. Each job's op gets its
+// src and dst extents, and the blocks of the dst extents are marked in
+// *written_blocks.
+bool CreateFileJobs(const string& old_root,
+                    const string& new_root,
+                    DeltaArchiveManifest* ops,
+                    BlobFile* blob_file,
+                    vector<DiffJob>* jobs,
+                    vector<bool>* written_blocks) {
+  struct stat old_root_stbuf;
+  TEST_AND_RETURN_FALSE_ERRNO(lstat(old_root.c_str(), &old_root_stbuf) == 0);
+  // Extents are in filesystem blocks, and the payload uses kBlockSize.
+  uint32 block_size = 0;
+  TEST_AND_RETURN_FALSE(
+      extent_mapper::GetFilesystemBlockSize(old_root, &block_size));
+  TEST_AND_RETURN_FALSE(block_size == kBlockSize);
+  TEST_AND_RETURN_FALSE(
+      extent_mapper::GetFilesystemBlockSize(new_root, &block_size));
+  TEST_AND_RETURN_FALSE(block_size == kBlockSize);
+  set<ino_t> visited_inodes;
+  for (FilesystemIterator fs_iter(new_root, set<string>());
+       !fs_iter.IsEnd(); fs_iter.Increment()) {
+    const struct stat& stbuf = fs_iter.GetStat();
+    if (!S_ISREG(stbuf.st_mode) || stbuf.st_size == 0)
+      continue;
+    // Hard links share their blocks, so only send them once.
+    if (!visited_inodes.insert(stbuf.st_ino).second)
+      continue;
+
+    DiffJob job;
+    job.new_path = fs_iter.GetFullPath();
+    job.blob_file = blob_file;
+    job.op = ops->add_install_operations();
+    vector<Extent> dst_extents;
+    TEST_AND_RETURN_FALSE(
+        extent_mapper::ExtentsForFile(job.new_path, &dst_extents));
+    StoreExtents(dst_extents, job.op->mutable_dst_extents());
+    for (vector<Extent>::const_iterator it = dst_extents.begin();
+         it != dst_extents.end(); ++it) {
+      if (it->start_block() == kSparseHole)
+        continue;
+      const uint64 end_block = it->start_block() + it->num_blocks();
+      TEST_AND_RETURN_FALSE(end_block <= written_blocks->size());
+      for (uint64 block = it->start_block(); block < end_block; block++)
+        (*written_blocks)[block] = true;
+    }
+
+    const string old_path = old_root + fs_iter.GetPartialPath();
+    struct stat old_stbuf;
+    if (lstat(old_path.c_str(), &old_stbuf) == 0 &&
+        S_ISREG(old_stbuf.st_mode) &&
+        old_stbuf.st_dev == old_root_stbuf.st_dev) {
+      job.old_path = old_path;
+      vector<Extent> src_extents;
+      TEST_AND_RETURN_FALSE(
+          extent_mapper::ExtentsForFile(old_path, &src_extents));
+      StoreExtents(src_extents, job.op->mutable_src_extents());
+    }
+    jobs->push_back(job);
+  }
+  return true;
+}
+
+// Creates jobs that send all the blocks of new_image that aren't in
+// written_blocks.
+void CreateImageChunkJobs(const string& new_image,
+                          const vector<bool>& written_blocks,
+                          DeltaArchiveManifest* ops,
+                          BlobFile* blob_file,
+                          vector<DiffJob>* jobs) {
+  vector<Extent> extents;
+  uint64 blocks = 0;
+  for (uint64 block = 0; block <= written_blocks.size(); block++) {
+    if ((block == written_blocks.size() && blocks > 0) ||
+        blocks == kChunkBlocks) {
+      DiffJob job;
+      job.new_path = new_image;
+      job.image_chunk = true;
+      job.blob_file = blob_file;
+      job.op = ops->add_install_operations();
+      StoreExtents(extents, job.op->mutable_dst_extents());
+      jobs->push_back(job);
+      extents.clear();
+      blocks = 0;
+    }
+    if (block < written_blocks.size() && !written_blocks[block]) {
+      graph_utils::AppendBlockToExtents(&extents, block);
+      blocks++;
+    }
+  }
+}
+
+// Turns job's operation into a full replace, so it doesn't read any blocks.
+bool ConvertToReplace(DiffJob* job) {
+  vector<char> new_data;
+  TEST_AND_RETURN_FALSE(ReadNewData(*job, &new_data));
+  vector<char> blob;
+  OperationType type;
+  TEST_AND_RETURN_FALSE(ReplaceBlobForData(new_data, &blob, &type));
+  job->op->set_type(type);
+  job->op->clear_src_extents();
+  job->op->clear_src_length();
+  return job->blob_file->StoreBlob(blob, job->op);
+}
+
+// Writes the payload to output_path. The data blobs are copied from
+// blobs_fd, in the order of the operations in manifest, and the data
+// offsets in the manifest are updated to match.
+bool WritePayload(const string& output_path,
+                  int blobs_fd,
+                  DeltaArchiveManifest* manifest) {
+  vector<uint64> blob_offsets;
+  uint64 next_offset = 0;
+  for (int i = 0; i < manifest->install_operations_size(); i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        manifest->mutable_install_operations(i);
+    blob_offsets.push_back(op->data_offset());
+    if (op->data_length() == 0) {
+      op->clear_data_offset();
+      continue;
+    }
+    op->set_data_offset(next_offset);
+    next_offset += op->data_length();
+  }
+  string serialized_manifest;
+  TEST_AND_RETURN_FALSE(manifest->SerializeToString(&serialized_manifest));
+
+  DirectFileWriter writer;
+  TEST_AND_RETURN_FALSE(writer.Open(output_path.c_str(),
+                                    O_WRONLY | O_CREAT | O_TRUNC,
+                                    0644) == 0);
+  vector<char> header;
+  DeltaPerformer::AppendHeader(serialized_manifest.size(), &header);
+  TEST_AND_RETURN_FALSE(writer.Write(&header[0], header.size()) ==
+                        static_cast<int>(header.size()));
+  TEST_AND_RETURN_FALSE(
+      writer.Write(serialized_manifest.data(), serialized_manifest.size()) ==
+      static_cast<int>(serialized_manifest.size()));
+
+  vector<char> buf;
+  for (int i = 0; i < manifest->install_operations_size(); i++) {
+    const uint64 length = manifest->install_operations(i).data_length();
+    if (length == 0)
+      continue;
+    buf.resize(length);
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(blobs_fd, &buf[0], length,
+                                          blob_offsets[i], &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(length));
+    TEST_AND_RETURN_FALSE(writer.Write(&buf[0], length) ==
+                          static_cast<int>(length));
+  }
+  TEST_AND_RETURN_FALSE(writer.Close() == 0);
+  LOG(INFO) << "Wrote " << manifest->install_operations_size()
+            << " operations and " << next_offset << " bytes of data to "
+            << output_path;
+  return true;
+}
+}  // namespace {}
+
+void DeltaDiffGenerator::CreateEdges(Graph* graph) {
+  // For each block, the vertices that read it and the vertex that writes it.
+  vector<vector<Vertex::Index> > readers;
+  vector<Vertex::Index> writers;
+  for (Vertex::Index i = 0; i < graph->size(); i++) {
+    const DeltaArchiveManifest_InstallOperation& op = *(*graph)[i].op;
+    for (int j = 0; j < op.src_extents_size(); j++) {
+      const Extent& extent = op.src_extents(j);
+      if (extent.start_block() == kSparseHole)
+        continue;
+      const uint64 end_block = extent.start_block() + extent.num_blocks();
+      if (readers.size() < end_block)
+        readers.resize(end_block);
+      for (uint64 block = extent.start_block(); block < end_block; block++)
+        readers[block].push_back(i);
+    }
+    for (int j = 0; j < op.dst_extents_size(); j++) {
+      const Extent& extent = op.dst_extents(j);
+      if (extent.start_block() == kSparseHole)
+        continue;
+      const uint64 end_block = extent.start_block() + extent.num_blocks();
+      if (writers.size() < end_block)
+        writers.resize(end_block, Vertex::kInvalidIndex);
+      for (uint64 block = extent.start_block(); block < end_block; block++) {
+        LOG_IF(WARNING, writers[block] != Vertex::kInvalidIndex)
+            << "Block " << block << " is written more than once.";
+        writers[block] = i;
+      }
+    }
+  }
+  const uint64 num_blocks = min(readers.size(), writers.size());
+  for (uint64 block = 0; block < num_blocks; block++) {
+    const Vertex::Index writer = writers[block];
+    if (writer == Vertex::kInvalidIndex)
+      continue;
+    for (vector<Vertex::Index>::const_iterator it = readers[block].begin();
+         it != readers[block].end(); ++it) {
+      // An operation reads all of its blocks before it writes any, so it
+      // doesn't depend on itself.
+      if (*it == writer)
+        continue;
+      graph_utils::AppendBlockToExtents(
+          &(*graph)[*it].out_edges[writer].extents, block);
+    }
+  }
+}
+
+void DeltaDiffGenerator::CutCycles(Graph* graph,
+                                   set<Vertex::Index>* cut_vertices) {
+  TarjanAlgorithm tarjan;
+  for (;;) {
+    vector<vector<Vertex::Index> > components;
+    tarjan.Execute(graph, &components);
+    if (components.empty())
+      return;
+    for (vector<vector<Vertex::Index> >::const_iterator it =
+             components.begin(); it != components.end(); ++it) {
+      const set<Vertex::Index> component(it->begin(), it->end());
+      Edge cheapest_edge;
+      uint64 cheapest_weight = kuint64max;
+      for (set<Vertex::Index>::const_iterator vertex_it = component.begin();
+           vertex_it != component.end(); ++vertex_it) {
+        const Vertex::EdgeMap& out_edges = (*graph)[*vertex_it].out_edges;
+        for (Vertex::EdgeMap::const_iterator edge_it = out_edges.begin();
+             edge_it != out_edges.end(); ++edge_it) {
+          if (component.find(edge_it->first) == component.end())
+            continue;
+          const Edge edge = make_pair(*vertex_it, edge_it->first);
+          const uint64 weight = graph_utils::EdgeWeight(*graph, edge);
+          if (weight < cheapest_weight) {
+            cheapest_weight = weight;
+            cheapest_edge = edge;
+          }
+        }
+      }
+      CHECK_NE(cheapest_weight, kuint64max);
+      // The source vertex won't read anything anymore, so none of its
+      // out-edges are needed.
+      (*graph)[cheapest_edge.first].out_edges.clear();
+      cut_vertices->insert(cheapest_edge.first);
+    }
+  }
+}
+
+bool DeltaDiffGenerator::GenerateDeltaUpdateFile(const string& old_root,
+                                                 const string& new_root,
+                                                 const string& new_image,
+                                                 const string& output_path) {
+  // The image may be a block device, for which st_size is 0.
+  int new_image_fd = open(new_image.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(new_image_fd >= 0);
+  const off_t new_image_size = lseek(new_image_fd, 0, SEEK_END);
+  close(new_image_fd);
+  TEST_AND_RETURN_FALSE_ERRNO(new_image_size >= 0);
+  vector<bool> written_blocks(
+      (new_image_size + kBlockSize - 1) / kBlockSize, false);
+
+  string blobs_path;
+  int blobs_fd = -1;
+  TEST_AND_RETURN_FALSE(utils::MakeTempFile("/tmp/delta.blobs.XXXXXX",
+                                            &blobs_path,
+                                            &blobs_fd));
+  ScopedPathUnlinker blobs_path_unlinker(blobs_path);
+  ScopedFdCloser blobs_fd_closer(&blobs_fd);
+  BlobFile blob_file(blobs_fd);
+
+  // Owns the operations while they're being generated. They're copied to
+  // the final manifest once they've been ordered.
+  DeltaArchiveManifest ops;
+  vector<DiffJob> jobs;
+  TEST_AND_RETURN_FALSE(CreateFileJobs(old_root, new_root, &ops, &blob_file,
+                                       &jobs, &written_blocks));
+  const vector<DiffJob>::size_type num_file_jobs = jobs.size();
+  CreateImageChunkJobs(new_image, written_blocks, &ops, &blob_file, &jobs);
+  TEST_AND_RETURN_FALSE(RunDiffJobs(&jobs));
+
+  // Order the file operations. The image chunk operations don't read
+  // anything but may overwrite any block that isn't part of a new file, so
+  // they go last.
+  Graph graph;
+  vector<vector<DiffJob>::size_type> vertex_jobs;
+  for (vector<DiffJob>::size_type i = 0; i < num_file_jobs; i++) {
+    if (jobs[i].noop)
+      continue;
+    graph.resize(graph.size() + 1);
+    graph.back().op = jobs[i].op;
+    vertex_jobs.push_back(i);
+  }
+  CreateEdges(&graph);
+  set<Vertex::Index> cut_vertices;
+  CutCycles(&graph, &cut_vertices);
+  LOG(INFO) << "Converting " << cut_vertices.size()
+            << " operations to full replace to break cycles.";
+  for (set<Vertex::Index>::const_iterator it = cut_vertices.begin();
+       it != cut_vertices.end(); ++it) {
+    TEST_AND_RETURN_FALSE(ConvertToReplace(&jobs[vertex_jobs[*it]]));
+  }
+  vector<Vertex::Index> order;
+  TEST_AND_RETURN_FALSE(graph_utils::TopologicalSort(graph, &order));
+
+  DeltaArchiveManifest manifest;
+  manifest.set_block_size(kBlockSize);
+  // Lets the client check the whole install device once it's applied this.
+  string new_image_hash;
+  TEST_AND_RETURN_FALSE(PartitionVerifierAction::HashPartition(
+      new_image, new_image_size, OmahaHashCalculator::kSha256, NULL,
+      &new_image_hash));
+  manifest.set_dst_checksum(new_image_hash);
+  manifest.set_dst_size(new_image_size);
+  for (vector<Vertex::Index>::const_iterator it = order.begin();
+       it != order.end(); ++it) {
+    *manifest.add_install_operations() = *graph[*it].op;
+  }
+  for (vector<DiffJob>::size_type i = num_file_jobs; i < jobs.size(); i++)
+    *manifest.add_install_operations() = *jobs[i].op;
+
+  return WritePayload(output_path, blobs_fd, &manifest);
+}
+
+};  // namespace chromeos_update_engine
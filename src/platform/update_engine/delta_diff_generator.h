@@ -5,11 +5,55 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_DELTA_DIFF_GENERATOR_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_DELTA_DIFF_GENERATOR_H__
 
+#include <set>
+#include <string>
 #include "base/basictypes.h"
+#include "update_engine/graph_types.h"
+
+// This class generates a delta payload (see update_metadata.proto) that
+// DeltaPerformer can apply, in place, to the old filesystem image to turn it
+// into the new one.
+//
+// Each regular file in the new filesystem gets one operation: MOVE if its
+// contents are unchanged, otherwise whichever of BSDIFF (against the file of
+// the same name in the old filesystem), REPLACE_BZ or REPLACE is smallest.
+// Since the operations are performed in place, an operation that reads a
+// block must run before any operation that writes it. Those dependencies
+// form a graph; cycles are broken by turning operations into full replaces,
+// which read nothing, and the operations are then emitted in topological
+// order. All blocks of the new image that aren't part of any regular file
+// (metadata, directories, etc.) are sent last, as REPLACE_BZ operations.
 
 namespace chromeos_update_engine {
 
 class DeltaDiffGenerator {
+ public:
+  // Generates a delta payload that turns the filesystem mounted at old_root
+  // into the one mounted at new_root, and writes it to output_path.
+  // new_image must be the image (file or device) that new_root is mounted
+  // from. Block numbers are read from the mounted filesystems, so the
+  // generated payload applies to the image that old_root is mounted from.
+  // Returns true on success.
+  static bool GenerateDeltaUpdateFile(const std::string& old_root,
+                                      const std::string& new_root,
+                                      const std::string& new_image,
+                                      const std::string& output_path);
+
+  // The functions below are exposed for testing.
+
+  // For each pair of vertices where the operation of one reads a block that
+  // the operation of the other writes, adds an edge from the reader to the
+  // writer (the reader must be performed first). The edge's extents are
+  // the blocks in question. Uses the src_extents and dst_extents of each
+  // vertex's op.
+  static void CreateEdges(Graph* graph);
+
+  // Makes graph acyclic. For each cycle, the edge with the smallest
+  // EdgeWeight is found, and the vertex it comes from has all of its
+  // out-edges removed. Those vertices are inserted into *cut_vertices; the
+  // caller must turn their operations into ones that don't read any blocks.
+  static void CutCycles(Graph* graph, std::set<Vertex::Index>* cut_vertices);
+
  private:
   // This should never be constructed
   DISALLOW_IMPLICIT_CONSTRUCTORS(DeltaDiffGenerator);
@@ -8,13 +8,16 @@
 #include <unistd.h>
 #include <set>
 #include <string>
+#include <utility>
 #include <vector>
 #include "base/string_util.h"
 #include <gtest/gtest.h>
 #include "chromeos/obsolete_logging.h"
 #include "update_engine/decompressing_file_writer.h"
 #include "update_engine/delta_diff_generator.h"
-#include "update_engine/delta_diff_parser.h"
+#include "update_engine/delta_performer.h"
+#include "update_engine/extent_writer.h"
+#include "update_engine/graph_utils.h"
 #include "update_engine/gzip.h"
 #include "update_engine/mock_file_writer.h"
 #include "update_engine/subprocess.h"
@@ -23,6 +26,76 @@
 
 namespace chromeos_update_engine {
 
+using std::make_pair;
+using std::set;
+using std::vector;
+
 class DeltaDiffGeneratorTest : public ::testing::Test {};
 
+namespace {
+void AddExtent(uint64 start_block, uint64 num_blocks,
+               google::protobuf::RepeatedPtrField<Extent>* extents) {
+  Extent* extent = extents->Add();
+  extent->set_start_block(start_block);
+  extent->set_num_blocks(num_blocks);
+}
+}  // namespace {}
+
+TEST(DeltaDiffGeneratorTest, CreateEdgesTest) {
+  DeltaArchiveManifest ops;
+  Graph graph(3);
+  for (Vertex::Index i = 0; i < graph.size(); i++)
+    graph[i].op = ops.add_install_operations();
+
+  // 0 reads blocks 0-3 and writes 10-11.
+  AddExtent(0, 4, graph[0].op->mutable_src_extents());
+  AddExtent(10, 2, graph[0].op->mutable_dst_extents());
+  // 1 reads blocks 10-11 and a hole and writes 2 and 4.
+  AddExtent(10, 2, graph[1].op->mutable_src_extents());
+  AddExtent(kSparseHole, 1, graph[1].op->mutable_src_extents());
+  AddExtent(2, 1, graph[1].op->mutable_dst_extents());
+  AddExtent(4, 1, graph[1].op->mutable_dst_extents());
+  // 2 reads and writes blocks 6-7.
+  AddExtent(6, 2, graph[2].op->mutable_src_extents());
+  AddExtent(6, 2, graph[2].op->mutable_dst_extents());
+
+  DeltaDiffGenerator::CreateEdges(&graph);
+
+  ASSERT_EQ(1, graph[0].out_edges.size());
+  ASSERT_EQ(1, graph[0].out_edges.count(1));
+  const vector<Extent>& extents = graph[0].out_edges[1].extents;
+  ASSERT_EQ(1, extents.size());
+  EXPECT_EQ(2, extents[0].start_block());
+  EXPECT_EQ(1, extents[0].num_blocks());
+
+  ASSERT_EQ(1, graph[1].out_edges.size());
+  ASSERT_EQ(1, graph[1].out_edges.count(0));
+  EXPECT_EQ(2, graph_utils::EdgeWeight(graph, make_pair(1, 0)));
+
+  EXPECT_TRUE(graph[2].out_edges.empty());
+}
+
+TEST(DeltaDiffGeneratorTest, CutCyclesTest) {
+  Graph graph(4);
+  // 0 -> 1 -> 2 -> 0 is a cycle, with the edge out of 1 the lightest.
+  // 2 -> 3 isn't part of it.
+  graph_utils::AppendBlockToExtents(&graph[0].out_edges[1].extents, 0);
+  graph_utils::AppendBlockToExtents(&graph[0].out_edges[1].extents, 1);
+  graph_utils::AppendBlockToExtents(&graph[1].out_edges[2].extents, 2);
+  graph_utils::AppendBlockToExtents(&graph[2].out_edges[0].extents, 3);
+  graph_utils::AppendBlockToExtents(&graph[2].out_edges[0].extents, 4);
+  graph_utils::AppendBlockToExtents(&graph[2].out_edges[3].extents, 5);
+
+  set<Vertex::Index> cut_vertices;
+  DeltaDiffGenerator::CutCycles(&graph, &cut_vertices);
+  ASSERT_EQ(1, cut_vertices.size());
+  EXPECT_EQ(1, *cut_vertices.begin());
+  EXPECT_TRUE(graph[1].out_edges.empty());
+  EXPECT_EQ(1, graph[0].out_edges.size());
+  EXPECT_EQ(2, graph[2].out_edges.size());
+
+  vector<Vertex::Index> order;
+  EXPECT_TRUE(graph_utils::TopologicalSort(graph, &order));
+}
+
 }  // namespace chromeos_update_engine
@@ -1,9 +0,0 @@
-// Copyright (c) 2009 The Chromium Authors. All rights reserved.
-// Use of this source code is governed by a BSD-style license that can be
-// found in the LICENSE file.
-
-#include "update_engine/delta_diff_parser.h"
-
-namespace chromeos_update_engine {
-
-}  // namespace chromeos_update_engine
@@ -1,2 +0,0 @@
-// Due to shared code, DeltaDiffParser is tested in
-// delta_diff_generator_unittest.cc
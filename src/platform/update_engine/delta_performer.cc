@@ -0,0 +1,367 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/delta_performer.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "base/scoped_ptr.h"
+#include "chromeos/obsolete_logging.h"
+#include "update_engine/bzip_extent_writer.h"
+#include "update_engine/extent_writer.h"
+#include "update_engine/subprocess.h"
+#include "update_engine/utils.h"
+
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+const char kDeltaMagic[] = "CrAU";
+const uint32 kDeltaVersion = 1;
+const size_t kDeltaHeaderLength = 4 + 4 + 8;  // magic, version, manifest size
+const uint64 kMaxManifestSize = 8 * 1024 * 1024;
+
+namespace {
+const size_t kMagicLength = 4;
+const char kBspatchPath[] = "/usr/bin/bspatch";
+
+// Big-endian helpers for the payload header.
+uint64 ReadBigEndian(const char* bytes, size_t length) {
+  uint64 ret = 0;
+  for (size_t i = 0; i < length; i++) {
+    ret = (ret << 8) | static_cast<unsigned char>(bytes[i]);
+  }
+  return ret;
+}
+
+void AppendBigEndian(uint64 value, size_t length, vector<char>* out) {
+  for (size_t i = length; i > 0; i--) {
+    out->push_back(static_cast<char>((value >> (8 * (i - 1))) & 0xff));
+  }
+}
+
+vector<Extent> ExtentsToVector(
+    const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  return vector<Extent>(extents.begin(), extents.end());
+}
+}  // namespace {}
+
+void DeltaPerformer::AppendHeader(uint64 manifest_size, vector<char>* out) {
+  out->insert(out->end(), kDeltaMagic, kDeltaMagic + kMagicLength);
+  AppendBigEndian(kDeltaVersion, 4, out);
+  AppendBigEndian(manifest_size, 8, out);
+}
+
+int DeltaPerformer::Open(const char* path, int flags, mode_t mode) {
+  if (fd_ != -1) {
+    LOG(ERROR) << "Can't Open(), fd_ != -1 (it's " << fd_ << ")";
+    return -EINVAL;
+  }
+  path_ = path;
+  // The operations read from, as well as write to, the device.
+  flags = (flags & ~(O_WRONLY | O_TRUNC)) | O_RDWR;
+  fd_ = open(path, flags, mode);
+  if (fd_ < 0)
+    return -errno;
+  return 0;
+}
+
+int DeltaPerformer::Close() {
+  if (fd_ < 0) {
+    LOG(ERROR) << "Called Close() while not open.";
+    return -EINVAL;
+  }
+  int rc = 0;
+  if (close(fd_) < 0)
+    rc = -errno;
+  fd_ = -2;  // Set so that isn't not valid AND calls to Open() will fail.
+  if (rc < 0)
+    return rc;
+  if (!manifest_valid_ ||
+      next_operation_num_ < manifest_.install_operations_size()) {
+    LOG(ERROR) << "Closed " << path_ << " before the delta was fully applied ("
+               << next_operation_num_ << " operations performed).";
+    return -EIO;
+  }
+  return 0;
+}
+
+bool DeltaPerformer::SaveState(DeltaPerformerState* state) {
+  if (!manifest_valid_)
+    return false;
+  TEST_AND_RETURN_FALSE(fd_ >= 0);
+  // The state says the operations so far are done, so make sure they are.
+  TEST_AND_RETURN_FALSE_ERRNO(fsync(fd_) == 0);
+  *state->mutable_manifest() = manifest_;
+  state->set_next_operation(next_operation_num_);
+  state->set_buffer_offset(buffer_offset_);
+  state->set_buffer(buffer_.empty() ? "" : &buffer_[0], buffer_.size());
+  return true;
+}
+
+bool DeltaPerformer::RestoreState(const DeltaPerformerState& state) {
+  TEST_AND_RETURN_FALSE(!manifest_valid_ && buffer_.empty());
+  TEST_AND_RETURN_FALSE(state.has_manifest());
+  TEST_AND_RETURN_FALSE(state.manifest().block_size() > 0);
+  TEST_AND_RETURN_FALSE(static_cast<int>(state.next_operation()) <=
+                        state.manifest().install_operations_size());
+  manifest_ = state.manifest();
+  block_size_ = manifest_.block_size();
+  next_operation_num_ = state.next_operation();
+  buffer_offset_ = state.buffer_offset();
+  buffer_.assign(state.buffer().begin(), state.buffer().end());
+  manifest_valid_ = true;
+  LOG(INFO) << "Resuming delta at operation " << next_operation_num_ << " of "
+            << manifest_.install_operations_size() << ".";
+  return true;
+}
+
+bool DeltaPerformer::ParseManifest(bool* error) {
+  *error = false;
+  if (buffer_.size() < kDeltaHeaderLength)
+    return false;
+  if (memcmp(&buffer_[0], kDeltaMagic, kMagicLength) != 0) {
+    LOG(ERROR) << "Bad payload format -- invalid delta magic.";
+    *error = true;
+    return false;
+  }
+  const uint32 version = ReadBigEndian(&buffer_[kMagicLength], 4);
+  if (version != kDeltaVersion) {
+    LOG(ERROR) << "Bad payload format -- unsupported version " << version;
+    *error = true;
+    return false;
+  }
+  manifest_size_ = ReadBigEndian(&buffer_[kMagicLength + 4], 8);
+  if (manifest_size_ > kMaxManifestSize) {
+    LOG(ERROR) << "Bad payload format -- manifest size " << manifest_size_
+               << " is too large.";
+    *error = true;
+    return false;
+  }
+  if (manifest_size_ > buffer_.size() - kDeltaHeaderLength)
+    return false;
+
+  if (!manifest_.ParseFromArray(&buffer_[0] + kDeltaHeaderLength,
+                                static_cast<int>(manifest_size_))) {
+    LOG(ERROR) << "Unable to parse manifest in update file.";
+    *error = true;
+    return false;
+  }
+  block_size_ = manifest_.block_size();
+  if (block_size_ == 0) {
+    LOG(ERROR) << "Bad payload format -- zero block size.";
+    *error = true;
+    return false;
+  }
+  // The data blobs start right after the manifest.
+  buffer_.erase(buffer_.begin(),
+                buffer_.begin() + kDeltaHeaderLength + manifest_size_);
+  buffer_offset_ = 0;
+  manifest_valid_ = true;
+  LOG(INFO) << "Parsed delta manifest with "
+            << manifest_.install_operations_size() << " operations.";
+  return true;
+}
+
+// Wrapper around write. Returns bytes written on success or
+// -errno on error.
+int DeltaPerformer::Write(const void* bytes, size_t count) {
+  if (fd_ < 0) {
+    LOG(ERROR) << "Write() called while not open.";
+    return -EBADF;
+  }
+  const char* c_bytes = reinterpret_cast<const char*>(bytes);
+  buffer_.insert(buffer_.end(), c_bytes, c_bytes + count);
+
+  if (!manifest_valid_) {
+    bool error = false;
+    if (!ParseManifest(&error))
+      return error ? -EINVAL : count;
+  }
+
+  while (next_operation_num_ < manifest_.install_operations_size()) {
+    const DeltaArchiveManifest_InstallOperation& op =
+        manifest_.install_operations(next_operation_num_);
+    if (op.data_length() > 0 && op.data_offset() < buffer_offset_) {
+      LOG(ERROR) << "Operation " << next_operation_num_ << " refers to data "
+                 << "that has already been consumed.";
+      return -EINVAL;
+    }
+    if (!CanPerformInstallOperation(op))
+      break;
+    bool success = false;
+    switch (op.type()) {
+      case DeltaArchiveManifest_InstallOperation_Type_REPLACE:
+      case DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ:
+        success = PerformReplaceOperation(op);
+        break;
+      case DeltaArchiveManifest_InstallOperation_Type_MOVE:
+        success = PerformMoveOperation(op);
+        break;
+      case DeltaArchiveManifest_InstallOperation_Type_BSDIFF:
+        success = PerformBsdiffOperation(op);
+        break;
+    }
+    if (!success) {
+      LOG(ERROR) << "Failed to perform operation " << next_operation_num_
+                 << " of type " << op.type();
+      return -EIO;
+    }
+    next_operation_num_++;
+  }
+  return count;
+}
+
+bool DeltaPerformer::CanPerformInstallOperation(
+    const DeltaArchiveManifest_InstallOperation& operation) {
+  // If we don't need data, we can always perform the operation.
+  if (operation.data_length() == 0)
+    return true;
+  // See if we have the data blob in the buffer yet.
+  return operation.data_offset() + operation.data_length() <=
+      buffer_offset_ + buffer_.size();
+}
+
+void DeltaPerformer::DiscardBufferHeadBytes(size_t count) {
+  CHECK_LE(count, buffer_.size());
+  buffer_.erase(buffer_.begin(), buffer_.begin() + count);
+  buffer_offset_ += count;
+}
+
+bool DeltaPerformer::PerformReplaceOperation(
+    const DeltaArchiveManifest_InstallOperation& operation) {
+  // Skip any bytes that no operation refers to.
+  DiscardBufferHeadBytes(operation.data_offset() - buffer_offset_);
+  CHECK_GE(buffer_.size(), operation.data_length());
+
+  DirectExtentWriter direct_writer;
+  ZeroPadExtentWriter zero_pad_writer(&direct_writer);
+  scoped_ptr<BzipExtentWriter> bzip_writer;
+
+  // Since bzip decompression is optional, we have a variable writer that will
+  // point to one of the ExtentWriter objects above.
+  ExtentWriter* writer = &zero_pad_writer;
+  if (operation.type() ==
+      DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ) {
+    bzip_writer.reset(new BzipExtentWriter(&zero_pad_writer));
+    writer = bzip_writer.get();
+  }
+  TEST_AND_RETURN_FALSE(writer->Init(fd_,
+                                     ExtentsToVector(operation.dst_extents()),
+                                     block_size_));
+  if (operation.data_length() > 0) {
+    TEST_AND_RETURN_FALSE(writer->Write(&buffer_[0],
+                                        operation.data_length()));
+  }
+  TEST_AND_RETURN_FALSE(writer->End());
+
+  DiscardBufferHeadBytes(operation.data_length());
+  return true;
+}
+
+bool DeltaPerformer::ReadSourceExtents(
+    const DeltaArchiveManifest_InstallOperation& operation,
+    vector<char>* out) {
+  uint64 blocks_to_read = 0;
+  for (int i = 0; i < operation.src_extents_size(); i++)
+    blocks_to_read += operation.src_extents(i).num_blocks();
+  out->clear();
+  out->resize(blocks_to_read * block_size_);
+
+  uint64 bytes_read = 0;
+  for (int i = 0; i < operation.src_extents_size(); i++) {
+    const Extent& extent = operation.src_extents(i);
+    const size_t bytes = extent.num_blocks() * block_size_;
+    if (extent.start_block() != kSparseHole) {
+      ssize_t bytes_read_this_iteration = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(
+          fd_, &(*out)[bytes_read], bytes,
+          extent.start_block() * block_size_, &bytes_read_this_iteration));
+      TEST_AND_RETURN_FALSE(bytes_read_this_iteration ==
+                            static_cast<ssize_t>(bytes));
+    }
+    // Sparse holes are left as the zeros that resize() filled in.
+    bytes_read += bytes;
+  }
+  return true;
+}
+
+bool DeltaPerformer::PerformMoveOperation(
+    const DeltaArchiveManifest_InstallOperation& operation) {
+  // Source and destination extents may overlap, so read all of the source
+  // before writing any of the destination.
+  vector<char> buf;
+  TEST_AND_RETURN_FALSE(ReadSourceExtents(operation, &buf));
+
+  DirectExtentWriter writer;
+  TEST_AND_RETURN_FALSE(writer.Init(fd_,
+                                    ExtentsToVector(operation.dst_extents()),
+                                    block_size_));
+  if (!buf.empty())
+    TEST_AND_RETURN_FALSE(writer.Write(&buf[0], buf.size()));
+  TEST_AND_RETURN_FALSE(writer.End());
+  return true;
+}
+
+bool DeltaPerformer::PerformBsdiffOperation(
+    const DeltaArchiveManifest_InstallOperation& operation) {
+  DiscardBufferHeadBytes(operation.data_offset() - buffer_offset_);
+  CHECK_GE(buffer_.size(), operation.data_length());
+
+  vector<char> old_data;
+  TEST_AND_RETURN_FALSE(ReadSourceExtents(operation, &old_data));
+  TEST_AND_RETURN_FALSE(operation.src_length() <= old_data.size());
+  old_data.resize(operation.src_length());
+
+  // bspatch only works on files, so stage the old data and the patch in
+  // temporary files.
+  string old_path, new_path, patch_path;
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("/tmp/au_old_data.XXXXXX", &old_path, NULL));
+  ScopedPathUnlinker old_path_unlinker(old_path);
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("/tmp/au_new_data.XXXXXX", &new_path, NULL));
+  ScopedPathUnlinker new_path_unlinker(new_path);
+  TEST_AND_RETURN_FALSE(
+      utils::MakeTempFile("/tmp/au_patch.XXXXXX", &patch_path, NULL));
+  ScopedPathUnlinker patch_path_unlinker(patch_path);
+
+  TEST_AND_RETURN_FALSE(utils::WriteFile(old_path.c_str(),
+                                         old_data.empty() ? "" : &old_data[0],
+                                         old_data.size()));
+  TEST_AND_RETURN_FALSE(utils::WriteFile(patch_path.c_str(),
+                                         &buffer_[0],
+                                         operation.data_length()));
+  DiscardBufferHeadBytes(operation.data_length());
+
+  vector<string> cmd;
+  cmd.push_back(kBspatchPath);
+  cmd.push_back(old_path);
+  cmd.push_back(new_path);
+  cmd.push_back(patch_path);
+  int return_code = 0;
+  TEST_AND_RETURN_FALSE(Subprocess::SynchronousExec(cmd, &return_code));
+  TEST_AND_RETURN_FALSE(return_code == 0);
+
+  vector<char> new_data;
+  TEST_AND_RETURN_FALSE(utils::ReadFile(new_path, &new_data));
+  TEST_AND_RETURN_FALSE(new_data.size() == operation.dst_length());
+
+  DirectExtentWriter direct_writer;
+  ZeroPadExtentWriter writer(&direct_writer);
+  TEST_AND_RETURN_FALSE(writer.Init(fd_,
+                                    ExtentsToVector(operation.dst_extents()),
+                                    block_size_));
+  if (!new_data.empty())
+    TEST_AND_RETURN_FALSE(writer.Write(&new_data[0], new_data.size()));
+  TEST_AND_RETURN_FALSE(writer.End());
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,148 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_DELTA_PERFORMER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_DELTA_PERFORMER_H__
+
+#include <string>
+#include <vector>
+#include "base/basictypes.h"
+#include "update_engine/download_checkpoint.pb.h"
+#include "update_engine/file_writer.h"
+#include "update_engine/update_metadata.pb.h"
+
+// This class performs the actions in a delta update synchronously. The delta
+// update itself should be passed in in chunks as it is received.
+//
+// The payload is parsed as the bytes come in: first the header and the
+// DeltaArchiveManifest, then, in order, each InstallOperation is performed
+// as soon as all of its data blob has arrived. Data that's been consumed by
+// an operation is discarded, so at most one operation's data is held in
+// memory at any time.
+//
+// Since the operations are performed in place, the file passed to Open()
+// must already contain the source image (e.g., the result of the
+// FilesystemCopierAction).
+//
+// Progress can be saved between operations with SaveState() and restored
+// into a new DeltaPerformer with RestoreState(), which then expects to be
+// given the rest of the payload.
+
+namespace chromeos_update_engine {
+
+// The first bytes of every delta payload.
+extern const char kDeltaMagic[];
+// The payload format version that this class understands.
+extern const uint32 kDeltaVersion;
+// Size of the fixed-length payload header: magic, version and manifest size.
+extern const size_t kDeltaHeaderLength;
+// Largest manifest size accepted from a payload header. The size isn't
+// verified before the manifest is buffered, so it must be bounded.
+extern const uint64 kMaxManifestSize;
+
+class DeltaPerformer : public FileWriter {
+ public:
+  DeltaPerformer()
+      : fd_(-1),
+        manifest_valid_(false),
+        manifest_size_(0),
+        next_operation_num_(0),
+        buffer_offset_(0),
+        block_size_(0) {}
+  virtual ~DeltaPerformer() {}
+
+  // Opens the install device (or file) that the delta is applied to.
+  // Returns 0 on success or -errno on error.
+  virtual int Open(const char* path, int flags, mode_t mode);
+
+  // Wrapper around write. Returns bytes written on success or
+  // -errno on error. Any operations whose data is now complete are
+  // performed before this returns.
+  virtual int Write(const void* bytes, size_t count);
+
+  // Wrapper around close. Returns 0 on success or -errno on error. It's an
+  // error to close before all of the operations have been performed.
+  virtual int Close();
+
+  // Flushes all operations performed so far to disk and saves what's needed
+  // to continue applying the payload into *state. Returns false if nothing
+  // worth saving has been received yet (the manifest hasn't been parsed) or
+  // on error.
+  bool SaveState(DeltaPerformerState* state);
+
+  // Restores state saved by SaveState(). The next call to Write() must pass
+  // the payload starting right after the last byte that had been passed to
+  // the DeltaPerformer that saved state. Must be called before Write().
+  // Returns true on success.
+  bool RestoreState(const DeltaPerformerState& state);
+
+  // The hash and size that the manifest says the install device has once
+  // the payload has been applied. Empty and 0 if the manifest hasn't been
+  // parsed or doesn't say.
+  std::string dst_checksum() const {
+    return manifest_valid_ ? manifest_.dst_checksum() : "";
+  }
+  uint64 dst_size() const {
+    return manifest_valid_ ? manifest_.dst_size() : 0;
+  }
+
+  // Helpers for the generator and for unittests: serializes the payload
+  // header for a manifest of manifest_size bytes into *out.
+  static void AppendHeader(uint64 manifest_size, std::vector<char>* out);
+
+ private:
+  // Returns true if enough of the payload has been received to parse the
+  // header and manifest. Returns false with *error set on bad input.
+  bool ParseManifest(bool* error);
+
+  // Returns true if all the data for operation has arrived.
+  bool CanPerformInstallOperation(
+      const DeltaArchiveManifest_InstallOperation& operation);
+
+  // These perform a specific type of operation and return true on success.
+  bool PerformReplaceOperation(
+      const DeltaArchiveManifest_InstallOperation& operation);
+  bool PerformMoveOperation(
+      const DeltaArchiveManifest_InstallOperation& operation);
+  bool PerformBsdiffOperation(
+      const DeltaArchiveManifest_InstallOperation& operation);
+
+  // Reads the src extents of operation into *out. Sparse holes read as zeros.
+  bool ReadSourceExtents(
+      const DeltaArchiveManifest_InstallOperation& operation,
+      std::vector<char>* out);
+
+  // Discards the first count bytes from the buffer_ and advances
+  // buffer_offset_ accordingly.
+  void DiscardBufferHeadBytes(size_t count);
+
+  // File descriptor of open device.
+  int fd_;
+
+  // The path of the open device. Used for logging.
+  std::string path_;
+
+  DeltaArchiveManifest manifest_;
+  bool manifest_valid_;
+  uint64 manifest_size_;
+
+  // Index of the next operation to perform in the manifest.
+  int next_operation_num_;
+
+  // Bytes that have been received but not yet consumed.
+  std::vector<char> buffer_;
+
+  // Offset of buffer_[0] in the data blobs section of the payload. Only
+  // meaningful once the manifest has been parsed.
+  uint64 buffer_offset_;
+
+  // The block size, as read from the manifest.
+  uint32 block_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(DeltaPerformer);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_DELTA_PERFORMER_H__
@@ -0,0 +1,199 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/delta_performer.h"
+#include "update_engine/extent_writer.h"
+#include "update_engine/update_metadata.pb.h"
+#include "update_engine/utils.h"
+
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+const char kPathTemplate[] = "./DeltaPerformerTest-file.XXXXXX";
+const uint32 kBlockSize = 4096;
+
+void AddExtent(uint64 start_block, uint64 num_blocks,
+               google::protobuf::RepeatedPtrField<Extent>* extents) {
+  Extent* extent = extents->Add();
+  extent->set_start_block(start_block);
+  extent->set_num_blocks(num_blocks);
+}
+}  // namespace {}
+
+class DeltaPerformerTest : public ::testing::Test {
+ protected:
+  virtual void SetUp() {
+    EXPECT_TRUE(utils::MakeTempFile(kPathTemplate, &path_, NULL));
+  }
+  virtual void TearDown() {
+    unlink(path_.c_str());
+  }
+
+  // Serializes manifest and blobs into a payload, then feeds it to a
+  // DeltaPerformer writing to path_, chunk_size bytes at a time. Returns
+  // the return value of Close().
+  int ApplyPayload(const DeltaArchiveManifest& manifest,
+                   const vector<char>& blobs,
+                   size_t chunk_size);
+  const string& path() const { return path_; }
+ private:
+  string path_;
+};
+
+int DeltaPerformerTest::ApplyPayload(const DeltaArchiveManifest& manifest,
+                                     const vector<char>& blobs,
+                                     size_t chunk_size) {
+  string serialized_manifest;
+  EXPECT_TRUE(manifest.SerializeToString(&serialized_manifest));
+  vector<char> payload;
+  DeltaPerformer::AppendHeader(serialized_manifest.size(), &payload);
+  payload.insert(payload.end(), serialized_manifest.begin(),
+                 serialized_manifest.end());
+  payload.insert(payload.end(), blobs.begin(), blobs.end());
+
+  DeltaPerformer performer;
+  EXPECT_EQ(0, performer.Open(path_.c_str(), O_WRONLY | O_CREAT, 0644));
+  for (size_t i = 0; i < payload.size(); i += chunk_size) {
+    const size_t count = min(chunk_size, payload.size() - i);
+    EXPECT_EQ(static_cast<int>(count), performer.Write(&payload[i], count));
+  }
+  return performer.Close();
+}
+
+TEST_F(DeltaPerformerTest, HeaderTest) {
+  vector<char> header;
+  DeltaPerformer::AppendHeader(0x0102, &header);
+  ASSERT_EQ(kDeltaHeaderLength, header.size());
+  EXPECT_EQ(0, memcmp(&header[0], kDeltaMagic, 4));
+  const char expected_rest[] = {
+    0, 0, 0, 1,  // version
+    0, 0, 0, 0, 0, 0, 1, 2  // manifest size
+  };
+  EXPECT_EQ(0, memcmp(&header[4], expected_rest, sizeof(expected_rest)));
+}
+
+TEST_F(DeltaPerformerTest, ReplaceAndMoveTest) {
+  // Start with an old image of three blocks: 'a's, 'b's, 'c's.
+  vector<char> old_image;
+  old_image.insert(old_image.end(), kBlockSize, 'a');
+  old_image.insert(old_image.end(), kBlockSize, 'b');
+  old_image.insert(old_image.end(), kBlockSize, 'c');
+  ASSERT_TRUE(utils::WriteFile(path().c_str(), &old_image[0],
+                               old_image.size()));
+
+  DeltaArchiveManifest manifest;
+  vector<char> blobs;
+
+  // Swap blocks 0 and 2 by way of block 3.
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+  AddExtent(0, 1, op->mutable_src_extents());
+  AddExtent(3, 1, op->mutable_dst_extents());
+  op = manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+  AddExtent(2, 1, op->mutable_src_extents());
+  AddExtent(0, 1, op->mutable_dst_extents());
+  op = manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_MOVE);
+  AddExtent(3, 1, op->mutable_src_extents());
+  AddExtent(2, 1, op->mutable_dst_extents());
+
+  // Replace block 1 with a short string, which gets zero padded.
+  const char kReplacement[] = "hello";
+  op = manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+  op->set_data_offset(blobs.size());
+  op->set_data_length(strlen(kReplacement));
+  AddExtent(1, 1, op->mutable_dst_extents());
+  blobs.insert(blobs.end(), kReplacement, kReplacement + strlen(kReplacement));
+
+  // Fill block 3 with a bzip2 compressed "test\n"
+  // ('echo test | bzip2 | hexdump').
+  const unsigned char kCompressed[] = {
+    0x42, 0x5a, 0x68, 0x39, 0x31, 0x41, 0x59, 0x26, 0x53, 0x59, 0xcc, 0xc3,
+    0x71, 0xd4, 0x00, 0x00, 0x02, 0x41, 0x80, 0x00, 0x10, 0x02, 0x00, 0x0c,
+    0x00, 0x20, 0x00, 0x21, 0x9a, 0x68, 0x33, 0x4d, 0x19, 0x97, 0x8b, 0xb9,
+    0x22, 0x9c, 0x28, 0x48, 0x66, 0x61, 0xb8, 0xea, 0x00,
+  };
+  // Leave a gap in the blobs that no operation uses.
+  blobs.insert(blobs.end(), 10, 'x');
+  op = manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE_BZ);
+  op->set_data_offset(blobs.size());
+  op->set_data_length(sizeof(kCompressed));
+  AddExtent(3, 1, op->mutable_dst_extents());
+  blobs.insert(blobs.end(), kCompressed, kCompressed + sizeof(kCompressed));
+
+  vector<char> expected;
+  expected.insert(expected.end(), kBlockSize, 'c');
+  expected.insert(expected.end(), kReplacement,
+                  kReplacement + strlen(kReplacement));
+  expected.resize(2 * kBlockSize);
+  expected.insert(expected.end(), kBlockSize, 'a');
+  const char kTest[] = "test\n";
+  expected.insert(expected.end(), kTest, kTest + strlen(kTest));
+  expected.resize(4 * kBlockSize);
+
+  // Feed the payload in chunks that don't line up with anything.
+  EXPECT_EQ(0, ApplyPayload(manifest, blobs, 7));
+
+  vector<char> found;
+  EXPECT_TRUE(utils::ReadFile(path(), &found));
+  EXPECT_TRUE(expected == found);
+}
+
+TEST_F(DeltaPerformerTest, BadMagicTest) {
+  DeltaPerformer performer;
+  EXPECT_EQ(0, performer.Open(path().c_str(), O_WRONLY | O_CREAT, 0644));
+  const char kJunk[] = "junkjunkjunkjunkjunk";
+  EXPECT_LT(performer.Write(kJunk, sizeof(kJunk)), 0);
+  EXPECT_LT(performer.Close(), 0);
+}
+
+TEST_F(DeltaPerformerTest, BadManifestSizeTest) {
+  // Sizes that are too large to buffer, or that make the header length
+  // plus the manifest size wrap around.
+  const uint64 kSizes[] = {
+    kMaxManifestSize + 1,
+    static_cast<uint64>(-1),
+    static_cast<uint64>(-static_cast<int64>(kDeltaHeaderLength)) + 4
+  };
+  for (size_t i = 0; i < arraysize(kSizes); i++) {
+    vector<char> payload;
+    DeltaPerformer::AppendHeader(kSizes[i], &payload);
+    payload.resize(payload.size() + 64, 'x');
+    DeltaPerformer performer;
+    EXPECT_EQ(0, performer.Open(path().c_str(), O_WRONLY | O_CREAT, 0644));
+    EXPECT_LT(performer.Write(&payload[0], payload.size()), 0) << kSizes[i];
+    EXPECT_LT(performer.Close(), 0);
+  }
+}
+
+TEST_F(DeltaPerformerTest, IncompletePayloadTest) {
+  DeltaArchiveManifest manifest;
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+  op->set_data_offset(0);
+  op->set_data_length(10);
+  AddExtent(0, 1, op->mutable_dst_extents());
+
+  // Only 5 of the 10 bytes of data arrive.
+  EXPECT_LT(ApplyPayload(manifest, vector<char>(5, 'x'), 3), 0);
+}
+
+}  // namespace chromeos_update_engine
@@ -7,41 +7,101 @@
 #include <algorithm>
 #include <glib.h>
 #include "update_engine/action_pipe.h"
+#include "update_engine/download_checkpoint.pb.h"
+#include "update_engine/utils.h"
 
 using std::min;
+using std::string;
 
 namespace chromeos_update_engine {
 
+namespace {
+// How much downloaded data may be queued up waiting to be written and hashed
+// before ReceivedBytes() blocks.
+const size_t kPipelineBufferSize = 1024 * 1024;
+
+// The transfer is paused once this much data is queued up, which leaves room
+// for the chunk after the one that crossed it, and resumed once the queue is
+// down to kPipelineLowWatermark.
+const uint64 kPipelineHighWatermark = kPipelineBufferSize / 2;
+const uint64 kPipelineLowWatermark = kPipelineBufferSize / 4;
+
+// How often to check the queue while the transfer is paused.
+const guint kBackpressurePollMs = 20;
+
+// How often to save a checkpoint, in downloaded bytes. Each checkpoint holds
+// up writing while the install device is synced.
+const uint64 kCheckpointInterval = 4 * 1024 * 1024;
+}  // namespace {}
+
 DownloadAction::DownloadAction(HttpFetcher* http_fetcher)
     : size_(0),
       should_decompress_(false),
+      bytes_received_(0),
+      resume_offset_(0),
+      checkpoint_bytes_received_(0),
       writer_(NULL),
-      http_fetcher_(http_fetcher) {}
+      http_fetcher_(http_fetcher),
+      backpressure_source_id_(0),
+      abort_source_id_(0) {}
 
-DownloadAction::~DownloadAction() {}
+DownloadAction::~DownloadAction() {
+  CancelBackpressureCheck();
+  CancelAbortTransfer();
+}
 
 void DownloadAction::PerformAction() {
   http_fetcher_->set_delegate(this);
   CHECK(!writer_);
-  direct_file_writer_.reset(new DirectFileWriter);
+  buffered_file_writer_.reset(
+      new BufferedFileWriter(BufferedFileWriter::kDefaultBufferSize, true));
 
   // Get the InstallPlan and read it
   CHECK(HasInputObject());
-  InstallPlan install_plan(GetInputObject());
+  MoveInputObject(&install_plan_);
 
-  should_decompress_ = install_plan.is_full_update;
-  url_ = install_plan.download_url;
-  output_path_ = install_plan.install_path;
-  hash_ = install_plan.download_hash;
-  install_plan.Dump();
+  should_decompress_ = install_plan_.is_full_update;
+  url_ = install_plan_.download_url;
+  output_path_ = install_plan_.install_path;
+  hash_ = install_plan_.download_hash;
+  install_plan_.Dump();
 
+  OmahaHashCalculator::Algorithm algorithm = OmahaHashCalculator::kSha1;
+  if (!OmahaHashCalculator::AlgorithmForHash(hash_, &algorithm))
+    LOG(WARNING) << "Unrecognized hash " << hash_ << "; assuming SHA-1.";
+  omaha_hash_calculator_.reset(new OmahaHashCalculator(algorithm));
+  bytes_received_ = 0;
+
+  FileWriter* output_writer = NULL;
+  bool resumed = false;
   if (should_decompress_) {
     decompressing_file_writer_.reset(
-        new GzipDecompressingFileWriter(direct_file_writer_.get()));
-    writer_ = decompressing_file_writer_.get();
+        new GzipDecompressingFileWriter(buffered_file_writer_.get()));
+    output_writer = decompressing_file_writer_.get();
   } else {
-    writer_ = direct_file_writer_.get();
+    // Not a full update, so the payload is a delta that's applied in place
+    // on top of the existing contents of output_path_.
+    delta_performer_.reset(new DeltaPerformer);
+    output_writer = delta_performer_.get();
+    resumed = !checkpoint_path_.empty() && ResumeFromCheckpoint();
+    if (!resumed) {
+      // Start over with a clean slate.
+      omaha_hash_calculator_.reset(new OmahaHashCalculator(algorithm));
+      delta_performer_.reset(new DeltaPerformer);
+      output_writer = delta_performer_.get();
+      bytes_received_ = 0;
+    }
   }
+  // The checkpoint may say that output_path_ holds a fresh copy from
+  // FilesystemCopierAction, which stops being true once writing starts.
+  if (!resumed)
+    DiscardCheckpoint();
+  resume_offset_ = bytes_received_;
+  checkpoint_bytes_received_ = bytes_received_;
+  pipelined_file_writer_.reset(
+      new PipelinedFileWriter(output_writer, omaha_hash_calculator_.get(),
+                              kPipelineBufferSize));
+  writer_ = pipelined_file_writer_.get();
   int rc = writer_->Open(output_path_.c_str(),
                          O_TRUNC | O_WRONLY | O_CREAT | O_LARGEFILE, 0644);
   if (rc < 0) {
@@ -50,12 +110,83 @@ void DownloadAction::PerformAction() {
     processor_->ActionComplete(this, false);
     return;
   }
+  http_fetcher_->SetOffset(bytes_received_);
+  http_fetcher_->SetContentHash(hash_);
   http_fetcher_->BeginTransfer(url_);
 }
 
+bool DownloadAction::ResumeFromCheckpoint() {
+  string data;
+  if (!utils::ReadFileToString(checkpoint_path_, &data))
+    return false;  // No checkpoint.
+  DownloadCheckpoint checkpoint;
+  TEST_AND_RETURN_FALSE(checkpoint.ParseFromString(data));
+  if (checkpoint.url() != url_ || checkpoint.hash() != hash_ ||
+      checkpoint.install_path() != output_path_) {
+    LOG(INFO) << "Ignoring checkpoint for a different download.";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(
+      omaha_hash_calculator_->SetContext(checkpoint.hash_context()));
+  TEST_AND_RETURN_FALSE(
+      delta_performer_->RestoreState(checkpoint.delta_performer_state()));
+  bytes_received_ = checkpoint.bytes_received();
+  LOG(INFO) << "Resuming download of " << url_ << " at byte "
+            << bytes_received_;
+  return true;
+}
+
+void DownloadAction::WriteCheckpoint() {
+  if (checkpoint_path_.empty() || !delta_performer_.get() ||
+      !pipelined_file_writer_.get())
+    return;
+  int rc = pipelined_file_writer_->Flush();
+  if (rc < 0)
+    return;  // Don't save a state that can't be resumed from.
+  if (SaveCheckpoint(bytes_received_))
+    checkpoint_bytes_received_ = bytes_received_;
+}
+
+bool DownloadAction::SaveCheckpoint(uint64 bytes_received) {
+  DownloadCheckpoint checkpoint;
+  if (!delta_performer_->SaveState(
+          checkpoint.mutable_delta_performer_state()))
+    return false;
+  checkpoint.set_url(url_);
+  checkpoint.set_hash(hash_);
+  checkpoint.set_install_path(output_path_);
+  checkpoint.set_bytes_received(bytes_received);
+  omaha_hash_calculator_->GetContext(checkpoint.mutable_hash_context());
+  string data;
+  if (!checkpoint.SerializeToString(&data) ||
+      !utils::WriteFileAtomically(checkpoint_path_, data.data(),
+                                  data.size())) {
+    LOG(ERROR) << "Unable to save checkpoint to " << checkpoint_path_;
+    return false;
+  }
+  return true;
+}
+
+void DownloadAction::CheckpointReached(uint64 offset) {
+  SaveCheckpoint(resume_offset_ + offset);
+}
+
+void DownloadAction::DiscardCheckpoint() {
+  if (checkpoint_path_.empty())
+    return;
+  if (unlink(checkpoint_path_.c_str()) != 0 && errno != ENOENT)
+    LOG(ERROR) << "Unable to delete checkpoint " << checkpoint_path_;
+}
+
 void DownloadAction::TerminateProcessing() {
   CHECK(writer_);
-  CHECK_EQ(writer_->Close(), 0);
+  CancelBackpressureCheck();
+  CancelAbortTransfer();
+  // Save as much progress as possible for the next attempt.
+  WriteCheckpoint();
+  // A partially applied delta fails to close cleanly, which is expected here.
+  if (writer_->Close() < 0)
+    LOG(INFO) << "Closing " << output_path_ << " after termination failed.";
   writer_ = NULL;
   http_fetcher_->TerminateTransfer();
 }
@@ -63,29 +194,99 @@ void DownloadAction::TerminateProcessing() {
 void DownloadAction::ReceivedBytes(HttpFetcher *fetcher,
                                    const char* bytes,
                                    int length) {
+  if (abort_source_id_)
+    return;  // Writing has failed, and the transfer is being stopped.
   int rc = writer_->Write(bytes, length);
-  TEST_AND_RETURN(rc >= 0);
-  omaha_hash_calculator_.Update(bytes, length);
+  if (rc < 0) {
+    LOG(ERROR) << "Unable to write " << output_path_ << ": "
+               << utils::ErrnoNumberAsString(-rc);
+    // There's no point in downloading the rest. The fetcher may not be
+    // stopped from inside its own callback, so that's done from the main
+    // loop.
+    abort_source_id_ = g_idle_add(StaticAbortTransfer, this);
+    return;
+  }
+  AddBytesIn(length);
+  bytes_received_ += length;
+  if (!checkpoint_path_.empty() && delta_performer_.get() &&
+      bytes_received_ - checkpoint_bytes_received_ >= kCheckpointInterval &&
+      pipelined_file_writer_->RequestCheckpoint(this))
+    checkpoint_bytes_received_ = bytes_received_;
+  if (!backpressure_source_id_ &&
+      pipelined_file_writer_->BytesBuffered() >= kPipelineHighWatermark) {
+    // The next few chunks would make Write() block.
+    http_fetcher_->Pause();
+    backpressure_source_id_ =
+        g_timeout_add(kBackpressurePollMs, StaticCheckBackpressure, this);
+  }
+}
+
+bool DownloadAction::CheckBackpressure() {
+  if (pipelined_file_writer_->BytesBuffered() > kPipelineLowWatermark)
+    return true;
+  backpressure_source_id_ = 0;
+  http_fetcher_->Unpause();
+  return false;
+}
+
+void DownloadAction::CancelBackpressureCheck() {
+  if (backpressure_source_id_) {
+    g_source_remove(backpressure_source_id_);
+    backpressure_source_id_ = 0;
+  }
+}
+
+void DownloadAction::AbortTransfer() {
+  abort_source_id_ = 0;
+  http_fetcher_->TerminateTransfer();
+  // Close() reports the write error, so this fails the action.
+  TransferComplete(http_fetcher_.get(), false);
+}
+
+void DownloadAction::CancelAbortTransfer() {
+  if (abort_source_id_) {
+    g_source_remove(abort_source_id_);
+    abort_source_id_ = 0;
+  }
 }
 
 void DownloadAction::TransferComplete(HttpFetcher *fetcher, bool successful) {
+  CancelBackpressureCheck();
+  // If writing failed, Close() below reports it.
+  CancelAbortTransfer();
   if (writer_) {
-    CHECK_EQ(writer_->Close(), 0) << errno;
+    int rc = writer_->Close();
+    if (rc < 0) {
+      LOG(ERROR) << "Unable to close " << output_path_ << ": "
+                 << utils::ErrnoNumberAsString(-rc);
+      successful = false;
+    }
     writer_ = NULL;
   }
   if (successful) {
     // Make sure hash is correct
-    omaha_hash_calculator_.Finalize();
-    if (omaha_hash_calculator_.hash() != hash_) {
+    // Close() has waited for all data to be hashed.
+    omaha_hash_calculator_->Finalize();
+    if (omaha_hash_calculator_->hash() != hash_) {
       LOG(ERROR) << "Download of " << url_ << " failed. Expect hash "
-                 << hash_ << " but got hash " << omaha_hash_calculator_.hash();
+                 << hash_ << " but got hash " << omaha_hash_calculator_->hash();
       successful = false;
     }
+    // The payload has been consumed, for better or worse. If the hash didn't
+    // match, resuming would only reproduce the mismatch.
+    DiscardCheckpoint();
   }
 
   // Write the path to the output pipe if we're successful
-  if (successful && HasOutputPipe())
-    SetOutputObject(GetInputObject());
+  if (successful && HasOutputPipe()) {
+    // A delta says what the install device should hold now, which lets a
+    // PartitionVerifierAction check it.
+    if (delta_performer_.get()) {
+      install_plan_.install_hash = delta_performer_->dst_checksum();
+      install_plan_.install_size = delta_performer_->dst_size();
+    }
+    MoveOutputObject(&install_plan_);
+  }
   processor_->ActionComplete(this, successful);
 }
 
@@ -12,17 +12,31 @@
 #include <string>
 
 #include <curl/curl.h>
+#include <glib.h>
 
 #include "base/scoped_ptr.h"
 #include "update_engine/action.h"
+#include "update_engine/buffered_file_writer.h"
 #include "update_engine/decompressing_file_writer.h"
+#include "update_engine/delta_performer.h"
 #include "update_engine/file_writer.h"
 #include "update_engine/http_fetcher.h"
 #include "update_engine/install_plan.h"
 #include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/pipelined_file_writer.h"
 
 // The Download Action downloads a requested url to a specified path on disk.
 // The url and output path are determined by the InstallPlan passed in.
+// Downloaded data is handed to a PipelinedFileWriter, so decompressing,
+// writing and hashing it happen on worker threads rather than the main loop.
+// When those fall behind, the HttpFetcher is paused until they catch up, so
+// that downloaded data doesn't pile up and the main loop never blocks.
+//
+// If a checkpoint path is set, progress on a delta payload is saved there
+// every so often (see download_checkpoint.proto), and a later DownloadAction
+// for the same payload and install path resumes from the saved offset. The
+// checkpoints are saved on the PipelinedFileWriter's write thread, so they
+// don't hold up the main loop.
 
 namespace chromeos_update_engine {
 
@@ -38,7 +52,8 @@ class ActionTraits<DownloadAction> {
 };
 
 class DownloadAction : public Action<DownloadAction>,
-                       public HttpFetcherDelegate {
+                       public HttpFetcherDelegate,
+                       public PipelinedFileWriter::CheckpointDelegate {
  public:
   // Takes ownership of the passed in HttpFetcher. Useful for testing.
   // A good calling pattern is:
@@ -50,6 +65,11 @@ class DownloadAction : public Action<DownloadAction>,
   void PerformAction();
   void TerminateProcessing();
 
+  // Enables saving and resuming from a checkpoint at path.
+  void set_checkpoint_path(const std::string& path) {
+    checkpoint_path_ = path;
+  }
+
   // Debugging/logging
   static std::string StaticType() { return "DownloadAction"; }
   std::string Type() const { return StaticType(); }
@@ -59,10 +79,52 @@ class DownloadAction : public Action<DownloadAction>,
                              const char* bytes, int length);
   virtual void TransferComplete(HttpFetcher *fetcher, bool successful);
 
+  // PipelinedFileWriter::CheckpointDelegate method, called on the write
+  // thread.
+  virtual void CheckpointReached(uint64 offset);
+
  private:
+  // If checkpoint_path_ holds a checkpoint for this download, restores the
+  // hash calculator and delta performer from it and returns true.
+  bool ResumeFromCheckpoint();
+
+  // Waits for all received data to be written and saves a checkpoint.
+  void WriteCheckpoint();
+
+  // Saves a checkpoint for the first bytes_received bytes of the payload,
+  // which must have been written and hashed, and nothing more. Safe to call
+  // on the write thread. Returns true on success.
+  bool SaveCheckpoint(uint64 bytes_received);
+
+  // Deletes the checkpoint, if any.
+  void DiscardCheckpoint();
+
+  // Resumes the paused transfer once the pipeline has caught up.
+  bool CheckBackpressure();
+  static gboolean StaticCheckBackpressure(gpointer data) {
+    return reinterpret_cast<DownloadAction*>(data)->CheckBackpressure();
+  }
+
+  // Stops checking on the pipeline for a paused transfer.
+  void CancelBackpressureCheck();
+
+  // Stops the transfer after a write error and fails the action.
+  void AbortTransfer();
+  static gboolean StaticAbortTransfer(gpointer data) {
+    reinterpret_cast<DownloadAction*>(data)->AbortTransfer();
+    return FALSE;
+  }
+
+  // Removes the pending AbortTransfer(), if any.
+  void CancelAbortTransfer();
+
   // Expected size of the file (will be used for progress info)
   const size_t size_;
 
+  // The plan, as taken from the input pipe. It's passed on, with the
+  // install hash and size filled in for a delta, to the output pipe.
+  InstallPlan install_plan_;
+
   // URL to download
   std::string url_;
 
@@ -76,21 +138,51 @@ class DownloadAction : public Action<DownloadAction>,
   // Whether the caller requested that we decompress the downloaded data.
   bool should_decompress_;
 
+  // Where to save progress. Empty if checkpoints are disabled.
+  std::string checkpoint_path_;
+
+  // Offset in the payload of the next byte to be received.
+  uint64 bytes_received_;
+
+  // The value of bytes_received_ when the transfer began. Offsets in the
+  // pipeline are relative to this.
+  uint64 resume_offset_;
+
+  // The value of bytes_received_ when the last checkpoint was asked for.
+  uint64 checkpoint_bytes_received_;
+
   // The FileWriter that downloaded data should be written to. It will
-  // either point to *decompressing_file_writer_ or *direct_file_writer_.
+  // point to *pipelined_file_writer_.
   FileWriter* writer_;
 
   // If non-null, a FileWriter used for gzip decompressing downloaded data
   scoped_ptr<GzipDecompressingFileWriter> decompressing_file_writer_;
 
-  // Used to write out the downloaded file
-  scoped_ptr<DirectFileWriter> direct_file_writer_;
+  // Used to write out the downloaded file, a whole buffer at a time and
+  // bypassing the page cache.
+  scoped_ptr<BufferedFileWriter> buffered_file_writer_;
+
+  // If non-null, applies a downloaded delta payload to the output path
+  scoped_ptr<DeltaPerformer> delta_performer_;
 
   // pointer to the HttpFetcher that does the http work
   scoped_ptr<HttpFetcher> http_fetcher_;
 
-  // Used to find the hash of the bytes downloaded
-  OmahaHashCalculator omaha_hash_calculator_;
+  // Runs CheckBackpressure() while http_fetcher_ is paused; 0 otherwise.
+  guint backpressure_source_id_;
+
+  // Runs AbortTransfer() once writing has failed; 0 otherwise.
+  guint abort_source_id_;
+
+  // Used to find the hash of the bytes downloaded. The algorithm is chosen
+  // to match hash_.
+  scoped_ptr<OmahaHashCalculator> omaha_hash_calculator_;
+
+  // Passes downloaded data to *omaha_hash_calculator_ and, on another thread,
+  // to either *decompressing_file_writer_ or *delta_performer_. Declared last
+  // so that its worker threads are stopped before anything they use is
+  // destroyed.
+  scoped_ptr<PipelinedFileWriter> pipelined_file_writer_;
   DISALLOW_COPY_AND_ASSIGN(DownloadAction);
 };
 
@@ -2,15 +2,25 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include <glib.h>
 #include <gtest/gtest.h>
 #include "update_engine/action_pipe.h"
+#include "update_engine/delta_performer.h"
 #include "update_engine/download_action.h"
+#include "update_engine/download_checkpoint.pb.h"
 #include "update_engine/mock_http_fetcher.h"
 #include "update_engine/omaha_hash_calculator.h"
 #include "update_engine/test_utils.h"
+#include "update_engine/throttling_http_fetcher.h"
+#include "update_engine/update_metadata.pb.h"
 #include "update_engine/utils.h"
 
 namespace chromeos_update_engine {
@@ -65,21 +75,64 @@ gboolean StartProcessorInRunLoop(gpointer data) {
   return FALSE;
 }
 
-void TestWithData(const vector<char>& data, bool compress) {
+// Returns a delta payload holding manifest followed by blobs.
+vector<char> PayloadWithManifest(const DeltaArchiveManifest& manifest,
+                                 const vector<char>& blobs) {
+  string serialized_manifest;
+  EXPECT_TRUE(manifest.SerializeToString(&serialized_manifest));
+  vector<char> payload;
+  DeltaPerformer::AppendHeader(serialized_manifest.size(), &payload);
+  payload.insert(payload.end(), serialized_manifest.begin(),
+                 serialized_manifest.end());
+  payload.insert(payload.end(), blobs.begin(), blobs.end());
+  return payload;
+}
+
+// Returns a delta payload with a single REPLACE operation that writes data
+// to the start of the output. The last block is zero padded, so on return
+// *expected_output holds what the output file should contain.
+vector<char> ReplacePayloadForData(const vector<char>& data,
+                                   vector<char>* expected_output) {
+  DeltaArchiveManifest manifest;
+  const uint64 num_blocks =
+      (data.size() + manifest.block_size() - 1) / manifest.block_size();
+  DeltaArchiveManifest_InstallOperation* op =
+      manifest.add_install_operations();
+  op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+  op->set_data_offset(0);
+  op->set_data_length(data.size());
+  Extent* extent = op->add_dst_extents();
+  extent->set_start_block(0);
+  extent->set_num_blocks(num_blocks);
+  op->set_dst_length(data.size());
+
+  *expected_output = data;
+  expected_output->resize(num_blocks * manifest.block_size());
+  return PayloadWithManifest(manifest, data);
+}
+
+void TestWithData(const vector<char>& data, bool compress,
+                  OmahaHashCalculator::Algorithm algorithm) {
   vector<char> use_data;
+  vector<char> expected_data;
   if (compress) {
     use_data = GzipCompressData(data);
+    expected_data = data;
   } else {
-    use_data = data;
+    // Non-full updates are delta payloads.
+    use_data = ReplacePayloadForData(data, &expected_data);
   }
 
   GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
 
   // TODO(adlr): see if we need a different file for build bots
   const string path("/tmp/DownloadActionTest");
+  // Deltas are applied on top of existing data, so start from scratch.
+  unlink(path.c_str());
   // takes ownership of passed in HttpFetcher
   InstallPlan install_plan(compress, "",
-                           OmahaHashCalculator::OmahaHashOfData(use_data),
+                           OmahaHashCalculator::OmahaHashOfBytes(
+                               &use_data[0], use_data.size(), algorithm),
                            path);
   ObjectFeederAction<InstallPlan> feeder_action;
   feeder_action.set_obj(install_plan);
@@ -89,7 +142,7 @@ void TestWithData(const vector<char>& data, bool compress) {
 
   DownloadActionTestProcessorDelegate delegate;
   delegate.loop_ = loop;
-  delegate.expected_data_ = data;
+  delegate.expected_data_ = expected_data;
   delegate.path_ = path;
   ActionProcessor processor;
   processor.set_delegate(&delegate);
@@ -109,8 +162,8 @@ TEST(DownloadActionTest, SimpleTest) {
   vector<char> small;
   const char* foo = "foo";
   small.insert(small.end(), foo, foo + strlen(foo));
-  TestWithData(small, false);
-  TestWithData(small, true);
+  TestWithData(small, false, OmahaHashCalculator::kSha1);
+  TestWithData(small, true, OmahaHashCalculator::kSha1);
 }
 
 TEST(DownloadActionTest, LargeTest) {
@@ -123,8 +176,16 @@ TEST(DownloadActionTest, LargeTest) {
     else
       c++;
   }
-  TestWithData(big, false);
-  TestWithData(big, true);
+  TestWithData(big, false, OmahaHashCalculator::kSha1);
+  TestWithData(big, true, OmahaHashCalculator::kSha1);
+}
+
+TEST(DownloadActionTest, Sha256Test) {
+  vector<char> data(3 * kMockHttpFetcherChunkSize);
+  for (unsigned int i = 0; i < data.size(); i++)
+    data[i] = 'a' + i % 26;
+  TestWithData(data, false, OmahaHashCalculator::kSha256);
+  TestWithData(data, true, OmahaHashCalculator::kSha256);
 }
 
 namespace {
@@ -231,13 +292,18 @@ gboolean PassObjectOutTestStarter(gpointer data) {
 TEST(DownloadActionTest, PassObjectOutTest) {
   GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
 
+  // A delta with no operations.
+  const vector<char> payload =
+      PayloadWithManifest(DeltaArchiveManifest(), vector<char>());
+
   // takes ownership of passed in HttpFetcher
   InstallPlan install_plan(false, "",
-                           OmahaHashCalculator::OmahaHashOfString("x"),
+                           OmahaHashCalculator::OmahaHashOfData(payload),
                            "/dev/null");
   ObjectFeederAction<InstallPlan> feeder_action;
   feeder_action.set_obj(install_plan);
-  DownloadAction download_action(new MockHttpFetcher("x", 1));
+  DownloadAction download_action(new MockHttpFetcher(&payload[0],
+                                                     payload.size()));
 
   DownloadActionTestAction test_action;
   test_action.expected_input_object_ = install_plan;
@@ -280,4 +346,331 @@ TEST(DownloadActionTest, BadOutFileTest) {
   g_main_loop_unref(loop);
 }
 
+namespace {
+class TerminateCountingHttpFetcher : public MockHttpFetcher {
+ public:
+  TerminateCountingHttpFetcher(const char* data, size_t size)
+      : MockHttpFetcher(data, size), terminate_count_(0) {}
+  virtual void TerminateTransfer() {
+    terminate_count_++;
+    MockHttpFetcher::TerminateTransfer();
+  }
+  int terminate_count_;
+};
+
+class WriteErrorTestProcessorDelegate : public ActionProcessorDelegate {
+ public:
+  WriteErrorTestProcessorDelegate() : loop_(NULL), success_(true) {}
+  virtual void ProcessingDone(const ActionProcessor* processor, bool success) {
+    success_ = success;
+    g_main_loop_quit(loop_);
+  }
+  GMainLoop* loop_;
+  bool success_;
+};
+}  // namespace {}
+
+TEST(DownloadActionTest, WriteErrorTest) {
+  // This isn't a delta payload, so applying it fails straight away.
+  vector<char> payload(32 * kMockHttpFetcherChunkSize, 'x');
+  const string path("/tmp/DownloadActionTest");
+  unlink(path.c_str());
+
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+  InstallPlan install_plan(false, "",
+                           OmahaHashCalculator::OmahaHashOfData(payload),
+                           path);
+  ObjectFeederAction<InstallPlan> feeder_action;
+  feeder_action.set_obj(install_plan);
+  TerminateCountingHttpFetcher* fetcher =
+      new TerminateCountingHttpFetcher(&payload[0], payload.size());
+  DownloadAction download_action(fetcher);
+  BondActions(&feeder_action, &download_action);
+
+  WriteErrorTestProcessorDelegate delegate;
+  delegate.loop_ = loop;
+  ActionProcessor processor;
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&download_action);
+
+  g_timeout_add(0, &StartProcessorInRunLoop, &processor);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+
+  // The rest of the payload isn't downloaded.
+  EXPECT_FALSE(delegate.success_);
+  EXPECT_EQ(1, fetcher->terminate_count_);
+  unlink(path.c_str());
+}
+
+namespace {
+// Runs a delta DownloadAction for payload with checkpoints at checkpoint_path.
+// The output at path must end up as expected_data.
+void RunCheckpointedDownload(const vector<char>& payload,
+                             const string& url,
+                             const string& path,
+                             const string& checkpoint_path,
+                             const vector<char>& expected_data) {
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+  InstallPlan install_plan(false, url,
+                           OmahaHashCalculator::OmahaHashOfData(payload),
+                           path);
+  ObjectFeederAction<InstallPlan> feeder_action;
+  feeder_action.set_obj(install_plan);
+  DownloadAction download_action(new MockHttpFetcher(&payload[0],
+                                                     payload.size()));
+  download_action.set_checkpoint_path(checkpoint_path);
+  BondActions(&feeder_action, &download_action);
+
+  DownloadActionTestProcessorDelegate delegate;
+  delegate.loop_ = loop;
+  delegate.expected_data_ = expected_data;
+  delegate.path_ = path;
+  ActionProcessor processor;
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&download_action);
+
+  g_timeout_add(0, &StartProcessorInRunLoop, &processor);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+}
+}  // namespace {}
+
+TEST(DownloadActionTest, ResumeFromCheckpointTest) {
+  // A delta with two REPLACE operations of one block each.
+  DeltaArchiveManifest manifest;
+  const uint32 block_size = manifest.block_size();
+  vector<char> blobs(2 * block_size);
+  for (unsigned int i = 0; i < blobs.size(); i++)
+    blobs[i] = 'a' + i % 26 + i / block_size;
+  for (int i = 0; i < 2; i++) {
+    DeltaArchiveManifest_InstallOperation* op =
+        manifest.add_install_operations();
+    op->set_type(DeltaArchiveManifest_InstallOperation_Type_REPLACE);
+    op->set_data_offset(i * block_size);
+    op->set_data_length(block_size);
+    Extent* extent = op->add_dst_extents();
+    extent->set_start_block(i);
+    extent->set_num_blocks(1);
+  }
+  const vector<char> payload = PayloadWithManifest(manifest, blobs);
+  const uint64 resume_offset = payload.size() - block_size;
+
+  const string path("/tmp/DownloadActionTest");
+  const string checkpoint_path("/tmp/DownloadActionTestCheckpoint");
+  const string url("http://example.com/delta");
+
+  // Pretend that an earlier run performed the first operation, which left
+  // the output with the first block written.
+  vector<char> partial_output(blobs.begin(), blobs.begin() + block_size);
+  partial_output.resize(2 * block_size);
+  ASSERT_TRUE(utils::WriteFile(path.c_str(), &partial_output[0],
+                               partial_output.size()));
+  DownloadCheckpoint checkpoint;
+  checkpoint.set_url(url);
+  checkpoint.set_hash(OmahaHashCalculator::OmahaHashOfData(payload));
+  checkpoint.set_install_path(path);
+  checkpoint.set_bytes_received(resume_offset);
+  OmahaHashCalculator calc;
+  calc.Update(&payload[0], resume_offset);
+  calc.GetContext(checkpoint.mutable_hash_context());
+  DeltaPerformerState* state = checkpoint.mutable_delta_performer_state();
+  *state->mutable_manifest() = manifest;
+  state->set_next_operation(1);
+  state->set_buffer_offset(block_size);
+  string serialized_checkpoint;
+  ASSERT_TRUE(checkpoint.SerializeToString(&serialized_checkpoint));
+  ASSERT_TRUE(utils::WriteFile(checkpoint_path.c_str(),
+                               serialized_checkpoint.data(),
+                               serialized_checkpoint.size()));
+
+  // The hash only matches if exactly the rest of the payload is downloaded
+  // and hashed on top of the saved context.
+  RunCheckpointedDownload(payload, url, path, checkpoint_path, blobs);
+  // A completed download leaves no checkpoint behind.
+  EXPECT_FALSE(utils::FileExists(checkpoint_path.c_str()));
+
+  // A checkpoint for another download is ignored.
+  checkpoint.set_url("http://example.com/other_delta");
+  ASSERT_TRUE(checkpoint.SerializeToString(&serialized_checkpoint));
+  ASSERT_TRUE(utils::WriteFile(checkpoint_path.c_str(),
+                               serialized_checkpoint.data(),
+                               serialized_checkpoint.size()));
+  unlink(path.c_str());
+  RunCheckpointedDownload(payload, url, path, checkpoint_path, blobs);
+  EXPECT_FALSE(utils::FileExists(checkpoint_path.c_str()));
+
+  unlink(path.c_str());
+}
+
+namespace {
+int64 NowMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<int64>(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
+
+vector<char> RandomData(size_t size) {
+  vector<char> data(size);
+  unsigned int seed = 42;
+  for (size_t i = 0; i < size; i++)
+    data[i] = rand_r(&seed);
+  return data;
+}
+}  // namespace {}
+
+TEST(DownloadActionTest, ThrottleTest) {
+  const int64 kBytesPerSecond = 1024 * 1024;
+  vector<char> data = RandomData(6 * kMockHttpFetcherChunkSize);
+  vector<char> expected_data;
+  vector<char> payload = ReplacePayloadForData(data, &expected_data);
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+  const string path("/tmp/DownloadActionTest");
+  unlink(path.c_str());
+  InstallPlan install_plan(false, "",
+                           OmahaHashCalculator::OmahaHashOfData(payload),
+                           path);
+  ObjectFeederAction<InstallPlan> feeder_action;
+  feeder_action.set_obj(install_plan);
+  ThrottlingHttpFetcher* fetcher = new ThrottlingHttpFetcher(
+      kBytesPerSecond, new MockHttpFetcher(&payload[0], payload.size()));
+  DownloadAction download_action(fetcher);
+  BondActions(&feeder_action, &download_action);
+
+  DownloadActionTestProcessorDelegate delegate;
+  delegate.loop_ = loop;
+  delegate.expected_data_ = expected_data;
+  delegate.path_ = path;
+  ActionProcessor processor;
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&download_action);
+
+  const int64 start_ms = NowMs();
+  g_timeout_add(0, &StartProcessorInRunLoop, &processor);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+  const int64 elapsed_ms = NowMs() - start_ms;
+
+  // Unthrottled, MockHttpFetcher would be done in about 60 ms. The first
+  // burst is free, and the last chunk needn't be paid for before it's
+  // received.
+  const int64 kBurstBytes =
+      kBytesPerSecond * ThrottlingHttpFetcher::kBurstMs / 1000;
+  EXPECT_GE(elapsed_ms, (payload.size() - kBurstBytes -
+                         kMockHttpFetcherChunkSize) * 1000 / kBytesPerSecond);
+  EXPECT_GT(fetcher->throttle_count(), 0);
+  unlink(path.c_str());
+}
+
+namespace {
+// A MockHttpFetcher that counts how often it's paused.
+class PauseCountingHttpFetcher : public MockHttpFetcher {
+ public:
+  PauseCountingHttpFetcher(const char* data, size_t size)
+      : MockHttpFetcher(data, size), pause_count_(0) {}
+  virtual void Pause() {
+    pause_count_++;
+    MockHttpFetcher::Pause();
+  }
+  int pause_count_;
+};
+
+class BackpressureTestProcessorDelegate : public ActionProcessorDelegate {
+ public:
+  BackpressureTestProcessorDelegate()
+      : loop_(NULL), success_(false), last_tick_ms_(0), max_tick_gap_ms_(0) {}
+  virtual void ProcessingDone(const ActionProcessor* processor, bool success) {
+    success_ = success;
+    g_main_loop_quit(loop_);
+  }
+  GMainLoop* loop_;
+  bool success_;
+  // See TickCallback().
+  int64 last_tick_ms_;
+  int64 max_tick_gap_ms_;
+};
+
+// Runs every 10 ms to see how long the main loop is ever kept busy.
+gboolean TickCallback(gpointer data) {
+  BackpressureTestProcessorDelegate* delegate =
+      reinterpret_cast<BackpressureTestProcessorDelegate*>(data);
+  const int64 now_ms = NowMs();
+  if (delegate->last_tick_ms_)
+    delegate->max_tick_gap_ms_ = std::max(delegate->max_tick_gap_ms_,
+                                          now_ms - delegate->last_tick_ms_);
+  delegate->last_tick_ms_ = now_ms;
+  return TRUE;
+}
+
+// A slow disk: opens a FIFO for reading, reads nothing for a second, then
+// reads everything.
+struct SlowReaderArgs {
+  string path;
+  string data;
+};
+
+gpointer SlowReader(gpointer data) {
+  SlowReaderArgs* args = reinterpret_cast<SlowReaderArgs*>(data);
+  int fd = open(args->path.c_str(), O_RDONLY);
+  CHECK_GE(fd, 0);
+  usleep(1000 * 1000);
+  char buf[64 * 1024];
+  ssize_t rc;
+  while ((rc = read(fd, buf, sizeof(buf))) > 0)
+    args->data.append(buf, rc);
+  close(fd);
+  return NULL;
+}
+}  // namespace {}
+
+TEST(DownloadActionTest, BackpressureTest) {
+  // Random data doesn't compress, so it fills the pipeline's buffer as fast
+  // as it's downloaded.
+  vector<char> data = RandomData(64 * kMockHttpFetcherChunkSize);
+  vector<char> payload = GzipCompressData(data);
+  const string path("/tmp/DownloadActionTestFifo");
+  unlink(path.c_str());
+  ASSERT_EQ(0, mkfifo(path.c_str(), 0600));
+  SlowReaderArgs reader_args;
+  reader_args.path = path;
+  GThread* reader = g_thread_create(&SlowReader, &reader_args, TRUE, NULL);
+  ASSERT_TRUE(reader);
+
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+  InstallPlan install_plan(true, "",
+                           OmahaHashCalculator::OmahaHashOfData(payload),
+                           path);
+  ObjectFeederAction<InstallPlan> feeder_action;
+  feeder_action.set_obj(install_plan);
+  PauseCountingHttpFetcher* fetcher =
+      new PauseCountingHttpFetcher(&payload[0], payload.size());
+  DownloadAction download_action(fetcher);
+  BondActions(&feeder_action, &download_action);
+
+  BackpressureTestProcessorDelegate delegate;
+  delegate.loop_ = loop;
+  ActionProcessor processor;
+  processor.set_delegate(&delegate);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&download_action);
+
+  g_timeout_add(0, &StartProcessorInRunLoop, &processor);
+  guint tick_id = g_timeout_add(10, &TickCallback, &delegate);
+  g_main_loop_run(loop);
+  g_source_remove(tick_id);
+  g_main_loop_unref(loop);
+  g_thread_join(reader);
+
+  EXPECT_TRUE(delegate.success_);
+  EXPECT_TRUE(reader_args.data == string(data.begin(), data.end()));
+  // The transfer was paused while the reader stalled, rather than blocking
+  // the main loop until it was done.
+  EXPECT_GT(fetcher->pause_count_, 0);
+  EXPECT_LT(delegate.max_tick_gap_ms_, 500);
+  unlink(path.c_str());
+}
+
 }  // namespace chromeos_update_engine
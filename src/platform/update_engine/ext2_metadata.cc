@@ -0,0 +1,162 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/ext2_metadata.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include "update_engine/utils.h"
+
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace ext2_metadata {
+
+namespace {
+// Offsets and values from the ext2/3/4 on-disk format. All fields are
+// little endian.
+const off_t kSuperblockOffset = 1024;
+const size_t kSuperblockSize = 1024;
+
+const size_t kSBlocksCount = 4;
+const size_t kSFirstDataBlock = 20;
+const size_t kSLogBlockSize = 24;
+const size_t kSBlocksPerGroup = 32;
+const size_t kSMagic = 56;
+const size_t kSFeatureIncompat = 96;
+const size_t kSFeatureRoCompat = 100;
+const size_t kSDescSize = 254;
+const size_t kSBlocksCountHi = 336;
+
+const uint16 kExt2Magic = 0xEF53;
+const uint32 kIncompatMetaBg = 0x0010;
+const uint32 kIncompat64Bit = 0x0080;
+const uint32 kRoCompatGdtCsum = 0x0010;
+const uint32 kRoCompatMetadataCsum = 0x0400;
+
+const size_t kMinDescSize = 32;
+const size_t kBgBlockBitmap = 0;
+const size_t kBgFlags = 18;
+const size_t kBgBlockBitmapHi = 32;
+const uint16 kBgBlockUninit = 0x0002;
+
+uint16 Get16(const vector<char>& buf, size_t offset) {
+  const unsigned char* p =
+      reinterpret_cast<const unsigned char*>(&buf[offset]);
+  return p[0] | (p[1] << 8);
+}
+
+uint32 Get32(const vector<char>& buf, size_t offset) {
+  return Get16(buf, offset) |
+      (static_cast<uint32>(Get16(buf, offset + 2)) << 16);
+}
+
+// Reads exactly buf->size() bytes at offset.
+bool ReadAt(int fd, off_t offset, vector<char>* buf) {
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(fd, &(*buf)[0], buf->size(), offset,
+                                        &bytes_read));
+  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buf->size()));
+  return true;
+}
+
+// Appends num_blocks blocks starting at start_block to *extents, extending
+// the last extent if possible.
+void AppendBlocks(uint64 start_block, uint64 num_blocks,
+                  vector<Extent>* extents) {
+  if (num_blocks == 0)
+    return;
+  if (!extents->empty()) {
+    Extent& last = extents->back();
+    if (last.start_block() + last.num_blocks() == start_block) {
+      last.set_num_blocks(last.num_blocks() + num_blocks);
+      return;
+    }
+  }
+  Extent extent;
+  extent.set_start_block(start_block);
+  extent.set_num_blocks(num_blocks);
+  extents->push_back(extent);
+}
+}  // namespace {}
+
+bool GetUsedExtents(const string& device,
+                    uint32* out_block_size,
+                    uint64* out_block_count,
+                    vector<Extent>* out) {
+  int fd = open(device.c_str(), O_RDONLY | O_LARGEFILE, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+
+  vector<char> sb(kSuperblockSize);
+  TEST_AND_RETURN_FALSE(ReadAt(fd, kSuperblockOffset, &sb));
+  TEST_AND_RETURN_FALSE(Get16(sb, kSMagic) == kExt2Magic);
+  const uint32 incompat = Get32(sb, kSFeatureIncompat);
+  // With meta_bg the group descriptors are scattered around the disk.
+  TEST_AND_RETURN_FALSE(!(incompat & kIncompatMetaBg));
+  const uint32 log_block_size = Get32(sb, kSLogBlockSize);
+  TEST_AND_RETURN_FALSE(log_block_size <= 6);
+  const uint32 block_size = 1024 << log_block_size;
+  uint64 block_count = Get32(sb, kSBlocksCount);
+  size_t desc_size = kMinDescSize;
+  if (incompat & kIncompat64Bit) {
+    block_count |= static_cast<uint64>(Get32(sb, kSBlocksCountHi)) << 32;
+    desc_size = Get16(sb, kSDescSize);
+    TEST_AND_RETURN_FALSE(desc_size >= kBgBlockBitmapHi + 4);
+  }
+  const uint32 first_data_block = Get32(sb, kSFirstDataBlock);
+  const uint32 blocks_per_group = Get32(sb, kSBlocksPerGroup);
+  TEST_AND_RETURN_FALSE(blocks_per_group > 0 &&
+                        blocks_per_group <= block_size * 8);
+  TEST_AND_RETURN_FALSE(block_count > first_data_block);
+  // Without checksums, the uninit flags can't be trusted.
+  const bool uninit_flags_valid = Get32(sb, kSFeatureRoCompat) &
+      (kRoCompatGdtCsum | kRoCompatMetadataCsum);
+
+  const uint64 group_count =
+      (block_count - first_data_block + blocks_per_group - 1) /
+      blocks_per_group;
+  vector<char> descriptors(group_count * desc_size);
+  TEST_AND_RETURN_FALSE(ReadAt(
+      fd, static_cast<off_t>(first_data_block + 1) * block_size,
+      &descriptors));
+
+  // Everything before the first group (the boot block, with 1 KiB blocks)
+  // is copied too.
+  AppendBlocks(0, first_data_block, out);
+  vector<char> bitmap(block_size);
+  for (uint64 group = 0; group < group_count; group++) {
+    const size_t desc = group * desc_size;
+    const uint64 group_start = first_data_block + group * blocks_per_group;
+    const uint64 group_blocks =
+        min(static_cast<uint64>(blocks_per_group), block_count - group_start);
+    if (uninit_flags_valid && (Get16(descriptors, desc + kBgFlags) &
+                               kBgBlockUninit)) {
+      AppendBlocks(group_start, group_blocks, out);
+      continue;
+    }
+    uint64 bitmap_block = Get32(descriptors, desc + kBgBlockBitmap);
+    if (desc_size > kMinDescSize)
+      bitmap_block |= static_cast<uint64>(
+          Get32(descriptors, desc + kBgBlockBitmapHi)) << 32;
+    TEST_AND_RETURN_FALSE(bitmap_block < block_count);
+    TEST_AND_RETURN_FALSE(ReadAt(fd, static_cast<off_t>(bitmap_block) *
+                                 block_size, &bitmap));
+    for (uint64 i = 0; i < group_blocks; i++) {
+      if (bitmap[i / 8] & (1 << (i % 8)))
+        AppendBlocks(group_start + i, 1, out);
+    }
+  }
+  *out_block_size = block_size;
+  *out_block_count = block_count;
+  return true;
+}
+
+}  // namespace ext2_metadata
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,39 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_EXT2_METADATA_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_EXT2_METADATA_H__
+
+#include <string>
+#include <vector>
+#include "base/basictypes.h"
+#include "update_engine/update_metadata.pb.h"
+
+// Reads just enough of an ext2/3/4 filesystem's on-disk metadata to tell
+// which of its blocks are in use, so that the filesystem can be copied
+// without walking its files.
+
+namespace chromeos_update_engine {
+
+namespace ext2_metadata {
+
+// Reads the superblock, group descriptors and block bitmaps of the
+// filesystem on device (a block device or an image file). Puts the block
+// size and the number of blocks in the filesystem into *out_block_size and
+// *out_block_count, and appends the extents of the blocks that are in use,
+// in block order, to *out. Filesystem metadata is always marked in use, so
+// copying these extents to another device of at least the same size yields
+// the same filesystem. Block groups whose bitmap was never initialized are
+// treated as fully in use. Returns false if device doesn't hold a
+// filesystem this understands.
+bool GetUsedExtents(const std::string& device,
+                    uint32* out_block_size,
+                    uint64* out_block_count,
+                    std::vector<Extent>* out);
+
+}  // namespace ext2_metadata
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_EXT2_METADATA_H__
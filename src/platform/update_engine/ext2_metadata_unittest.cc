@@ -0,0 +1,90 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "base/string_util.h"
+#include "update_engine/ext2_metadata.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class Ext2MetadataTest : public ::testing::Test { };
+
+namespace {
+const char* const kImagePath = "/tmp/Ext2MetadataTest.img";
+const int kImageSizeMiB = 20;
+
+// Returns the free block count that mkfs wrote in the superblock.
+uint32 SuperblockFreeBlocks(const string& image) {
+  vector<char> image_data;
+  EXPECT_TRUE(utils::ReadFile(image, &image_data));
+  const unsigned char* p =
+      reinterpret_cast<const unsigned char*>(&image_data[1024 + 12]);
+  return p[0] | (p[1] << 8) | (p[2] << 16) | (p[3] << 24);
+}
+
+void DoTest(int block_size) {
+  EXPECT_EQ(0, System(StringPrintf("dd if=/dev/zero of=%s bs=1M count=0 "
+                                   "seek=%d", kImagePath, kImageSizeMiB)));
+  EXPECT_EQ(0, System(StringPrintf("mkfs.ext3 -q -F -b %d %s", block_size,
+                                   kImagePath)));
+  uint32 out_block_size = 0;
+  uint64 block_count = 0;
+  vector<Extent> extents;
+  EXPECT_TRUE(ext2_metadata::GetUsedExtents(kImagePath, &out_block_size,
+                                            &block_count, &extents));
+  EXPECT_EQ(block_size, out_block_size);
+  EXPECT_EQ(kImageSizeMiB * 1024 * 1024 / block_size, block_count);
+
+  // Extents are in order, and don't touch each other.
+  uint64 used_blocks = 0;
+  for (vector<Extent>::size_type i = 0; i < extents.size(); i++) {
+    EXPECT_GT(extents[i].num_blocks(), 0);
+    if (i > 0) {
+      EXPECT_GT(extents[i].start_block(),
+                extents[i - 1].start_block() + extents[i - 1].num_blocks());
+    }
+    used_blocks += extents[i].num_blocks();
+  }
+  EXPECT_LE(extents.back().start_block() + extents.back().num_blocks(),
+            block_count);
+  // The superblock and the group descriptors come first.
+  EXPECT_EQ(0, extents[0].start_block());
+  EXPECT_EQ(block_count - SuperblockFreeBlocks(kImagePath), used_blocks);
+  EXPECT_EQ(0, unlink(kImagePath));
+}
+}  // namespace {}
+
+TEST(Ext2MetadataTest, UsedExtentsTest) {
+  DoTest(4096);
+}
+
+TEST(Ext2MetadataTest, SmallBlocksTest) {
+  // With 1 KiB blocks the filesystem starts at block 1.
+  DoTest(1024);
+}
+
+TEST(Ext2MetadataTest, NotAFilesystemTest) {
+  EXPECT_EQ(0, System(StringPrintf("dd if=/dev/zero of=%s bs=1M count=1",
+                                   kImagePath)));
+  uint32 block_size = 0;
+  uint64 block_count = 0;
+  vector<Extent> extents;
+  EXPECT_FALSE(ext2_metadata::GetUsedExtents(kImagePath, &block_size,
+                                             &block_count, &extents));
+  EXPECT_FALSE(ext2_metadata::GetUsedExtents("/some/missing/file",
+                                             &block_size, &block_count,
+                                             &extents));
+  EXPECT_EQ(0, unlink(kImagePath));
+}
+
+}  // namespace chromeos_update_engine
@@ -14,10 +14,16 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+
 #include <linux/fs.h>
+#include <linux/fiemap.h>
 
+#include "base/scoped_ptr.h"
+#include "update_engine/extent_writer.h"
 #include "update_engine/utils.h"
 
+using std::min;
 using std::string;
 using std::vector;
 
@@ -26,59 +32,167 @@ namespace chromeos_update_engine {
 namespace extent_mapper {
 
 namespace {
-const int kBlockSize = 4096;
+// How many extents to ask FS_IOC_FIEMAP for per call.
+const uint32 kFiemapExtentCount = 256;
+
+// Appends num_blocks blocks starting at start_block (which may be
+// kSparseHole) to *extents, extending the last extent if possible.
+void AppendBlocks(uint64 start_block, uint64 num_blocks,
+                  vector<Extent>* extents) {
+  if (num_blocks == 0)
+    return;
+  if (!extents->empty()) {
+    Extent& last = extents->back();
+    if ((start_block == kSparseHole && last.start_block() == kSparseHole) ||
+        (start_block != kSparseHole && last.start_block() != kSparseHole &&
+         last.start_block() + last.num_blocks() == start_block)) {
+      last.set_num_blocks(last.num_blocks() + num_blocks);
+      return;
+    }
+  }
+  Extent extent;
+  extent.set_start_block(start_block);
+  extent.set_num_blocks(num_blocks);
+  extents->push_back(extent);
 }
 
-bool ExtentsForFileFibmap(const std::string& path, std::vector<Extent>* out) {
-  CHECK(out);
-  // TODO(adlr): verify path is a file
+// Opens path, which must be a regular file, and returns its size in blocks.
+bool OpenFile(const string& path, int* fd, uint32* block_size,
+              uint64* block_count) {
+  *fd = open(path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(*fd >= 0);
   struct stat stbuf;
-  int rc = stat(path.c_str(), &stbuf);
-  TEST_AND_RETURN_FALSE_ERRNO(rc == 0);
+  TEST_AND_RETURN_FALSE_ERRNO(fstat(*fd, &stbuf) == 0);
   TEST_AND_RETURN_FALSE(S_ISREG(stbuf.st_mode));
-  
-  int fd = open(path.c_str(), O_RDONLY, 0);
-  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  int fs_block_size = 0;
+  TEST_AND_RETURN_FALSE_ERRNO(ioctl(*fd, FIGETBSZ, &fs_block_size) == 0);
+  TEST_AND_RETURN_FALSE(fs_block_size > 0);
+  *block_size = fs_block_size;
+  *block_count = (stbuf.st_size + fs_block_size - 1) / fs_block_size;
+  return true;
+}
+
+// Does the work for ExtentsForFileFiemap. If it fails because the
+// filesystem doesn't support FIEMAP, *unsupported is set to true.
+bool FiemapExtents(const string& path, vector<Extent>* out,
+                   bool* unsupported) {
+  *unsupported = false;
+  vector<Extent> extents;
+  int fd = -1;
   ScopedFdCloser fd_closer(&fd);
-  
-  // Get file size in blocks
-  rc = fstat(fd, &stbuf);
-  if (rc < 0) {
-    perror("fstat");
-    return false;
-  }
-  const int block_count = (stbuf.st_size + kBlockSize - 1) / kBlockSize;
-  Extent current;
-  current.set_start_block(0);
-  current.set_num_blocks(0);
+  uint32 block_size = 0;
+  uint64 block_count = 0;
+  TEST_AND_RETURN_FALSE(OpenFile(path, &fd, &block_size, &block_count));
+  const uint64 file_length = block_count * block_size;
 
-  for (int i = 0; i < block_count; i++) {
-    unsigned int block = i;
-    rc = ioctl(fd, FIBMAP, &block);
-    TEST_AND_RETURN_FALSE_ERRNO(rc == 0);
-    
-    // Add next block to extents
-    if (current.num_blocks() == 0) {
-      // We're starting a new extent
-      current.set_start_block(block);
-      current.set_num_blocks(1);
-      continue;
+  const size_t fiemap_size = sizeof(struct fiemap) +
+      kFiemapExtentCount * sizeof(struct fiemap_extent);
+  scoped_array<char> fiemap_buf(new char[fiemap_size]);
+  struct fiemap* fiemap = reinterpret_cast<struct fiemap*>(fiemap_buf.get());
+
+  // Offset in the file, in bytes, up to which extents is filled in.
+  uint64 next_offset = 0;
+  bool last = false;
+  while (!last && next_offset < file_length) {
+    memset(fiemap, 0, fiemap_size);
+    fiemap->fm_start = next_offset;
+    fiemap->fm_length = file_length - next_offset;
+    // Make sure delayed allocations have been given blocks.
+    fiemap->fm_flags = FIEMAP_FLAG_SYNC;
+    fiemap->fm_extent_count = kFiemapExtentCount;
+    if (ioctl(fd, FS_IOC_FIEMAP, fiemap) != 0) {
+      *unsupported = (errno == EOPNOTSUPP || errno == ENOTTY);
+      TEST_AND_RETURN_FALSE_ERRNO(false);
     }
-    if ((current.start_block() + current.num_blocks()) == block) {
-      // We're continuing the last extent
-      current.set_num_blocks(current.num_blocks() + 1);
-      continue;
+    if (fiemap->fm_mapped_extents == 0)
+      break;
+    for (uint32 i = 0; i < fiemap->fm_mapped_extents; i++) {
+      const struct fiemap_extent& extent = fiemap->fm_extents[i];
+      if (extent.fe_flags & FIEMAP_EXTENT_LAST)
+        last = true;
+      // Data that doesn't sit in whole blocks of its own can't be
+      // described with Extents.
+      TEST_AND_RETURN_FALSE(!(extent.fe_flags & (FIEMAP_EXTENT_NOT_ALIGNED |
+                                                 FIEMAP_EXTENT_DATA_INLINE |
+                                                 FIEMAP_EXTENT_DATA_TAIL |
+                                                 FIEMAP_EXTENT_ENCODED |
+                                                 FIEMAP_EXTENT_UNKNOWN)));
+      TEST_AND_RETURN_FALSE(extent.fe_logical % block_size == 0);
+      TEST_AND_RETURN_FALSE(extent.fe_physical % block_size == 0);
+      if (extent.fe_logical >= file_length) {
+        // Preallocated blocks past the end of the file.
+        last = true;
+        break;
+      }
+      // A gap before this extent is a hole.
+      if (extent.fe_logical > next_offset) {
+        AppendBlocks(kSparseHole,
+                     (extent.fe_logical - next_offset) / block_size,
+                     &extents);
+      }
+      const uint64 length =
+          min<uint64>(extent.fe_length, file_length - extent.fe_logical);
+      const uint64 num_blocks = (length + block_size - 1) / block_size;
+      // Unwritten (preallocated) extents read back as zeros.
+      AppendBlocks((extent.fe_flags & FIEMAP_EXTENT_UNWRITTEN) ?
+                   kSparseHole : extent.fe_physical / block_size,
+                   num_blocks,
+                   &extents);
+      next_offset = extent.fe_logical + num_blocks * block_size;
     }
-    // We're starting a new extent and keeping the current one
-    out->push_back(current);
-    current.set_start_block(block);
-    current.set_num_blocks(1);
-    continue;
   }
-  
-  if (current.num_blocks() > 0)
-    out->push_back(current);
+  // Anything past the last extent is a hole.
+  if (next_offset < file_length)
+    AppendBlocks(kSparseHole, (file_length - next_offset) / block_size,
+                 &extents);
+  out->insert(out->end(), extents.begin(), extents.end());
+  return true;
+}
+}  // namespace {}
+
+bool ExtentsForFileFibmap(const std::string& path, std::vector<Extent>* out) {
+  CHECK(out);
+  int fd = -1;
+  ScopedFdCloser fd_closer(&fd);
+  uint32 block_size = 0;
+  uint64 block_count = 0;
+  TEST_AND_RETURN_FALSE(OpenFile(path, &fd, &block_size, &block_count));
+
+  vector<Extent> extents;
+  for (uint64 i = 0; i < block_count; i++) {
+    unsigned int block = i;
+    TEST_AND_RETURN_FALSE_ERRNO(ioctl(fd, FIBMAP, &block) == 0);
+    // FIBMAP reports holes in sparse files as block 0.
+    AppendBlocks(block == 0 ? kSparseHole : block, 1, &extents);
+  }
+  out->insert(out->end(), extents.begin(), extents.end());
+  return true;
+}
 
+bool ExtentsForFileFiemap(const std::string& path, std::vector<Extent>* out) {
+  CHECK(out);
+  bool unsupported = false;
+  return FiemapExtents(path, out, &unsupported);
+}
+
+bool ExtentsForFile(const std::string& path, std::vector<Extent>* out) {
+  CHECK(out);
+  bool unsupported = false;
+  if (FiemapExtents(path, out, &unsupported))
+    return true;
+  TEST_AND_RETURN_FALSE(unsupported);
+  LOG(INFO) << "FIEMAP isn't supported for " << path << "; using FIBMAP.";
+  return ExtentsForFileFibmap(path, out);
+}
+
+bool GetFilesystemBlockSize(const std::string& path, uint32* out_blocksize) {
+  int fd = open(path.c_str(), O_RDONLY, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+  int block_size = 0;
+  TEST_AND_RETURN_FALSE_ERRNO(ioctl(fd, FIGETBSZ, &block_size) == 0);
+  TEST_AND_RETURN_FALSE(block_size > 0);
+  *out_blocksize = block_size;
   return true;
 }
 
@@ -7,14 +7,32 @@
 
 #include <string>
 #include <vector>
+#include "base/basictypes.h"
 #include "update_engine/update_metadata.pb.h"
 
 namespace chromeos_update_engine {
 
 namespace extent_mapper {
 
+// These append the extents of the file at path, in file order, to *out.
+// Block numbers are in units of the filesystem's block size (see
+// GetFilesystemBlockSize()). Holes in sparse files, and with FIEMAP also
+// unwritten (preallocated) extents, are returned as extents that start at
+// kSparseHole. Both return true on success.
+
+// Uses one FIBMAP ioctl per block.
 bool ExtentsForFileFibmap(const std::string& path, std::vector<Extent>* out);
 
+// Uses FS_IOC_FIEMAP, which returns many extents per ioctl. Fails if the
+// filesystem doesn't support it.
+bool ExtentsForFileFiemap(const std::string& path, std::vector<Extent>* out);
+
+// Uses FIEMAP, falling back to FIBMAP if the filesystem doesn't support it.
+bool ExtentsForFile(const std::string& path, std::vector<Extent>* out);
+
+// Puts the block size of the filesystem that path is on into *out_blocksize.
+bool GetFilesystemBlockSize(const std::string& path, uint32* out_blocksize);
+
 }  // namespace extent_mapper
 
 }  // namespace chromeos_update_engine
@@ -3,6 +3,7 @@
 // found in the LICENSE file.
 
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <set>
@@ -10,7 +11,10 @@
 #include <vector>
 #include <gtest/gtest.h>
 #include "base/basictypes.h"
+#include "base/string_util.h"
 #include "update_engine/extent_mapper.h"
+#include "update_engine/extent_writer.h"
+#include "update_engine/test_utils.h"
 #include "update_engine/utils.h"
 
 using std::set;
@@ -21,6 +25,42 @@ namespace chromeos_update_engine {
 
 class ExtentMapperTest : public ::testing::Test {};
 
+namespace {
+bool ExtentsEq(const vector<Extent>& a, const vector<Extent>& b) {
+  if (a.size() != b.size())
+    return false;
+  for (vector<Extent>::size_type i = 0; i < a.size(); i++) {
+    if (a[i].start_block() != b[i].start_block() ||
+        a[i].num_blocks() != b[i].num_blocks())
+      return false;
+  }
+  return true;
+}
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+// Creates an empty ext3 filesystem with 4 KiB blocks of the given size at
+// image and mounts it at kMountPath.
+void CreateAndMountImage(const string& image, int size_mib) {
+  EXPECT_EQ(0, System(StringPrintf("dd if=/dev/zero of=%s bs=1M count=0 "
+                                   "seek=%d", image.c_str(), size_mib)));
+  EXPECT_EQ(0, System(StringPrintf("mkfs.ext3 -q -F -b 4096 %s",
+                                   image.c_str())));
+  EXPECT_EQ(0, System(StringPrintf("mkdir -p %s", kMountPath)));
+  EXPECT_EQ(0, System(StringPrintf("mount -o loop %s %s", image.c_str(),
+                                   kMountPath)));
+}
+
+void UnmountAndRemoveImage(const string& image) {
+  EXPECT_EQ(0, System(StringPrintf("umount %s", kMountPath)));
+  EXPECT_EQ(0, unlink(image.c_str()));
+}
+}  // namespace {}
+
 TEST(ExtentMapperTest, RunAsRootSimpleTest) {
   // It's hard to have a concrete test for extent mapping without including
   // a specific filesystem image.
@@ -49,6 +89,79 @@ TEST(ExtentMapperTest, RunAsRootSimpleTest) {
   struct stat stbuf;
   EXPECT_EQ(0, stat(kFilename.c_str(), &stbuf));
   EXPECT_EQ(blocks.size(), (stbuf.st_size + kBlockSize - 1)/kBlockSize);
+
+  // FIEMAP, where supported, should agree with FIBMAP.
+  vector<Extent> fiemap_extents;
+  ASSERT_TRUE(extent_mapper::ExtentsForFile(kFilename, &fiemap_extents));
+  EXPECT_TRUE(ExtentsEq(extents, fiemap_extents));
+}
+
+TEST(ExtentMapperTest, RunAsRootSparseFileTest) {
+  ASSERT_EQ(0, getuid());
+  const string kImage = "ExtentMapperTest.image";
+  CreateAndMountImage(kImage, 16);
+  const string path = string(kMountPath) + "/sparse";
+  // Blocks 2 and 5 have data; 0, 1, 3, 4 and 6 are holes.
+  EXPECT_EQ(0, System(StringPrintf("dd if=/dev/urandom of=%s bs=4096 "
+                                   "count=1 seek=2 conv=notrunc",
+                                   path.c_str())));
+  EXPECT_EQ(0, System(StringPrintf("dd if=/dev/urandom of=%s bs=4096 "
+                                   "count=1 seek=5 conv=notrunc",
+                                   path.c_str())));
+  EXPECT_EQ(0, truncate(path.c_str(), 7 * 4096 - 10));
+
+  uint32 block_size = 0;
+  EXPECT_TRUE(extent_mapper::GetFilesystemBlockSize(path, &block_size));
+  EXPECT_EQ(4096, block_size);
+
+  vector<Extent> fibmap_extents;
+  vector<Extent> fiemap_extents;
+  EXPECT_TRUE(extent_mapper::ExtentsForFileFibmap(path, &fibmap_extents));
+  EXPECT_TRUE(extent_mapper::ExtentsForFileFiemap(path, &fiemap_extents));
+  EXPECT_TRUE(ExtentsEq(fibmap_extents, fiemap_extents));
+
+  ASSERT_EQ(5, fiemap_extents.size());
+  EXPECT_EQ(kSparseHole, fiemap_extents[0].start_block());
+  EXPECT_EQ(2, fiemap_extents[0].num_blocks());
+  EXPECT_NE(kSparseHole, fiemap_extents[1].start_block());
+  EXPECT_EQ(1, fiemap_extents[1].num_blocks());
+  EXPECT_EQ(kSparseHole, fiemap_extents[2].start_block());
+  EXPECT_EQ(2, fiemap_extents[2].num_blocks());
+  EXPECT_NE(kSparseHole, fiemap_extents[3].start_block());
+  EXPECT_EQ(1, fiemap_extents[3].num_blocks());
+  EXPECT_EQ(kSparseHole, fiemap_extents[4].start_block());
+  EXPECT_EQ(1, fiemap_extents[4].num_blocks());
+
+  UnmountAndRemoveImage(kImage);
+}
+
+// Not so much a test as a benchmark: compares FIBMAP and FIEMAP on a large
+// file in a loopback ext3 image.
+TEST(ExtentMapperTest, RunAsRootFiemapBenchmarkTest) {
+  ASSERT_EQ(0, getuid());
+  const string kImage = "ExtentMapperTest.image";
+  const int kFileSizeMiB = 64;
+  CreateAndMountImage(kImage, kFileSizeMiB + 32);
+  const string path = string(kMountPath) + "/big";
+  EXPECT_EQ(0, System(StringPrintf("dd if=/dev/zero of=%s bs=1M count=%d",
+                                   path.c_str(), kFileSizeMiB)));
+  EXPECT_EQ(0, System("sync"));
+
+  vector<Extent> fibmap_extents;
+  vector<Extent> fiemap_extents;
+  const double fibmap_start = Now();
+  EXPECT_TRUE(extent_mapper::ExtentsForFileFibmap(path, &fibmap_extents));
+  const double fiemap_start = Now();
+  EXPECT_TRUE(extent_mapper::ExtentsForFileFiemap(path, &fiemap_extents));
+  const double fiemap_end = Now();
+  EXPECT_TRUE(ExtentsEq(fibmap_extents, fiemap_extents));
+
+  LOG(INFO) << "Mapped " << kFileSizeMiB << " MiB file in "
+            << fiemap_extents.size() << " extents. FIBMAP: "
+            << (fiemap_start - fibmap_start) << "s, FIEMAP: "
+            << (fiemap_end - fiemap_start) << "s";
+
+  UnmountAndRemoveImage(kImage);
 }
 
 }  // namespace chromeos_update_engine
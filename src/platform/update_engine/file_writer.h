@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <vector>
 #include "chromeos/obsolete_logging.h"
 #include "update_engine/utils.h"
 
@@ -52,6 +53,27 @@ class DirectFileWriter : public FileWriter {
   int fd_;
 };
 
+// VectorFileWriter appends everything written to it to a vector, so that
+// data can be streamed through other FileWriters into memory. Open and
+// Close do nothing.
+
+class VectorFileWriter : public FileWriter {
+ public:
+  explicit VectorFileWriter(std::vector<char>* out) : out_(out) {}
+  virtual ~VectorFileWriter() {}
+
+  virtual int Open(const char* path, int flags, mode_t mode) { return 0; }
+  virtual int Write(const void* bytes, size_t count) {
+    const char* char_bytes = reinterpret_cast<const char*>(bytes);
+    out_->insert(out_->end(), char_bytes, char_bytes + count);
+    return count;
+  }
+  virtual int Close() { return 0; }
+
+ private:
+  std::vector<char>* const out_;
+};
+
 class ScopedFileWriterCloser {
  public:
   explicit ScopedFileWriterCloser(FileWriter* writer) : writer_(writer) {}
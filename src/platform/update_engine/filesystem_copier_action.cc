@@ -3,20 +3,27 @@
 // found in the LICENSE file.
 
 #include "update_engine/filesystem_copier_action.h"
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <algorithm>
 #include <map>
 #include <string>
 #include <vector>
+#include "base/scoped_ptr.h"
+#include "update_engine/download_checkpoint.pb.h"
+#include "update_engine/ext2_metadata.h"
 #include "update_engine/filesystem_iterator.h"
 #include "update_engine/subprocess.h"
 #include "update_engine/utils.h"
 
 using std::map;
+using std::max;
 using std::min;
 using std::string;
 using std::vector;
@@ -25,8 +32,80 @@ namespace chromeos_update_engine {
 
 namespace {
 const char* kMountpointTemplate = "/tmp/au_dest_mnt.XXXXXX";
-const off_t kCopyFileBufferSize = 4 * 1024 * 1024;
+const off_t kCopyChunkSize = 4 * 1024 * 1024;
 const char* kCopyExclusionPrefix = "/lost+found";
+
+// Ways of copying file data, fastest first. copy_file_range() and sendfile()
+// copy within the kernel, without a trip through a user space buffer.
+enum CopyMethod {
+  kCopyFileRange,
+  kSendfile,
+  kReadWrite
+};
+
+// The fastest method that's known to work on this kernel. Failures that
+// apply to all files, such as a missing system call, move this down so that
+// the next files don't try the same thing again.
+volatile gint best_copy_method = kCopyFileRange;
+
+// Copies up to length bytes from fd_in to fd_out at their file offsets with
+// *method, moving to a slower method if the files don't support it. *buf is
+// used for read() and write(). Returns the number of bytes copied, 0 at the
+// end of fd_in, or -1 with errno set on error.
+ssize_t CopyChunk(int fd_in, int fd_out, size_t length, CopyMethod* method,
+                  vector<char>* buf) {
+#ifdef __NR_copy_file_range
+  if (*method == kCopyFileRange) {
+    ssize_t rc = syscall(__NR_copy_file_range, fd_in, NULL, fd_out, NULL,
+                         length, 0);
+    if (rc >= 0 || (errno != ENOSYS && errno != EXDEV && errno != EINVAL &&
+                    errno != EOPNOTSUPP))
+      return rc;
+    // Older kernels can't copy between filesystems, which is always the
+    // case here.
+    if (errno == ENOSYS || errno == EXDEV)
+      g_atomic_int_set(&best_copy_method, kSendfile);
+    *method = kSendfile;
+  }
+#else
+  if (*method == kCopyFileRange)
+    *method = kSendfile;
+#endif
+  if (*method == kSendfile) {
+    ssize_t rc = sendfile(fd_out, fd_in, NULL, length);
+    if (rc >= 0 || (errno != ENOSYS && errno != EINVAL))
+      return rc;
+    if (errno == ENOSYS)
+      g_atomic_int_set(&best_copy_method, kReadWrite);
+    *method = kReadWrite;
+  }
+  if (buf->size() < length)
+    buf->resize(length);
+  ssize_t read_size = read(fd_in, &(*buf)[0], length);
+  if (read_size <= 0)
+    return read_size;
+  ssize_t write_size = 0;
+  while (write_size < read_size) {
+    ssize_t rc = write(fd_out, &(*buf)[write_size], read_size - write_size);
+    if (rc < 0)
+      return rc;
+    write_size += rc;
+  }
+  return read_size;
+}
+
+// Calls pwrite() repeatedly until count bytes are written. Returns true on
+// success.
+bool PWriteAll(int fd, const char* buf, size_t count, off_t offset) {
+  size_t bytes_written = 0;
+  while (bytes_written < count) {
+    ssize_t rc = pwrite(fd, buf + bytes_written, count - bytes_written,
+                        offset + bytes_written);
+    TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
+    bytes_written += rc;
+  }
+  return true;
+}
 }  // namespace {}
 
 void FilesystemCopierAction::PerformAction() {
@@ -35,10 +114,21 @@ void FilesystemCopierAction::PerformAction() {
     processor_->ActionComplete(this, false);
     return;
   }
-  install_plan_ = GetInputObject();
+  MoveInputObject(&install_plan_);
 
   if (install_plan_.is_full_update) {
     // No copy needed.
+    if (HasOutputPipe())
+      MoveOutputObject(&install_plan_);
+    processor_->ActionComplete(this, true);
+    return;
+  }
+
+  if (HasCopy()) {
+    LOG(INFO) << install_plan_.install_path << " already holds a copy.";
+    skipped_copy_ = true;
+    if (HasOutputPipe())
+      SetOutputObject(install_plan_);
     processor_->ActionComplete(this, true);
     return;
   }
@@ -53,33 +143,8 @@ void FilesystemCopierAction::PerformAction() {
     free(dest_path_temp);
   }
 
-  // Make sure we're properly mounted
-  if (Mount(install_plan_.install_path, dest_path_)) {
-    bool done_early = false;
-    if (utils::FileExists(
-            (dest_path_ +
-             FilesystemCopierAction::kCompleteFilesystemMarker).c_str())) {
-      // We're done!
-      done_early = true;
-      skipped_copy_ = true;
-      if (HasOutputPipe())
-        SetOutputObject(install_plan_);
-    }
-    if (!Unmount(dest_path_)) {
-      LOG(ERROR) << "Unmount failed. Aborting.";
-      processor_->ActionComplete(this, false);
-      return;
-    }
-    if (done_early) {
-      CHECK(!is_mounted_);
-      if (rmdir(dest_path_.c_str()) != 0)
-        LOG(ERROR) << "Unable to remove " << dest_path_;
-      processor_->ActionComplete(this, true);
-      return;
-    }
-  }
-  LOG(ERROR) << "not mounted; spawning thread";
-  // If we get here, mount failed or we're not done yet. Reformat and copy.
+  LOG(INFO) << install_plan_.install_path << " needs a fresh copy; spawning "
+            << "thread";
   CHECK_EQ(pthread_create(&helper_thread_, NULL, HelperThreadMainStatic, this),
            0);
 }
@@ -90,6 +155,41 @@ void FilesystemCopierAction::TerminateProcessing() {
   }
 }
 
+bool FilesystemCopierAction::HasCopy() {
+  if (download_checkpoint_path_.empty())
+    return false;
+  string data;
+  if (!utils::ReadFileToString(download_checkpoint_path_, &data))
+    return false;
+  DownloadCheckpoint checkpoint;
+  if (!checkpoint.ParseFromString(data) ||
+      checkpoint.install_path() != install_plan_.install_path)
+    return false;
+  // A delta that's partially applied can only be finished by the same
+  // payload; any other one needs a fresh copy to start from. The helper
+  // thread deletes the checkpoint before it copies.
+  if (checkpoint.has_url() &&
+      (checkpoint.url() != install_plan_.download_url ||
+       checkpoint.hash() != install_plan_.download_hash)) {
+    LOG(INFO) << install_plan_.install_path << " has part of a different "
+              << "delta applied to it.";
+    return false;
+  }
+  return true;
+}
+
+void FilesystemCopierAction::SaveCopyCheckpoint() {
+  if (download_checkpoint_path_.empty())
+    return;
+  DownloadCheckpoint checkpoint;
+  checkpoint.set_install_path(install_plan_.install_path);
+  string data;
+  if (!checkpoint.SerializeToString(&data) ||
+      !utils::WriteFileAtomically(download_checkpoint_path_, data.data(),
+                                  data.size()))
+    LOG(ERROR) << "Unable to save checkpoint to " << download_checkpoint_path_;
+}
+
 bool FilesystemCopierAction::Mount(const string& device,
                                    const string& mountpoint) {
   CHECK(!is_mounted_);
@@ -106,40 +206,63 @@ bool FilesystemCopierAction::Unmount(const string& mountpoint) {
 }
 
 void* FilesystemCopierAction::HelperThreadMain() {
-  // First, format the drive
-  vector<string> cmd;
-  cmd.push_back("/sbin/mkfs.ext3");
-  cmd.push_back("-F");
-  cmd.push_back(install_plan_.install_path);
-  int return_code = 1;
-  bool success = Subprocess::SynchronousExec(cmd, &return_code);
-  if (return_code != 0) {
-    LOG(INFO) << "Format of " << install_plan_.install_path
-              << " failed. Exit code: " << return_code;
-    success = false;
+  // A partially applied delta can't be resumed on top of a fresh copy.
+  if (!download_checkpoint_path_.empty() &&
+      unlink(download_checkpoint_path_.c_str()) != 0 && errno != ENOENT) {
+    LOG(ERROR) << "Unable to delete " << download_checkpoint_path_;
+  }
+
+  vector<Extent> used_extents;
+  uint32 block_size = 0;
+  uint64 block_count = 0;
+  copied_blocks_ = false;
+  if (!copy_source_device_.empty()) {
+    copied_blocks_ = ext2_metadata::GetUsedExtents(copy_source_device_,
+                                                   &block_size,
+                                                   &block_count,
+                                                   &used_extents);
+    if (!copied_blocks_)
+      LOG(ERROR) << "Unable to read the block bitmaps of "
+                 << copy_source_device_ << "; can't copy its blocks.";
   }
-  if (success) {
-    if (!Mount(install_plan_.install_path, dest_path_)) {
+
+  bool success = true;
+  if (copied_blocks_) {
+    success = CopyBlocksSynchronously(used_extents, block_size, block_count);
+  } else if (!copy_source_device_.empty()) {
+    // A delta expects the blocks of the source filesystem where they are on
+    // copy_source_device_, which a file by file copy wouldn't reproduce, so
+    // the update fails here rather than after downloading the payload.
+    success = false;
+  } else {
+    // First, format the drive
+    vector<string> cmd;
+    cmd.push_back("/sbin/mkfs.ext3");
+    cmd.push_back("-F");
+    cmd.push_back(install_plan_.install_path);
+    int return_code = 1;
+    success = Subprocess::SynchronousExec(cmd, &return_code);
+    if (return_code != 0) {
+      LOG(INFO) << "Format of " << install_plan_.install_path
+                << " failed. Exit code: " << return_code;
+      success = false;
+    }
+    if (success && !Mount(install_plan_.install_path, dest_path_)) {
       LOG(ERROR) << "Mount failed. Aborting";
       success = false;
     }
+    if (success)
+      success = CopySynchronously();
+    // Unmount
+    if (is_mounted_ && !Unmount(dest_path_)) {
+      LOG(ERROR) << "Unmount failed. Aborting";
+      success = false;
+    }
   }
-  if (success) {
-    success = CopySynchronously();
-  }
-  if (success) {
-    // Place our marker to avoid copies again in the future
-    int r = open((dest_path_ +
-                  FilesystemCopierAction::kCompleteFilesystemMarker).c_str(),
-                 O_CREAT | O_WRONLY, 0644);
-    if (r >= 0)
-      close(r);
-  }
-  // Unmount
-  if (!Unmount(dest_path_)) {
-    LOG(ERROR) << "Unmount failed. Aborting";
-    success = false;
-  }
+  // Remember the copy, so that it's not made again if the update is
+  // interrupted.
+  if (success)
+    SaveCopyCheckpoint();
   if (HasOutputPipe())
     SetOutputObject(install_plan_);
 
@@ -159,6 +282,56 @@ void FilesystemCopierAction::CollectThread() {
   processor_->ActionComplete(this, success);
 }
 
+bool FilesystemCopierAction::CopyBlocksSynchronously(
+    const vector<Extent>& extents,
+    uint32 block_size,
+    uint64 block_count) {
+  int fd_in = open(copy_source_device_.c_str(), O_RDONLY | O_LARGEFILE, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(fd_in >= 0);
+  ScopedFdCloser fd_in_closer(&fd_in);
+  int fd_out = open(install_plan_.install_path.c_str(),
+                    O_WRONLY | O_LARGEFILE, 0);
+  TEST_AND_RETURN_FALSE_ERRNO(fd_out >= 0);
+  ScopedFdCloser fd_out_closer(&fd_out);
+
+  const off_t filesystem_size = static_cast<off_t>(block_count) * block_size;
+  const off_t install_size = lseek(fd_out, 0, SEEK_END);
+  TEST_AND_RETURN_FALSE_ERRNO(install_size >= 0);
+  if (install_size < filesystem_size) {
+    LOG(ERROR) << install_plan_.install_path << " is " << install_size
+               << " bytes, too small for the " << filesystem_size
+               << " byte filesystem on " << copy_source_device_;
+    return false;
+  }
+
+  vector<char> buf(kCopyChunkSize);
+  off_t bytes_copied = 0;
+  for (vector<Extent>::const_iterator it = extents.begin();
+       it != extents.end(); ++it) {
+    off_t offset = static_cast<off_t>(it->start_block()) * block_size;
+    const off_t end = offset +
+        static_cast<off_t>(it->num_blocks()) * block_size;
+    while (offset < end) {
+      TEST_AND_RETURN_FALSE(!g_atomic_int_get(&thread_should_exit_));
+      const size_t length = min(end - offset, kCopyChunkSize);
+      ssize_t bytes_read = 0;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(fd_in, &buf[0], length, offset,
+                                            &bytes_read));
+      TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(length));
+      TEST_AND_RETURN_FALSE(PWriteAll(fd_out, &buf[0], length, offset));
+      offset += length;
+      bytes_copied += length;
+    }
+  }
+  TEST_AND_RETURN_FALSE_ERRNO(fsync(fd_out) == 0);
+  AddBytesIn(bytes_copied);
+  AddBytesOut(bytes_copied);
+  LOG(INFO) << "Copied " << bytes_copied << " bytes in " << extents.size()
+            << " extents of the " << filesystem_size << " byte filesystem on "
+            << copy_source_device_;
+  return true;
+}
+
 bool FilesystemCopierAction::CreateDirSynchronously(const std::string& new_path,
                                                     const struct stat& stbuf) {
   int r = mkdir(new_path.c_str(), stbuf.st_mode);
@@ -166,44 +339,54 @@ bool FilesystemCopierAction::CreateDirSynchronously(const std::string& new_path,
   return true;
 }
 
+bool FilesystemCopierAction::CreateFileSynchronously(
+    const std::string& new_path,
+    const struct stat& stbuf) {
+  int fd = open(new_path.c_str(), O_CREAT | O_EXCL | O_WRONLY, stbuf.st_mode);
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  TEST_AND_RETURN_FALSE_ERRNO(close(fd) == 0);
+  return true;
+}
+
 bool FilesystemCopierAction::CopyFileSynchronously(const std::string& old_path,
                                                    const std::string& new_path,
-                                                   const struct stat& stbuf) {
-  int fd_out = open(new_path.c_str(), O_CREAT | O_EXCL | O_WRONLY,
-                    stbuf.st_mode);
+                                                   off_t size) {
+  int fd_out = open(new_path.c_str(), O_WRONLY | O_LARGEFILE, 0);
   TEST_AND_RETURN_FALSE_ERRNO(fd_out >= 0);
   ScopedFdCloser fd_out_closer(&fd_out);
-  int fd_in = open(old_path.c_str(), O_RDONLY, 0);
+  int fd_in = open(old_path.c_str(), O_RDONLY | O_LARGEFILE, 0);
   TEST_AND_RETURN_FALSE_ERRNO(fd_in >= 0);
   ScopedFdCloser fd_in_closer(&fd_in);
 
-  vector<char> buf(min(kCopyFileBufferSize, stbuf.st_size));
+  CopyMethod method = static_cast<CopyMethod>(
+      g_atomic_int_get(&best_copy_method));
+  vector<char> buf;
   off_t bytes_written = 0;
-  while (true) {
+  while (bytes_written < size) {
     // Make sure we don't need to abort early:
-    TEST_AND_RETURN_FALSE(!g_atomic_int_get(&thread_should_exit_));
-
-    ssize_t read_size = read(fd_in, &buf[0], buf.size());
-    TEST_AND_RETURN_FALSE_ERRNO(read_size >= 0);
-    if (0 == read_size)  // EOF
-      break;
-
-    ssize_t write_size = 0;
-    while (write_size < read_size) {
-      ssize_t r = write(fd_out, &buf[write_size], read_size - write_size);
-      TEST_AND_RETURN_FALSE_ERRNO(r >= 0);
-      write_size += r;
-    }
-    CHECK_EQ(write_size, read_size);
-    bytes_written += write_size;
-    CHECK_LE(bytes_written, stbuf.st_size);
-    if (bytes_written == stbuf.st_size)
-      break;
+    TEST_AND_RETURN_FALSE(!ShouldStopCopying());
+    const size_t length = min(size - bytes_written, kCopyChunkSize);
+    ssize_t rc = CopyChunk(fd_in, fd_out, length, &method, &buf);
+    TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
+    // The file shouldn't shrink while it's being copied.
+    TEST_AND_RETURN_FALSE(rc > 0);
+    bytes_written += rc;
   }
-  CHECK_EQ(bytes_written, stbuf.st_size);
+  CHECK_EQ(bytes_written, size);
   return true;
 }
 
+void FilesystemCopierAction::RunCopyFileJob(CopyFileJob* job) {
+  scoped_ptr<CopyFileJob> job_deleter(job);
+  if (ShouldStopCopying())
+    return;
+  if (!CopyFileSynchronously(job->old_path, job->new_path, job->size)) {
+    LOG(ERROR) << "Unable to copy " << job->old_path << " to "
+               << job->new_path;
+    g_atomic_int_set(&copy_failed_, 1);
+  }
+}
+
 bool FilesystemCopierAction::CreateHardLinkSynchronously(
     const std::string& old_path,
     const std::string& new_path) {
@@ -237,17 +420,44 @@ bool FilesystemCopierAction::CreateNodeSynchronously(
 
 // Returns true on success
 bool FilesystemCopierAction::CopySynchronously() {
+  g_atomic_int_set(&copy_failed_, 0);
+  GError* err = NULL;
+  GThreadPool* pool = g_thread_pool_new(&RunCopyFileJobStatic,
+                                        this,
+                                        max(num_copy_threads_, 1),
+                                        TRUE,  // exclusive
+                                        &err);
+  TEST_AND_RETURN_FALSE(pool);
+  off_t bytes_queued = 0;
+  int files_queued = 0;
+  bool success = CopyTreeSynchronously(pool, &files_queued, &bytes_queued);
+  // Tells the copies that haven't started not to bother.
+  if (!success)
+    g_atomic_int_set(&copy_failed_, 1);
+  // Waits for all the copies to finish.
+  g_thread_pool_free(pool, FALSE, TRUE);
+  TEST_AND_RETURN_FALSE(success);
+  TEST_AND_RETURN_FALSE(!g_atomic_int_get(&copy_failed_));
+  AddBytesIn(bytes_queued);
+  AddBytesOut(bytes_queued);
+  LOG(INFO) << "Copied " << files_queued << " files (" << bytes_queued
+            << " bytes) from " << copy_source_ << " on "
+            << max(num_copy_threads_, 1) << " threads";
+  return true;
+}
+
+bool FilesystemCopierAction::CopyTreeSynchronously(GThreadPool* pool,
+                                                   int* files_queued,
+                                                   off_t* bytes_queued) {
   // This map is a map from inode # to new_path.
   map<ino_t, string> hard_links;
   FilesystemIterator iter(copy_source_,
                           utils::SetWithValue<string>(kCopyExclusionPrefix));
   bool success = true;
-  for (; !g_atomic_int_get(&thread_should_exit_) &&
-           !iter.IsEnd(); iter.Increment()) {
-    const string old_path = iter.GetFullPath();
+  for (; !ShouldStopCopying() && !iter.IsEnd(); iter.Increment()) {
+    const string& old_path = iter.GetFullPath();
     const string new_path = dest_path_ + iter.GetPartialPath();
-    LOG(INFO) << "copying " << old_path << " to " << new_path;
-    const struct stat stbuf = iter.GetStat();
+    const struct stat& stbuf = iter.GetStat();
     success = false;
 
     // Skip lost+found
@@ -270,7 +480,18 @@ bool FilesystemCopierAction::CopySynchronously() {
         if (stbuf.st_nlink > 1)
           hard_links[stbuf.st_ino] = new_path;
         if (S_ISREG(stbuf.st_mode)) {
-          success = CopyFileSynchronously(old_path, new_path, stbuf);
+          // The file is created here, so that hard links to it can be made
+          // right away, and its contents are copied on the pool.
+          success = CreateFileSynchronously(new_path, stbuf);
+          if (success && stbuf.st_size > 0) {
+            CopyFileJob* job = new CopyFileJob;
+            job->old_path = old_path;
+            job->new_path = new_path;
+            job->size = stbuf.st_size;
+            g_thread_pool_push(pool, job, NULL);
+            (*files_queued)++;
+            *bytes_queued += stbuf.st_size;
+          }
         } else if (S_ISLNK(stbuf.st_mode)) {
           success = CopySymlinkSynchronously(old_path, new_path, stbuf);
         } else if (S_ISFIFO(stbuf.st_mode) ||
@@ -301,7 +522,4 @@ bool FilesystemCopierAction::CopySynchronously() {
   return true;
 }
 
-const char* FilesystemCopierAction::kCompleteFilesystemMarker(
-    "/update_engine_copy_success");
-
 }  // namespace chromeos_update_engine
@@ -8,13 +8,20 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <string>
+#include <vector>
 #include <glib.h>
 #include "update_engine/action.h"
 #include "update_engine/install_plan.h"
+#include "update_engine/update_metadata.pb.h"
 
 // This action will only do real work if it's a delta update. It will
 // format the install partition as ext3/4, copy the root filesystem into it,
 // and then terminate.
+//
+// If a source device is set (see set_copy_source_device()), the action
+// instead copies just the blocks that its ext filesystem's block bitmaps
+// mark as in use straight to the install device, which is much faster than
+// copying one file at a time.
 
 // Implementation notes: This action uses a helper thread, which seems to
 // violate the design decision to only have a single thread and use
@@ -32,6 +39,8 @@
 // we still honor the Action API. That is, all interaction between the action
 // and other objects in the system (e.g. the ActionProcessor) happens on the
 // main thread. The helper thread is fully encapsulated by the action.
+// The same goes for the pool of threads the helper thread hands file
+// contents to, so that several files are copied at once.
 
 namespace chromeos_update_engine {
 
@@ -50,9 +59,12 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
  public:
   FilesystemCopierAction()
       : thread_should_exit_(0),
+        copy_failed_(0),
         is_mounted_(false),
         copy_source_("/"),
-        skipped_copy_(false) {}
+        num_copy_threads_(kDefaultCopyThreads),
+        skipped_copy_(false),
+        copied_blocks_(false) {}
   typedef ActionTraits<FilesystemCopierAction>::InputObjectType
   InputObjectType;
   typedef ActionTraits<FilesystemCopierAction>::OutputObjectType
@@ -64,30 +76,85 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
   void set_copy_source(const std::string& path) {
     copy_source_ = path;
   }
+  // The device that holds the filesystem at the copy source. If set, its
+  // used blocks are copied rather than its files, and the action fails if
+  // it doesn't hold an ext filesystem. It must not be mounted read-write
+  // while the copy is made.
+  void set_copy_source_device(const std::string& device) {
+    copy_source_device_ = device;
+  }
+  // How many files are copied at once when copying files.
+  void set_num_copy_threads(int num_copy_threads) {
+    num_copy_threads_ = num_copy_threads;
+  }
+  // A DownloadAction checkpoint at path describes a delta partially applied
+  // to the install device, so it's deleted whenever the device is recopied.
+  // Once a copy is done, a checkpoint with just the install path is saved
+  // there, and as long as that checkpoint, or one for the same payload,
+  // remains for the install device, later runs skip the copy. This keeps the
+  // install device itself untouched.
+  void set_download_checkpoint_path(const std::string& path) {
+    download_checkpoint_path_ = path;
+  }
+
   // Returns true if we detected that a copy was unneeded and thus skipped it.
   bool skipped_copy() { return skipped_copy_; }
 
+  // Returns true if the last copy was done block by block from the copy
+  // source device.
+  bool copied_blocks() { return copied_blocks_; }
+
   // Debugging/logging
   static std::string StaticType() { return "FilesystemCopierAction"; }
   std::string Type() const { return StaticType(); }
 
  private:
+  // True if the download checkpoint says that the install device already
+  // holds a copy, possibly with part of the install plan's delta applied to
+  // it.
+  bool HasCopy();
+
+  // Saves a download checkpoint recording that the install device holds a
+  // fresh copy.
+  void SaveCopyCheckpoint();
+
   // These synchronously mount or unmount the given mountpoint
   bool Mount(const std::string& device, const std::string& mountpoint);
   bool Unmount(const std::string& mountpoint);
 
+  // Copies the extents of copy_source_device_, in blocks of block_size
+  // bytes, to the same place on the install device. block_count is the size
+  // of the source filesystem. Returns true on success.
+  bool CopyBlocksSynchronously(const std::vector<Extent>& extents,
+                               uint32 block_size,
+                               uint64 block_count);
+
   // Performs a recursive file/directory copy from copy_source_ to dest_path_.
   // Doesn't return until the copy has completed. Returns true on success
   // or false on error.
   bool CopySynchronously();
 
+  // Walks copy_source_ for CopySynchronously(), creating everything in
+  // dest_path_ and pushing a CopyFileJob onto pool for each file with
+  // contents. Adds the number of files and bytes queued to *files_queued
+  // and *bytes_queued. Returns true on success.
+  bool CopyTreeSynchronously(GThreadPool* pool,
+                             int* files_queued,
+                             off_t* bytes_queued);
+
   // There are helper functions for CopySynchronously. They handle creating
   // various types of files. They return true on success.
   bool CreateDirSynchronously(const std::string& new_path,
                               const struct stat& stbuf);
+  // Creates an empty new_path. Its contents are copied by a CopyFileJob
+  // later, if it has any.
+  bool CreateFileSynchronously(const std::string& new_path,
+                               const struct stat& stbuf);
+  // Copies size bytes from old_path into new_path, which already exists.
+  // Runs on the copy thread pool.
   bool CopyFileSynchronously(const std::string& old_path,
                              const std::string& new_path,
-                             const struct stat& stbuf);
+                             off_t size);
   bool CreateHardLinkSynchronously(const std::string& old_path,
                                    const std::string& new_path);
   // Note: Here, old_path is an existing symlink that will be copied to
@@ -99,6 +166,27 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
   bool CreateNodeSynchronously(const std::string& new_path,
                                const struct stat& stbuf);
 
+  // Copies the contents of a regular file on the copy thread pool.
+  struct CopyFileJob {
+    std::string old_path;
+    std::string new_path;
+    off_t size;
+  };
+  // Runs job, which it deletes. Sets copy_failed_ if the copy fails.
+  void RunCopyFileJob(CopyFileJob* job);
+  static void RunCopyFileJobStatic(gpointer data, gpointer user_data) {
+    FilesystemCopierAction* self =
+        reinterpret_cast<FilesystemCopierAction*>(user_data);
+    self->RunCopyFileJob(reinterpret_cast<CopyFileJob*>(data));
+  }
+
+  // True if the copy should stop, because of an error or because the
+  // action was terminated.
+  bool ShouldStopCopying() {
+    return g_atomic_int_get(&thread_should_exit_) ||
+        g_atomic_int_get(&copy_failed_);
+  }
+
   // Returns NULL on success
   void* HelperThreadMain();
   static void* HelperThreadMainStatic(void* data) {
@@ -121,7 +209,10 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
 
   volatile gint thread_should_exit_;
 
-  static const char* kCompleteFilesystemMarker;
+  // Set by the copy thread pool when copying a file fails.
+  volatile gint copy_failed_;
+
+  static const int kDefaultCopyThreads = 4;
 
   // Whether or not the destination device is currently mounted.
   bool is_mounted_;
@@ -133,12 +224,23 @@ class FilesystemCopierAction : public Action<FilesystemCopierAction> {
   // change it.
   std::string copy_source_;
 
+  // See set_copy_source_device(). May be empty.
+  std::string copy_source_device_;
+
+  int num_copy_threads_;
+
   // The install plan we're passed in via the input pipe.
   InstallPlan install_plan_;
 
   // Set to true if we detected the copy was unneeded and thus we skipped it.
   bool skipped_copy_;
 
+  // Set to true if the copy was made block by block.
+  bool copied_blocks_;
+
+  // See set_download_checkpoint_path(). May be empty.
+  std::string download_checkpoint_path_;
+
   DISALLOW_COPY_AND_ASSIGN(FilesystemCopierAction);
 };
 
@@ -7,6 +7,7 @@
 #include <string>
 #include <vector>
 #include <gtest/gtest.h>
+#include "update_engine/download_checkpoint.pb.h"
 #include "update_engine/filesystem_copier_action.h"
 #include "update_engine/filesystem_iterator.h"
 #include "update_engine/omaha_hash_calculator.h"
@@ -21,7 +22,7 @@ namespace chromeos_update_engine {
 
 class FilesystemCopierActionTest : public ::testing::Test {
  protected:
-  void DoTest(bool double_copy, bool run_out_of_space);
+  void DoTest(bool double_copy, bool run_out_of_space, bool block_copy);
   string TestDir() { return "./FilesystemCopierActionTestDir"; }
   void SetUp() {
     System(string("mkdir -p ") + TestDir());
@@ -64,10 +65,11 @@ gboolean StartProcessorInRunLoop(gpointer data) {
 
 TEST_F(FilesystemCopierActionTest, RunAsRootSimpleTest) {
   ASSERT_EQ(0, getuid());
-  DoTest(false, false);
+  DoTest(false, false, false);
 }
 void FilesystemCopierActionTest::DoTest(bool double_copy,
-                                        bool run_out_of_space) {
+                                        bool run_out_of_space,
+                                        bool block_copy) {
   GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
 
   // make two populated ext images, mount them both (one in the other),
@@ -81,9 +83,12 @@ void FilesystemCopierActionTest::DoTest(bool double_copy,
   CreateExtImageAtPath(a_image, &expected_paths_vector);
   CreateExtImageAtPath(b_image, NULL);
 
-  // create 5 MiB file
+  // create 5 MiB file, or for a block copy one as big as a_image, unless
+  // it's meant to be too small.
+  const bool full_size_out = block_copy && !run_out_of_space;
   ASSERT_EQ(0, System(string("dd if=/dev/zero of=") + out_image
-                      + " seek=5242879 bs=1 count=1"));
+                      + (full_size_out ? " seek=10485759" : " seek=5242879")
+                      + " bs=1 count=1"));
 
   // mount them both
   System(("mkdir -p " + TestDir() + "/mnt").c_str());
@@ -130,6 +135,11 @@ void FilesystemCopierActionTest::DoTest(bool double_copy,
   processor.EnqueueAction(&collector_action);
 
   copier_action.set_copy_source(TestDir() + "/mnt");
+  if (block_copy)
+    copier_action.set_copy_source_device(a_image);
+  const string checkpoint_path(TestDir() + "/checkpoint");
+  copier_action.set_download_checkpoint_path(checkpoint_path);
+  copier_action2.set_download_checkpoint_path(checkpoint_path);
   feeder_action.set_obj(install_plan);
 
   g_timeout_add(0, &StartProcessorInRunLoop, &processor);
@@ -145,6 +155,7 @@ void FilesystemCopierActionTest::DoTest(bool double_copy,
   EXPECT_TRUE(delegate.ran());
   if (run_out_of_space) {
     EXPECT_FALSE(delegate.success());
+    EXPECT_FALSE(utils::FileExists(checkpoint_path.c_str()));
     EXPECT_EQ(0, unlink(out_image.c_str()));
     EXPECT_EQ(0, rmdir((TestDir() + "/mnt").c_str()));
     return;
@@ -154,7 +165,6 @@ void FilesystemCopierActionTest::DoTest(bool double_copy,
   EXPECT_EQ(0, System(string("mount -o loop ") + out_image + " " +
                       TestDir() + "/mnt"));
   // Make sure everything in the out_image is there
-  expected_paths_vector.push_back("/update_engine_copy_success");
   for (vector<string>::iterator it = expected_paths_vector.begin();
        it != expected_paths_vector.end(); ++it) {
     *it = TestDir() + "/mnt" + *it;
@@ -174,6 +184,15 @@ void FilesystemCopierActionTest::DoTest(bool double_copy,
   EXPECT_EQ(0, rmdir((TestDir() + "/mnt").c_str()));
 
   EXPECT_FALSE(copier_action.skipped_copy());
+  EXPECT_EQ(block_copy, copier_action.copied_blocks());
+  EXPECT_EQ(double_copy, copier_action2.skipped_copy());
+  // The copy is recorded outside the install device.
+  string checkpoint_data;
+  EXPECT_TRUE(utils::ReadFileToString(checkpoint_path, &checkpoint_data));
+  DownloadCheckpoint checkpoint;
+  EXPECT_TRUE(checkpoint.ParseFromString(checkpoint_data));
+  EXPECT_EQ(dev, checkpoint.install_path());
+  EXPECT_FALSE(checkpoint.has_url());
   LOG(INFO) << "collected plan:";
   collector_action.object().Dump();
   LOG(INFO) << "expected plan:";
@@ -262,14 +281,140 @@ TEST_F(FilesystemCopierActionTest, NonExistentDriveTest) {
   EXPECT_FALSE(delegate.success_);
 }
 
+TEST_F(FilesystemCopierActionTest, BadSourceDeviceTest) {
+  // The source device has no ext filesystem, so its blocks can't be copied,
+  // and the install device must be left alone rather than reformatted.
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+  ActionProcessor processor;
+  FilesystemCopierActionTestDelegate delegate;
+  delegate.set_loop(loop);
+  processor.set_delegate(&delegate);
+
+  const string source_device(TestDir() + "/source_device");
+  const string install_device(TestDir() + "/install_device");
+  const string data(4096, 'x');
+  ASSERT_TRUE(WriteFileString(source_device, string(1024 * 1024, '\0')));
+  ASSERT_TRUE(WriteFileString(install_device, data));
+
+  ObjectFeederAction<InstallPlan> feeder_action;
+  InstallPlan install_plan(false, "", "", install_device);
+  feeder_action.set_obj(install_plan);
+  FilesystemCopierAction copier_action;
+  copier_action.set_copy_source_device(source_device);
+  ObjectCollectorAction<InstallPlan> collector_action;
+
+  BondActions(&feeder_action, &copier_action);
+  BondActions(&copier_action, &collector_action);
+
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&copier_action);
+  processor.EnqueueAction(&collector_action);
+
+  g_timeout_add(0, &StartProcessorInRunLoop, &processor);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+
+  EXPECT_TRUE(delegate.ran());
+  EXPECT_FALSE(delegate.success());
+  EXPECT_FALSE(copier_action.copied_blocks());
+  string install_data;
+  EXPECT_TRUE(utils::ReadFileToString(install_device, &install_data));
+  EXPECT_EQ(data, install_data);
+}
+
+const char* const kDeltaUrl = "http://example.com/delta";
+const char* const kDeltaHash = "HASH";
+
+// Runs a FilesystemCopierAction for a delta from kDeltaUrl with the given
+// checkpoint saved in dir. The install device in dir can't be copied to, so
+// the action only succeeds if it skips the copy. Returns whether it did.
+bool CopySkipped(const string& dir, const DownloadCheckpoint& checkpoint) {
+  const string checkpoint_path(dir + "/checkpoint");
+  string data;
+  EXPECT_TRUE(checkpoint.SerializeToString(&data));
+  EXPECT_TRUE(WriteFileString(checkpoint_path, data));
+
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+  ActionProcessor processor;
+  FilesystemCopierActionTestDelegate delegate;
+  delegate.set_loop(loop);
+  processor.set_delegate(&delegate);
+
+  ObjectFeederAction<InstallPlan> feeder_action;
+  InstallPlan install_plan(false, kDeltaUrl, kDeltaHash,
+                           dir + "/install_device");
+  feeder_action.set_obj(install_plan);
+  FilesystemCopierAction copier_action;
+  copier_action.set_copy_source_device(dir + "/missing_source_device");
+  copier_action.set_download_checkpoint_path(checkpoint_path);
+  ObjectCollectorAction<InstallPlan> collector_action;
+
+  BondActions(&feeder_action, &copier_action);
+  BondActions(&copier_action, &collector_action);
+
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&copier_action);
+  processor.EnqueueAction(&collector_action);
+
+  g_timeout_add(0, &StartProcessorInRunLoop, &processor);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+
+  EXPECT_TRUE(delegate.ran());
+  EXPECT_EQ(copier_action.skipped_copy(), delegate.success());
+  // A checkpoint that isn't trusted is deleted before the copy.
+  EXPECT_EQ(copier_action.skipped_copy(),
+            utils::FileExists(checkpoint_path.c_str()));
+  return copier_action.skipped_copy();
+}
+
+TEST_F(FilesystemCopierActionTest, CheckpointTest) {
+  DownloadCheckpoint checkpoint;
+  checkpoint.set_install_path(TestDir() + "/install_device");
+
+  // The copy was finished, and nothing has been written since.
+  EXPECT_TRUE(CopySkipped(TestDir(), checkpoint));
+
+  // The same delta was partially applied.
+  checkpoint.set_url(kDeltaUrl);
+  checkpoint.set_hash(kDeltaHash);
+  checkpoint.set_bytes_received(1024);
+  EXPECT_TRUE(CopySkipped(TestDir(), checkpoint));
+
+  // A different delta was partially applied, so the install device has to
+  // be copied again before this one can start.
+  checkpoint.set_url("http://example.com/other_delta");
+  EXPECT_FALSE(CopySkipped(TestDir(), checkpoint));
+  checkpoint.set_url(kDeltaUrl);
+  checkpoint.set_hash("OTHER_HASH");
+  EXPECT_FALSE(CopySkipped(TestDir(), checkpoint));
+
+  // The checkpoint is for another install device.
+  checkpoint.clear_url();
+  checkpoint.clear_hash();
+  checkpoint.set_install_path(TestDir() + "/other_install_device");
+  EXPECT_FALSE(CopySkipped(TestDir(), checkpoint));
+}
+
 TEST_F(FilesystemCopierActionTest, RunAsRootSkipUpdateTest) {
   ASSERT_EQ(0, getuid());
-  DoTest(true, false);
+  DoTest(true, false, false);
 }
 
 TEST_F(FilesystemCopierActionTest, RunAsRootNoSpaceTest) {
   ASSERT_EQ(0, getuid());
-  DoTest(false, true);
+  DoTest(false, true, false);
+}
+
+TEST_F(FilesystemCopierActionTest, RunAsRootBlockCopyTest) {
+  ASSERT_EQ(0, getuid());
+  DoTest(false, false, true);
+}
+
+TEST_F(FilesystemCopierActionTest, RunAsRootBlockCopyNoSpaceTest) {
+  // The 10 MiB source filesystem doesn't fit on the 5 MiB install device.
+  ASSERT_EQ(0, getuid());
+  DoTest(false, true, true);
 }
 
 }  // namespace chromeos_update_engine
@@ -3,9 +3,12 @@
 // found in the LICENSE file.
 
 #include "update_engine/filesystem_iterator.h"
+#include <sys/syscall.h>
 #include <sys/types.h>
-#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
 #include <set>
 #include <string>
 #include <vector>
@@ -18,6 +21,28 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+// Big enough for a few thousand entries, so most directories are read with
+// a single getdents64 call.
+const size_t kGetdentsBufferSize = 64 * 1024;
+
+const int kOpenDirFlags = O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_LARGEFILE;
+
+// The records getdents64 fills its buffer with. glibc doesn't declare it.
+struct LinuxDirent64 {
+  uint64 d_ino;
+  int64 d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[1];  // Really d_reclen - 19 bytes, NUL terminated.
+};
+
+// A normalized "/" is "", which can't be opened.
+const char* RootPathOrSlash(const string& root_path) {
+  return root_path.empty() ? "/" : root_path.c_str();
+}
+}  // namespace {}
+
 // We use a macro here for two reasons:
 // 1. We want to be able to return from the caller's function.
 // 2. We can use the #macro_arg ism to get a string of the calling statement,
@@ -38,35 +63,26 @@ namespace chromeos_update_engine {
 FilesystemIterator::FilesystemIterator(
     const std::string& path,
     const std::set<std::string>& excl_prefixes)
-    : excl_prefixes_(excl_prefixes),
+    : depth_(0),
+      excl_prefixes_(excl_prefixes),
       is_end_(false),
-      is_err_(false) {
+      is_err_(false),
+      system_calls_(0) {
   root_path_ = utils::NormalizePath(path, true);
-  RETURN_ERROR_IF_FALSE(lstat(root_path_.c_str(), &stbuf_) == 0);
+  full_path_ = root_path_;
+  system_calls_++;
+  RETURN_ERROR_IF_FALSE(lstat(RootPathOrSlash(root_path_), &stbuf_) == 0);
   root_dev_ = stbuf_.st_dev;
 }
 
 FilesystemIterator::~FilesystemIterator() {
-  for (vector<DIR*>::iterator it = dirs_.begin(); it != dirs_.end(); ++it) {
-    LOG_IF(ERROR, closedir(*it) != 0) << "closedir failed";
+  for (vector<Directory*>::size_type i = 0; i < dirs_.size(); i++) {
+    if (i < depth_)
+      LOG_IF(ERROR, close(dirs_[i]->fd) != 0) << "close failed";
+    delete dirs_[i];
   }
 }
 
-// Returns full path for current file
-std::string FilesystemIterator::GetFullPath() const {
-  return root_path_ + GetPartialPath();
-}
-
-std::string FilesystemIterator::GetPartialPath() const {
-  std::string ret;
-  for (vector<string>::const_iterator it = names_.begin();
-       it != names_.end(); ++it) {
-    ret += "/";
-    ret += *it;
-  }
-  return ret;
-}
-
 // Increments to the next file
 void FilesystemIterator::Increment() {
   // If we're currently on a dir, descend into children, but only if
@@ -74,73 +90,96 @@ void FilesystemIterator::Increment() {
 
   bool entering_dir = false;  // true if we're entering into a new dir
   if (S_ISDIR(stbuf_.st_mode) && (stbuf_.st_dev == root_dev_)) {
-    DIR* dir = opendir(GetFullPath().c_str());
-    if ((!dir) && ((errno == ENOTDIR) || (errno == ENOENT))) {
-      // opendir failed b/c either it's not a dir or it doesn't exist.
+    int fd = -1;
+    system_calls_++;
+    if (depth_ == 0) {
+      fd = open(RootPathOrSlash(root_path_), kOpenDirFlags);
+    } else {
+      fd = openat(dirs_[depth_ - 1]->fd, basename_.c_str(), kOpenDirFlags);
+    }
+    if ((fd < 0) && ((errno == ENOTDIR) || (errno == ENOENT))) {
+      // open failed b/c either it's not a dir or it doesn't exist.
       // that's fine. let's just skip over this.
-      LOG(ERROR) << "Can't descend into " << GetFullPath();
+      LOG(ERROR) << "Can't descend into " << full_path_;
     } else {
-      RETURN_ERROR_IF_FALSE(dir);
+      RETURN_ERROR_IF_FALSE(fd >= 0);
       entering_dir = true;
-      dirs_.push_back(dir);
+      if (depth_ == dirs_.size()) {
+        dirs_.push_back(new Directory);
+        dirs_.back()->buffer.resize(kGetdentsBufferSize);
+      }
+      Directory* dir = dirs_[depth_++];
+      dir->fd = fd;
+      dir->path_length = partial_path_.size();
+      dir->offset = 0;
+      dir->end = 0;
     }
   }
 
-  if (!entering_dir && names_.empty()) {
+  if (!entering_dir && depth_ == 0) {
     // root disappeared while we tried to descend into it
     is_end_ = true;
     return;
   }
 
-  if (!entering_dir)
-    names_.pop_back();
-
   IncrementInternal();
+}
+
+bool FilesystemIterator::IsExcluded() const {
   for (set<string>::const_iterator it = excl_prefixes_.begin();
        it != excl_prefixes_.end(); ++it) {
-    if (utils::StringHasPrefix(GetPartialPath(), *it)) {
-      Increment();
-      break;
-    }
+    if (utils::StringHasPrefix(partial_path_, *it))
+      return true;
   }
-  return;
+  return false;
 }
 
-// Assumes that we need to find the next child of dirs_.back(), or if
+// Assumes that we need to find the next child of dirs_[depth_ - 1], or if
 // there are none more, go up the chain
 void FilesystemIterator::IncrementInternal() {
-  CHECK_EQ(dirs_.size(), names_.size() + 1);
+  CHECK_GT(depth_, 0);
   for (;;) {
-    struct dirent dir_entry;
-    struct dirent* dir_entry_pointer;
-    int r;
-    RETURN_ERROR_IF_FALSE(
-        (r = readdir_r(dirs_.back(), &dir_entry, &dir_entry_pointer)) == 0);
-    if (dir_entry_pointer) {
-      // Found an entry
-      names_.push_back(dir_entry_pointer->d_name);
-      // Validate
-      RETURN_ERROR_IF_FALSE(lstat(GetFullPath().c_str(), &stbuf_) == 0);
-      if (strcmp(dir_entry_pointer->d_name, ".") &&
-          strcmp(dir_entry_pointer->d_name, "..")) {
-        // Done
-        return;
-      }
-      // Child didn't work out. Try again
-      names_.pop_back();
-    } else {
-      // No more children in this dir. Pop it and try again
-      RETURN_ERROR_IF_FALSE(closedir(dirs_.back()) == 0);
-      dirs_.pop_back();
-      if (dirs_.empty()) {
-        CHECK(names_.empty());
-        // Done with the entire iteration
-        is_end_ = true;
-        return;
+    Directory* dir = dirs_[depth_ - 1];
+    if (dir->offset == dir->end) {
+      system_calls_++;
+      long r = syscall(SYS_getdents64, dir->fd, &dir->buffer[0],
+                       dir->buffer.size());
+      RETURN_ERROR_IF_FALSE(r >= 0);
+      if (r == 0) {
+        // No more children in this dir. Pop it and try again
+        depth_--;
+        system_calls_++;
+        RETURN_ERROR_IF_FALSE(close(dir->fd) == 0);
+        if (depth_ == 0) {
+          // Done with the entire iteration
+          is_end_ = true;
+          return;
+        }
+        continue;
       }
-      CHECK(!names_.empty());
-      names_.pop_back();
+      dir->offset = 0;
+      dir->end = r;
     }
+    const LinuxDirent64* entry =
+        reinterpret_cast<const LinuxDirent64*>(&dir->buffer[dir->offset]);
+    dir->offset += entry->d_reclen;
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+      continue;
+    // Found an entry
+    partial_path_.resize(dir->path_length);
+    partial_path_ += '/';
+    partial_path_ += entry->d_name;
+    // Excluded entries, and thus everything under them, are skipped without
+    // being looked at.
+    if (IsExcluded())
+      continue;
+    basename_ = entry->d_name;
+    full_path_.resize(root_path_.size());
+    full_path_ += partial_path_;
+    system_calls_++;
+    RETURN_ERROR_IF_FALSE(fstatat(dir->fd, entry->d_name, &stbuf_,
+                                  AT_SYMLINK_NOFOLLOW) == 0);
+    return;
   }
 }
 
@@ -24,13 +24,18 @@
 // 3. If you don't want that, you can just check Stat().st_dev and skip
 //    foreign filesystems manually.
 
+// Implementation notes: Each directory on the way down to the current file
+// is held open, and its entries are read with getdents64 in large batches.
+// Entries are stat()ed with fstatat() relative to their directory, so the
+// kernel doesn't resolve the whole path again for every file, and the
+// paths handed out are kept up to date in place rather than rebuilt.
+
 #include <sys/stat.h>
 #include <sys/types.h>
-#include <dirent.h>
-#include <unistd.h>
 #include <string>
 #include <set>
 #include <vector>
+#include "base/basictypes.h"
 
 namespace chromeos_update_engine {
 
@@ -42,12 +47,14 @@ class FilesystemIterator {
   ~FilesystemIterator();
 
   // Returns stat struct for the current file.
-  struct stat GetStat() const {
+  const struct stat& GetStat() const {
     return stbuf_;
   }
 
   // Returns full path for current file.
-  std::string GetFullPath() const;
+  const std::string& GetFullPath() const {
+    return full_path_;
+  }
 
   // Returns the path that's part of the iterator. For example, if
   // the object were constructed by passing in "/foo/bar" and Path()
@@ -55,11 +62,13 @@ class FilesystemIterator {
   // "/baz/bat.txt". When this object is on root (ie, the very first
   // path), IterPath will return "", otherwise the first character of
   // IterPath will be "/".
-  std::string GetPartialPath() const;
+  const std::string& GetPartialPath() const {
+    return partial_path_;
+  }
 
-  // Returns name for current file.
-  std::string GetBasename() const {
-    return names_.back();
+  // Returns name for current file. This is "" on the root.
+  const std::string& GetBasename() const {
+    return basename_;
   }
 
   // Increments to the next file.
@@ -75,31 +84,47 @@ class FilesystemIterator {
   bool IsErr() const {
     return is_err_;
   }
+
+  // The number of system calls made so far. For benchmarking.
+  uint64 system_calls() const {
+    return system_calls_;
+  }
+
  private:
+  // An open directory, and the entries read from it that haven't been
+  // visited yet.
+  struct Directory {
+    int fd;
+    // The length of partial_path_ when on this directory.
+    std::string::size_type path_length;
+    // Entries returned by getdents64. [offset, end) haven't been visited.
+    std::vector<char> buffer;
+    size_t offset;
+    size_t end;
+  };
+
   // Helper for Increment.
   void IncrementInternal();
 
-  // Returns true if path exists and it's a directory.
-  bool DirectoryExists(const std::string& path);
-
-  // In general (i.e., not midway through a call to Increment()), there is a
-  // relationship between dirs_ and names_: dirs[i] == names_[i - 1].
-  // For example, say we are asked to iterate "/usr/local" and we're currently
-  // at /usr/local/share/dict/words. dirs_ contains DIR* variables for the
-  // dirs at: {"/usr/local", ".../share", ".../dict"} and names_ contains:
-  // {"share", "dict", "words"}. root_path_ contains "/usr/local".
-  // root_dev_ would be the dev for root_path_
+  // Returns true if partial_path_ starts with one of excl_prefixes_.
+  bool IsExcluded() const;
+
+  // There is a relationship between dirs_ and the current path: the first
+  // depth_ entries of dirs_ are the open directories that contain the
+  // current file, in root-to-leaf order. For example, say we are asked to
+  // iterate "/usr/local" and we're currently at
+  // /usr/local/share/dict/words. dirs_ holds directories for
+  // {"/usr/local", ".../share", ".../dict"}, partial_path_ is
+  // "/share/dict/words" and basename_ is "words". root_path_ contains
+  // "/usr/local". root_dev_ would be the dev for root_path_
   // (and /usr/local/share/dict/words). stbuf_ would be the stbuf for
   // /usr/local/share/dict/words.
-
-  // All opened directories. If this is empty, we're currently on the root,
-  // but not descended into the root.
-  // This will always contain the current directory and all it's ancestors
-  // in root-to-leaf order. For more details, see comment above.
-  std::vector<DIR*> dirs_;
-
-  // The list of all filenames for the current path that we've descended into.
-  std::vector<std::string> names_;
+  //
+  // If depth_ is 0, we're currently on the root, but not descended into
+  // the root. Directories past depth_ are kept so their buffers can be
+  // reused.
+  std::vector<Directory*> dirs_;
+  std::vector<Directory*>::size_type depth_;
 
   // The device of the root path we've been asked to iterate.
   dev_t root_dev_;
@@ -107,6 +132,11 @@ class FilesystemIterator {
   // The root path we've been asked to iteratate.
   std::string root_path_;
 
+  // See GetFullPath(), GetPartialPath() and GetBasename().
+  std::string full_path_;
+  std::string partial_path_;
+  std::string basename_;
+
   // Exclude items w/ this prefix.
   std::set<std::string> excl_prefixes_;
 
@@ -119,6 +149,10 @@ class FilesystemIterator {
 
   // Generally false; set to true if an error occurrs.
   bool is_err_;
+
+  uint64 system_calls_;
+
+  DISALLOW_COPY_AND_ASSIGN(FilesystemIterator);
 };
 
 }  // namespace chromeos_update_engine
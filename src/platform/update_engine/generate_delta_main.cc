@@ -15,9 +15,10 @@
 #include "update_engine/update_metadata.pb.h"
 #include "update_engine/utils.h"
 
-// This file contains a simple program that takes an old path, a new path,
-// and an output file as arguments and the path to an output file and
-// generates a delta that can be sent to Chrome OS clients.
+// This file contains a simple program that takes the mount points of the old
+// and new root filesystems, the new root filesystem image and the path to an
+// output file as arguments, and generates a delta that can be sent to
+// Chrome OS clients.
 
 using std::set;
 using std::string;
@@ -27,7 +28,7 @@ namespace chromeos_update_engine {
 namespace {
 
 void usage(const char* argv0) {
-  printf("usage: %s old_dir new_dir out_file\n", argv0);
+  printf("usage: %s old_dir new_dir new_image out_file\n", argv0);
   exit(1);
 }
 
@@ -40,7 +41,7 @@ bool IsDir(const char* path) {
 int Main(int argc, char** argv) {
   g_thread_init(NULL);
   Subprocess::Init();
-  if (argc != 4) {
+  if (argc != 5) {
     usage(argv[0]);
   }
   logging::InitLogging("",
@@ -49,12 +50,18 @@ int Main(int argc, char** argv) {
                        logging::APPEND_TO_OLD_LOG_FILE);
   const char* old_dir = argv[1];
   const char* new_dir = argv[2];
+  const char* new_image = argv[3];
+  const char* out_file = argv[4];
   if ((!IsDir(old_dir)) || (!IsDir(new_dir))) {
     usage(argv[0]);
   }
-  
-  // TODO(adlr): generate delta file
-
+  if (!DeltaDiffGenerator::GenerateDeltaUpdateFile(old_dir,
+                                                   new_dir,
+                                                   new_image,
+                                                   out_file)) {
+    LOG(ERROR) << "Failed to generate delta " << out_file;
+    return 1;
+  }
   return 0;
 }
 
@@ -9,6 +9,8 @@ using std::vector;
 
 namespace chromeos_update_engine {
 
+const Vertex::Index Vertex::kInvalidIndex;
+
 namespace graph_utils {
 
 uint64 EdgeWeight(const Graph& graph, const Edge& edge) {
@@ -36,6 +38,35 @@ void AppendBlockToExtents(vector<Extent>* extents, uint64 block) {
   extents->push_back(new_extent);
 }
 
+bool TopologicalSort(const Graph& graph, vector<Vertex::Index>* out) {
+  out->clear();
+  vector<uint64> in_degree(graph.size(), 0);
+  for (Graph::const_iterator it = graph.begin(); it != graph.end(); ++it) {
+    for (Vertex::EdgeMap::const_iterator edge_it = it->out_edges.begin();
+         edge_it != it->out_edges.end(); ++edge_it) {
+      in_degree[edge_it->first]++;
+    }
+  }
+  // Vertices whose predecessors have all been output. It's used as a stack
+  // and filled in reverse, so that unconstrained vertices keep their order.
+  vector<Vertex::Index> ready;
+  for (Vertex::Index i = graph.size(); i > 0; i--) {
+    if (in_degree[i - 1] == 0)
+      ready.push_back(i - 1);
+  }
+  while (!ready.empty()) {
+    Vertex::Index vertex = ready.back();
+    ready.pop_back();
+    out->push_back(vertex);
+    for (Vertex::EdgeMap::const_iterator it = graph[vertex].out_edges.begin();
+         it != graph[vertex].out_edges.end(); ++it) {
+      if (--in_degree[it->first] == 0)
+        ready.push_back(it->first);
+    }
+  }
+  return out->size() == graph.size();
+}
+
 }  // namespace graph_utils
 
 }  // namespace chromeos_update_engine
@@ -24,6 +24,10 @@ uint64 EdgeWeight(const Graph& graph, const Edge& edge);
 // into an arbitrary place in the extents.
 void AppendBlockToExtents(std::vector<Extent>* extents, uint64 block);
 
+// Puts all the vertices of graph into *out such that for every edge
+// (a, b), a comes before b. Returns false if graph has a cycle.
+bool TopologicalSort(const Graph& graph, std::vector<Vertex::Index>* out);
+
 }  // namespace graph_utils
 
 }  // namespace chromeos_update_engine
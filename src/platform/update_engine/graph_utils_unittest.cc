@@ -38,4 +38,23 @@ TEST(GraphUtilsTest, SimpleTest) {
   EXPECT_EQ(4, graph_utils::EdgeWeight(graph, make_pair(0, 1)));
 }
 
+TEST(GraphUtilsTest, TopologicalSortTest) {
+  Graph graph(4);
+  graph[2].out_edges.insert(make_pair(0, EdgeProperties()));
+  graph[0].out_edges.insert(make_pair(3, EdgeProperties()));
+  graph[1].out_edges.insert(make_pair(3, EdgeProperties()));
+
+  vector<Vertex::Index> order;
+  EXPECT_TRUE(graph_utils::TopologicalSort(graph, &order));
+  ASSERT_EQ(4, order.size());
+  EXPECT_EQ(1, order[0]);
+  EXPECT_EQ(2, order[1]);
+  EXPECT_EQ(0, order[2]);
+  EXPECT_EQ(3, order[3]);
+
+  // Add a cycle: 3 -> 2 -> 0 -> 3
+  graph[3].out_edges.insert(make_pair(2, EdgeProperties()));
+  EXPECT_FALSE(graph_utils::TopologicalSort(graph, &order));
+}
+
 }  // namespace chromeos_update_engine
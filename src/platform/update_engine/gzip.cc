@@ -10,11 +10,20 @@
 #include "update_engine/utils.h"
 
 using std::max;
+using std::min;
 using std::string;
 using std::vector;
 
 namespace chromeos_update_engine {
 
+namespace {
+// The smallest gzip stream: a 10 byte header, an empty deflate block and an
+// 8 byte trailer.
+const size_t kGzipMinSize = 20;
+// Deflate can't compress better than about 1032:1.
+const size_t kMaxDeflateRatio = 1032;
+}  // namespace {}
+
 bool GzipDecompressData(const char* const in, const size_t in_size,
                         char** out, size_t* out_size) {
   if (in_size == 0) {
@@ -29,8 +38,19 @@ bool GzipDecompressData(const char* const in, const size_t in_size,
   memset(&stream, 0, sizeof(stream));
   TEST_AND_RETURN_FALSE(inflateInit2(&stream, 16 + MAX_WBITS) == Z_OK);
 
-  // guess that output will be roughly double the input size
+  // The gzip trailer holds the uncompressed size mod 2^32, so usually the
+  // output buffer can be allocated once. It's only a hint, since the input
+  // may be corrupt or have several members, so cap it at deflate's best
+  // possible ratio and keep growing the buffer if it turns out too small.
   *out_size = in_size * 2;
+  if (in_size >= kGzipMinSize) {
+    const unsigned char* trailer =
+        reinterpret_cast<const unsigned char*>(in + in_size - 4);
+    const size_t isize = trailer[0] | (trailer[1] << 8) |
+        (trailer[2] << 16) | (static_cast<uint32>(trailer[3]) << 24);
+    *out_size = max(static_cast<size_t>(1),
+                    min(isize, in_size * kMaxDeflateRatio));
+  }
   *out = reinterpret_cast<char*>(malloc(*out_size));
   TEST_AND_RETURN_FALSE(*out);
 
@@ -49,6 +69,13 @@ bool GzipDecompressData(const char* const in, const size_t in_size,
       }
       case Z_OK:  // fall through
       case Z_BUF_ERROR: {
+        if (stream.avail_out > 0) {
+          // inflate() wants more input than there is.
+          LOG(INFO) << "Truncated gzip stream";
+          inflateEnd(&stream);
+          free(*out);
+          return false;
+        }
         // allocate more space
         ptrdiff_t out_length =
             reinterpret_cast<char*>(stream.next_out) - (*out);
@@ -92,8 +119,9 @@ bool GzipCompressData(const char* const in, const size_t in_size,
                                       9,  // most memory used/best compression
                                       Z_DEFAULT_STRATEGY) == Z_OK);
 
-  // guess that output will be roughly half the input size
-  *out_size = max(1U, in_size / 2);
+  // deflateBound() is an upper bound on the compressed size, so the whole
+  // stream is written in one call without reallocating.
+  *out_size = deflateBound(&stream, in_size);
   *out = reinterpret_cast<char*>(malloc(*out_size));
   TEST_AND_RETURN_FALSE(*out);
 
@@ -102,38 +130,22 @@ bool GzipCompressData(const char* const in, const size_t in_size,
   stream.avail_in = in_size;
   stream.next_out = reinterpret_cast<Bytef*>(*out);
   stream.avail_out = *out_size;
-  for (;;) {
-    int rc = deflate(&stream, Z_FINISH);
-    switch (rc) {
-      case Z_STREAM_END: {
-        *out_size = reinterpret_cast<char*>(stream.next_out) - (*out);
-        TEST_AND_RETURN_FALSE(deflateEnd(&stream) == Z_OK);
-        return true;
-      }
-      case Z_OK:  // fall through
-      case Z_BUF_ERROR: {
-        // allocate more space
-        ptrdiff_t out_length =
-            reinterpret_cast<char*>(stream.next_out) - (*out);
-        *out_size *= 2;
-        char* new_out = reinterpret_cast<char*>(realloc(*out, *out_size));
-        if (!new_out) {
-          free(*out);
-          return false;
-        }
-        *out = new_out;
-        stream.next_out = reinterpret_cast<Bytef*>((*out) + out_length);
-        stream.avail_out = (*out_size) - out_length;
-        break;
-      }
-      default:
-        LOG(INFO) << "Unknown defalate() return value: " << rc;
-        if (stream.msg)
-          LOG(INFO) << " message: " << stream.msg;
-        free(*out);
-        return false;
-    }
+  int rc = deflate(&stream, Z_FINISH);
+  if (rc != Z_STREAM_END) {
+    LOG(INFO) << "Unexpected deflate() return value: " << rc;
+    if (stream.msg)
+      LOG(INFO) << " message: " << stream.msg;
+    deflateEnd(&stream);
+    free(*out);
+    return false;
   }
+  *out_size = reinterpret_cast<char*>(stream.next_out) - (*out);
+  TEST_AND_RETURN_FALSE(deflateEnd(&stream) == Z_OK);
+  // Give back what the bound overestimated.
+  char* new_out = reinterpret_cast<char*>(realloc(*out, *out_size));
+  if (new_out)
+    *out = new_out;
+  return true;
 }
 
 bool GzipDecompress(const std::vector<char>& in, std::vector<char>* out) {
@@ -5,6 +5,7 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_HTTP_FETCHER_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_HTTP_FETCHER_H__
 
+#include <sys/types.h>
 #include <string>
 #include <vector>
 #include <glib.h>
@@ -23,7 +24,11 @@ class HttpFetcherDelegate;
 
 class HttpFetcher {
  public:
-  HttpFetcher() : post_data_set_(false), delegate_(NULL) {}
+  HttpFetcher()
+      : post_data_set_(false),
+        offset_(0),
+        http_response_code_(0),
+        delegate_(NULL) {}
   virtual ~HttpFetcher() {}
   void set_delegate(HttpFetcherDelegate* delegate) {
     delegate_ = delegate;
@@ -41,6 +46,36 @@ class HttpFetcher {
     post_data_.insert(post_data_.end(), char_data, char_data + size);
   }
 
+  // Optional: Start the transfer offset bytes into the resource, e.g. to
+  // resume a transfer that was interrupted earlier. Must be called before
+  // BeginTransfer(). The delegate only receives the bytes from offset on.
+  void SetOffset(off_t offset) {
+    offset_ = offset;
+  }
+
+  // Optional: Ask the server not to send the resource if it still has the
+  // given entity tag, as from etag(), but to reply 304 Not Modified with no
+  // body (412 Precondition Failed if it follows RFC 7232 and the request is
+  // a POST). Must be called before BeginTransfer().
+  void SetIfNoneMatch(const std::string& etag) {
+    if_none_match_ = etag;
+  }
+
+  // Optional: The hash of the resource, as from OmahaHashCalculator, if it's
+  // known ahead of time. Fetchers that cache resources use it to find them.
+  // Must be called before BeginTransfer().
+  void SetContentHash(const std::string& hash) {
+    content_hash_ = hash;
+  }
+
+  // Once the transfer is complete, the HTTP status code of the response, or
+  // 0 if it isn't known.
+  int http_response_code() const { return http_response_code_; }
+
+  // Once the transfer is complete, the response's ETag header, or empty
+  // string if it had none.
+  const std::string& etag() const { return etag_; }
+
   // Begins the transfer to the specified URL.
   virtual void BeginTransfer(const std::string& url) = 0;
 
@@ -66,6 +101,19 @@ class HttpFetcher {
   bool post_data_set_;
   std::vector<char> post_data_;
 
+  // Where in the resource the transfer begins; see SetOffset().
+  off_t offset_;
+
+  // See SetIfNoneMatch(); empty if not set.
+  std::string if_none_match_;
+
+  // See SetContentHash(); empty if not set.
+  std::string content_hash_;
+
+  // What's known about the response; see http_response_code() and etag().
+  int http_response_code_;
+  std::string etag_;
+
   // The delegate; may be NULL.
   HttpFetcherDelegate* delegate_;
  private:
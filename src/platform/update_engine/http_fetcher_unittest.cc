@@ -2,15 +2,22 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <sys/time.h>
 #include <unistd.h>
 #include <string>
 #include <vector>
 #include <base/scoped_ptr.h>
 #include <glib.h>
 #include <gtest/gtest.h>
+#include "base/string_util.h"
 #include "chromeos/obsolete_logging.h"
+#include "update_engine/caching_http_fetcher.h"
 #include "update_engine/libcurl_http_fetcher.h"
 #include "update_engine/mock_http_fetcher.h"
+#include "update_engine/multi_range_http_fetcher.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
 
 using std::string;
 using std::vector;
@@ -122,7 +129,30 @@ class HttpFetcherTest<LibcurlHttpFetcher> : public ::testing::Test {
   typedef PythonHttpServer HttpServer;
 };
 
-typedef ::testing::Types<LibcurlHttpFetcher, MockHttpFetcher>
+template <>
+class HttpFetcherTest<MultiRangeHttpFetcher> : public ::testing::Test {
+ public:
+  HttpFetcher* NewLargeFetcher() {
+    // Small ranges and buffer so that /big is fetched in many pieces.
+    MultiRangeHttpFetcher *ret = new MultiRangeHttpFetcher(4, 4096, 16384);
+    ret->set_idle_ms(1);  // speeds up test execution
+    return ret;
+  }
+  HttpFetcher* NewSmallFetcher() {
+    return NewLargeFetcher();
+  }
+  string BigUrl() const {
+    return LocalServerUrlForPath("/big");
+  }
+  string SmallUrl() const {
+    return LocalServerUrlForPath("/foo");
+  }
+  bool IsMock() const { return false; }
+  typedef PythonHttpServer HttpServer;
+};
+
+typedef ::testing::Types<LibcurlHttpFetcher, MockHttpFetcher,
+                         MultiRangeHttpFetcher>
     HttpFetcherTestTypes;
 TYPED_TEST_CASE(HttpFetcherTest, HttpFetcherTestTypes);
 
@@ -337,4 +367,207 @@ TYPED_TEST(HttpFetcherTest, FlakyTest) {
   g_main_loop_unref(loop);
 }
 
+namespace {
+class CollectingHttpFetcherTestDelegate : public HttpFetcherDelegate {
+ public:
+  CollectingHttpFetcherTestDelegate() : successful_(false) {}
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes, int length) {
+    data_.append(bytes, length);
+  }
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful) {
+    successful_ = successful;
+    g_main_loop_quit(loop_);
+  }
+  string data_;
+  bool successful_;
+  GMainLoop* loop_;
+};
+
+// Fetches url with fetcher and returns how long it took, in seconds.
+double FetchUrl(HttpFetcher* fetcher, const string& url,
+                CollectingHttpFetcherTestDelegate* delegate) {
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+  delegate->loop_ = loop;
+  fetcher->set_delegate(delegate);
+  StartTransferArgs start_xfer_args = {fetcher, url};
+  struct timeval start, end;
+  gettimeofday(&start, NULL);
+  g_timeout_add(0, StartTransfer, &start_xfer_args);
+  g_main_loop_run(loop);
+  gettimeofday(&end, NULL);
+  g_main_loop_unref(loop);
+  return (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+}
+
+// Checks that data is bytes [offset, offset + data.size()) of what the test
+// server sends for /big.
+void ExpectBigData(const string& data, off_t offset) {
+  for (string::size_type i = 0; i < data.size(); i++) {
+    // Assert so that we don't flood the screen w/ EXPECT errors on failure.
+    ASSERT_EQ('a' + ((offset + i) % 10), data[i]) << "at " << (offset + i);
+  }
+}
+}  // namespace {}
+
+TEST(MultiRangeHttpFetcherTest, InOrderTest) {
+  PythonHttpServer server;
+  ASSERT_TRUE(server.started_);
+  // Many more connections than the buffer can keep busy, so that ranges
+  // arrive out of order and have to wait.
+  const size_t kMaxBufferedBytes = 3000;
+  MultiRangeHttpFetcher fetcher(8, 1000, kMaxBufferedBytes);
+  fetcher.set_idle_ms(1);
+  CollectingHttpFetcherTestDelegate delegate;
+  FetchUrl(&fetcher, LocalServerUrlForPath("/big"), &delegate);
+  EXPECT_TRUE(delegate.successful_);
+  ASSERT_EQ(100000, delegate.data_.size());
+  ExpectBigData(delegate.data_, 0);
+  EXPECT_LE(fetcher.peak_buffered_bytes(), kMaxBufferedBytes);
+}
+
+TEST(MultiRangeHttpFetcherTest, OffsetTest) {
+  PythonHttpServer server;
+  ASSERT_TRUE(server.started_);
+  MultiRangeHttpFetcher fetcher(3, 7000, 20000);
+  fetcher.set_idle_ms(1);
+  fetcher.SetOffset(12345);
+  CollectingHttpFetcherTestDelegate delegate;
+  FetchUrl(&fetcher, LocalServerUrlForPath("/big"), &delegate);
+  EXPECT_TRUE(delegate.successful_);
+  ASSERT_EQ(100000 - 12345, delegate.data_.size());
+  ExpectBigData(delegate.data_, 12345);
+}
+
+TEST(MultiRangeHttpFetcherTest, ThroughputTest) {
+  PythonHttpServer server;
+  ASSERT_TRUE(server.started_);
+  const off_t kSize = 20 * 1024 * 1024;
+  const string url = LocalServerUrlForPath("/big/" + StringPrintf("%lld",
+      static_cast<long long>(kSize)));
+
+  LibcurlHttpFetcher single_fetcher;
+  single_fetcher.set_idle_ms(1);
+  CollectingHttpFetcherTestDelegate single_delegate;
+  double single_seconds = FetchUrl(&single_fetcher, url, &single_delegate);
+  EXPECT_TRUE(single_delegate.successful_);
+  EXPECT_EQ(kSize, single_delegate.data_.size());
+
+  MultiRangeHttpFetcher multi_fetcher(4, 1024 * 1024, 4 * 1024 * 1024);
+  multi_fetcher.set_idle_ms(1);
+  CollectingHttpFetcherTestDelegate multi_delegate;
+  double multi_seconds = FetchUrl(&multi_fetcher, url, &multi_delegate);
+  EXPECT_TRUE(multi_delegate.successful_);
+  ASSERT_EQ(kSize, multi_delegate.data_.size());
+  EXPECT_TRUE(single_delegate.data_ == multi_delegate.data_);
+
+  LOG(INFO) << "Fetched " << kSize << " bytes in " << single_seconds
+            << " s with one connection and in " << multi_seconds
+            << " s with four.";
+}
+
+TEST(LibcurlHttpFetcherTest, WakeupsTest) {
+  PythonHttpServer server;
+  ASSERT_TRUE(server.started_);
+  const off_t kSize = 8 * 1024 * 1024;
+  const string url = LocalServerUrlForPath("/big/" + StringPrintf("%lld",
+      static_cast<long long>(kSize)));
+
+  LibcurlHttpFetcher polling_fetcher;
+  polling_fetcher.set_use_socket_callbacks(false);
+  CollectingHttpFetcherTestDelegate polling_delegate;
+  double polling_seconds = FetchUrl(&polling_fetcher, url, &polling_delegate);
+  EXPECT_TRUE(polling_delegate.successful_);
+  EXPECT_EQ(kSize, polling_delegate.data_.size());
+
+  LibcurlHttpFetcher fetcher;
+  CollectingHttpFetcherTestDelegate delegate;
+  double seconds = FetchUrl(&fetcher, url, &delegate);
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_EQ(kSize, delegate.data_.size());
+
+  LOG(INFO) << "Polling: " << polling_fetcher.wakeups() << " wakeups in "
+            << polling_seconds << " s. Socket callbacks: "
+            << fetcher.wakeups() << " wakeups in " << seconds << " s.";
+  EXPECT_GT(fetcher.wakeups(), 0);
+  EXPECT_LE(fetcher.wakeups(), polling_fetcher.wakeups());
+}
+
+TEST(LibcurlHttpFetcherTest, EtagTest) {
+  PythonHttpServer server;
+  ASSERT_TRUE(server.started_);
+  const string url = LocalServerUrlForPath("/etag");
+
+  LibcurlHttpFetcher fetcher;
+  CollectingHttpFetcherTestDelegate delegate;
+  FetchUrl(&fetcher, url, &delegate);
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_EQ("etag data", delegate.data_);
+  EXPECT_EQ(200, fetcher.http_response_code());
+  EXPECT_EQ("\"update-engine-test\"", fetcher.etag());
+
+  // Asking for the same thing again gets nothing.
+  LibcurlHttpFetcher conditional_fetcher;
+  conditional_fetcher.SetIfNoneMatch(fetcher.etag());
+  CollectingHttpFetcherTestDelegate conditional_delegate;
+  FetchUrl(&conditional_fetcher, url, &conditional_delegate);
+  EXPECT_TRUE(conditional_delegate.successful_);
+  EXPECT_EQ("", conditional_delegate.data_);
+  EXPECT_EQ(304, conditional_fetcher.http_response_code());
+  EXPECT_EQ(fetcher.etag(), conditional_fetcher.etag());
+}
+
+TEST(CachingHttpFetcherTest, PeerTest) {
+  PythonHttpServer server;
+  ASSERT_TRUE(server.started_);
+  const char* const kServerCacheDir = "test_http_server_cache";
+  const char* const kPeerCacheDir = "caching_http_fetcher-peer";
+  ASSERT_EQ(0, System(string("rm -rf ") + kServerCacheDir + " " +
+                      kPeerCacheDir));
+  string big_data;
+  while (big_data.size() < 100000)
+    big_data.append("abcdefghij");
+  const string hash = OmahaHashCalculator::OmahaHashOfString(big_data);
+
+  // One machine downloads the payload into the cache that the server
+  // shares...
+  CachingHttpFetcher fetcher(kServerCacheDir, new LibcurlHttpFetcher);
+  fetcher.SetContentHash(hash);
+  CollectingHttpFetcherTestDelegate delegate;
+  FetchUrl(&fetcher, LocalServerUrlForPath("/big"), &delegate);
+  EXPECT_TRUE(delegate.successful_);
+  EXPECT_FALSE(fetcher.cache_hit());
+
+  // ...and another gets it from there instead, all of it or part of it.
+  const string peer_url =
+      LocalServerUrlForPath("/cache/" + CachingHttpFetcher::EntryName(hash));
+  CachingHttpFetcher peer_fetcher(kPeerCacheDir, new LibcurlHttpFetcher);
+  peer_fetcher.SetContentHash(hash);
+  CollectingHttpFetcherTestDelegate peer_delegate;
+  FetchUrl(&peer_fetcher, peer_url, &peer_delegate);
+  EXPECT_TRUE(peer_delegate.successful_);
+  EXPECT_FALSE(peer_fetcher.cache_hit());
+  EXPECT_TRUE(peer_delegate.data_ == big_data);
+  EXPECT_TRUE(utils::FileExists((string(kPeerCacheDir) + "/" +
+                                 CachingHttpFetcher::EntryName(hash)).c_str()));
+
+  LibcurlHttpFetcher range_fetcher;
+  range_fetcher.SetOffset(12345);
+  CollectingHttpFetcherTestDelegate range_delegate;
+  FetchUrl(&range_fetcher, peer_url, &range_delegate);
+  EXPECT_TRUE(range_delegate.successful_);
+  EXPECT_TRUE(range_delegate.data_ == big_data.substr(12345));
+
+  // Asking for something that isn't there gets nothing.
+  LibcurlHttpFetcher missing_fetcher;
+  CollectingHttpFetcherTestDelegate missing_delegate;
+  FetchUrl(&missing_fetcher, LocalServerUrlForPath("/cache/missing"),
+           &missing_delegate);
+  EXPECT_EQ(404, missing_fetcher.http_response_code());
+  EXPECT_EQ("", missing_delegate.data_);
+
+  EXPECT_EQ(0, System(string("rm -rf ") + kServerCacheDir + " " +
+                      kPeerCacheDir));
+}
+
 }  // namespace chromeos_update_engine
@@ -5,7 +5,9 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_INSTALL_PLAN_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_INSTALL_PLAN_H__
 
+#include <algorithm>
 #include <string>
+#include "base/basictypes.h"
 #include "chromeos/obsolete_logging.h"
 
 // InstallPlan is a simple struct that contains relevant info for many
@@ -21,31 +23,55 @@ struct InstallPlan {
       : is_full_update(is_full),
         download_url(url),
         download_hash(hash),
-        install_path(install_path) {}
-  InstallPlan() : is_full_update(false) {}
+        install_path(install_path),
+        install_size(0) {}
+  InstallPlan() : is_full_update(false), install_size(0) {}
 
   bool is_full_update;
   std::string download_url;  // url to download from
   std::string download_hash;  // hash of the data at the url
   std::string install_path;  // path to install device
+  // If install_hash isn't empty, the hash that the first install_size bytes
+  // of the install device must have once the update has been applied.
+  uint64 install_size;
+  std::string install_hash;
 
   bool operator==(const InstallPlan& that) const {
     return (is_full_update == that.is_full_update) &&
            (download_url == that.download_url) &&
            (download_hash == that.download_hash) &&
-           (install_path == that.install_path);
+           (install_path == that.install_path) &&
+           (install_size == that.install_size) &&
+           (install_hash == that.install_hash);
   }
   bool operator!=(const InstallPlan& that) const {
     return !((*this) == that);
   }
+  // Exchanges the contents of the two plans without copying any of them,
+  // so that plans can be moved between Actions: see ActionPipe. Like
+  // operator==, this needs to know about every member.
+  void Swap(InstallPlan* that) {
+    std::swap(is_full_update, that->is_full_update);
+    download_url.swap(that->download_url);
+    download_hash.swap(that->download_hash);
+    install_path.swap(that->install_path);
+    std::swap(install_size, that->install_size);
+    install_hash.swap(that->install_hash);
+  }
   void Dump() const {
     LOG(INFO) << "InstallPlan: "
               << (is_full_update ? "full_update" : "delta_update")
               << ", url: " << download_url << ", hash: " << download_hash
-              << ", install_path: " << install_path;
+              << ", install_path: " << install_path
+              << ", install_size: " << install_size
+              << ", install_hash: " << install_hash;
   }
 };
 
+inline void swap(InstallPlan& a, InstallPlan& b) {
+  a.Swap(&b);
+}
+
 }  // namespace chromeos_update_engine
 
 #endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_INSTALL_PLAN_H__
@@ -3,15 +3,14 @@
 // found in the LICENSE file.
 
 #include "update_engine/libcurl_http_fetcher.h"
-#include <algorithm>
+#include <strings.h>
 #include "chromeos/obsolete_logging.h"
 
-using std::max;
-using std::make_pair;
-
 // This is a concrete implementation of HttpFetcher that uses libcurl to do the
 // http work.
 
+using std::string;
+
 namespace chromeos_update_engine {
 
 LibcurlHttpFetcher::~LibcurlHttpFetcher() {
@@ -37,6 +36,14 @@ void LibcurlHttpFetcher::ResumeTransfer(const std::string& url) {
              CURLE_OK);
   }
 
+  if (!if_none_match_.empty()) {
+    headers_ = curl_slist_append(
+        NULL, ("If-None-Match: " + if_none_match_).c_str());
+    CHECK(headers_);
+    CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_HTTPHEADER, headers_),
+             CURLE_OK);
+  }
+
   if (bytes_downloaded_ > 0) {
     // Resume from where we left off
     resume_offset_ = bytes_downloaded_;
@@ -48,17 +55,25 @@ void LibcurlHttpFetcher::ResumeTransfer(const std::string& url) {
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_WRITEDATA, this), CURLE_OK);
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_WRITEFUNCTION,
                             StaticLibcurlWrite), CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_HEADERDATA, this),
+           CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_HEADERFUNCTION,
+                            StaticLibcurlHeader), CURLE_OK);
   CHECK_EQ(curl_easy_setopt(curl_handle_, CURLOPT_URL, url_.c_str()), CURLE_OK);
   CHECK_EQ(curl_multi_add_handle(curl_multi_handle_, curl_handle_), CURLM_OK);
   transfer_in_progress_ = true;
-  CurlPerformOnce();
+  driver_.Attach(curl_multi_handle_);
+  driver_.PerformOnce();
 }
 
 // Begins the transfer, which must not have already been started.
 void LibcurlHttpFetcher::BeginTransfer(const std::string& url) {
   transfer_size_ = -1;
-  bytes_downloaded_ = 0;
+  // Starting past the beginning works just like resuming.
+  bytes_downloaded_ = offset_;
   resume_offset_ = 0;
+  http_response_code_ = 0;
+  etag_.clear();
   ResumeTransfer(url);
 }
 
@@ -67,18 +82,16 @@ void LibcurlHttpFetcher::TerminateTransfer() {
 }
 
 // TODO(adlr): detect network failures
-void LibcurlHttpFetcher::CurlPerformOnce() {
+void LibcurlHttpFetcher::CurlMultiPerformed(int running_handles) {
   CHECK(transfer_in_progress_);
-  int running_handles = 0;
-  CURLMcode retcode = CURLM_CALL_MULTI_PERFORM;
-
-  // libcurl may request that we immediately call curl_multi_perform after it
-  // returns, so we do. libcurl promises that curl_multi_perform will not block.
-  while (CURLM_CALL_MULTI_PERFORM == retcode) {
-    retcode = curl_multi_perform(curl_multi_handle_, &running_handles);
-  }
   if (0 == running_handles) {
     // we're done!
+    long http_response_code = 0;
+    if (curl_easy_getinfo(curl_handle_, CURLINFO_RESPONSE_CODE,
+                          &http_response_code) == CURLE_OK &&
+        http_response_code) {
+      http_response_code_ = http_response_code;
+    }
     CleanUp();
 
     if ((transfer_size_ >= 0) && (bytes_downloaded_ < transfer_size_)) {
@@ -88,9 +101,6 @@ void LibcurlHttpFetcher::CurlPerformOnce() {
         delegate_->TransferComplete(this, true);  // success
       }
     }
-  } else {
-    // set up callback
-    SetupMainloopSources();
   }
 }
 
@@ -111,6 +121,24 @@ size_t LibcurlHttpFetcher::LibcurlWrite(void *ptr, size_t size, size_t nmemb) {
   return size * nmemb;
 }
 
+size_t LibcurlHttpFetcher::LibcurlHeader(char *ptr, size_t size,
+                                         size_t nmemb) {
+  static const char kEtagHeader[] = "ETag:";
+  const size_t length = size * nmemb;
+  // Each response, e.g. after a redirect, starts with its status line.
+  if (length >= 5 && strncmp(ptr, "HTTP/", 5) == 0) {
+    etag_.clear();
+  } else if (length > strlen(kEtagHeader) &&
+      strncasecmp(ptr, kEtagHeader, strlen(kEtagHeader)) == 0) {
+    // The tag is kept with its quotes, as it's sent back in If-None-Match.
+    string value(ptr + strlen(kEtagHeader), length - strlen(kEtagHeader));
+    const string::size_type begin = value.find_first_not_of(" \t");
+    const string::size_type end = value.find_last_not_of(" \t\r\n");
+    etag_ = begin == string::npos ? "" : value.substr(begin, end - begin + 1);
+  }
+  return length;
+}
+
 void LibcurlHttpFetcher::Pause() {
   CHECK(curl_handle_);
   CHECK(transfer_in_progress_);
@@ -123,128 +151,8 @@ void LibcurlHttpFetcher::Unpause() {
   CHECK_EQ(curl_easy_pause(curl_handle_, CURLPAUSE_CONT), CURLE_OK);
 }
 
-// This method sets up callbacks with the glib main loop.
-void LibcurlHttpFetcher::SetupMainloopSources() {
-  fd_set fd_read;
-  fd_set fd_write;
-  fd_set fd_exec;
-
-  FD_ZERO(&fd_read);
-  FD_ZERO(&fd_write);
-  FD_ZERO(&fd_exec);
-
-  int fd_max = 0;
-
-  // Ask libcurl for the set of file descriptors we should track on its
-  // behalf.
-  CHECK_EQ(curl_multi_fdset(curl_multi_handle_, &fd_read, &fd_write,
-                            &fd_exec, &fd_max), CURLM_OK);
-
-  // We should iterate through all file descriptors up to libcurl's fd_max or
-  // the highest one we're tracking, whichever is larger
-  if (!io_channels_.empty())
-    fd_max = max(fd_max, io_channels_.rbegin()->first);
-
-  // For each fd, if we're not tracking it, track it. If we are tracking it,
-  // but libcurl doesn't care about it anymore, stop tracking it.
-  // After this loop, there should be exactly as many GIOChannel objects
-  // in io_channels_ as there are fds that we're tracking.
-  for (int i = 0; i <= fd_max; i++) {
-    if (!(FD_ISSET(i, &fd_read) || FD_ISSET(i, &fd_write) ||
-          FD_ISSET(i, &fd_exec))) {
-      // if we have an outstanding io_channel, remove it
-      if (io_channels_.find(i) != io_channels_.end()) {
-        g_source_remove(io_channels_[i].second);
-        g_io_channel_unref(io_channels_[i].first);
-        io_channels_.erase(io_channels_.find(i));
-      }
-      continue;
-    }
-    // If we are already tracking this fd, continue.
-    if (io_channels_.find(i) != io_channels_.end())
-      continue;
-
-    // We must track a new fd
-    GIOChannel *io_channel = g_io_channel_unix_new(i);
-    guint tag = g_io_add_watch(
-        io_channel,
-        static_cast<GIOCondition>(G_IO_IN | G_IO_OUT | G_IO_PRI |
-                                  G_IO_ERR | G_IO_HUP),
-        &StaticFDCallback,
-        this);
-    io_channels_[i] = make_pair(io_channel, tag);
-  }
-
-  // Wet up a timeout callback for libcurl
-  long ms = 0;
-  CHECK_EQ(curl_multi_timeout(curl_multi_handle_, &ms), CURLM_OK);
-  if (ms < 0) {
-    // From http://curl.haxx.se/libcurl/c/curl_multi_timeout.html:
-    //     if libcurl returns a -1 timeout here, it just means that libcurl
-    //     currently has no stored timeout value. You must not wait too long
-    //     (more than a few seconds perhaps) before you call
-    //     curl_multi_perform() again.
-    ms = idle_ms_;
-  }
-  if (timeout_source_) {
-    g_source_destroy(timeout_source_);
-    timeout_source_ = NULL;
-  }
-  timeout_source_ = g_timeout_source_new(ms);
-  CHECK(timeout_source_);
-  g_source_set_callback(timeout_source_, StaticTimeoutCallback, this,
-                        NULL);
-  g_source_attach(timeout_source_, NULL);
-}
-
-bool LibcurlHttpFetcher::FDCallback(GIOChannel *source,
-                                    GIOCondition condition) {
-  // Figure out which source it was; hopefully there aren't too many b/c
-  // this is a linear scan of our channels
-  bool found_in_set = false;
-  for (IOChannels::iterator it = io_channels_.begin();
-       it != io_channels_.end(); ++it) {
-    if (it->second.first == source) {
-      // We will return false from this method, meaning that we shouldn't keep
-      // this g_io_channel around. So we remove it now from our collection of
-      // g_io_channels so that the other code in this class doens't mess with
-      // this (doomed) GIOChannel.
-      // TODO(adlr): optimize by seeing if we should reuse this GIOChannel
-      g_source_remove(it->second.second);
-      g_io_channel_unref(it->second.first);
-      io_channels_.erase(it);
-      found_in_set = true;
-      break;
-    }
-  }
-  CHECK(found_in_set);
-  CurlPerformOnce();
-  return false;
-}
-
-bool LibcurlHttpFetcher::TimeoutCallback() {
-  // Since we will return false from this function, which tells glib to
-  // destroy the timeout callback, we must NULL it out here. This way, when
-  // setting up callback sources again, we won't try to delete this (doomed)
-  // timeout callback then.
-  // TODO(adlr): optimize by checking if we can keep this timeout callback.
-  timeout_source_ = NULL;
-  CurlPerformOnce();
-  return false;
-}
-
 void LibcurlHttpFetcher::CleanUp() {
-  if (timeout_source_) {
-    g_source_destroy(timeout_source_);
-    timeout_source_ = NULL;
-  }
-
-  for (IOChannels::iterator it = io_channels_.begin();
-       it != io_channels_.end(); ++it) {
-    g_source_remove(it->second.second);
-    g_io_channel_unref(it->second.first);
-  }
-  io_channels_.clear();
+  driver_.Detach();
 
   if (curl_handle_) {
     if (curl_multi_handle_) {
@@ -258,6 +166,10 @@ void LibcurlHttpFetcher::CleanUp() {
     CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
     curl_multi_handle_ = NULL;
   }
+  if (headers_) {
+    curl_slist_free_all(headers_);
+    headers_ = NULL;
+  }
   transfer_in_progress_ = false;
 }
 
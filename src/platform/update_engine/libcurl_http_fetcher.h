@@ -5,12 +5,12 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_LIBCURL_HTTP_FETCHER_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_LIBCURL_HTTP_FETCHER_H__
 
-#include <map>
 #include <string>
 #include <curl/curl.h>
 #include <glib.h>
 #include "base/basictypes.h"
 #include "chromeos/obsolete_logging.h"
+#include "update_engine/curl_multi_driver.h"
 #include "update_engine/http_fetcher.h"
 
 // This is a concrete implementation of HttpFetcher that uses libcurl to do the
@@ -18,12 +18,12 @@
 
 namespace chromeos_update_engine {
 
-class LibcurlHttpFetcher : public HttpFetcher {
+class LibcurlHttpFetcher : public HttpFetcher,
+                           public CurlMultiDriverDelegate {
  public:
   LibcurlHttpFetcher()
-      : curl_multi_handle_(NULL), curl_handle_(NULL),
-        timeout_source_(NULL), transfer_in_progress_(false),
-        idle_ms_(1000) {}
+      : curl_multi_handle_(NULL), curl_handle_(NULL), headers_(NULL),
+        driver_(this), transfer_in_progress_(false) {}
 
   // Cleans up all internal state. Does not notify delegate
   ~LibcurlHttpFetcher();
@@ -51,40 +51,26 @@ class LibcurlHttpFetcher : public HttpFetcher {
   //     (more than a few seconds perhaps) before you call
   //     curl_multi_perform() again.
   void set_idle_ms(long ms) {
-    idle_ms_ = ms;
+    driver_.set_idle_ms(ms);
   }
+
+  // See CurlMultiDriver. Must be called before BeginTransfer().
+  void set_use_socket_callbacks(bool use_socket_callbacks) {
+    driver_.set_use_socket_callbacks(use_socket_callbacks);
+  }
+
+  // How many times the main loop woke us up, for comparing the two ways of
+  // driving libcurl.
+  uint64 wakeups() const { return driver_.wakeups(); }
  private:
   // Resumes a transfer where it left off. This will use the
   // HTTP Range: header to make a new connection from where the last
   // left off.
   virtual void ResumeTransfer(const std::string& url);
 
-  // These two methods are for glib main loop callbacks. They are called
-  // when either a file descriptor is ready for work or when a timer
-  // has fired. The static versions are shims for libcurl which has a C API.
-  bool FDCallback(GIOChannel *source, GIOCondition condition);
-  static gboolean StaticFDCallback(GIOChannel *source,
-                                   GIOCondition condition,
-                                   gpointer data) {
-    return reinterpret_cast<LibcurlHttpFetcher*>(data)->FDCallback(source,
-                                                                   condition);
-  }
-  bool TimeoutCallback();
-  static gboolean StaticTimeoutCallback(gpointer data) {
-    return reinterpret_cast<LibcurlHttpFetcher*>(data)->TimeoutCallback();
-  }
-
-  // Calls into curl_multi_perform to let libcurl do its work. Returns after
-  // curl_multi_perform is finished, which may actually be after more than
-  // one call to curl_multi_perform. This method will set up the glib run
-  // loop with sources for future work that libcurl will do.
-  // This method will not block.
-  void CurlPerformOnce();
-
-  // Sets up glib main loop sources as needed by libcurl. This is generally
-  // the file descriptor of the socket and a timer in case nothing happens
-  // on the fds.
-  void SetupMainloopSources();
+  // Called by driver_ after libcurl has done some work. Notices when the
+  // transfer is done.
+  virtual void CurlMultiPerformed(int running_handles);
 
   // Callback called by libcurl when new data has arrived on the transfer
   size_t LibcurlWrite(void *ptr, size_t size, size_t nmemb);
@@ -94,22 +80,26 @@ class LibcurlHttpFetcher : public HttpFetcher {
         LibcurlWrite(ptr, size, nmemb);
   }
 
-  // Cleans up the following if they are non-null:
-  // curl(m) handles, io_channels_, timeout_source_.
+  // Callback called by libcurl for each header line of the response
+  size_t LibcurlHeader(char *ptr, size_t size, size_t nmemb);
+  static size_t StaticLibcurlHeader(void *ptr, size_t size,
+                                    size_t nmemb, void *stream) {
+    return reinterpret_cast<LibcurlHttpFetcher*>(stream)->
+        LibcurlHeader(reinterpret_cast<char*>(ptr), size, nmemb);
+  }
+
+  // Detaches driver_ and cleans up the curl(m) handles if they are non-null.
   void CleanUp();
 
   // Handles for the libcurl library
   CURLM *curl_multi_handle_;
   CURL *curl_handle_;
 
-  // a list of all file descriptors that we're waiting on from the
-  // glib main loop
-  typedef std::map<int, std::pair<GIOChannel*, guint> > IOChannels;
-  IOChannels io_channels_;
+  // Extra request headers, or NULL if there are none.
+  struct curl_slist *headers_;
 
-  // if non-NULL, a timer we're waiting on. glib main loop will call us back
-  // when it fires.
-  GSource* timeout_source_;
+  // Runs curl_multi_handle_ from the glib main loop.
+  CurlMultiDriver driver_;
 
   bool transfer_in_progress_;
 
@@ -123,7 +113,6 @@ class LibcurlHttpFetcher : public HttpFetcher {
   // new connection.  0 otherwise.
   off_t resume_offset_;
 
-  long idle_ms_;
   DISALLOW_COPY_AND_ASSIGN(LibcurlHttpFetcher);
 };
 
@@ -12,36 +12,66 @@
 #include <glib.h>
 #include "chromeos/obsolete_logging.h"
 #include "update_engine/action_processor.h"
+#include "update_engine/caching_http_fetcher.h"
 #include "update_engine/download_action.h"
 #include "update_engine/filesystem_copier_action.h"
 // #include "update_engine/install_action.h"  // re-add
 #include "update_engine/libcurl_http_fetcher.h"
 #include "update_engine/omaha_request_prep_action.h"
 #include "update_engine/omaha_response_handler_action.h"
+#include "update_engine/partition_verifier_action.h"
 #include "update_engine/postinstall_runner_action.h"
 #include "update_engine/set_bootable_flag_action.h"
+#include "update_engine/throttling_http_fetcher.h"
 #include "update_engine/update_check_action.h"
+#include "update_engine/update_check_scheduler.h"
+#include "update_engine/utils.h"
 
 using std::string;
 using std::tr1::shared_ptr;
 using std::vector;
 
+DEFINE_string(trace_file,
+              "/mnt/stateful_partition/.update_engine_trace.json",
+              "Where to write a Chrome trace of the actions of each update "
+              "attempt. Empty for none.");
+DEFINE_int32(max_download_rate, 0,
+             "Limit payload downloads to this many KiB/s, to leave the "
+             "network to the user. 0 for no limit.");
+
 namespace chromeos_update_engine {
 
-class UpdateAttempter : public ActionProcessorDelegate {
+namespace {
+// Where download progress is saved, relative to the stateful partition.
+const char kDownloadCheckpointFile[] = "/.update_engine_download_checkpoint";
+// Where downloaded payloads are kept, relative to the stateful partition, so
+// that a payload that's needed again isn't downloaded again.
+const char kPayloadCacheDir[] = "/.update_engine_payload_cache";
+// Actions that don't depend on each other may run at the same time. Only
+// actions that just read the install partition may run alongside the
+// PartitionVerifierAction.
+const int kMaxConcurrentActions = 2;
+}  // namespace {}
+
+// Installs the updates that scheduler_ finds.
+class UpdateAttempter : public ActionProcessorDelegate,
+                        public UpdateCheckSchedulerDelegate {
  public:
-  UpdateAttempter(GMainLoop *loop)
+  UpdateAttempter()
       : full_update_(false),
-        loop_(loop) {}
+        scheduler_(this) {}
+  void Start() { scheduler_.Start(); }
   void Update(bool force_full_update);
   
-  // Delegate method:
+  // Delegate methods:
   void ProcessingDone(const ActionProcessor* processor, bool success);
+  void UpdateAvailable(UpdateCheckScheduler* scheduler,
+                       const UpdateCheckResponse& response);
  private:
   bool full_update_;
   vector<shared_ptr<AbstractAction> > actions_;
   ActionProcessor processor_;
-  GMainLoop *loop_;
+  UpdateCheckScheduler scheduler_;
 
   // pointer to the OmahaResponseHandlerAction in the actions_ vector;
   shared_ptr<OmahaResponseHandlerAction> response_handler_action_;
@@ -55,6 +85,9 @@ void UpdateAttempter::Update(bool force_full_update) {
   full_update_ = force_full_update;
   CHECK(!processor_.IsRunning());
   processor_.set_delegate(this);
+  processor_.set_trace_path(FLAGS_trace_file);
+  processor_.set_send_metrics(true);
+  processor_.set_max_concurrent_actions(kMaxConcurrentActions);
 
   // Actions:
   shared_ptr<OmahaRequestPrepAction> request_prep_action(
@@ -65,12 +98,26 @@ void UpdateAttempter::Update(bool force_full_update) {
       new OmahaResponseHandlerAction);
   shared_ptr<FilesystemCopierAction> filesystem_copier_action(
       new FilesystemCopierAction);
+  HttpFetcher* download_fetcher = new LibcurlHttpFetcher;
+  if (FLAGS_max_download_rate > 0)
+    download_fetcher = new ThrottlingHttpFetcher(
+        static_cast<int64>(FLAGS_max_download_rate) * 1024, download_fetcher);
   shared_ptr<DownloadAction> download_action(
-      new DownloadAction(new LibcurlHttpFetcher));
+      new DownloadAction(new CachingHttpFetcher(
+          string(utils::kStatefulPartition) + kPayloadCacheDir,
+          download_fetcher)));
+  const string checkpoint_path(string(utils::kStatefulPartition) +
+                               kDownloadCheckpointFile);
+  filesystem_copier_action->set_download_checkpoint_path(checkpoint_path);
+  // The root filesystem is mounted read-only, so its blocks can be copied.
+  filesystem_copier_action->set_copy_source_device(utils::BootDevice());
+  download_action->set_checkpoint_path(checkpoint_path);
   // shared_ptr<InstallAction> install_action(  // re-add
   //     new InstallAction);
   shared_ptr<PostinstallRunnerAction> postinstall_runner_action(
       new PostinstallRunnerAction);
+  shared_ptr<PartitionVerifierAction> partition_verifier_action(
+      new PartitionVerifierAction);
   shared_ptr<SetBootableFlagAction> set_bootable_flag_action(
       new SetBootableFlagAction);
       
@@ -81,6 +128,7 @@ void UpdateAttempter::Update(bool force_full_update) {
   actions_.push_back(shared_ptr<AbstractAction>(response_handler_action));
   actions_.push_back(shared_ptr<AbstractAction>(filesystem_copier_action));
   actions_.push_back(shared_ptr<AbstractAction>(download_action));
+  actions_.push_back(shared_ptr<AbstractAction>(partition_verifier_action));
   // actions_.push_back(shared_ptr<AbstractAction>(install_action));  // re-add
   actions_.push_back(shared_ptr<AbstractAction>(postinstall_runner_action));
   actions_.push_back(shared_ptr<AbstractAction>(set_bootable_flag_action));
@@ -100,6 +148,13 @@ void UpdateAttempter::Update(bool force_full_update) {
   // BondActions(download_action.get(), install_action.get());  // re-add
   // BondActions(install_action.get(), postinstall_runner_action.get());
   BondActions(postinstall_runner_action.get(), set_bootable_flag_action.get());
+  BondActions(download_action.get(), partition_verifier_action.get());
+  // Postinstall takes no input from the verifier, but it mounts the install
+  // partition read-write, which would change it under the verifier, and
+  // runs a program from it, which mustn't happen before it's verified.
+  postinstall_runner_action->AddDependency(partition_verifier_action.get());
+  // Never mark a partition bootable unless it holds what the payload said.
+  set_bootable_flag_action->AddDependency(partition_verifier_action.get());
 
   processor_.StartProcessing();
 }
@@ -108,8 +163,8 @@ void UpdateAttempter::ProcessingDone(const ActionProcessor* processor,
                                      bool success) {
   CHECK(response_handler_action_);
   if (response_handler_action_->GotNoUpdateResponse()) {
-    // All done.
-    g_main_loop_quit(loop_);
+    // The update was withdrawn since the scheduler's check.
+    scheduler_.UpdateAttemptDone(true);
     return;
   }
   if (!success) {
@@ -121,14 +176,27 @@ void UpdateAttempter::ProcessingDone(const ActionProcessor* processor,
       return;
     } else {
       LOG(ERROR) << "Full update failed. Aborting";
+      scheduler_.UpdateAttemptDone(false);
+      return;
     }
   }
-  g_main_loop_quit(loop_);
+  // Omaha will keep offering the same update until we've rebooted into it,
+  // so there's no point in checking again.
+  LOG(INFO) << "Update installed. It will be used after a reboot.";
+}
+
+void UpdateAttempter::UpdateAvailable(UpdateCheckScheduler* scheduler,
+                                      const UpdateCheckResponse& response) {
+  // The update attempt asks Omaha again, so that what's installed is what
+  // Omaha offers at the time.
+  actions_.clear();
+  response_handler_action_.reset();
+  Update(false);
 }
 
-gboolean UpdateInMainLoop(void* arg) {
+gboolean StartInMainLoop(void* arg) {
   UpdateAttempter* update_attempter = reinterpret_cast<UpdateAttempter*>(arg);
-  update_attempter->Update(false);
+  update_attempter->Start();
   return FALSE;  // Don't call this callback function again
 }
 
@@ -150,9 +218,9 @@ int main(int argc, char** argv) {
   // Create the single GMainLoop
   GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
 
-  chromeos_update_engine::UpdateAttempter update_attempter(loop);
+  chromeos_update_engine::UpdateAttempter update_attempter;
 
-  g_timeout_add(0, &chromeos_update_engine::UpdateInMainLoop,
+  g_timeout_add(0, &chromeos_update_engine::StartInMainLoop,
                 &update_attempter);
 
   g_main_loop_run(loop);
@@ -17,6 +17,19 @@ MockHttpFetcher::~MockHttpFetcher() {
 }
 
 void MockHttpFetcher::BeginTransfer(const std::string& url) {
+  etag_ = response_etag_;
+  if (!response_etag_.empty() && if_none_match_ == response_etag_) {
+    http_response_code_ = not_modified_response_code_;
+    CHECK(delegate_);
+    delegate_->TransferComplete(this, true);
+    return;
+  }
+  http_response_code_ = 200;
+  if (sent_size_ == 0) {
+    // The data passed to the ctor is the whole resource.
+    CHECK_LE(static_cast<size_t>(offset_), data_.size());
+    sent_size_ = offset_;
+  }
   if (sent_size_ < data_.size())
     SendData(true);
 }
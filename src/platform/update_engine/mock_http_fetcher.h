@@ -5,6 +5,7 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_MOCK_HTTP_FETCHER_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_MOCK_HTTP_FETCHER_H__
 
+#include <string>
 #include <vector>
 #include <glib.h>
 #include "chromeos/obsolete_logging.h"
@@ -13,7 +14,10 @@
 // This is a mock implementation of HttpFetcher which is useful for testing.
 // All data must be passed into the ctor. When started, MockHttpFetcher will
 // deliver the data in chunks of size kMockHttpFetcherChunkSize. To simulate
-// a network failure, you can call FailTransfer().
+// a network failure, you can call FailTransfer(). If the data is given an
+// ETag and the request asks for it with SetIfNoneMatch(), the transfer
+// completes with a 304 response (see SetNotModifiedResponseCode()) and no
+// data.
 
 namespace chromeos_update_engine {
 
@@ -27,7 +31,8 @@ class MockHttpFetcher : public HttpFetcher {
   // The data passed in here is copied and then passed to the delegate after
   // the transfer begins.
   MockHttpFetcher(const char* data, size_t size)
-      : sent_size_(0), timeout_source_(NULL), timout_tag_(0), paused_(false) {
+      : sent_size_(0), timeout_source_(NULL), timout_tag_(0), paused_(false),
+        not_modified_response_code_(304) {
     data_.insert(data_.end(), data, data + size);
     LOG(INFO) << "timeout_source_ = " << (int)timeout_source_;
   }
@@ -55,6 +60,21 @@ class MockHttpFetcher : public HttpFetcher {
     return post_data_;
   }
 
+  // Sets the ETag that the data is sent with.
+  void SetResponseEtag(const std::string& etag) {
+    response_etag_ = etag;
+  }
+
+  // Sets the status code of the response when the ETag matches, 304 by
+  // default.
+  void SetNotModifiedResponseCode(int code) {
+    not_modified_response_code_ = code;
+  }
+
+  const std::string& if_none_match() const {
+    return if_none_match_;
+  }
+
  private:
   // Sends data to the delegate and sets up a glib timeout callback if needed.
   // There must be a delegate and there must be data to send. If there is
@@ -86,6 +106,12 @@ class MockHttpFetcher : public HttpFetcher {
   // True iff the fetcher is paused.
   bool paused_;
 
+  // See SetResponseEtag().
+  std::string response_etag_;
+
+  // See SetNotModifiedResponseCode().
+  int not_modified_response_code_;
+
   DISALLOW_COPY_AND_ASSIGN(MockHttpFetcher);
 };
 
@@ -0,0 +1,411 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/multi_range_http_fetcher.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <algorithm>
+#include "chromeos/obsolete_logging.h"
+
+using std::max;
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+MultiRangeHttpFetcher::MultiRangeHttpFetcher(int num_connections,
+                                             off_t range_size,
+                                             size_t max_buffered_bytes)
+    : num_connections_(num_connections),
+      range_size_(range_size),
+      max_buffered_bytes_(max_buffered_bytes),
+      curl_multi_handle_(NULL),
+      driver_(this),
+      transfer_size_(-1),
+      next_range_offset_(0),
+      buffered_bytes_(0),
+      peak_buffered_bytes_(0),
+      perform_source_id_(0),
+      transfer_in_progress_(false),
+      paused_(false),
+      in_libcurl_callback_(false),
+      terminate_requested_(false) {
+  CHECK_GT(num_connections_, 0);
+  CHECK_GT(range_size_, 0);
+}
+
+MultiRangeHttpFetcher::~MultiRangeHttpFetcher() {
+  CleanUp();
+}
+
+void MultiRangeHttpFetcher::BeginTransfer(const string& url) {
+  CHECK(!transfer_in_progress_);
+  CHECK(!post_data_set_) << "POST is not supported";
+  url_ = url;
+  transfer_size_ = -1;
+  buffered_bytes_ = 0;
+  peak_buffered_bytes_ = 0;
+  paused_ = false;
+  terminate_requested_ = false;
+
+  curl_multi_handle_ = curl_multi_init();
+  CHECK(curl_multi_handle_);
+  driver_.Attach(curl_multi_handle_);
+  transfer_in_progress_ = true;
+
+  // The size of the resource isn't known yet, so start with just one range.
+  // The rest are started once its headers have arrived.
+  AddRange(offset_, offset_ + range_size_);
+  driver_.PerformOnce();
+}
+
+void MultiRangeHttpFetcher::TerminateTransfer() {
+  if (in_libcurl_callback_) {
+    // Handles can't be removed from within a libcurl callback, so this is
+    // finished in CurlMultiPerformed().
+    terminate_requested_ = true;
+    return;
+  }
+  CleanUp();
+}
+
+void MultiRangeHttpFetcher::Pause() {
+  CHECK(transfer_in_progress_);
+  paused_ = true;
+  for (std::deque<Range*>::iterator it = ranges_.begin(); it != ranges_.end();
+       ++it) {
+    if ((*it)->curl_handle)
+      CHECK_EQ(curl_easy_pause((*it)->curl_handle, CURLPAUSE_ALL), CURLE_OK);
+  }
+}
+
+void MultiRangeHttpFetcher::Unpause() {
+  CHECK(transfer_in_progress_);
+  paused_ = false;
+  if (!DeliverBufferedData())
+    return;
+  for (size_t i = 0; i < ranges_.size() && !paused_; i++) {
+    Range* range = ranges_[i];
+    if (range->curl_handle && !range->paused)
+      CHECK_EQ(curl_easy_pause(range->curl_handle, CURLPAUSE_CONT), CURLE_OK);
+  }
+  UnpauseBufferedRanges();
+  // There may be no request left in progress to wake us up, e.g., if all
+  // the remaining data was buffered, so look for work from the main loop.
+  SchedulePerform();
+}
+
+void MultiRangeHttpFetcher::AddRange(off_t offset, off_t end) {
+  Range* range = new Range;
+  range->fetcher = this;
+  range->offset = offset;
+  range->end = end;
+  range->received = 0;
+  range->received_at_start = 0;
+  range->discard = 0;
+  range->curl_handle = NULL;
+  range->done = false;
+  range->paused = false;
+  ranges_.push_back(range);
+  next_range_offset_ = end;
+  StartRequest(range);
+}
+
+void MultiRangeHttpFetcher::StartRequest(Range* range) {
+  CHECK(!range->curl_handle);
+  range->curl_handle = curl_easy_init();
+  CHECK(range->curl_handle);
+  range->received_at_start = range->received;
+  range->discard = 0;
+  range->paused = false;
+
+  const off_t start = range->offset + range->received;
+  char range_header[64];
+  if (range->end >= 0) {
+    snprintf(range_header, sizeof(range_header), "%lld-%lld",
+             static_cast<long long>(start),
+             static_cast<long long>(range->end - 1));
+  } else {
+    snprintf(range_header, sizeof(range_header), "%lld-",
+             static_cast<long long>(start));
+  }
+
+  CURL* handle = range->curl_handle;
+  CHECK_EQ(curl_easy_setopt(handle, CURLOPT_URL, url_.c_str()), CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(handle, CURLOPT_RANGE, range_header), CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(handle, CURLOPT_FAILONERROR, 1), CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(handle, CURLOPT_HEADERDATA, range), CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(handle, CURLOPT_HEADERFUNCTION,
+                            StaticLibcurlHeader), CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(handle, CURLOPT_WRITEDATA, range), CURLE_OK);
+  CHECK_EQ(curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION,
+                            StaticLibcurlWrite), CURLE_OK);
+  CHECK_EQ(curl_multi_add_handle(curl_multi_handle_, handle), CURLM_OK);
+}
+
+void MultiRangeHttpFetcher::StopRequest(Range* range) {
+  if (!range->curl_handle)
+    return;
+  CHECK_EQ(curl_multi_remove_handle(curl_multi_handle_, range->curl_handle),
+           CURLM_OK);
+  curl_easy_cleanup(range->curl_handle);
+  range->curl_handle = NULL;
+  range->paused = false;
+}
+
+bool MultiRangeHttpFetcher::StartRanges() {
+  if (transfer_size_ < 0)
+    return false;
+  int requests = 0;
+  for (std::deque<Range*>::iterator it = ranges_.begin(); it != ranges_.end();
+       ++it) {
+    if ((*it)->curl_handle)
+      requests++;
+  }
+  bool started = false;
+  // There's no point in starting a range that would have nowhere to put
+  // its data.
+  while (requests < num_connections_ &&
+         next_range_offset_ < transfer_size_ &&
+         buffered_bytes_ < max_buffered_bytes_) {
+    AddRange(next_range_offset_,
+             min(next_range_offset_ + range_size_, transfer_size_));
+    requests++;
+    started = true;
+  }
+  return started;
+}
+
+bool MultiRangeHttpFetcher::DeliverBufferedData() {
+  while (!ranges_.empty() && !paused_) {
+    Range* range = ranges_.front();
+    if (!range->buffer.empty()) {
+      vector<char> data;
+      data.swap(range->buffer);
+      buffered_bytes_ -= data.size();
+      if (!Deliver(&data[0], data.size()))
+        return false;
+      continue;
+    }
+    if (!range->done)
+      break;
+    ranges_.pop_front();
+    delete range;
+  }
+  return true;
+}
+
+bool MultiRangeHttpFetcher::Deliver(const char* bytes, size_t length) {
+  if (delegate_)
+    delegate_->ReceivedBytes(this, bytes, length);
+  return transfer_in_progress_ && !terminate_requested_;
+}
+
+void MultiRangeHttpFetcher::UnpauseBufferedRanges() {
+  // Unpausing may call LibcurlWrite() right away, which changes
+  // buffered_bytes_ and may pause the range again.
+  for (size_t i = 0; i < ranges_.size() && !paused_; i++) {
+    Range* range = ranges_[i];
+    if (!range->paused || !range->curl_handle)
+      continue;
+    if (i > 0 && buffered_bytes_ >= max_buffered_bytes_)
+      continue;
+    range->paused = false;
+    CHECK_EQ(curl_easy_pause(range->curl_handle, CURLPAUSE_CONT), CURLE_OK);
+    if (terminate_requested_)
+      return;
+  }
+}
+
+bool MultiRangeHttpFetcher::HandleFinishedRequests() {
+  CURLMsg* msg = NULL;
+  int msgs_left = 0;
+  while ((msg = curl_multi_info_read(curl_multi_handle_, &msgs_left))) {
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+    // msg is freed when its handle is removed, so copy what's needed first.
+    CURL* handle = msg->easy_handle;
+    CURLcode result = msg->data.result;
+    Range* range = NULL;
+    for (std::deque<Range*>::iterator it = ranges_.begin();
+         it != ranges_.end(); ++it) {
+      if ((*it)->curl_handle == handle) {
+        range = *it;
+        break;
+      }
+    }
+    CHECK(range);
+    StopRequest(range);
+
+    if (range->end < 0) {
+      // The server is sending the whole resource in one response.
+      if (result != CURLE_OK && range->received > range->received_at_start) {
+        StartRequest(range);
+        continue;
+      }
+      range->done = (result == CURLE_OK);
+    } else if (range->offset + range->received >= range->end) {
+      range->done = true;
+    } else if (range->received > range->received_at_start) {
+      // The connection was dropped, but made progress. Ask for the rest.
+      LOG(INFO) << "Range at " << range->offset << " ended early after "
+                << range->received << " bytes; resuming.";
+      StartRequest(range);
+      continue;
+    }
+    if (!range->done) {
+      LOG(ERROR) << "Request for range at " << range->offset << " failed: "
+                 << curl_easy_strerror(result);
+      return false;
+    }
+    if (transfer_size_ < 0 && range->end >= 0) {
+      LOG(ERROR) << "Server didn't send the size of " << url_;
+      return false;
+    }
+  }
+  return true;
+}
+
+void MultiRangeHttpFetcher::CurlMultiPerformed(int running_handles) {
+  CHECK(transfer_in_progress_);
+  if (terminate_requested_) {
+    CleanUp();
+    return;
+  }
+  if (!HandleFinishedRequests()) {
+    CompleteTransfer(false);
+    return;
+  }
+  if (!DeliverBufferedData())
+    return;
+  UnpauseBufferedRanges();
+  if (terminate_requested_) {
+    CleanUp();
+    return;
+  }
+  if (ranges_.empty() &&
+      (transfer_size_ < 0 || next_range_offset_ >= transfer_size_)) {
+    CompleteTransfer(true);
+    return;
+  }
+  // New requests don't get going until libcurl is called again.
+  if (StartRanges())
+    SchedulePerform();
+}
+
+size_t MultiRangeHttpFetcher::LibcurlHeader(Range* range, const char* line,
+                                            size_t length) {
+  const string header(line, length);
+  if (header.compare(0, strlen("HTTP/"), "HTTP/") == 0) {
+    // The status line. 200 rather than 206 means the Range header was
+    // ignored and the response starts at the beginning of the resource.
+    string::size_type space = header.find(' ');
+    if (space != string::npos && atoi(header.c_str() + space + 1) == 200) {
+      LOG(INFO) << "Server doesn't support ranges; fetching " << url_
+                << " over one connection.";
+      range->discard = range->offset + range->received;
+      if (transfer_size_ < 0)
+        range->end = -1;
+    }
+  } else if (strncasecmp(header.c_str(), "Content-Range:",
+                         strlen("Content-Range:")) == 0) {
+    // Content-Range: bytes first-last/size
+    string::size_type slash = header.find('/');
+    if (slash != string::npos && header[slash + 1] != '*' &&
+        transfer_size_ < 0) {
+      transfer_size_ = atoll(header.c_str() + slash + 1);
+      LOG(INFO) << "Size of " << url_ << " is " << transfer_size_;
+    }
+  }
+  if (transfer_size_ >= 0 && range->end > transfer_size_)
+    range->end = transfer_size_;
+  return length;
+}
+
+size_t MultiRangeHttpFetcher::LibcurlWrite(Range* range, const char* bytes,
+                                           size_t length) {
+  if (terminate_requested_)
+    return 0;  // Fails the request.
+  if (paused_)
+    return CURL_WRITEFUNC_PAUSE;
+
+  // Work out which of these bytes belong to the range.
+  const off_t discard = min(range->discard, static_cast<off_t>(length));
+  size_t count = length - discard;
+  if (range->end >= 0) {
+    count = min(static_cast<off_t>(count),
+                max(static_cast<off_t>(0),
+                    range->end - range->offset - range->received));
+  }
+
+  const bool deliver_now = (range == ranges_.front() && range->buffer.empty());
+  if (!deliver_now && count > 0 &&
+      buffered_bytes_ + count > max_buffered_bytes_) {
+    // No room. libcurl will hand us the same bytes again once unpaused.
+    range->paused = true;
+    return CURL_WRITEFUNC_PAUSE;
+  }
+
+  range->discard -= discard;
+  range->received += count;
+  if (count == 0)
+    return length;
+  if (!deliver_now) {
+    range->buffer.insert(range->buffer.end(), bytes + discard,
+                         bytes + discard + count);
+    buffered_bytes_ += count;
+    peak_buffered_bytes_ = max(peak_buffered_bytes_, buffered_bytes_);
+    return length;
+  }
+  in_libcurl_callback_ = true;
+  const bool still_running = Deliver(bytes + discard, count);
+  in_libcurl_callback_ = false;
+  return still_running ? length : 0;
+}
+
+void MultiRangeHttpFetcher::SchedulePerform() {
+  if (perform_source_id_ || !transfer_in_progress_)
+    return;
+  perform_source_id_ = g_idle_add(&StaticPerformCallback, this);
+}
+
+gboolean MultiRangeHttpFetcher::StaticPerformCallback(gpointer data) {
+  MultiRangeHttpFetcher* fetcher =
+      reinterpret_cast<MultiRangeHttpFetcher*>(data);
+  fetcher->perform_source_id_ = 0;
+  fetcher->driver_.PerformOnce();
+  return FALSE;
+}
+
+void MultiRangeHttpFetcher::CleanUp() {
+  driver_.Detach();
+  if (perform_source_id_) {
+    g_source_remove(perform_source_id_);
+    perform_source_id_ = 0;
+  }
+  for (std::deque<Range*>::iterator it = ranges_.begin(); it != ranges_.end();
+       ++it) {
+    StopRequest(*it);
+    delete *it;
+  }
+  ranges_.clear();
+  buffered_bytes_ = 0;
+  if (curl_multi_handle_) {
+    CHECK_EQ(curl_multi_cleanup(curl_multi_handle_), CURLM_OK);
+    curl_multi_handle_ = NULL;
+  }
+  transfer_in_progress_ = false;
+  paused_ = false;
+}
+
+void MultiRangeHttpFetcher::CompleteTransfer(bool successful) {
+  CleanUp();
+  if (delegate_)
+    delegate_->TransferComplete(this, successful);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,178 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_MULTI_RANGE_HTTP_FETCHER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_MULTI_RANGE_HTTP_FETCHER_H__
+
+#include <deque>
+#include <string>
+#include <vector>
+#include <curl/curl.h>
+#include <glib.h>
+#include "base/basictypes.h"
+#include "update_engine/curl_multi_driver.h"
+#include "update_engine/http_fetcher.h"
+
+// MultiRangeHttpFetcher is an HttpFetcher that downloads a resource over
+// several connections at once. The resource is split into byte ranges of a
+// fixed size, which are fetched concurrently with HTTP Range requests on one
+// libcurl multi handle. The delegate still receives the bytes in order:
+// data that arrives ahead of the range being delivered is buffered, and a
+// connection is paused when the buffer would grow beyond a limit.
+//
+// The first range is requested by itself, and the size of the resource is
+// taken from its Content-Range header. If the server doesn't support range
+// requests, the whole resource is streamed over that one connection.
+
+namespace chromeos_update_engine {
+
+class MultiRangeHttpFetcher : public HttpFetcher,
+                              public CurlMultiDriverDelegate {
+ public:
+  // Uses at most num_connections connections at a time and requests
+  // range_size bytes per request. At most max_buffered_bytes bytes of data
+  // that the delegate isn't ready for yet are held in memory.
+  MultiRangeHttpFetcher(int num_connections, off_t range_size,
+                        size_t max_buffered_bytes);
+
+  // Cleans up all internal state. Does not notify delegate
+  ~MultiRangeHttpFetcher();
+
+  virtual void BeginTransfer(const std::string& url);
+  virtual void TerminateTransfer();
+  virtual void Pause();
+  virtual void Unpause();
+
+  // See LibcurlHttpFetcher::set_idle_ms().
+  void set_idle_ms(long ms) {
+    driver_.set_idle_ms(ms);
+  }
+
+  // The most data that was ever held for out of order delivery. For testing.
+  size_t peak_buffered_bytes() const { return peak_buffered_bytes_; }
+
+ private:
+  // One byte range of the resource, [offset, end). Ranges are kept in
+  // order in ranges_; data is delivered from the first one.
+  struct Range {
+    MultiRangeHttpFetcher* fetcher;
+    off_t offset;
+    // -1 if the server ignored the Range header and is sending everything.
+    off_t end;
+    // Bytes of the range received so far, whether delivered or buffered.
+    off_t received;
+    // received when the current request was started.
+    off_t received_at_start;
+    // Bytes to drop from the front of the response, if the server sent
+    // the resource from the beginning rather than the range asked for.
+    off_t discard;
+    // Received data that hasn't been delivered yet.
+    std::vector<char> buffer;
+    // The request for this range, or NULL when none is in progress.
+    CURL* curl_handle;
+    // True once all of the range has been received.
+    bool done;
+    // True if curl_handle is paused because there was no room to buffer.
+    bool paused;
+  };
+
+  // Appends the range [offset, end) to ranges_ and starts requesting it.
+  void AddRange(off_t offset, off_t end);
+
+  // Starts a request for the part of range that hasn't been received yet.
+  void StartRequest(Range* range);
+
+  // Removes and frees range's request, if any.
+  void StopRequest(Range* range);
+
+  // Starts new ranges while there are free connections and bytes left to
+  // request. Returns true if any were started.
+  bool StartRanges();
+
+  // Delivers buffered data from the front of ranges_ and drops ranges that
+  // are completely delivered. Returns false if the delegate terminated the
+  // transfer.
+  bool DeliverBufferedData();
+
+  // Hands bytes to the delegate. Returns false if the delegate terminated
+  // the transfer.
+  bool Deliver(const char* bytes, size_t length);
+
+  // Unpauses requests that were paused for lack of buffer space, if there
+  // is space now.
+  void UnpauseBufferedRanges();
+
+  // Handles requests that libcurl says are finished. Returns false if the
+  // transfer failed.
+  bool HandleFinishedRequests();
+
+  virtual void CurlMultiPerformed(int running_handles);
+
+  // Callbacks called by libcurl with the response headers and the data of
+  // a range's request.
+  size_t LibcurlHeader(Range* range, const char* line, size_t length);
+  static size_t StaticLibcurlHeader(void* ptr, size_t size, size_t nmemb,
+                                    void* data) {
+    Range* range = reinterpret_cast<Range*>(data);
+    return range->fetcher->LibcurlHeader(
+        range, reinterpret_cast<const char*>(ptr), size * nmemb);
+  }
+  size_t LibcurlWrite(Range* range, const char* bytes, size_t length);
+  static size_t StaticLibcurlWrite(void* ptr, size_t size, size_t nmemb,
+                                   void* data) {
+    Range* range = reinterpret_cast<Range*>(data);
+    return range->fetcher->LibcurlWrite(
+        range, reinterpret_cast<const char*>(ptr), size * nmemb);
+  }
+
+  // Calls the driver from the main loop soon. Used when there's work for
+  // libcurl that no main loop source is waiting for.
+  void SchedulePerform();
+  static gboolean StaticPerformCallback(gpointer data);
+
+  // Stops all requests and frees all ranges and curl handles.
+  void CleanUp();
+
+  // Calls CleanUp() and tells the delegate the transfer is over.
+  void CompleteTransfer(bool successful);
+
+  const int num_connections_;
+  const off_t range_size_;
+  const size_t max_buffered_bytes_;
+
+  CURLM* curl_multi_handle_;
+
+  // Runs curl_multi_handle_ from the glib main loop.
+  CurlMultiDriver driver_;
+
+  // Ranges that haven't been fully delivered yet, in order.
+  std::deque<Range*> ranges_;
+
+  // The size of the resource, or -1 while it isn't known.
+  off_t transfer_size_;
+
+  // Where the next range begins.
+  off_t next_range_offset_;
+
+  // Total size of the buffers of all ranges.
+  size_t buffered_bytes_;
+  size_t peak_buffered_bytes_;
+
+  // The idle source added by SchedulePerform(), or 0.
+  guint perform_source_id_;
+
+  bool transfer_in_progress_;
+  bool paused_;
+
+  // True while the delegate is being called from a libcurl callback. A
+  // TerminateTransfer() from the delegate must wait until libcurl returns.
+  bool in_libcurl_callback_;
+  bool terminate_requested_;
+
+  DISALLOW_COPY_AND_ASSIGN(MultiRangeHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_MULTI_RANGE_HTTP_FETCHER_H__
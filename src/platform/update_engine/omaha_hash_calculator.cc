@@ -2,33 +2,61 @@
 // Use of this source code is governed by a BSD-style license that can be
 // found in the LICENSE file.
 
+#include <string.h>
 #include <openssl/bio.h>
 #include <openssl/buffer.h>
 #include <openssl/evp.h>
 #include "chromeos/obsolete_logging.h"
 #include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/utils.h"
 
 namespace chromeos_update_engine {
 
-OmahaHashCalculator::OmahaHashCalculator() {
+namespace {
+// Lengths of the base64 encodings of the digests, including padding.
+const size_t kSha1Base64Length = 28;
+const size_t kSha256Base64Length = 44;
+}  // namespace {}
+
+OmahaHashCalculator::OmahaHashCalculator() : algorithm_(kSha1) {
   CHECK_EQ(SHA1_Init(&ctx_), 1);
 }
 
+OmahaHashCalculator::OmahaHashCalculator(Algorithm algorithm)
+    : algorithm_(algorithm) {
+  if (algorithm_ == kSha256)
+    CHECK_EQ(SHA256_Init(&sha256_ctx_), 1);
+  else
+    CHECK_EQ(SHA1_Init(&ctx_), 1);
+}
+
 // Update is called with all of the data that should be hashed in order.
-// Mostly just passes the data through to OpenSSL's SHA1_Update()
+// Mostly just passes the data through to OpenSSL's SHA1_Update() or
+// SHA256_Update()
 void OmahaHashCalculator::Update(const char* data, size_t length) {
   CHECK(hash_.empty()) << "Can't Update after hash is finalized";
   COMPILE_ASSERT(sizeof(size_t) <= sizeof(unsigned long),
                  length_param_may_be_truncated_in_SHA1_Update);
-  CHECK_EQ(SHA1_Update(&ctx_, data, length), 1);
+  if (algorithm_ == kSha256)
+    CHECK_EQ(SHA256_Update(&sha256_ctx_, data, length), 1);
+  else
+    CHECK_EQ(SHA1_Update(&ctx_, data, length), 1);
 }
 
 // Call Finalize() when all data has been passed in. This mostly just
-// calls OpenSSL's SHA1_Final() and then base64 encodes the hash.
+// calls OpenSSL's SHA1_Final() or SHA256_Final() and then base64 encodes the
+// hash.
 void OmahaHashCalculator::Finalize() {
   CHECK(hash_.empty()) << "Don't call Finalize() twice";
-  unsigned char md[SHA_DIGEST_LENGTH];
-  CHECK_EQ(SHA1_Final(md, &ctx_), 1);
+  unsigned char md[SHA256_DIGEST_LENGTH];
+  size_t md_length = 0;
+  if (algorithm_ == kSha256) {
+    CHECK_EQ(SHA256_Final(md, &sha256_ctx_), 1);
+    md_length = SHA256_DIGEST_LENGTH;
+  } else {
+    CHECK_EQ(SHA1_Final(md, &ctx_), 1);
+    md_length = SHA_DIGEST_LENGTH;
+  }
 
   // Convert md to base64 encoding and store it in hash_
   BIO *b64 = BIO_new(BIO_f_base64());
@@ -36,7 +64,7 @@ void OmahaHashCalculator::Finalize() {
   BIO *bmem = BIO_new(BIO_s_mem());
   CHECK(bmem);
   b64 = BIO_push(b64, bmem);
-  CHECK_EQ(BIO_write(b64, md, sizeof(md)), sizeof(md));
+  CHECK_EQ(BIO_write(b64, md, md_length), static_cast<int>(md_length));
   CHECK_EQ(BIO_flush(b64), 1);
 
   BUF_MEM *bptr = NULL;
@@ -46,6 +74,51 @@ void OmahaHashCalculator::Finalize() {
   BIO_free_all(b64);
 }
 
+void OmahaHashCalculator::GetContext(std::string* context) const {
+  CHECK(hash_.empty()) << "Can't get the context after hash is finalized";
+  if (algorithm_ == kSha256) {
+    context->assign(reinterpret_cast<const char*>(&sha256_ctx_),
+                    sizeof(sha256_ctx_));
+  } else {
+    context->assign(reinterpret_cast<const char*>(&ctx_), sizeof(ctx_));
+  }
+}
+
+bool OmahaHashCalculator::SetContext(const std::string& context) {
+  CHECK(hash_.empty()) << "Can't set the context after hash is finalized";
+  void* ctx = &ctx_;
+  size_t ctx_size = sizeof(ctx_);
+  if (algorithm_ == kSha256) {
+    ctx = &sha256_ctx_;
+    ctx_size = sizeof(sha256_ctx_);
+  }
+  TEST_AND_RETURN_FALSE(context.size() == ctx_size);
+  memcpy(ctx, context.data(), ctx_size);
+  return true;
+}
+
+bool OmahaHashCalculator::AlgorithmForHash(const std::string& hash,
+                                           Algorithm* out) {
+  switch (hash.size()) {
+    case kSha1Base64Length:
+      *out = kSha1;
+      return true;
+    case kSha256Base64Length:
+      *out = kSha256;
+      return true;
+    default:
+      return false;
+  }
+}
+
+std::string OmahaHashCalculator::OmahaHashOfBytes(
+    const void* data, size_t length, Algorithm algorithm) {
+  OmahaHashCalculator calc(algorithm);
+  calc.Update(reinterpret_cast<const char*>(data), length);
+  calc.Finalize();
+  return calc.hash();
+}
+
 std::string OmahaHashCalculator::OmahaHashOfBytes(
     const void* data, size_t length) {
   OmahaHashCalculator calc;
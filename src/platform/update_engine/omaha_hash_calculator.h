@@ -9,9 +9,11 @@
 #include <string>
 #include <vector>
 #include <openssl/sha.h>
+#include "chromeos/obsolete_logging.h"
 
-// Omaha uses base64 encoded SHA-1 as the hash. This class provides a simple
-// wrapper around OpenSSL providing such a formatted hash of data passed in.
+// Omaha uses a base64 encoded SHA-1 or SHA-256 as the hash. This class
+// provides a simple wrapper around OpenSSL providing such a formatted hash of
+// data passed in.
 // The methods of this class must be called in a very specific order:
 // First the ctor (of course), then 0 or more calls to Update(), then
 // Finalize(), then 0 or more calls to hash().
@@ -20,7 +22,14 @@ namespace chromeos_update_engine {
 
 class OmahaHashCalculator {
  public:
-   OmahaHashCalculator();
+  enum Algorithm {
+    kSha1,
+    kSha256
+  };
+
+  // The default is SHA-1.
+  OmahaHashCalculator();
+  explicit OmahaHashCalculator(Algorithm algorithm);
 
   // Update is called with all of the data that should be hashed in order.
   // Update will read |length| bytes of |data|
@@ -37,7 +46,23 @@ class OmahaHashCalculator {
     return hash_;
   }
 
+  Algorithm algorithm() const { return algorithm_; }
+
+  // Gets or sets the state of a hash in progress, so that hashing can be
+  // resumed by a later process. The context is only meaningful to the same
+  // algorithm and OpenSSL version. These may only be called before
+  // Finalize(). SetContext() returns false if context isn't valid.
+  void GetContext(std::string* context) const;
+  bool SetContext(const std::string& context);
+
+  // Returns the algorithm that produced hash, a base64 encoded hash as sent
+  // by Omaha, based on its length. Returns false if hash isn't the length of
+  // any supported algorithm.
+  static bool AlgorithmForHash(const std::string& hash, Algorithm* out);
+
   // Used by tests
+  static std::string OmahaHashOfBytes(const void* data, size_t length,
+                                      Algorithm algorithm);
   static std::string OmahaHashOfBytes(const void* data, size_t length);
   static std::string OmahaHashOfString(const std::string& str);
   static std::string OmahaHashOfData(const std::vector<char>& data);
@@ -47,8 +72,11 @@ class OmahaHashCalculator {
   // non-empty when Finalize is called.
   std::string hash_;
 
-  // The hash state used by OpenSSL
+  const Algorithm algorithm_;
+
+  // The hash state used by OpenSSL. Only the one for algorithm_ is used.
   SHA_CTX ctx_;
+  SHA256_CTX sha256_ctx_;
   DISALLOW_COPY_AND_ASSIGN(OmahaHashCalculator);
 };
 
@@ -52,6 +52,53 @@ TEST(OmahaHashCalculatorTest, BigTest) {
   EXPECT_EQ("qdNsMeRqzoEUu5/ABi+MGRli87s=", calc.hash());
 }
 
+TEST(OmahaHashCalculatorTest, Sha256SimpleTest) {
+  OmahaHashCalculator calc(OmahaHashCalculator::kSha256);
+  calc.Update("h", 1);
+  calc.Update("i", 1);
+  calc.Finalize();
+  // Generated by running this on a linux shell:
+  // $ echo -n hi | openssl sha256 -binary | openssl base64
+  EXPECT_EQ("j0NDRmSPa5bfid2pAcUXaxCm2Dlh3TwayItZstwyeqQ=", calc.hash());
+  EXPECT_EQ(calc.hash(),
+            OmahaHashCalculator::OmahaHashOfBytes(
+                "hi", 2, OmahaHashCalculator::kSha256));
+}
+
+TEST(OmahaHashCalculatorTest, AlgorithmForHashTest) {
+  OmahaHashCalculator::Algorithm algorithm = OmahaHashCalculator::kSha256;
+  EXPECT_TRUE(OmahaHashCalculator::AlgorithmForHash(
+      "witfkXg0JglCjW9RssWvTAveakI=", &algorithm));
+  EXPECT_EQ(OmahaHashCalculator::kSha1, algorithm);
+  EXPECT_TRUE(OmahaHashCalculator::AlgorithmForHash(
+      "j0NDRmSPa5bfid2pAcUXaxCm2Dlh3TwayItZstwyeqQ=", &algorithm));
+  EXPECT_EQ(OmahaHashCalculator::kSha256, algorithm);
+  EXPECT_FALSE(OmahaHashCalculator::AlgorithmForHash("", &algorithm));
+  EXPECT_FALSE(OmahaHashCalculator::AlgorithmForHash("abc=", &algorithm));
+}
+
+TEST(OmahaHashCalculatorTest, ContextTest) {
+  const OmahaHashCalculator::Algorithm kAlgorithms[] = {
+    OmahaHashCalculator::kSha1,
+    OmahaHashCalculator::kSha256
+  };
+  for (size_t i = 0; i < arraysize(kAlgorithms); i++) {
+    std::string context;
+    {
+      OmahaHashCalculator calc(kAlgorithms[i]);
+      calc.Update("h", 1);
+      calc.GetContext(&context);
+    }
+    OmahaHashCalculator calc(kAlgorithms[i]);
+    EXPECT_FALSE(calc.SetContext(context + "x"));
+    EXPECT_TRUE(calc.SetContext(context));
+    calc.Update("i", 1);
+    calc.Finalize();
+    EXPECT_EQ(OmahaHashCalculator::OmahaHashOfBytes("hi", 2, kAlgorithms[i]),
+              calc.hash());
+  }
+}
+
 TEST(OmahaHashCalculatorTest, AbortTest) {
   // Just make sure we don't crash and valgrind doesn't detect memory leaks
   {
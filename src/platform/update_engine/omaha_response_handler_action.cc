@@ -47,10 +47,10 @@ void OmahaResponseHandlerAction::PerformAction() {
     // Very long name. Let's shorten it
     filename.resize(255);
   }
-  if (HasOutputPipe())
-    SetOutputObject(install_plan);
   LOG(INFO) << "Using this install plan:";
   install_plan.Dump();
+  if (HasOutputPipe())
+    MoveOutputObject(&install_plan);
   completer.set_success(true);
 }
 
@@ -0,0 +1,288 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/partition_verifier_action.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+#include "update_engine/utils.h"
+
+using std::deque;
+using std::min;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+// How much of the device is read at a time.
+const size_t kReadSize = 4 * 1024 * 1024;
+// One buffer is being read into while another is hashed; the third lets the
+// reader get ahead when the device is briefly faster than the hash.
+const int kNumBuffers = 3;
+// O_DIRECT needs the buffer, the file offset and the length of each read to
+// be aligned. A page is enough for any block device we read from.
+const size_t kAlignment = 4096;
+
+// Hands buffers that have been read from the device to a thread that hashes
+// them, and hands them back to be read into again once they've been hashed.
+class HashPipeline {
+ public:
+  explicit HashPipeline(OmahaHashCalculator* calculator)
+      : calculator_(calculator),
+        mutex_(g_mutex_new()),
+        cond_(g_cond_new()),
+        closing_(false),
+        thread_(NULL) {
+    for (int i = 0; i < kNumBuffers; i++) {
+      void* buffer = NULL;
+      CHECK_EQ(posix_memalign(&buffer, kAlignment, kReadSize), 0);
+      buffers_[i] = reinterpret_cast<char*>(buffer);
+      free_buffers_.push_back(buffers_[i]);
+    }
+    thread_ = g_thread_create(&StaticHasherMain, this, TRUE, NULL);
+    CHECK(thread_);
+  }
+
+  ~HashPipeline() {
+    Finish();
+    for (int i = 0; i < kNumBuffers; i++)
+      free(buffers_[i]);
+    g_cond_free(cond_);
+    g_mutex_free(mutex_);
+  }
+
+  // Returns a buffer of kReadSize bytes to read into, waiting for the hasher
+  // to finish with one if need be.
+  char* GetFreeBuffer() {
+    g_mutex_lock(mutex_);
+    while (free_buffers_.empty())
+      g_cond_wait(cond_, mutex_);
+    char* buffer = free_buffers_.back();
+    free_buffers_.pop_back();
+    g_mutex_unlock(mutex_);
+    return buffer;
+  }
+
+  // Queues the first length bytes of buffer, which came from
+  // GetFreeBuffer(), to be hashed.
+  void Hash(char* buffer, size_t length) {
+    g_mutex_lock(mutex_);
+    full_buffers_.push_back(FullBuffer(buffer, length));
+    g_cond_broadcast(cond_);
+    g_mutex_unlock(mutex_);
+  }
+
+  // Waits for everything queued to be hashed and stops the hashing thread.
+  void Finish() {
+    if (!thread_)
+      return;
+    g_mutex_lock(mutex_);
+    closing_ = true;
+    g_cond_broadcast(cond_);
+    g_mutex_unlock(mutex_);
+    g_thread_join(thread_);
+    thread_ = NULL;
+  }
+
+ private:
+  typedef std::pair<char*, size_t> FullBuffer;
+
+  static gpointer StaticHasherMain(gpointer data) {
+    reinterpret_cast<HashPipeline*>(data)->HasherMain();
+    return NULL;
+  }
+
+  void HasherMain() {
+    g_mutex_lock(mutex_);
+    for (;;) {
+      while (full_buffers_.empty() && !closing_)
+        g_cond_wait(cond_, mutex_);
+      if (full_buffers_.empty())
+        break;  // Closing, and nothing left to do.
+      FullBuffer buffer = full_buffers_.front();
+      full_buffers_.pop_front();
+      g_mutex_unlock(mutex_);
+      calculator_->Update(buffer.first, buffer.second);
+      g_mutex_lock(mutex_);
+      free_buffers_.push_back(buffer.first);
+      g_cond_broadcast(cond_);
+    }
+    g_mutex_unlock(mutex_);
+  }
+
+  OmahaHashCalculator* const calculator_;
+
+  char* buffers_[kNumBuffers];
+
+  // Protects everything below.
+  GMutex* mutex_;
+  // Signaled when a buffer changes hands or the pipeline is closing.
+  GCond* cond_;
+
+  vector<char*> free_buffers_;
+  // Buffers waiting to be hashed, in the order they were read.
+  deque<FullBuffer> full_buffers_;
+  bool closing_;
+
+  GThread* thread_;
+
+  DISALLOW_COPY_AND_ASSIGN(HashPipeline);
+};
+
+// Reads count bytes from fd at offset into buf. With O_DIRECT, count must be
+// a multiple of kAlignment. Returns the number of bytes read, which is less
+// than count only at the end of the file, or -1 on error.
+ssize_t PReadAll(int fd, char* buf, size_t count, off_t offset,
+                 bool o_direct) {
+  size_t bytes_read = 0;
+  while (bytes_read < count) {
+    ssize_t rc = pread(fd, buf + bytes_read, count - bytes_read,
+                       offset + bytes_read);
+    if (rc < 0)
+      return rc;
+    if (rc == 0)
+      break;
+    bytes_read += rc;
+    // A direct read that stops short of a block has hit the end of the file,
+    // and couldn't continue from an unaligned offset anyway.
+    if (o_direct && bytes_read % kAlignment != 0)
+      break;
+  }
+  return bytes_read;
+}
+}  // namespace {}
+
+bool PartitionVerifierAction::HashPartition(
+    const string& path,
+    uint64 size,
+    OmahaHashCalculator::Algorithm algorithm,
+    volatile gint* should_exit,
+    string* out_hash) {
+  bool o_direct = true;
+  int fd = open(path.c_str(), O_RDONLY | O_LARGEFILE | O_DIRECT, 0);
+  if (fd < 0 && errno == EINVAL) {
+    LOG(INFO) << path << " doesn't support O_DIRECT; reading through the "
+              << "page cache.";
+    o_direct = false;
+    fd = open(path.c_str(), O_RDONLY | O_LARGEFILE, 0);
+    if (fd >= 0)
+      posix_fadvise(fd, 0, size, POSIX_FADV_SEQUENTIAL);
+  }
+  TEST_AND_RETURN_FALSE_ERRNO(fd >= 0);
+  ScopedFdCloser fd_closer(&fd);
+
+  OmahaHashCalculator calculator(algorithm);
+  {
+    // Everything read has been hashed once the pipeline goes out of scope.
+    HashPipeline pipeline(&calculator);
+    for (uint64 offset = 0; offset < size; ) {
+      TEST_AND_RETURN_FALSE(!should_exit || !g_atomic_int_get(should_exit));
+      const size_t length = min(static_cast<uint64>(kReadSize),
+                                size - offset);
+      // Direct reads cover whole blocks; only what's wanted is hashed.
+      const size_t read_length =
+          o_direct ? (length + kAlignment - 1) / kAlignment * kAlignment :
+          length;
+      char* buffer = pipeline.GetFreeBuffer();
+      ssize_t rc = PReadAll(fd, buffer, read_length, offset, o_direct);
+      TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
+      if (static_cast<size_t>(rc) < length) {
+        LOG(ERROR) << path << " is shorter than the " << size
+                   << " bytes to be hashed.";
+        return false;
+      }
+      pipeline.Hash(buffer, length);
+      offset += length;
+    }
+  }
+  calculator.Finalize();
+  *out_hash = calculator.hash();
+  return true;
+}
+
+void PartitionVerifierAction::PerformAction() {
+  if (!HasInputObject()) {
+    LOG(ERROR) << "No input object. Aborting.";
+    processor_->ActionComplete(this, false);
+    return;
+  }
+  MoveInputObject(&install_plan_);
+
+  if (install_plan_.install_hash.empty()) {
+    LOG(INFO) << "No hash for " << install_plan_.install_path
+              << "; not verifying it.";
+    if (HasOutputPipe())
+      MoveOutputObject(&install_plan_);
+    processor_->ActionComplete(this, true);
+    return;
+  }
+
+  g_atomic_int_set(&thread_should_exit_, 0);
+  collect_source_id_ = 0;
+  CHECK_EQ(pthread_create(&helper_thread_, NULL, HelperThreadMainStatic, this),
+           0);
+  thread_running_ = true;
+}
+
+void PartitionVerifierAction::TerminateProcessing() {
+  if (!thread_running_)
+    return;
+  g_atomic_int_set(&thread_should_exit_, 1);
+  CHECK_EQ(pthread_join(helper_thread_, NULL), 0);
+  thread_running_ = false;
+  // The thread may have finished and asked for CollectThread() already.
+  if (collect_source_id_)
+    g_source_remove(collect_source_id_);
+  collect_source_id_ = 0;
+}
+
+void* PartitionVerifierAction::HelperThreadMain() {
+  OmahaHashCalculator::Algorithm algorithm = OmahaHashCalculator::kSha256;
+  bool success = OmahaHashCalculator::AlgorithmForHash(
+      install_plan_.install_hash, &algorithm);
+  if (!success)
+    LOG(ERROR) << "Unrecognized hash " << install_plan_.install_hash;
+  string hash;
+  if (success) {
+    success = HashPartition(install_plan_.install_path,
+                            install_plan_.install_size,
+                            algorithm,
+                            &thread_should_exit_,
+                            &hash);
+  }
+  if (success && hash != install_plan_.install_hash) {
+    LOG(ERROR) << "Verification of " << install_plan_.install_path
+               << " failed. Expected hash " << install_plan_.install_hash
+               << " but got hash " << hash;
+    success = false;
+  }
+
+  // Tell main thread that we're done
+  collect_source_id_ = g_timeout_add(0, CollectThreadStatic, this);
+  return reinterpret_cast<void*>(success ? 0 : 1);
+}
+
+void PartitionVerifierAction::CollectThread() {
+  void *thread_ret_value = NULL;
+  CHECK_EQ(pthread_join(helper_thread_, &thread_ret_value), 0);
+  thread_running_ = false;
+  collect_source_id_ = 0;
+  bool success = (thread_ret_value == 0);
+  if (success) {
+    LOG(INFO) << install_plan_.install_path << " verified.";
+    AddBytesIn(install_plan_.install_size);
+    if (HasOutputPipe())
+      MoveOutputObject(&install_plan_);
+  }
+  processor_->ActionComplete(this, success);
+}
+
+}  // namespace chromeos_update_engine
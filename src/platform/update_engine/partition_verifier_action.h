@@ -0,0 +1,108 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PARTITION_VERIFIER_ACTION_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PARTITION_VERIFIER_ACTION_H__
+
+#include <pthread.h>
+#include <string>
+#include <glib.h>
+#include "update_engine/action.h"
+#include "update_engine/install_plan.h"
+#include "update_engine/omaha_hash_calculator.h"
+
+// PartitionVerifierAction reads back the install device once an update has
+// been written to it and checks that its first install_size bytes have
+// install_hash, as given by the InstallPlan. It fails if they don't, so that
+// the new partition is never marked bootable. If the InstallPlan has no
+// install_hash, the action succeeds without reading anything.
+//
+// The device is read with O_DIRECT where possible, so that what's checked is
+// what's on disk rather than what's still in the page cache. Reads go into a
+// few large buffers, and a second thread hashes each one while the next is
+// being read, so the check runs at close to the speed of the device.
+//
+// Like FilesystemCopierAction, this uses a helper thread, which is fully
+// encapsulated by the action: all interaction with the ActionProcessor
+// happens on the main thread.
+
+namespace chromeos_update_engine {
+
+class PartitionVerifierAction;
+
+template<>
+class ActionTraits<PartitionVerifierAction> {
+ public:
+  // Takes the install plan as input
+  typedef InstallPlan InputObjectType;
+  // Passes the install plan as output
+  typedef InstallPlan OutputObjectType;
+};
+
+class PartitionVerifierAction : public Action<PartitionVerifierAction> {
+ public:
+  PartitionVerifierAction()
+      : thread_should_exit_(0),
+        thread_running_(false),
+        collect_source_id_(0) {}
+  typedef ActionTraits<PartitionVerifierAction>::InputObjectType
+      InputObjectType;
+  typedef ActionTraits<PartitionVerifierAction>::OutputObjectType
+      OutputObjectType;
+  void PerformAction();
+  void TerminateProcessing();
+
+  // Debugging/logging
+  static std::string StaticType() { return "PartitionVerifierAction"; }
+  std::string Type() const { return StaticType(); }
+
+  // Hashes the first size bytes of the file or device at path with
+  // algorithm and puts the base64 encoded hash in *out_hash. Stops early
+  // and fails if should_exit (which may be NULL) becomes nonzero. Returns
+  // true on success; it's an error for path to be shorter than size.
+  static bool HashPartition(const std::string& path,
+                            uint64 size,
+                            OmahaHashCalculator::Algorithm algorithm,
+                            volatile gint* should_exit,
+                            std::string* out_hash);
+
+ private:
+  // Returns NULL if the device has the expected hash.
+  void* HelperThreadMain();
+  static void* HelperThreadMainStatic(void* data) {
+    PartitionVerifierAction* self =
+        reinterpret_cast<PartitionVerifierAction*>(data);
+    return self->HelperThreadMain();
+  }
+
+  // Joins the thread and tells the processor that we're done
+  void CollectThread();
+  // GMainLoop callback function:
+  static gboolean CollectThreadStatic(gpointer data) {
+    PartitionVerifierAction* self =
+        reinterpret_cast<PartitionVerifierAction*>(data);
+    self->CollectThread();
+    return FALSE;
+  }
+
+  pthread_t helper_thread_;
+
+  volatile gint thread_should_exit_;
+
+  // Whether helper_thread_ needs to be joined.
+  bool thread_running_;
+
+  // The main loop source that runs CollectThread(). Set by the helper
+  // thread just before it exits.
+  guint collect_source_id_;
+
+  // The install plan we're passed in via the input pipe.
+  InstallPlan install_plan_;
+
+  DISALLOW_COPY_AND_ASSIGN(PartitionVerifierAction);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PARTITION_VERIFIER_ACTION_H__
@@ -0,0 +1,243 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <sys/time.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <glib.h>
+#include <gtest/gtest.h>
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/partition_verifier_action.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class PartitionVerifierActionTest : public ::testing::Test { };
+
+namespace {
+const char* const kImagePath = "/tmp/PartitionVerifierActionTest.image";
+
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+vector<char> MakeData(size_t size) {
+  vector<char> data(size);
+  unsigned int seed = 1;
+  for (size_t i = 0; i < size; i++)
+    data[i] = static_cast<char>(rand_r(&seed));
+  return data;
+}
+
+string Sha256Of(const vector<char>& data, size_t size) {
+  return OmahaHashCalculator::OmahaHashOfBytes(&data[0], size,
+                                               OmahaHashCalculator::kSha256);
+}
+
+class PartitionVerifierActionTestDelegate : public ActionProcessorDelegate {
+ public:
+  PartitionVerifierActionTestDelegate(GMainLoop* loop)
+      : loop_(loop), ran_(false), success_(false) {}
+  void ProcessingDone(const ActionProcessor* processor, bool success) {
+    g_main_loop_quit(loop_);
+  }
+  void ActionCompleted(ActionProcessor* processor,
+                       AbstractAction* action,
+                       bool success) {
+    if (action->Type() == PartitionVerifierAction::StaticType()) {
+      ran_ = true;
+      success_ = success;
+    }
+  }
+  bool ran() { return ran_; }
+  bool success() { return success_; }
+ private:
+  GMainLoop* loop_;
+  bool ran_;
+  bool success_;
+};
+
+gboolean StartProcessorInRunLoop(gpointer data) {
+  reinterpret_cast<ActionProcessor*>(data)->StartProcessing();
+  return FALSE;
+}
+
+// Runs a PartitionVerifierAction on install_plan and returns whether it
+// succeeded. On success, the plan must come out unchanged.
+bool RunVerifier(const InstallPlan& install_plan) {
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
+  ActionProcessor processor;
+  PartitionVerifierActionTestDelegate delegate(loop);
+  processor.set_delegate(&delegate);
+
+  ObjectFeederAction<InstallPlan> feeder_action;
+  PartitionVerifierAction verifier_action;
+  ObjectCollectorAction<InstallPlan> collector_action;
+  BondActions(&feeder_action, &verifier_action);
+  BondActions(&verifier_action, &collector_action);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&verifier_action);
+  processor.EnqueueAction(&collector_action);
+  feeder_action.set_obj(install_plan);
+
+  g_timeout_add(0, &StartProcessorInRunLoop, &processor);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+
+  EXPECT_TRUE(delegate.ran());
+  if (delegate.success())
+    EXPECT_TRUE(install_plan == collector_action.object());
+  return delegate.success();
+}
+}  // namespace {}
+
+TEST(PartitionVerifierActionTest, HashPartitionTest) {
+  // Several read buffers' worth, not a whole number of blocks.
+  const vector<char> data = MakeData(13 * 1024 * 1024 + 123);
+  ASSERT_TRUE(WriteFileVector(kImagePath, data));
+  const size_t kSizes[] = { 0, 1, 4096, 4 * 1024 * 1024, 4 * 1024 * 1024 + 1,
+                            data.size() };
+  for (size_t i = 0; i < arraysize(kSizes); i++) {
+    string hash;
+    EXPECT_TRUE(PartitionVerifierAction::HashPartition(
+        kImagePath, kSizes[i], OmahaHashCalculator::kSha256, NULL, &hash));
+    EXPECT_EQ(Sha256Of(data, kSizes[i]), hash) << "size " << kSizes[i];
+  }
+  string hash;
+  EXPECT_TRUE(PartitionVerifierAction::HashPartition(
+      kImagePath, data.size(), OmahaHashCalculator::kSha1, NULL, &hash));
+  EXPECT_EQ(OmahaHashCalculator::OmahaHashOfData(data), hash);
+
+  // Too short.
+  EXPECT_FALSE(PartitionVerifierAction::HashPartition(
+      kImagePath, data.size() + 1, OmahaHashCalculator::kSha256, NULL,
+      &hash));
+  EXPECT_FALSE(PartitionVerifierAction::HashPartition(
+      "/tmp/PartitionVerifierActionTest.nonexistent", 1,
+      OmahaHashCalculator::kSha256, NULL, &hash));
+
+  // Told to stop.
+  volatile gint should_exit = 1;
+  EXPECT_FALSE(PartitionVerifierAction::HashPartition(
+      kImagePath, data.size(), OmahaHashCalculator::kSha256, &should_exit,
+      &hash));
+  unlink(kImagePath);
+}
+
+TEST(PartitionVerifierActionTest, TerminateTest) {
+  const vector<char> data = MakeData(16 * 1024 * 1024);
+  ASSERT_TRUE(WriteFileVector(kImagePath, data));
+  InstallPlan install_plan(false, "", "", kImagePath);
+  install_plan.install_size = data.size();
+  install_plan.install_hash = Sha256Of(data, data.size());
+
+  ActionProcessor processor;
+  ObjectFeederAction<InstallPlan> feeder_action;
+  PartitionVerifierAction verifier_action;
+  BondActions(&feeder_action, &verifier_action);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&verifier_action);
+  feeder_action.set_obj(install_plan);
+  processor.StartProcessing();
+  EXPECT_TRUE(verifier_action.IsRunning());
+  // Stops the helper thread, and the main loop never hears from it.
+  processor.StopProcessing();
+  EXPECT_FALSE(processor.IsRunning());
+  while (g_main_context_pending(NULL))
+    g_main_context_iteration(NULL, FALSE);
+  unlink(kImagePath);
+}
+
+TEST(PartitionVerifierActionTest, NoHashTest) {
+  // Nothing is read, so the device needn't even exist.
+  InstallPlan install_plan(false, "", "", "/dev/null/nonexistent");
+  EXPECT_TRUE(RunVerifier(install_plan));
+}
+
+TEST(PartitionVerifierActionTest, RunAsRootLoopDeviceTest) {
+  ASSERT_EQ(0, getuid());
+  // The image is a whole number of blocks, as a device is, but the payload
+  // only covers part of the last one.
+  vector<char> data = MakeData(6 * 1024 * 1024);
+  ASSERT_TRUE(WriteFileVector(kImagePath, data));
+  string dev = GetUnusedLoopDevice();
+  ASSERT_EQ(0, System(string("losetup ") + dev + " " + kImagePath));
+
+  InstallPlan install_plan(false, "", "", dev);
+  install_plan.install_size = data.size() - 1000;
+  install_plan.install_hash = Sha256Of(data, install_plan.install_size);
+  EXPECT_TRUE(RunVerifier(install_plan));
+
+  // Only the first install_size bytes count.
+  InstallPlan wrong_plan = install_plan;
+  wrong_plan.install_hash = Sha256Of(data, data.size());
+  EXPECT_FALSE(RunVerifier(wrong_plan));
+
+  // Bigger than the device.
+  InstallPlan too_big_plan = install_plan;
+  too_big_plan.install_size = data.size() + 4096;
+  EXPECT_FALSE(RunVerifier(too_big_plan));
+
+  // A corrupt byte in the middle of the device.
+  EXPECT_EQ(0, System(string("losetup -d ") + dev));
+  data[3 * 1024 * 1024 + 17] ^= 1;
+  ASSERT_TRUE(WriteFileVector(kImagePath, data));
+  ASSERT_EQ(0, System(string("losetup ") + dev + " " + kImagePath));
+  EXPECT_FALSE(RunVerifier(install_plan));
+
+  EXPECT_EQ(0, System(string("losetup -d ") + dev));
+  unlink(kImagePath);
+}
+
+// Not so much a test as a benchmark: compares HashPartition(), which hashes
+// one buffer while reading the next, to reading and hashing in turn, on a
+// loopback device.
+TEST(PartitionVerifierActionTest, RunAsRootHashBenchmarkTest) {
+  ASSERT_EQ(0, getuid());
+  const int kImageSizeMiB = 64;
+  const vector<char> data = MakeData(kImageSizeMiB * 1024 * 1024);
+  ASSERT_TRUE(WriteFileVector(kImagePath, data));
+  string dev = GetUnusedLoopDevice();
+  ASSERT_EQ(0, System(string("losetup ") + dev + " " + kImagePath));
+  const string expected_hash = Sha256Of(data, data.size());
+
+  const double serial_start = Now();
+  {
+    int fd = open(dev.c_str(), O_RDONLY | O_LARGEFILE, 0);
+    ASSERT_GE(fd, 0);
+    OmahaHashCalculator calculator(OmahaHashCalculator::kSha256);
+    vector<char> buf(4 * 1024 * 1024);
+    ssize_t rc;
+    while ((rc = read(fd, &buf[0], buf.size())) > 0)
+      calculator.Update(&buf[0], rc);
+    close(fd);
+    calculator.Finalize();
+    EXPECT_EQ(expected_hash, calculator.hash());
+  }
+  const double pipelined_start = Now();
+  string hash;
+  EXPECT_TRUE(PartitionVerifierAction::HashPartition(
+      dev, data.size(), OmahaHashCalculator::kSha256, NULL, &hash));
+  const double pipelined_end = Now();
+  EXPECT_EQ(expected_hash, hash);
+
+  LOG(INFO) << "Hashed " << kImageSizeMiB << " MiB device. Read then hash: "
+            << kImageSizeMiB / (pipelined_start - serial_start)
+            << " MiB/s, pipelined: "
+            << kImageSizeMiB / (pipelined_end - pipelined_start) << " MiB/s";
+
+  EXPECT_EQ(0, System(string("losetup -d ") + dev));
+  unlink(kImagePath);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,228 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/pipelined_file_writer.h"
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+using std::max;
+using std::min;
+
+namespace chromeos_update_engine {
+
+PipelinedFileWriter::PipelinedFileWriter(FileWriter* next,
+                                         OmahaHashCalculator* hash_calculator,
+                                         size_t buffer_size)
+    : next_(next),
+      hash_calculator_(hash_calculator),
+      buffer_(new char[buffer_size]),
+      buffer_size_(buffer_size),
+      mutex_(g_mutex_new()),
+      data_available_(g_cond_new()),
+      space_available_(g_cond_new()),
+      bytes_received_(0),
+      closing_(false),
+      error_(0),
+      checkpoint_delegate_(NULL),
+      checkpoint_offset_(0) {
+  CHECK(next_);
+  CHECK_GT(buffer_size_, 0);
+  for (int i = 0; i < kNumStages; i++) {
+    bytes_processed_[i] = 0;
+    threads_[i] = NULL;
+    thread_args_[i].writer = this;
+    thread_args_[i].stage = static_cast<Stage>(i);
+  }
+}
+
+PipelinedFileWriter::~PipelinedFileWriter() {
+  StopThreads();
+  g_cond_free(space_available_);
+  g_cond_free(data_available_);
+  g_mutex_free(mutex_);
+}
+
+int PipelinedFileWriter::Open(const char* path, int flags, mode_t mode) {
+  CHECK(!threads_[kStageWrite]) << "Already open";
+  int rc = next_->Open(path, flags, mode);
+  if (rc < 0)
+    return rc;
+  bytes_received_ = 0;
+  closing_ = false;
+  error_ = 0;
+  checkpoint_delegate_ = NULL;
+  for (int i = 0; i < kNumStages; i++) {
+    bytes_processed_[i] = 0;
+    if (i == kStageHash && !hash_calculator_)
+      continue;
+    threads_[i] = g_thread_create(&StaticStageMain, &thread_args_[i], TRUE,
+                                  NULL);
+    CHECK(threads_[i]);
+  }
+  return 0;
+}
+
+int PipelinedFileWriter::Write(const void* bytes, size_t count) {
+  CHECK(threads_[kStageWrite]) << "Not open";
+  const char* data = reinterpret_cast<const char*>(bytes);
+  size_t copied = 0;
+  g_mutex_lock(mutex_);
+  while (copied < count && error_ == 0) {
+    // Wait until at least one byte of the ring is free.
+    while (BytesInUse() == buffer_size_ && error_ == 0)
+      g_cond_wait(space_available_, mutex_);
+    if (error_ != 0)
+      break;
+    const size_t offset = bytes_received_ % buffer_size_;
+    const size_t length = min(count - copied,
+                              min(buffer_size_ - offset,
+                                  static_cast<size_t>(buffer_size_ -
+                                                      BytesInUse())));
+    // The workers never touch the free part of the ring, so it's safe to
+    // copy without holding the lock.
+    g_mutex_unlock(mutex_);
+    memcpy(&buffer_[offset], data + copied, length);
+    g_mutex_lock(mutex_);
+    copied += length;
+    bytes_received_ += length;
+    g_cond_broadcast(data_available_);
+  }
+  const int error = error_;
+  g_mutex_unlock(mutex_);
+  return error != 0 ? error : count;
+}
+
+int PipelinedFileWriter::Close() {
+  StopThreads();
+  int rc = next_->Close();
+  return error_ != 0 ? error_ : rc;
+}
+
+int PipelinedFileWriter::Flush() {
+  g_mutex_lock(mutex_);
+  while (BytesInUse() > 0 || checkpoint_delegate_)
+    g_cond_wait(space_available_, mutex_);
+  const int error = error_;
+  g_mutex_unlock(mutex_);
+  return error;
+}
+
+bool PipelinedFileWriter::RequestCheckpoint(CheckpointDelegate* delegate) {
+  CHECK(delegate);
+  g_mutex_lock(mutex_);
+  const bool ret = !checkpoint_delegate_;
+  if (ret) {
+    checkpoint_delegate_ = delegate;
+    checkpoint_offset_ = bytes_received_;
+    g_cond_broadcast(data_available_);
+  }
+  g_mutex_unlock(mutex_);
+  return ret;
+}
+
+uint64 PipelinedFileWriter::BytesBuffered() {
+  g_mutex_lock(mutex_);
+  const uint64 ret = BytesInUse();
+  g_mutex_unlock(mutex_);
+  return ret;
+}
+
+gpointer PipelinedFileWriter::StaticStageMain(gpointer data) {
+  ThreadArgs* args = reinterpret_cast<ThreadArgs*>(data);
+  args->writer->StageMain(args->stage);
+  return NULL;
+}
+
+void PipelinedFileWriter::StageMain(Stage stage) {
+  g_mutex_lock(mutex_);
+  for (;;) {
+    if (stage == kStageWrite && AtCheckpoint()) {
+      CheckpointDelegate* delegate = checkpoint_delegate_;
+      const uint64 checkpoint_offset = checkpoint_offset_;
+      const bool failed = error_ != 0;
+      g_mutex_unlock(mutex_);
+      if (!failed)
+        delegate->CheckpointReached(checkpoint_offset);
+      g_mutex_lock(mutex_);
+      checkpoint_delegate_ = NULL;
+      g_cond_broadcast(data_available_);
+      g_cond_broadcast(space_available_);
+      continue;
+    }
+    // Nothing is processed past a pending checkpoint.
+    const uint64 end =
+        checkpoint_delegate_ ? checkpoint_offset_ : bytes_received_;
+    if (bytes_processed_[stage] == end) {
+      if (closing_ && !checkpoint_delegate_)
+        break;  // Closing, and nothing left to do.
+      g_cond_wait(data_available_, mutex_);
+      continue;
+    }
+    const size_t offset = bytes_processed_[stage] % buffer_size_;
+    const size_t count =
+        min(static_cast<size_t>(end - bytes_processed_[stage]),
+            buffer_size_ - offset);
+    // Once a write has failed, the remaining data is just drained so that
+    // Write() and Close() don't block.
+    const bool skip = (stage == kStageWrite && error_ != 0);
+    g_mutex_unlock(mutex_);
+    int rc = skip ? 0 : ProcessBytes(stage, offset, count);
+    g_mutex_lock(mutex_);
+    if (rc < 0 && error_ == 0)
+      error_ = rc;
+    bytes_processed_[stage] += count;
+    g_cond_broadcast(space_available_);
+    // The write stage may be waiting for this one to reach a checkpoint.
+    if (checkpoint_delegate_)
+      g_cond_broadcast(data_available_);
+  }
+  g_mutex_unlock(mutex_);
+}
+
+int PipelinedFileWriter::ProcessBytes(Stage stage, size_t offset,
+                                      size_t count) {
+  if (stage == kStageHash) {
+    hash_calculator_->Update(&buffer_[offset], count);
+    return 0;
+  }
+  int rc = next_->Write(&buffer_[offset], count);
+  if (rc < 0)
+    return rc;
+  return static_cast<size_t>(rc) == count ? 0 : -EIO;
+}
+
+bool PipelinedFileWriter::AtCheckpoint() const {
+  if (!checkpoint_delegate_)
+    return false;
+  for (int i = 0; i < kNumStages; i++) {
+    if (threads_[i] && bytes_processed_[i] != checkpoint_offset_)
+      return false;
+  }
+  return true;
+}
+
+uint64 PipelinedFileWriter::BytesInUse() const {
+  uint64 ret = 0;
+  for (int i = 0; i < kNumStages; i++) {
+    if (threads_[i])
+      ret = max(ret, bytes_received_ - bytes_processed_[i]);
+  }
+  return ret;
+}
+
+void PipelinedFileWriter::StopThreads() {
+  g_mutex_lock(mutex_);
+  closing_ = true;
+  g_cond_broadcast(data_available_);
+  g_mutex_unlock(mutex_);
+  for (int i = 0; i < kNumStages; i++) {
+    if (threads_[i]) {
+      g_thread_join(threads_[i]);
+      threads_[i] = NULL;
+    }
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,143 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_PIPELINED_FILE_WRITER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_PIPELINED_FILE_WRITER_H__
+
+#include <glib.h>
+#include "base/basictypes.h"
+#include "base/scoped_ptr.h"
+#include "update_engine/file_writer.h"
+#include "update_engine/omaha_hash_calculator.h"
+
+// PipelinedFileWriter is a FileWriter that moves the work of writing (and
+// hashing) off of the calling thread. Write() copies the data into a
+// bounded ring buffer and returns. Two worker threads consume the buffer in
+// parallel: one passes the data to the underlying FileWriter (which may
+// decompress it, apply a delta, etc.), and the other feeds it to an
+// OmahaHashCalculator. Write() only blocks if the ring buffer is full.
+//
+// The caller can avoid blocking altogether by watching BytesBuffered(): see
+// DownloadAction, which pauses its HttpFetcher while the buffer is nearly
+// full.
+//
+// Since writes complete asynchronously, an error from the underlying
+// FileWriter is returned from a later call to Write(), or from Close().
+// Close() waits for all buffered data to be written and hashed, after which
+// the hash calculator may be finalized by the caller.
+//
+// To save progress without blocking, RequestCheckpoint() has the workers stop
+// at the current offset and call back on the write thread, with the
+// underlying FileWriter and hash calculator in step, before they go on.
+
+namespace chromeos_update_engine {
+
+class PipelinedFileWriter : public FileWriter {
+ public:
+  // Receives the checkpoints asked for with RequestCheckpoint().
+  class CheckpointDelegate {
+   public:
+    virtual ~CheckpointDelegate() {}
+
+    // Called on the write thread once the first offset bytes passed to
+    // Write() have been written and hashed, and before any more are. Until
+    // it returns, the underlying FileWriter and hash calculator may be used
+    // as after Flush().
+    virtual void CheckpointReached(uint64 offset) = 0;
+  };
+
+  // Does not take ownership of next or hash_calculator, which may be NULL.
+  // Neither may be used by anyone else between Open() and Close().
+  PipelinedFileWriter(FileWriter* next,
+                      OmahaHashCalculator* hash_calculator,
+                      size_t buffer_size);
+  virtual ~PipelinedFileWriter();
+
+  virtual int Open(const char* path, int flags, mode_t mode);
+  virtual int Write(const void* bytes, size_t count);
+  virtual int Close();
+
+  // Waits until all data passed to Write() so far has been written and
+  // hashed. Until the next call to Write(), the underlying FileWriter and
+  // hash calculator may then be used by the caller. Returns 0 or -errno.
+  int Flush();
+
+  // Asks for delegate->CheckpointReached() to be called once all data passed
+  // to Write() so far has been written and hashed. Unlike Flush(), this
+  // doesn't wait. Returns false, and does nothing, if the last checkpoint
+  // hasn't been reached yet. No checkpoint is reached after a write error.
+  bool RequestCheckpoint(CheckpointDelegate* delegate);
+
+  // Returns how many of the bytes passed to Write() haven't been written and
+  // hashed yet. A caller that mustn't block can stop writing while this is
+  // close to buffer_size, and start again once it's dropped.
+  uint64 BytesBuffered();
+
+ private:
+  // The stages of the pipeline, each of which runs on its own thread.
+  enum Stage {
+    kStageWrite = 0,
+    kStageHash,
+    kNumStages
+  };
+
+  struct ThreadArgs {
+    PipelinedFileWriter* writer;
+    Stage stage;
+  };
+
+  static gpointer StaticStageMain(gpointer data);
+  void StageMain(Stage stage);
+
+  // Processes the count bytes at buffer_[offset] for stage. Returns 0 or
+  // -errno.
+  int ProcessBytes(Stage stage, size_t offset, size_t count);
+
+  // True if there's a pending checkpoint and all stages have reached it.
+  // Must be called with mutex_ held.
+  bool AtCheckpoint() const;
+
+  // Returns the number of bytes that have been put into buffer_ but not yet
+  // processed by all stages. Must be called with mutex_ held.
+  uint64 BytesInUse() const;
+
+  // Waits for the workers to finish and joins them.
+  void StopThreads();
+
+  FileWriter* const next_;
+  OmahaHashCalculator* const hash_calculator_;
+
+  // The ring buffer. Byte n of the stream lives at buffer_[n % buffer_size_].
+  scoped_array<char> buffer_;
+  const size_t buffer_size_;
+
+  // Protects everything below.
+  GMutex* mutex_;
+  // Signaled when data is added or the writer is closing.
+  GCond* data_available_;
+  // Signaled when a stage has consumed data.
+  GCond* space_available_;
+
+  // Total bytes passed to Write().
+  uint64 bytes_received_;
+  // Total bytes consumed by each stage.
+  uint64 bytes_processed_[kNumStages];
+  // Set when Close() has been called; the workers exit once they're done.
+  bool closing_;
+  // The first error from the write stage, or 0.
+  int error_;
+  // The pending checkpoint, if any. The stages stop at checkpoint_offset_
+  // until the write stage has passed it to checkpoint_delegate_.
+  CheckpointDelegate* checkpoint_delegate_;
+  uint64 checkpoint_offset_;
+
+  GThread* threads_[kNumStages];
+  ThreadArgs thread_args_[kNumStages];
+
+  DISALLOW_COPY_AND_ASSIGN(PipelinedFileWriter);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_PIPELINED_FILE_WRITER_H__
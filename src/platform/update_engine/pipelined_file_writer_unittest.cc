@@ -0,0 +1,182 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <errno.h>
+#include <string>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/mock_file_writer.h"
+#include "update_engine/omaha_hash_calculator.h"
+#include "update_engine/pipelined_file_writer.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class PipelinedFileWriterTest : public ::testing::Test { };
+
+namespace {
+// A FileWriter that fails every Write() after the first fail_after bytes.
+class FailingFileWriter : public FileWriter {
+ public:
+  explicit FailingFileWriter(size_t fail_after)
+      : fail_after_(fail_after), bytes_written_(0) {}
+  virtual int Open(const char* path, int flags, mode_t mode) { return 0; }
+  virtual int Write(const void* bytes, size_t count) {
+    if (bytes_written_ + count > fail_after_)
+      return -ENOSPC;
+    bytes_written_ += count;
+    return count;
+  }
+  virtual int Close() { return 0; }
+ private:
+  const size_t fail_after_;
+  size_t bytes_written_;
+};
+
+vector<char> TestData(size_t size) {
+  vector<char> data(size);
+  for (size_t i = 0; i < size; i++)
+    data[i] = static_cast<char>(i * 7 + i / 256);
+  return data;
+}
+}  // namespace {}
+
+TEST(PipelinedFileWriterTest, SimpleTest) {
+  // A ring much smaller than the data and the writes forces wraparound and
+  // makes Write() wait for the workers.
+  const vector<char> data = TestData(100000);
+  MockFileWriter mock_file_writer;
+  OmahaHashCalculator calc;
+  PipelinedFileWriter writer(&mock_file_writer, &calc, 1000);
+  ASSERT_EQ(0, writer.Open("unused", O_CREAT | O_WRONLY, 0644));
+  size_t offset = 0;
+  for (size_t chunk = 1; offset < data.size(); chunk = chunk * 3 + 1) {
+    const size_t count = std::min(chunk, data.size() - offset);
+    EXPECT_EQ(count, writer.Write(&data[offset], count));
+    offset += count;
+  }
+  EXPECT_EQ(0, writer.Close());
+  EXPECT_TRUE(data == mock_file_writer.bytes());
+  calc.Finalize();
+  EXPECT_EQ(OmahaHashCalculator::OmahaHashOfData(data), calc.hash());
+}
+
+TEST(PipelinedFileWriterTest, Sha256Test) {
+  const vector<char> data = TestData(4096);
+  MockFileWriter mock_file_writer;
+  OmahaHashCalculator calc(OmahaHashCalculator::kSha256);
+  PipelinedFileWriter writer(&mock_file_writer, &calc, 512);
+  ASSERT_EQ(0, writer.Open("unused", O_CREAT | O_WRONLY, 0644));
+  EXPECT_EQ(data.size(), writer.Write(&data[0], data.size()));
+  EXPECT_EQ(0, writer.Close());
+  EXPECT_TRUE(data == mock_file_writer.bytes());
+  calc.Finalize();
+  EXPECT_EQ(OmahaHashCalculator::OmahaHashOfBytes(
+                &data[0], data.size(), OmahaHashCalculator::kSha256),
+            calc.hash());
+}
+
+TEST(PipelinedFileWriterTest, NoHashTest) {
+  const vector<char> data = TestData(3000);
+  MockFileWriter mock_file_writer;
+  PipelinedFileWriter writer(&mock_file_writer, NULL, 128);
+  ASSERT_EQ(0, writer.Open("unused", O_CREAT | O_WRONLY, 0644));
+  EXPECT_EQ(data.size(), writer.Write(&data[0], data.size()));
+  EXPECT_EQ(0, writer.Close());
+  EXPECT_TRUE(data == mock_file_writer.bytes());
+}
+
+TEST(PipelinedFileWriterTest, FlushTest) {
+  const vector<char> data = TestData(5000);
+  MockFileWriter mock_file_writer;
+  OmahaHashCalculator calc;
+  PipelinedFileWriter writer(&mock_file_writer, &calc, 1024);
+  ASSERT_EQ(0, writer.Open("unused", O_CREAT | O_WRONLY, 0644));
+  EXPECT_EQ(data.size(), writer.Write(&data[0], data.size()));
+  EXPECT_EQ(0, writer.Flush());
+  // Everything has reached the underlying writer and the hash before Close().
+  EXPECT_TRUE(data == mock_file_writer.bytes());
+  string context;
+  calc.GetContext(&context);
+  OmahaHashCalculator expected_calc;
+  expected_calc.Update(&data[0], data.size());
+  string expected_context;
+  expected_calc.GetContext(&expected_context);
+  EXPECT_EQ(expected_context, context);
+  EXPECT_EQ(0, writer.Close());
+}
+
+namespace {
+// Records what had been written and hashed at each checkpoint.
+class TestCheckpointDelegate : public PipelinedFileWriter::CheckpointDelegate {
+ public:
+  TestCheckpointDelegate(MockFileWriter* file_writer,
+                         OmahaHashCalculator* calc)
+      : file_writer_(file_writer), calc_(calc) {}
+  virtual void CheckpointReached(uint64 offset) {
+    offsets_.push_back(offset);
+    bytes_written_.push_back(file_writer_->bytes().size());
+    string context;
+    calc_->GetContext(&context);
+    contexts_.push_back(context);
+  }
+  MockFileWriter* file_writer_;
+  OmahaHashCalculator* calc_;
+  vector<uint64> offsets_;
+  vector<size_t> bytes_written_;
+  vector<string> contexts_;
+};
+}  // namespace {}
+
+TEST(PipelinedFileWriterTest, CheckpointTest) {
+  const vector<char> data = TestData(20000);
+  MockFileWriter mock_file_writer;
+  OmahaHashCalculator calc;
+  TestCheckpointDelegate delegate(&mock_file_writer, &calc);
+  PipelinedFileWriter writer(&mock_file_writer, &calc, 1000);
+  ASSERT_EQ(0, writer.Open("unused", O_CREAT | O_WRONLY, 0644));
+  // A checkpoint isn't taken while another one is pending, so there may be
+  // fewer than asked for.
+  for (size_t offset = 0; offset < data.size(); offset += 500) {
+    EXPECT_EQ(500, writer.Write(&data[offset], 500));
+    if (offset % 5000 == 0)
+      writer.RequestCheckpoint(&delegate);
+  }
+  EXPECT_EQ(0, writer.Close());
+  EXPECT_TRUE(data == mock_file_writer.bytes());
+
+  ASSERT_FALSE(delegate.offsets_.empty());
+  for (size_t i = 0; i < delegate.offsets_.size(); i++) {
+    // The workers were stopped exactly at the checkpoint.
+    const uint64 offset = delegate.offsets_[i];
+    EXPECT_EQ(offset, delegate.bytes_written_[i]);
+    OmahaHashCalculator expected_calc;
+    expected_calc.Update(&data[0], offset);
+    string expected_context;
+    expected_calc.GetContext(&expected_context);
+    EXPECT_EQ(expected_context, delegate.contexts_[i]);
+  }
+}
+
+TEST(PipelinedFileWriterTest, WriteErrorTest) {
+  const vector<char> data = TestData(10000);
+  FailingFileWriter failing_file_writer(1000);
+  OmahaHashCalculator calc;
+  PipelinedFileWriter writer(&failing_file_writer, &calc, 256);
+  ASSERT_EQ(0, writer.Open("unused", O_CREAT | O_WRONLY, 0644));
+  // The error may surface from a Write() or not until Close(), but it must
+  // surface, and nothing may block.
+  int rc = 0;
+  for (size_t offset = 0; offset < data.size() && rc >= 0; offset += 100)
+    rc = writer.Write(&data[offset], 100);
+  if (rc >= 0)
+    rc = writer.Close();
+  else
+    EXPECT_EQ(-ENOSPC, writer.Close());
+  EXPECT_EQ(-ENOSPC, rc);
+}
+
+}  // namespace chromeos_update_engine
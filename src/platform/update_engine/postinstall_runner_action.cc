@@ -5,11 +5,14 @@
 #include "update_engine/postinstall_runner_action.h"
 #include <sys/mount.h>
 #include <stdlib.h>
+#include <vector>
+#include "update_engine/subprocess.h"
 #include "update_engine/utils.h"
 
 namespace chromeos_update_engine {
 
 using std::string;
+using std::vector;
 
 namespace {
 const string kMountPath(string(utils::kStatefulPartition) + "/au_destination");
@@ -18,30 +21,56 @@ const string kPostinstallScript("/postinst");
 
 void PostinstallRunnerAction::PerformAction() {
   CHECK(HasInputObject());
-  const string install_device = GetInputObject();
+  install_device_ = GetInputObject();
 
-  int rc = mount(install_device.c_str(), kMountPath.c_str(), "ext3", 0, NULL);
+  int rc = mount(install_device_.c_str(), kMountPath.c_str(), "ext3", 0,
+                 NULL);
   if (rc < 0) {
-    LOG(ERROR) << "Unable to mount destination device " << install_device
+    LOG(ERROR) << "Unable to mount destination device " << install_device_
                << " onto " << kMountPath;
     processor_->ActionComplete(this, false);
     return;
   }
 
   // run postinstall script
-  rc = system((kMountPath + kPostinstallScript + " " + install_device).c_str());
-  bool success = (rc == 0);
+  vector<string> command;
+  command.push_back(kMountPath + kPostinstallScript);
+  command.push_back(install_device_);
+  subprocess_tag_ = Subprocess::Get().ExecWithTimeout(
+      command, kPostinstallTimeoutSeconds, StaticCompletePostinstall, this);
+  if (!subprocess_tag_) {
+    LOG(ERROR) << "Unable to run " << command[0];
+    if (umount(kMountPath.c_str()) < 0)
+      LOG(ERROR) << "Unable to umount destination device";
+    processor_->ActionComplete(this, false);
+  }
+}
+
+void PostinstallRunnerAction::TerminateProcessing() {
+  if (!subprocess_tag_)
+    return;
+  Subprocess::Get().CancelExec(subprocess_tag_);
+  Subprocess::Get().KillExec(subprocess_tag_);
+  subprocess_tag_ = 0;
+  // The script may take a moment to die, so let the unmount finish then.
+  if (umount2(kMountPath.c_str(), MNT_DETACH) < 0)
+    LOG(ERROR) << "Unable to umount destination device";
+}
+
+void PostinstallRunnerAction::CompletePostinstall(int return_code) {
+  subprocess_tag_ = 0;
+  bool success = (return_code == 0);
   if (!success) {
-    LOG(ERROR) << "Postinst command failed with code: " << rc;
+    LOG(ERROR) << "Postinst command failed with code: " << return_code;
   }
 
-  rc = umount(kMountPath.c_str());
+  int rc = umount(kMountPath.c_str());
   if (rc < 0) {
     // non-fatal
     LOG(ERROR) << "Unable to umount destination device";
   }
   if (success && HasOutputPipe()) {
-    SetOutputObject(install_device);
+    SetOutputObject(install_device_);
   }
   processor_->ActionComplete(this, success);
 }
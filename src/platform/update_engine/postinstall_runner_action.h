@@ -9,7 +9,9 @@
 #include "update_engine/action.h"
 
 // The Postinstall Runner Action is responsible for running the postinstall
-// script of a successfully downloaded update.
+// script of a successfully downloaded update. The script runs
+// asynchronously, with its output going to the log, and is killed if it
+// hangs.
 
 namespace chromeos_update_engine {
 
@@ -27,22 +29,37 @@ class ActionTraits<PostinstallRunnerAction> {
 
 class PostinstallRunnerAction : public Action<PostinstallRunnerAction> {
  public:
-  PostinstallRunnerAction() {}
+  PostinstallRunnerAction() : subprocess_tag_(0) {}
   typedef ActionTraits<PostinstallRunnerAction>::InputObjectType
       InputObjectType;
   typedef ActionTraits<PostinstallRunnerAction>::OutputObjectType
       OutputObjectType;
   void PerformAction();
 
-  // This is a synchronous action, and thus TerminateProcessing() should
-  // never be called
-  void TerminateProcessing() { CHECK(false); }
+  // Kills the postinstall script, if it's running.
+  void TerminateProcessing();
 
   // Debugging/logging
   static std::string StaticType() { return "PostinstallRunnerAction"; }
   std::string Type() const { return StaticType(); }
 
+  // A script that runs for longer than this is killed, and the action fails.
+  static const int kPostinstallTimeoutSeconds = 10 * 60;
+
  private:
+  // Unmounts the install device and completes the action once the script
+  // has exited with return_code, a wait() status.
+  void CompletePostinstall(int return_code);
+  static void StaticCompletePostinstall(int return_code, void* p) {
+    reinterpret_cast<PostinstallRunnerAction*>(p)->CompletePostinstall(
+        return_code);
+  }
+
+  std::string install_device_;
+
+  // The Subprocess tag of the running script, or 0.
+  uint32 subprocess_tag_;
+
   DISALLOW_COPY_AND_ASSIGN(PostinstallRunnerAction);
 };
 
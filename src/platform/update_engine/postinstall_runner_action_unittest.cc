@@ -7,6 +7,7 @@
 #include <unistd.h>
 #include <string>
 #include <vector>
+#include <glib.h>
 #include <gtest/gtest.h>
 #include "update_engine/postinstall_runner_action.h"
 #include "update_engine/test_utils.h"
@@ -19,12 +20,19 @@ namespace chromeos_update_engine {
 
 class PostinstallRunnerActionTest : public ::testing::Test {
  public:
-  void DoTest(bool do_losetup, bool do_err_script);
+  void DoTest(bool do_losetup, bool do_err_script, bool do_hang_script);
 };
 
 class PostinstActionProcessorDelegate : public ActionProcessorDelegate {
  public:
-  PostinstActionProcessorDelegate() : success_(false), success_set_(false) {}
+  PostinstActionProcessorDelegate(GMainLoop* loop)
+      : loop_(loop), success_(false), success_set_(false) {}
+  void ProcessingDone(const ActionProcessor* processor, bool success) {
+    g_main_loop_quit(loop_);
+  }
+  void ProcessingStopped(const ActionProcessor* processor) {
+    g_main_loop_quit(loop_);
+  }
   void ActionCompleted(ActionProcessor* processor,
                        AbstractAction* action,
                        bool success) {
@@ -33,26 +41,49 @@ class PostinstActionProcessorDelegate : public ActionProcessorDelegate {
       success_set_ = true;
     }
   }
+  GMainLoop* loop_;
   bool success_;
   bool success_set_;
 };
 
+gboolean StartProcessorInRunLoop(gpointer data) {
+  reinterpret_cast<ActionProcessor*>(data)->StartProcessing();
+  return FALSE;
+}
+
+gboolean StopProcessorInRunLoop(gpointer data) {
+  reinterpret_cast<ActionProcessor*>(data)->StopProcessing();
+  return FALSE;
+}
+
+gboolean QuitMainLoop(gpointer data) {
+  g_main_loop_quit(reinterpret_cast<GMainLoop*>(data));
+  return FALSE;
+}
+
 TEST_F(PostinstallRunnerActionTest, RunAsRootSimpleTest) {
   ASSERT_EQ(0, getuid());
-  DoTest(true, false);
+  DoTest(true, false, false);
 }
 
 TEST_F(PostinstallRunnerActionTest, RunAsRootCantMountTest) {
   ASSERT_EQ(0, getuid());
-  DoTest(false, false);
+  DoTest(false, false, false);
 }
 
 TEST_F(PostinstallRunnerActionTest, RunAsRootErrScriptTest) {
   ASSERT_EQ(0, getuid());
-  DoTest(true, true);
+  DoTest(true, true, false);
+}
+
+TEST_F(PostinstallRunnerActionTest, RunAsRootTerminateTest) {
+  ASSERT_EQ(0, getuid());
+  DoTest(true, false, true);
 }
 
-void PostinstallRunnerActionTest::DoTest(bool do_losetup, bool do_err_script) {
+void PostinstallRunnerActionTest::DoTest(bool do_losetup,
+                                         bool do_err_script,
+                                         bool do_hang_script) {
   ASSERT_EQ(0, getuid()) << "Run me as root. Ideally don't run other tests "
                          << "as root, tho.";
 
@@ -84,6 +115,11 @@ void PostinstallRunnerActionTest::DoTest(bool do_losetup, bool do_err_script) {
   if (do_err_script) {
     script = "#!/bin/bash\nexit 1";
   }
+  if (do_hang_script) {
+    // Stopped before it gets to the touch.
+    script = string("#!/bin/bash\nsleep 30\ntouch ") + cwd +
+        "/postinst_called\n";
+  }
   ASSERT_TRUE(WriteFileString(mountpoint + "/postinst", script));
   ASSERT_EQ(0, System(string("chmod a+x ") + mountpoint + "/postinst"));
 
@@ -109,6 +145,7 @@ void PostinstallRunnerActionTest::DoTest(bool do_losetup, bool do_err_script) {
   if (do_losetup)
     ASSERT_EQ(0, System(string("losetup ") + dev + " " + cwd + "/image.dat"));
 
+  GMainLoop *loop = g_main_loop_new(g_main_context_default(), FALSE);
   ActionProcessor processor;
   ObjectFeederAction<string> feeder_action;
   feeder_action.set_obj(dev);
@@ -116,25 +153,37 @@ void PostinstallRunnerActionTest::DoTest(bool do_losetup, bool do_err_script) {
   BondActions(&feeder_action, &runner_action);
   ObjectCollectorAction<string> collector_action;
   BondActions(&runner_action, &collector_action);
-  PostinstActionProcessorDelegate delegate;
+  PostinstActionProcessorDelegate delegate(loop);
   processor.EnqueueAction(&feeder_action);
   processor.EnqueueAction(&runner_action);
   processor.EnqueueAction(&collector_action);
   processor.set_delegate(&delegate);
-  processor.StartProcessing();
-  ASSERT_FALSE(processor.IsRunning())
-      << "Update test to handle non-asynch actions";
-
-  EXPECT_TRUE(delegate.success_set_);
-  EXPECT_EQ(do_losetup && !do_err_script, delegate.success_);
-  EXPECT_EQ(do_losetup && !do_err_script, !collector_action.object().empty());
-  if (do_losetup && !do_err_script) {
+  g_timeout_add(0, &StartProcessorInRunLoop, &processor);
+  if (do_hang_script)
+    g_timeout_add(500, &StopProcessorInRunLoop, &processor);
+  g_main_loop_run(loop);
+  g_main_loop_unref(loop);
+  EXPECT_FALSE(processor.IsRunning());
+
+  const bool should_succeed = do_losetup && !do_err_script && !do_hang_script;
+  EXPECT_EQ(!do_hang_script, delegate.success_set_);
+  EXPECT_EQ(should_succeed, delegate.success_);
+  EXPECT_EQ(should_succeed, !collector_action.object().empty());
+  if (should_succeed) {
     EXPECT_EQ(dev, collector_action.object());
   }
 
+  if (do_hang_script) {
+    // Give the killed script a moment to die, so the device is unmounted.
+    GMainLoop *wait_loop = g_main_loop_new(g_main_context_default(), FALSE);
+    g_timeout_add(1000, &QuitMainLoop, wait_loop);
+    g_main_loop_run(wait_loop);
+    g_main_loop_unref(wait_loop);
+  }
+
   struct stat stbuf;
   int rc = lstat((string(cwd) + "/postinst_called").c_str(), &stbuf);
-  if (do_losetup && !do_err_script)
+  if (should_succeed)
     ASSERT_EQ(0, rc);
   else
     ASSERT_LT(rc, 0);
@@ -145,12 +194,4 @@ void PostinstallRunnerActionTest::DoTest(bool do_losetup, bool do_err_script) {
   ASSERT_EQ(0, System(string("rm -f ") + cwd + "/image.dat"));
 }
 
-// Death tests don't seem to be working on Hardy
-TEST_F(PostinstallRunnerActionTest, DISABLED_RunAsRootDeathTest) {
-  ASSERT_EQ(0, getuid());
-  PostinstallRunnerAction runner_action;
-  ASSERT_DEATH({ runner_action.TerminateProcessing(); },
-               "postinstall_runner_action.h:.*] Check failed");
-}
-
 }  // namespace chromeos_update_engine
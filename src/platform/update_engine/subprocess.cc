@@ -3,44 +3,158 @@
 // found in the LICENSE file.
 
 #include "update_engine/subprocess.h"
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 #include "chromeos/obsolete_logging.h"
 #include "base/scoped_ptr.h"
+#include "update_engine/utils.h"
 
+using std::max;
+using std::min;
 using std::string;
 using std::vector;
 
 namespace chromeos_update_engine {
 
-void Subprocess::GChildExitedCallback(GPid pid, gint status, gpointer data) {
-  COMPILE_ASSERT(sizeof(guint) == sizeof(uint32),
-                 guint_uint32_size_mismatch);
-  guint *tag = reinterpret_cast<guint*>(data);
-  const SubprocessCallbackRecord& record = Get().callback_records_[*tag];
-  if (record.callback)
-    record.callback(status, record.callback_data);
-  g_spawn_close_pid(pid);
-  Get().callback_records_.erase(*tag);
-  delete tag;
-}
-
 namespace {
+// Output lines longer than this are logged in pieces.
+const size_t kMaxLineLength = 4096;
+
+// How long SynchronousExecWithTimeout() waits on a quiet pipe before
+// checking whether the process has exited anyway, which it may have if
+// something it started still holds the pipe open.
+const int kPollIntervalMs = 1000;
+
 void FreeArgv(char** argv) {
   for (int i = 0; argv[i]; i++) {
     free(argv[i]);
     argv[i] = NULL;
   }
 }
+
+string Basename(const string& path) {
+  string::size_type slash = path.rfind('/');
+  return slash == string::npos ? path : path.substr(slash + 1);
+}
+
+int64 NowMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<int64>(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
+
+// Logs each complete line in *partial_line, keeping whatever follows the
+// last newline. If flush is true, logs that too.
+void LogLines(const string& name, string* partial_line, bool flush) {
+  string::size_type start = 0;
+  for (;;) {
+    string::size_type end = partial_line->find('\n', start);
+    if (end == string::npos) {
+      if (partial_line->size() - start < kMaxLineLength &&
+          !(flush && start < partial_line->size()))
+        break;
+      end = min(partial_line->size(), start + kMaxLineLength);
+    }
+    LOG(INFO) << name << ": " << partial_line->substr(start, end - start);
+    start = (end < partial_line->size() && (*partial_line)[end] == '\n') ?
+        end + 1 : end;
+  }
+  partial_line->erase(0, start);
+}
+
+// Reads everything that's available now from the non-blocking *fd, logging
+// it a line at a time under name and appending it to *output if that isn't
+// NULL. At end of file, or on error, logs what's left, closes *fd and sets it
+// to -1. Returns false once *fd has been closed.
+bool ReadAndLogOutput(int* fd, const string& name, string* partial_line,
+                      string* output) {
+  char buf[4096];
+  for (;;) {
+    ssize_t rc = read(*fd, buf, sizeof(buf));
+    if (rc > 0) {
+      partial_line->append(buf, rc);
+      if (output)
+        output->append(buf, rc);
+      LogLines(name, partial_line, false);
+      continue;
+    }
+    if (rc < 0 && errno == EINTR)
+      continue;
+    if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return true;
+    if (rc < 0)
+      LOG(ERROR) << "Unable to read the output of " << name << ": "
+                 << utils::ErrnoNumberAsString(errno);
+    LogLines(name, partial_line, true);
+    close(*fd);
+    *fd = -1;
+    return false;
+  }
+}
+
+// Sends signal to the process group that pid, which runs name, leads.
+void SignalProcessGroup(pid_t pid, const string& name, int signal) {
+  LOG(INFO) << "Sending " << (signal == SIGKILL ? "SIGKILL" : "SIGTERM")
+            << " to " << name << " (pid " << pid << ")";
+  if (kill(-pid, signal) != 0 && errno != ESRCH)
+    LOG(ERROR) << "Unable to signal " << name << ": "
+               << utils::ErrnoNumberAsString(errno);
+}
 }  // namespace {}
 
-uint32 Subprocess::Exec(const std::vector<std::string>& cmd,
-                        ExecCallback callback,
-                        void *p) {
-  GPid child_pid;
-  GError *err;
+pid_t Subprocess::Spawn(const vector<string>& cmd, int* output_fd) {
+  if (cmd.empty()) {
+    LOG(ERROR) << "No command to run.";
+    return -1;
+  }
+  // Only the copies the child gets as stdout and stderr survive exec. The
+  // pipe is close-on-exec from the start, since other threads (such as
+  // FilesystemCopierAction's) may spawn processes at any moment.
+  int fds[2];
+  if (pipe2(fds, O_CLOEXEC) != 0) {
+    LOG(ERROR) << "Unable to create a pipe for " << cmd[0] << ": "
+               << utils::ErrnoNumberAsString(errno);
+    return -1;
+  }
+
+  posix_spawn_file_actions_t file_actions;
+  posix_spawn_file_actions_init(&file_actions);
+  posix_spawn_file_actions_addopen(&file_actions, STDIN_FILENO, "/dev/null",
+                                   O_RDONLY, 0);
+  posix_spawn_file_actions_adddup2(&file_actions, fds[1], STDOUT_FILENO);
+  posix_spawn_file_actions_adddup2(&file_actions, fds[1], STDERR_FILENO);
+
+  // The child gets its own process group, so it can be killed along with
+  // its children, and starts with no signals blocked or ignored.
+  posix_spawnattr_t attr;
+  posix_spawnattr_init(&attr);
+  short flags = POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGMASK |
+      POSIX_SPAWN_SETSIGDEF;
+#ifdef POSIX_SPAWN_USEVFORK
+  flags |= POSIX_SPAWN_USEVFORK;
+#endif
+  posix_spawnattr_setflags(&attr, flags);
+  posix_spawnattr_setpgroup(&attr, 0);
+  sigset_t signals;
+  sigemptyset(&signals);
+  posix_spawnattr_setsigmask(&attr, &signals);
+  sigfillset(&signals);
+  sigdelset(&signals, SIGKILL);
+  sigdelset(&signals, SIGSTOP);
+  posix_spawnattr_setsigdefault(&attr, &signals);
+
   scoped_array<char *> argv(new char*[cmd.size() + 1]);
   for (unsigned int i = 0; i < cmd.size(); i++) {
     argv[i] = strdup(cmd[i].c_str());
@@ -49,58 +163,203 @@ uint32 Subprocess::Exec(const std::vector<std::string>& cmd,
   char *argp[1];
   argp[0] = NULL;
 
-  SubprocessCallbackRecord callback_record;
-  callback_record.callback = callback;
-  callback_record.callback_data = p;
-
-  bool success = g_spawn_async(NULL,  // working directory
-                               argv.get(),
-                               argp,
-                               G_SPAWN_DO_NOT_REAP_CHILD,  // flags
-                               NULL,  // child setup function
-                               NULL,  // child setup data pointer
-                               &child_pid,
-                               &err);
+  pid_t pid = -1;
+  int rc = posix_spawn(&pid, argv[0], &file_actions, &attr, argv.get(), argp);
   FreeArgv(argv.get());
-  if (!success) {
-    LOG(ERROR) << "g_spawn_async failed";
-    return 0;
+  posix_spawnattr_destroy(&attr);
+  posix_spawn_file_actions_destroy(&file_actions);
+  close(fds[1]);
+  if (rc != 0) {
+    LOG(ERROR) << "posix_spawn of " << cmd[0] << " failed: " << strerror(rc);
+    close(fds[0]);
+    return -1;
   }
-  guint *tag = new guint;
-  *tag = g_child_watch_add(child_pid, GChildExitedCallback, tag);
-  callback_records_[*tag] = callback_record;
-  return *tag;
+  // Only the read end is nonblocking; the child's stdout stays blocking.
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  *output_fd = fds[0];
+  return pid;
 }
 
-void Subprocess::CancelExec(uint32 tag) {
-  if (callback_records_[tag].callback) {
-    callback_records_[tag].callback = NULL;
+void Subprocess::CleanUpRecord(SubprocessRecord* record) {
+  if (record->output_watch_id) {
+    g_source_remove(record->output_watch_id);
+    record->output_watch_id = 0;
+  }
+  if (record->output_fd >= 0) {
+    // Pick up whatever the process wrote just before it exited.
+    ReadAndLogOutput(&record->output_fd, record->name, &record->partial_line,
+                     NULL);
+    if (record->output_fd >= 0) {
+      LogLines(record->name, &record->partial_line, true);
+      close(record->output_fd);
+      record->output_fd = -1;
+    }
+  }
+  if (record->timer_id) {
+    g_source_remove(record->timer_id);
+    record->timer_id = 0;
   }
 }
 
-bool Subprocess::SynchronousExec(const std::vector<std::string>& cmd,
-                                 int* return_code) {
-  GError *err;
-  scoped_array<char *> argv(new char*[cmd.size() + 1]);
-  for (unsigned int i = 0; i < cmd.size(); i++) {
-    argv[i] = strdup(cmd[i].c_str());
+void Subprocess::GChildExitedCallback(GPid pid, gint status, gpointer data) {
+  COMPILE_ASSERT(sizeof(guint) == sizeof(uint32),
+                 guint_uint32_size_mismatch);
+  SubprocessRecord* record = reinterpret_cast<SubprocessRecord*>(data);
+  CleanUpRecord(record);
+  g_spawn_close_pid(pid);
+  // The callback may start another process, which mustn't find this one in
+  // flight.
+  Get().subprocess_records_.erase(record->tag);
+  if (record->callback)
+    record->callback(status, record->callback_data);
+  delete record;
+}
+
+gboolean Subprocess::GOutputCallback(GIOChannel* source,
+                                     GIOCondition condition,
+                                     gpointer data) {
+  SubprocessRecord* record = reinterpret_cast<SubprocessRecord*>(data);
+  if (ReadAndLogOutput(&record->output_fd, record->name,
+                       &record->partial_line, NULL))
+    return TRUE;
+  record->output_watch_id = 0;
+  return FALSE;
+}
+
+gboolean Subprocess::GTimeoutCallback(gpointer data) {
+  SubprocessRecord* record = reinterpret_cast<SubprocessRecord*>(data);
+  record->timer_id = 0;
+  if (record->killed) {
+    SignalProcessGroup(record->pid, record->name, SIGKILL);
+    return FALSE;
   }
-  argv[cmd.size()] = NULL;
-  char *argp[1];
-  argp[0] = NULL;
+  LOG(ERROR) << record->name << " timed out.";
+  Get().KillExec(record->tag);
+  return FALSE;
+}
 
-  bool success = g_spawn_sync(NULL,  // working directory
-                              argv.get(),
-                              argp,
-                              static_cast<GSpawnFlags>(NULL),  // flags
-                              NULL,  // child setup function
-                              NULL,  // data for child setup function
-                              NULL,  // return location for stdout
-                              NULL,  // return location for stderr
-                              return_code,
-                              &err);
-  FreeArgv(argv.get());
-  return success;
+uint32 Subprocess::Exec(const vector<string>& cmd,
+                        ExecCallback callback,
+                        void *p) {
+  return ExecWithTimeout(cmd, 0, callback, p);
+}
+
+uint32 Subprocess::ExecWithTimeout(const vector<string>& cmd,
+                                   int timeout_seconds,
+                                   ExecCallback callback,
+                                   void *p) {
+  int output_fd = -1;
+  pid_t pid = Spawn(cmd, &output_fd);
+  if (pid < 0)
+    return 0;
+
+  SubprocessRecord* record = new SubprocessRecord;
+  record->pid = pid;
+  record->name = Basename(cmd[0]);
+  record->callback = callback;
+  record->callback_data = p;
+  record->output_fd = output_fd;
+  record->killed = false;
+  record->timer_id = 0;
+  if (timeout_seconds > 0)
+    record->timer_id = g_timeout_add(timeout_seconds * 1000,
+                                     GTimeoutCallback, record);
+  GIOChannel* channel = g_io_channel_unix_new(output_fd);
+  record->output_watch_id = g_io_add_watch(
+      channel,
+      static_cast<GIOCondition>(G_IO_IN | G_IO_HUP | G_IO_ERR),
+      GOutputCallback,
+      record);
+  g_io_channel_unref(channel);
+  record->tag = g_child_watch_add(pid, GChildExitedCallback, record);
+  subprocess_records_[record->tag] = record;
+  return record->tag;
+}
+
+void Subprocess::CancelExec(uint32 tag) {
+  std::map<uint32, SubprocessRecord*>::iterator it =
+      subprocess_records_.find(tag);
+  if (it != subprocess_records_.end())
+    it->second->callback = NULL;
+}
+
+void Subprocess::KillExec(uint32 tag) {
+  std::map<uint32, SubprocessRecord*>::iterator it =
+      subprocess_records_.find(tag);
+  if (it == subprocess_records_.end() || it->second->killed)
+    return;
+  SubprocessRecord* record = it->second;
+  if (record->timer_id)
+    g_source_remove(record->timer_id);
+  record->killed = true;
+  SignalProcessGroup(record->pid, record->name, SIGTERM);
+  record->timer_id = g_timeout_add(kKillGraceSeconds * 1000,
+                                   GTimeoutCallback, record);
+}
+
+bool Subprocess::SynchronousExec(const vector<string>& cmd,
+                                 int* return_code) {
+  return SynchronousExecWithTimeout(cmd, 0, return_code, NULL);
+}
+
+bool Subprocess::SynchronousExecWithTimeout(const vector<string>& cmd,
+                                            int timeout_seconds,
+                                            int* return_code,
+                                            string* output) {
+  int output_fd = -1;
+  pid_t pid = Spawn(cmd, &output_fd);
+  if (pid < 0)
+    return false;
+  const string name = Basename(cmd[0]);
+  string partial_line;
+  int64 deadline_ms = timeout_seconds > 0 ?
+      NowMs() + timeout_seconds * 1000 : 0;
+  bool killed = false;
+  int status = 0;
+  for (;;) {
+    pid_t rc = waitpid(pid, &status, output_fd >= 0 || deadline_ms ?
+                       WNOHANG : 0);
+    if (rc == pid)
+      break;
+    if (rc < 0 && errno != EINTR) {
+      LOG(ERROR) << "waitpid failed for " << name << ": "
+                 << utils::ErrnoNumberAsString(errno);
+      if (output_fd >= 0)
+        close(output_fd);
+      return false;
+    }
+    int wait_ms = deadline_ms ?
+        static_cast<int>(max(static_cast<int64>(0), deadline_ms - NowMs())) :
+        kPollIntervalMs;
+    if (deadline_ms && wait_ms == 0) {
+      // Ask nicely first, then not so nicely.
+      if (!killed)
+        LOG(ERROR) << name << " timed out.";
+      SignalProcessGroup(pid, name, killed ? SIGKILL : SIGTERM);
+      deadline_ms = killed ? 0 : NowMs() + kKillGraceSeconds * 1000;
+      killed = true;
+      continue;
+    }
+    if (output_fd >= 0) {
+      struct pollfd pfd;
+      pfd.fd = output_fd;
+      pfd.events = POLLIN;
+      pfd.revents = 0;
+      if (poll(&pfd, 1, min(wait_ms, kPollIntervalMs)) > 0)
+        ReadAndLogOutput(&output_fd, name, &partial_line, output);
+    } else {
+      // Only a deadline to wait for.
+      usleep(min(wait_ms, 10) * 1000);
+    }
+  }
+  if (output_fd >= 0 &&
+      ReadAndLogOutput(&output_fd, name, &partial_line, output)) {
+    // Something the process started still has the pipe open.
+    LogLines(name, &partial_line, true);
+    close(output_fd);
+  }
+  *return_code = status;
+  return true;
 }
 
 Subprocess* Subprocess::subprocess_singleton_ = NULL;
@@ -5,6 +5,7 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_SUBPROCESS_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_SUBPROCESS_H__
 
+#include <sys/types.h>
 #include <map>
 #include <string>
 #include <vector>
@@ -16,6 +17,14 @@
 // and get notified when the subprocess exits. The result of Exec() can
 // be saved and used to cancel the callback request. If you know you won't
 // call CancelExec(), you may safely lose the return value from Exec().
+//
+// Subprocesses are started with posix_spawn(), which doesn't copy our page
+// tables the way fork() does, with an empty environment and stdin from
+// /dev/null. Whatever they write to stdout or stderr is logged a line at a
+// time as it arrives. Each one leads its own process group, so that killing
+// it also kills anything it started.
+//
+// Return codes are wait() statuses, as with g_spawn_sync().
 
 namespace chromeos_update_engine {
 
@@ -25,7 +34,7 @@ class Subprocess {
     CHECK(!subprocess_singleton_);
     subprocess_singleton_ = new Subprocess;
   }
-   
+
   typedef void(*ExecCallback)(int return_code, void *p);
 
   // Returns a tag > 0 on success.
@@ -33,29 +42,74 @@ class Subprocess {
               ExecCallback callback,
               void* p);
 
+  // Like Exec(), but if the process is still running timeout_seconds later,
+  // it's killed as by KillExec(). A timeout of 0 means none.
+  uint32 ExecWithTimeout(const std::vector<std::string>& cmd,
+                         int timeout_seconds,
+                         ExecCallback callback,
+                         void* p);
+
   // Used to cancel the callback. The process will still run to completion.
   void CancelExec(uint32 tag);
 
+  // Sends SIGTERM to the process's group, and SIGKILL if it's still around
+  // kKillGraceSeconds later. Unless it's been cancelled, the callback is
+  // called once the process has exited.
+  void KillExec(uint32 tag);
+
   // Executes a command synchronously. Returns true on success.
   static bool SynchronousExec(const std::vector<std::string>& cmd,
                               int* return_code);
 
+  // Like SynchronousExec(), but kills the process, as KillExec() would, if
+  // it runs for longer than timeout_seconds (unless that's 0). If output
+  // isn't NULL, everything the process wrote is also put there. Returns true
+  // if the process was started, in which case *return_code says how it
+  // ended.
+  static bool SynchronousExecWithTimeout(const std::vector<std::string>& cmd,
+                                         int timeout_seconds,
+                                         int* return_code,
+                                         std::string* output);
+
   // Gets the one instance
   static Subprocess& Get() {
     return *subprocess_singleton_;
   }
-  
+
   // Returns true iff there is at least one subprocess we're waiting on.
   bool SubprocessInFlight() {
-    for (std::map<int, SubprocessCallbackRecord>::iterator it =
-             callback_records_.begin();
-         it != callback_records_.end(); ++it) {
-      if (it->second.callback)
+    for (std::map<uint32, SubprocessRecord*>::iterator it =
+             subprocess_records_.begin();
+         it != subprocess_records_.end(); ++it) {
+      if (it->second->callback)
         return true;
     }
     return false;
   }
+
+  // How long a process that's been sent SIGTERM has to exit.
+  static const int kKillGraceSeconds = 3;
+
  private:
+  // Everything about a process started by Exec().
+  struct SubprocessRecord {
+    uint32 tag;
+    pid_t pid;
+    // The name of the program, which its output is logged under.
+    std::string name;
+    ExecCallback callback;
+    void* callback_data;
+    // The read end of the process's stdout and stderr, or -1 once it's been
+    // closed, and its main loop watch.
+    int output_fd;
+    guint output_watch_id;
+    // Output after the last newline.
+    std::string partial_line;
+    // The timeout, or the wait for SIGTERM to work, if either is pending.
+    guint timer_id;
+    bool killed;
+  };
+
   // The global instance
   static Subprocess* subprocess_singleton_;
 
@@ -63,12 +117,24 @@ class Subprocess {
   // requested callback.
   static void GChildExitedCallback(GPid pid, gint status, gpointer data);
 
-  struct SubprocessCallbackRecord {
-    ExecCallback callback;
-    void* callback_data;
-  };
+  // Logs what's available on the output pipe.
+  static gboolean GOutputCallback(GIOChannel* source,
+                                  GIOCondition condition,
+                                  gpointer data);
+
+  // Sends SIGTERM when the timeout expires, or SIGKILL when the grace
+  // period after that does.
+  static gboolean GTimeoutCallback(gpointer data);
+
+  // Starts cmd with its stdout and stderr going to a pipe, whose
+  // non-blocking read end is put in *output_fd. Returns the pid, or -1 on
+  // failure.
+  static pid_t Spawn(const std::vector<std::string>& cmd, int* output_fd);
+
+  // Removes record's watch and timer and closes its pipe.
+  static void CleanUpRecord(SubprocessRecord* record);
 
-  std::map<int, SubprocessCallbackRecord> callback_records_;
+  std::map<uint32, SubprocessRecord*> subprocess_records_;
 
   Subprocess() {}
   DISALLOW_COPY_AND_ASSIGN(Subprocess);
@@ -3,7 +3,10 @@
 // found in the LICENSE file.
 
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <unistd.h>
 #include <string>
 #include <vector>
@@ -112,4 +115,113 @@ TEST(SubprocessTest, CancelTest) {
   printf("here\n");
 }
 
+namespace {
+double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+vector<string> ShellCommand(const string& script) {
+  vector<string> cmd;
+  cmd.push_back("/bin/sh");
+  cmd.push_back("-c");
+  cmd.push_back(script);
+  return cmd;
+}
+}  // namespace {}
+
+TEST(SubprocessTest, SynchronousOutputTest) {
+  int return_code = 0;
+  string output;
+  EXPECT_TRUE(Subprocess::SynchronousExecWithTimeout(
+      ShellCommand("echo hello; echo world >&2; printf partial; exit 3"),
+      0, &return_code, &output));
+  EXPECT_TRUE(WIFEXITED(return_code));
+  EXPECT_EQ(3, WEXITSTATUS(return_code));
+  EXPECT_EQ("hello\nworld\npartial", output);
+
+  // The child's stdin is /dev/null.
+  output.clear();
+  EXPECT_TRUE(Subprocess::SynchronousExecWithTimeout(ShellCommand("cat"), 0,
+                                                     &return_code, &output));
+  EXPECT_EQ(0, return_code);
+  EXPECT_EQ("", output);
+
+  EXPECT_TRUE(Subprocess::SynchronousExec(ShellCommand("exit 1"),
+                                          &return_code));
+  EXPECT_EQ(256, return_code);
+  vector<string> cmd;
+  cmd.push_back("/nonexistent/program");
+  EXPECT_FALSE(Subprocess::SynchronousExec(cmd, &return_code));
+}
+
+TEST(SubprocessTest, SynchronousTimeoutTest) {
+  int return_code = 0;
+  const double start = Now();
+  EXPECT_TRUE(Subprocess::SynchronousExecWithTimeout(
+      ShellCommand("sleep 30"), 1, &return_code, NULL));
+  EXPECT_LT(Now() - start, 1 + Subprocess::kKillGraceSeconds);
+  EXPECT_TRUE(WIFSIGNALED(return_code));
+  EXPECT_EQ(SIGTERM, WTERMSIG(return_code));
+
+  // Ignoring SIGTERM only buys the grace period.
+  string output;
+  EXPECT_TRUE(Subprocess::SynchronousExecWithTimeout(
+      ShellCommand("trap '' TERM; echo started; sleep 30"), 1, &return_code,
+      &output));
+  EXPECT_LT(Now() - start, 5 + 2 * Subprocess::kKillGraceSeconds);
+  EXPECT_TRUE(WIFSIGNALED(return_code));
+  EXPECT_EQ(SIGKILL, WTERMSIG(return_code));
+  EXPECT_EQ("started\n", output);
+}
+
+namespace {
+struct KillTestData {
+  GMainLoop* loop;
+  int return_code;
+  bool kill;
+};
+
+void KillTestCallback(int return_code, void *p) {
+  KillTestData* data = reinterpret_cast<KillTestData*>(p);
+  data->return_code = return_code;
+  g_main_loop_quit(data->loop);
+}
+
+gboolean StartSleepInMainLoop(gpointer p) {
+  KillTestData* data = reinterpret_cast<KillTestData*>(p);
+  uint32 tag = Subprocess::Get().ExecWithTimeout(
+      ShellCommand("echo sleeping; sleep 30"), data->kill ? 0 : 1,
+      KillTestCallback, data);
+  EXPECT_NE(0, tag);
+  if (data->kill)
+    Subprocess::Get().KillExec(tag);
+  return FALSE;
+}
+
+void DoKillTest(bool kill) {
+  KillTestData data;
+  data.loop = g_main_loop_new(g_main_context_default(), FALSE);
+  data.return_code = 0;
+  data.kill = kill;
+  const double start = Now();
+  g_timeout_add(0, &StartSleepInMainLoop, &data);
+  g_main_loop_run(data.loop);
+  g_main_loop_unref(data.loop);
+  EXPECT_LT(Now() - start, 1 + Subprocess::kKillGraceSeconds);
+  EXPECT_TRUE(WIFSIGNALED(data.return_code));
+  EXPECT_EQ(SIGTERM, WTERMSIG(data.return_code));
+  EXPECT_FALSE(Subprocess::Get().SubprocessInFlight());
+}
+}  // namespace {}
+
+TEST(SubprocessTest, TimeoutTest) {
+  DoKillTest(false);
+}
+
+TEST(SubprocessTest, KillTest) {
+  DoKillTest(true);
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,85 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/tarjan.h"
+#include <algorithm>
+#include <vector>
+#include "chromeos/obsolete_logging.h"
+
+using std::min;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+void TarjanAlgorithm::Execute(Graph* graph,
+                              vector<vector<Vertex::Index> >* out_components) {
+  CHECK(out_components);
+  index_ = 0;
+  stack_.clear();
+  on_stack_.assign(graph->size(), false);
+  components_ = out_components;
+  components_->clear();
+  for (Graph::iterator it = graph->begin(); it != graph->end(); ++it) {
+    it->index = Vertex::kInvalidIndex;
+    it->lowlink = Vertex::kInvalidIndex;
+  }
+  for (Vertex::Index i = 0; i < graph->size(); i++) {
+    if ((*graph)[i].index == Vertex::kInvalidIndex)
+      Tarjan(i, graph);
+  }
+  components_ = NULL;
+}
+
+void TarjanAlgorithm::Tarjan(Vertex::Index vertex, Graph* graph) {
+  Visit(vertex, graph);
+  while (!frames_.empty()) {
+    vertex = frames_.back().first;
+    Vertex::EdgeMap::iterator& it = frames_.back().second;
+    if (it != (*graph)[vertex].out_edges.end()) {
+      Vertex::Index vertex_next = it->first;
+      ++it;
+      if ((*graph)[vertex_next].index == Vertex::kInvalidIndex) {
+        Visit(vertex_next, graph);
+      } else if (on_stack_[vertex_next]) {
+        (*graph)[vertex].lowlink = min((*graph)[vertex].lowlink,
+                                       (*graph)[vertex_next].index);
+      }
+      continue;
+    }
+
+    // All of vertex's out-edges have been followed.
+    frames_.pop_back();
+    if (!frames_.empty()) {
+      Vertex::Index vertex_prev = frames_.back().first;
+      (*graph)[vertex_prev].lowlink = min((*graph)[vertex_prev].lowlink,
+                                          (*graph)[vertex].lowlink);
+    }
+    if ((*graph)[vertex].lowlink != (*graph)[vertex].index)
+      continue;
+
+    // vertex is the root of a strongly connected component; pop it off.
+    vector<Vertex::Index> component;
+    Vertex::Index other_vertex;
+    do {
+      other_vertex = stack_.back();
+      stack_.pop_back();
+      on_stack_[other_vertex] = false;
+      component.push_back(other_vertex);
+    } while (other_vertex != vertex);
+    if (component.size() > 1)
+      components_->push_back(component);
+  }
+}
+
+void TarjanAlgorithm::Visit(Vertex::Index vertex, Graph* graph) {
+  CHECK_EQ((*graph)[vertex].index, Vertex::kInvalidIndex);
+  (*graph)[vertex].index = index_;
+  (*graph)[vertex].lowlink = index_;
+  index_++;
+  stack_.push_back(vertex);
+  on_stack_[vertex] = true;
+  frames_.push_back(Frame(vertex, (*graph)[vertex].out_edges.begin()));
+}
+
+}  // namespace chromeos_update_engine
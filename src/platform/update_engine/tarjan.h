@@ -0,0 +1,56 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_TARJAN_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_TARJAN_H__
+
+// This is an implementation of Tarjan's algorithm which finds all
+// Strongly Connected Components in a graph.
+
+// Note: a true Tarjan algorithm would find all strongly connected components
+// in the graph. This implementation finds them all, but returns only the
+// ones with more than one vertex, since those are the ones that contain
+// cycles.
+
+#include <utility>
+#include <vector>
+#include "base/basictypes.h"
+#include "update_engine/graph_types.h"
+
+namespace chromeos_update_engine {
+
+class TarjanAlgorithm {
+ public:
+  TarjanAlgorithm() : index_(0) {}
+
+  // Puts each strongly connected component of more than one vertex in
+  // graph into *out_components. Uses, and clobbers, the index and lowlink
+  // fields of the vertices. Only out_edges are followed.
+  void Execute(Graph* graph,
+               std::vector<std::vector<Vertex::Index> >* out_components);
+ private:
+  // Finds the components reachable from vertex that haven't been found yet.
+  // The search keeps its own stack rather than recursing, since paths in
+  // the graph of a delta can be as long as it has operations.
+  void Tarjan(Vertex::Index vertex, Graph* graph);
+
+  // Numbers vertex and starts following its out-edges.
+  void Visit(Vertex::Index vertex, Graph* graph);
+
+  // The vertices whose out-edges are being followed, each with the next
+  // out-edge to follow.
+  typedef std::pair<Vertex::Index, Vertex::EdgeMap::iterator> Frame;
+  std::vector<Frame> frames_;
+
+  Vertex::Index index_;
+  std::vector<Vertex::Index> stack_;
+  std::vector<bool> on_stack_;
+  std::vector<std::vector<Vertex::Index> >* components_;
+
+  DISALLOW_COPY_AND_ASSIGN(TarjanAlgorithm);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_TARJAN_H__
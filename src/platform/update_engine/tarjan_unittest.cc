@@ -0,0 +1,80 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <algorithm>
+#include <utility>
+#include <vector>
+#include <gtest/gtest.h>
+#include "update_engine/graph_types.h"
+#include "update_engine/tarjan.h"
+
+using std::make_pair;
+using std::sort;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class TarjanAlgorithmTest : public ::testing::Test {};
+
+TEST(TarjanAlgorithmTest, SimpleTest) {
+  const Vertex::Index n_a = 0;
+  const Vertex::Index n_b = 1;
+  const Vertex::Index n_c = 2;
+  const Vertex::Index n_d = 3;
+  const Vertex::Index n_e = 4;
+  const Vertex::Index n_f = 5;
+  const Vertex::Index n_g = 6;
+  const Vertex::Index n_h = 7;
+  const Graph::size_type kNodeCount = 8;
+
+  Graph graph(kNodeCount);
+
+  // a -> b -> c -> a is a cycle, d -> e -> d is another, and f -> g,
+  // c -> d, e -> f and h are not part of any cycle.
+  graph[n_a].out_edges.insert(make_pair(n_b, EdgeProperties()));
+  graph[n_b].out_edges.insert(make_pair(n_c, EdgeProperties()));
+  graph[n_c].out_edges.insert(make_pair(n_a, EdgeProperties()));
+  graph[n_c].out_edges.insert(make_pair(n_d, EdgeProperties()));
+  graph[n_d].out_edges.insert(make_pair(n_e, EdgeProperties()));
+  graph[n_e].out_edges.insert(make_pair(n_d, EdgeProperties()));
+  graph[n_e].out_edges.insert(make_pair(n_f, EdgeProperties()));
+  graph[n_f].out_edges.insert(make_pair(n_g, EdgeProperties()));
+
+  TarjanAlgorithm tarjan;
+  vector<vector<Vertex::Index> > components;
+  tarjan.Execute(&graph, &components);
+
+  ASSERT_EQ(2, components.size());
+  for (vector<vector<Vertex::Index> >::iterator it = components.begin();
+       it != components.end(); ++it) {
+    sort(it->begin(), it->end());
+  }
+  sort(components.begin(), components.end());
+  ASSERT_EQ(3, components[0].size());
+  EXPECT_EQ(n_a, components[0][0]);
+  EXPECT_EQ(n_b, components[0][1]);
+  EXPECT_EQ(n_c, components[0][2]);
+  ASSERT_EQ(2, components[1].size());
+  EXPECT_EQ(n_d, components[1][0]);
+  EXPECT_EQ(n_e, components[1][1]);
+  EXPECT_NE(Vertex::kInvalidIndex, graph[n_h].index);
+}
+
+TEST(TarjanAlgorithmTest, LongCycleTest) {
+  // A path this long would overflow the stack if the search recursed.
+  const Graph::size_type kNodeCount = 1000000;
+  Graph graph(kNodeCount);
+  for (Vertex::Index i = 0; i < kNodeCount; i++)
+    graph[i].out_edges.insert(make_pair((i + 1) % kNodeCount,
+                                        EdgeProperties()));
+
+  TarjanAlgorithm tarjan;
+  vector<vector<Vertex::Index> > components;
+  tarjan.Execute(&graph, &components);
+
+  ASSERT_EQ(1, components.size());
+  EXPECT_EQ(kNodeCount, components[0].size());
+}
+
+}  // namespace chromeos_update_engine
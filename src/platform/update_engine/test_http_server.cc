@@ -8,12 +8,16 @@
 // handles very slow data transfers.
 
 // To use this, simply make an HTTP connection to localhost:port and
-// GET a url.
+// GET a url. Each connection is served by its own process, so several
+// requests can be in flight at once.
 
 #include <netinet/in.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,12 +35,20 @@ namespace chromeos_update_engine {
 
 struct HttpRequest {
   string url;
+  bool has_range;
   off_t offset;
+  // One past the last byte requested, or -1 for everything from offset on.
+  off_t end;
+  // The If-None-Match header, if any.
+  string if_none_match;
 };
 
 namespace {
 const int kPort = 8080;  // hardcoded to 8080 for now
 const int kBigLength = 100000;
+const off_t kWriteChunkSize = 64 * 1024;
+// Relative to the directory the server runs in.
+const char kCacheDir[] = "test_http_server_cache";
 }
 
 bool ParseRequest(int fd, HttpRequest* request) {
@@ -64,18 +76,33 @@ bool ParseRequest(int fd, HttpRequest* request) {
   LOG(INFO) << "URL: " << url;
 
   string::size_type range_start, range_end;
-  if (headers.find("\r\nRange: ") == string::npos) {
-    request->offset = 0;
-  } else {
+  request->has_range = false;
+  request->offset = 0;
+  request->end = -1;
+  if (headers.find("\r\nRange: ") != string::npos) {
     range_start = headers.find("\r\nRange: ") + strlen("\r\nRange: ");
     range_end = headers.find('\r', range_start);
     CHECK_NE(string::npos, range_end);
     string range_header = headers.substr(range_start, range_end - range_start);
 
     LOG(INFO) << "Range: " << range_header;
-    CHECK(*range_header.rbegin() == '-');
+    // Either "bytes=offset-" or "bytes=offset-last".
+    string::size_type dash = range_header.find('-');
+    CHECK_NE(string::npos, dash);
+    request->has_range = true;
     request->offset = atoll(range_header.c_str() + strlen("bytes="));
-    LOG(INFO) << "Offset: " << request->offset;
+    if (dash + 1 < range_header.size())
+      request->end = atoll(range_header.c_str() + dash + 1) + 1;
+    LOG(INFO) << "Offset: " << request->offset << ", end: " << request->end;
+  }
+  request->if_none_match.clear();
+  if (headers.find("\r\nIf-None-Match: ") != string::npos) {
+    string::size_type start = headers.find("\r\nIf-None-Match: ") +
+        strlen("\r\nIf-None-Match: ");
+    string::size_type end = headers.find('\r', start);
+    CHECK_NE(string::npos, end);
+    request->if_none_match = headers.substr(start, end - start);
+    LOG(INFO) << "If-None-Match: " << request->if_none_match;
   }
   request->url = url;
   return true;
@@ -102,38 +129,56 @@ string Itoa(off_t num) {
   return buf;
 }
 
-void WriteHeaders(int fd, bool support_range, off_t full_size,
-                  off_t start_offset) {
+// Returns one past the last byte of a resource of size full_size to send in
+// response to request.
+off_t EndOffset(const HttpRequest& request, off_t full_size) {
+  if (request.end < 0)
+    return full_size;
+  return min(request.end, full_size);
+}
+
+void WriteHeaders(int fd, const HttpRequest& request, bool support_range,
+                  off_t full_size) {
   LOG(INFO) << "writing headers";
-  WriteString(fd, "HTTP/1.1 200 OK\r\n");
+  const bool partial = support_range && request.has_range;
+  WriteString(fd, partial ? "HTTP/1.1 206 Partial Content\r\n" :
+              "HTTP/1.1 200 OK\r\n");
   WriteString(fd, "Content-Type: application/octet-stream\r\n");
+  off_t start_offset = 0;
+  off_t end_offset = full_size;
   if (support_range) {
+    start_offset = request.offset;
+    end_offset = EndOffset(request, full_size);
     WriteString(fd, "Accept-Ranges: bytes\r\n");
     WriteString(fd, string("Content-Range: bytes ") + Itoa(start_offset) +
-                "-" + Itoa(full_size - 1) + "/" + Itoa(full_size) + "\r\n");
+                "-" + Itoa(end_offset - 1) + "/" + Itoa(full_size) + "\r\n");
   }
-  off_t content_length = full_size;
-  if (support_range)
-    content_length -= start_offset;
-  WriteString(fd, string("Content-Length: ") + Itoa(content_length) + "\r\n");
+  WriteString(fd, string("Content-Length: ") +
+              Itoa(end_offset - start_offset) + "\r\n");
   WriteString(fd, "\r\n");
 }
 
+// Writes bytes [start, end) of an endless "abcdefghij" pattern.
+void WritePattern(int fd, off_t start, off_t end) {
+  string buf;
+  for (off_t i = start; i < end; ) {
+    const off_t chunk_end = min(end, i + kWriteChunkSize);
+    buf.clear();
+    for (; i < chunk_end; i++)
+      buf.push_back('a' + (i % 10));
+    WriteString(fd, buf);
+  }
+}
+
 void HandleQuitQuitQuit(int fd) {
   exit(0);
 }
 
-void HandleBig(int fd, const HttpRequest& request) {
-  const off_t full_length = kBigLength;
-  WriteHeaders(fd, true, full_length, request.offset);
-  const off_t content_length = full_length - request.offset;
-  int i = request.offset;
-  for (; i % 10; i++)
-    WriteString(fd, string(1, 'a' + (i % 10)));
-  CHECK_EQ(i % 10, 0);
-  for (; i < content_length; i += 10)
-    WriteString(fd, "abcdefghij");
-  CHECK_EQ(i, full_length);
+// Serves full_length bytes of "abcdefghij" repeated. /big is 100000 bytes
+// long; /big/<length> is as long as requested, e.g. for benchmarks.
+void HandleBig(int fd, const HttpRequest& request, off_t full_length) {
+  WriteHeaders(fd, request, true, full_length);
+  WritePattern(fd, request.offset, EndOffset(request, full_length));
 }
 
 // This is like /big, but it writes at most 9000 bytes. Also,
@@ -141,8 +186,10 @@ void HandleBig(int fd, const HttpRequest& request) {
 // (technically, when (offset % (9000 * 7)) == 0).
 void HandleFlaky(int fd, const HttpRequest& request) {
   const off_t full_length = kBigLength;
-  WriteHeaders(fd, true, full_length, request.offset);
-  const off_t content_length = min(9000LL, full_length - request.offset);
+  WriteHeaders(fd, request, true, full_length);
+  const off_t content_length = min(static_cast<off_t>(9000),
+                                   EndOffset(request, full_length) -
+                                   request.offset);
   const bool should_sleep = (request.offset % (9000 * 7)) == 0;
 
   string buf;
@@ -167,24 +214,77 @@ void HandleFlaky(int fd, const HttpRequest& request) {
   }
 }
 
+// Serves a short resource with an ETag, or replies 304 Not Modified if the
+// request says it already has that one.
+void HandleEtag(int fd, const HttpRequest& request) {
+  const string etag("\"update-engine-test\"");
+  if (request.if_none_match == etag) {
+    WriteString(fd, "HTTP/1.1 304 Not Modified\r\n");
+    WriteString(fd, "ETag: " + etag + "\r\n\r\n");
+    return;
+  }
+  const string data("etag data");
+  WriteString(fd, "HTTP/1.1 200 OK\r\n");
+  WriteString(fd, "ETag: " + etag + "\r\n");
+  WriteString(fd, string("Content-Length: ") + Itoa(data.size()) + "\r\n");
+  WriteString(fd, "\r\n");
+  WriteString(fd, data);
+}
+
+// Serves /cache/<name> from the file of that name in kCacheDir, so that a
+// machine on the LAN can share the payloads in its CachingHttpFetcher cache
+// with its peers. Names are as from CachingHttpFetcher::EntryName().
+void HandleCache(int fd, const HttpRequest& request) {
+  const string name = request.url.substr(strlen("/cache/"));
+  int file_fd = -1;
+  struct stat stbuf;
+  if (!name.empty() && name[0] != '.' && name.find('/') == string::npos) {
+    file_fd = open((string(kCacheDir) + "/" + name).c_str(), O_RDONLY);
+    if (file_fd >= 0 && (fstat(file_fd, &stbuf) != 0 ||
+                         !S_ISREG(stbuf.st_mode))) {
+      close(file_fd);
+      file_fd = -1;
+    }
+  }
+  if (file_fd < 0) {
+    WriteString(fd, "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+    return;
+  }
+  WriteHeaders(fd, request, true, stbuf.st_size);
+  vector<char> buf(kWriteChunkSize);
+  const off_t end = EndOffset(request, stbuf.st_size);
+  for (off_t i = request.offset; i < end; ) {
+    ssize_t r = pread(file_fd, &buf[0], min(kWriteChunkSize, end - i), i);
+    if (r <= 0) {
+      perror("pread");
+      break;
+    }
+    WriteString(fd, string(&buf[0], r));
+    i += r;
+  }
+  close(file_fd);
+}
+
 void HandleDefault(int fd, const HttpRequest& request) {
   const string data("unhandled path");
-  WriteHeaders(fd, true, data.size(), request.offset);
+  WriteHeaders(fd, request, true, data.size());
   const string data_to_write(data.substr(request.offset,
-                                         data.size() - request.offset));
+                                         EndOffset(request, data.size()) -
+                                         request.offset));
   WriteString(fd, data_to_write);
 }
 
-void HandleConnection(int fd) {
-  HttpRequest request;
-  ParseRequest(fd, &request);
-
-  if (request.url == "/quitquitquit")
-    HandleQuitQuitQuit(fd);
-  else if (request.url == "/big")
-    HandleBig(fd, request);
+void HandleConnection(int fd, const HttpRequest& request) {
+  if (request.url == "/big")
+    HandleBig(fd, request, kBigLength);
+  else if (request.url.find("/big/") == 0)
+    HandleBig(fd, request, atoll(request.url.c_str() + strlen("/big/")));
   else if (request.url == "/flaky")
     HandleFlaky(fd, request);
+  else if (request.url == "/etag")
+    HandleEtag(fd, request);
+  else if (request.url.find("/cache/") == 0)
+    HandleCache(fd, request);
   else
     HandleDefault(fd, request);
 
@@ -226,6 +326,8 @@ int main(int argc, char** argv) {
     exit(1);
   }
   CHECK_EQ(listen(listen_fd,5), 0);
+  // Children are reaped automatically.
+  signal(SIGCHLD, SIG_IGN);
   while (1) {
     clilen = sizeof(client_addr);
     int client_fd = accept(listen_fd,
@@ -234,7 +336,20 @@ int main(int argc, char** argv) {
     LOG(INFO) << "got past accept";
     if (client_fd < 0)
       LOG(FATAL) << "ERROR on accept";
-    HandleConnection(client_fd);
+    // The request is read here so that /quitquitquit exits this process.
+    HttpRequest request;
+    ParseRequest(client_fd, &request);
+    if (request.url == "/quitquitquit")
+      HandleQuitQuitQuit(client_fd);
+    pid_t pid = fork();
+    if (pid < 0)
+      LOG(FATAL) << "fork() failed";
+    if (pid == 0) {
+      close(listen_fd);
+      HandleConnection(client_fd, request);
+      exit(0);
+    }
+    close(client_fd);
   }
   return 0;
 }
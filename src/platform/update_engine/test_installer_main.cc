@@ -18,7 +18,7 @@
 #include "chromeos/obsolete_logging.h"
 
 #include "update_engine/delta_diff_generator.h"
-#include "update_engine/delta_diff_parser.h"
+#include "update_engine/delta_performer.h"
 #include "update_engine/filesystem_copier_action.h"
 // #include "update_engine/install_action.h"  // re-add
 #include "update_engine/install_plan.h"
@@ -6,6 +6,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -228,7 +229,7 @@ void VerifyAllPaths(const string& parent, set<string> expected_paths) {
   ino_t test_ino = 0;
   ino_t testlink_ino = 0;
   while (!iter.IsEnd()) {
-    string path = iter.GetFullPath();
+    const string& path = iter.GetFullPath();
     EXPECT_TRUE(expected_paths.find(path) != expected_paths.end()) << path;
     EXPECT_EQ(1, expected_paths.erase(path));
     if (utils::StringHasSuffix(path, "/hi") ||
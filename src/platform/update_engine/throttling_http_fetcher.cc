@@ -0,0 +1,136 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/throttling_http_fetcher.h"
+#include <sys/time.h>
+#include <algorithm>
+#include "chromeos/obsolete_logging.h"
+
+using std::max;
+using std::min;
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+int64 NowMs() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return static_cast<int64>(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
+}  // namespace {}
+
+const int ThrottlingHttpFetcher::kBurstMs;
+
+ThrottlingHttpFetcher::ThrottlingHttpFetcher(int64 bytes_per_second,
+                                             HttpFetcher* base_fetcher)
+    : bytes_per_second_(bytes_per_second),
+      bucket_size_(max(static_cast<int64>(1),
+                       bytes_per_second * kBurstMs / 1000)),
+      base_fetcher_(base_fetcher),
+      tokens_(0),
+      last_refill_ms_(0),
+      paused_(false),
+      throttled_(false),
+      throttle_source_id_(0),
+      throttle_count_(0) {
+  CHECK_GT(bytes_per_second_, 0);
+}
+
+ThrottlingHttpFetcher::~ThrottlingHttpFetcher() {
+  CancelThrottleTimeout();
+}
+
+void ThrottlingHttpFetcher::BeginTransfer(const string& url) {
+  CancelThrottleTimeout();
+  paused_ = false;
+  throttled_ = false;
+  http_response_code_ = 0;
+  etag_.clear();
+  tokens_ = bucket_size_;
+  last_refill_ms_ = NowMs();
+
+  base_fetcher_->set_delegate(this);
+  if (post_data_set_)
+    base_fetcher_->SetPostData(post_data_.empty() ? NULL : &post_data_[0],
+                               post_data_.size());
+  base_fetcher_->SetOffset(offset_);
+  base_fetcher_->SetIfNoneMatch(if_none_match_);
+  base_fetcher_->SetContentHash(content_hash_);
+  base_fetcher_->BeginTransfer(url);
+}
+
+void ThrottlingHttpFetcher::TerminateTransfer() {
+  CancelThrottleTimeout();
+  throttled_ = false;
+  base_fetcher_->TerminateTransfer();
+}
+
+void ThrottlingHttpFetcher::Pause() {
+  CHECK(!paused_);
+  paused_ = true;
+  if (!throttled_)
+    base_fetcher_->Pause();
+}
+
+void ThrottlingHttpFetcher::Unpause() {
+  CHECK(paused_);
+  paused_ = false;
+  if (!throttled_)
+    base_fetcher_->Unpause();
+}
+
+void ThrottlingHttpFetcher::ReceivedBytes(HttpFetcher* fetcher,
+                                          const char* bytes,
+                                          int length) {
+  Refill();
+  tokens_ -= length;
+  if (tokens_ < 0 && !throttled_) {
+    // Wait until the debt is paid off.
+    const int64 wait_ms = (-tokens_ * 1000 + bytes_per_second_ - 1) /
+        bytes_per_second_;
+    throttled_ = true;
+    throttle_count_++;
+    if (!paused_)
+      base_fetcher_->Pause();
+    throttle_source_id_ = g_timeout_add(wait_ms, StaticThrottleTimeout, this);
+  }
+  if (delegate_)
+    delegate_->ReceivedBytes(this, bytes, length);
+}
+
+void ThrottlingHttpFetcher::TransferComplete(HttpFetcher* fetcher,
+                                             bool successful) {
+  CancelThrottleTimeout();
+  throttled_ = false;
+  http_response_code_ = base_fetcher_->http_response_code();
+  etag_ = base_fetcher_->etag();
+  if (delegate_)
+    delegate_->TransferComplete(this, successful);
+}
+
+void ThrottlingHttpFetcher::Refill() {
+  const int64 now_ms = NowMs();
+  // The clock may have been set back.
+  const int64 elapsed_ms = max(static_cast<int64>(0), now_ms - last_refill_ms_);
+  last_refill_ms_ = now_ms;
+  tokens_ = min(bucket_size_, tokens_ + elapsed_ms * bytes_per_second_ / 1000);
+}
+
+void ThrottlingHttpFetcher::ThrottleTimeout() {
+  throttle_source_id_ = 0;
+  throttled_ = false;
+  Refill();
+  if (!paused_)
+    base_fetcher_->Unpause();
+}
+
+void ThrottlingHttpFetcher::CancelThrottleTimeout() {
+  if (throttle_source_id_) {
+    g_source_remove(throttle_source_id_);
+    throttle_source_id_ = 0;
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,88 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_THROTTLING_HTTP_FETCHER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_THROTTLING_HTTP_FETCHER_H__
+
+#include <string>
+#include <glib.h>
+#include "base/basictypes.h"
+#include "base/scoped_ptr.h"
+#include "update_engine/http_fetcher.h"
+
+// ThrottlingHttpFetcher is an HttpFetcher that limits how fast another
+// HttpFetcher downloads, so that a background update leaves the network to
+// whatever the user is doing. It uses a token bucket: each byte received
+// takes a token, tokens come back at bytes_per_second, and the bucket holds
+// kBurstMs worth of them. Once the bucket is empty, the other fetcher is
+// paused until it's refilled enough to pay for what's been received.
+//
+// Pause() and Unpause() work as usual on top of the throttling.
+
+namespace chromeos_update_engine {
+
+class ThrottlingHttpFetcher : public HttpFetcher, public HttpFetcherDelegate {
+ public:
+  // How long a burst at full speed may last, after a quiet spell.
+  static const int kBurstMs = 250;
+
+  // Takes ownership of base_fetcher.
+  ThrottlingHttpFetcher(int64 bytes_per_second, HttpFetcher* base_fetcher);
+
+  // Cleans up all internal state. Does not notify delegate
+  ~ThrottlingHttpFetcher();
+
+  virtual void BeginTransfer(const std::string& url);
+  virtual void TerminateTransfer();
+  virtual void Pause();
+  virtual void Unpause();
+
+  // HttpFetcherDelegate methods, called by base_fetcher_:
+  virtual void ReceivedBytes(HttpFetcher* fetcher,
+                             const char* bytes,
+                             int length);
+  virtual void TransferComplete(HttpFetcher* fetcher, bool successful);
+
+  // How many times the transfer has been held back. For testing.
+  int throttle_count() const { return throttle_count_; }
+
+ private:
+  // Adds the tokens earned since the last call.
+  void Refill();
+
+  // Ends the wait for tokens.
+  void ThrottleTimeout();
+  static gboolean StaticThrottleTimeout(gpointer data) {
+    reinterpret_cast<ThrottlingHttpFetcher*>(data)->ThrottleTimeout();
+    return FALSE;
+  }
+
+  // Removes the pending ThrottleTimeout(), if any.
+  void CancelThrottleTimeout();
+
+  const int64 bytes_per_second_;
+  const int64 bucket_size_;
+  scoped_ptr<HttpFetcher> base_fetcher_;
+
+  // Bytes that may be received before the transfer is held back. Negative
+  // once more than that has been received.
+  int64 tokens_;
+  // When tokens_ was last refilled, in ms.
+  int64 last_refill_ms_;
+
+  // base_fetcher_ is paused while either of these is true.
+  bool paused_;
+  bool throttled_;
+
+  // Runs ThrottleTimeout(); 0 if it's not scheduled.
+  guint throttle_source_id_;
+
+  int throttle_count_;
+
+  DISALLOW_COPY_AND_ASSIGN(ThrottlingHttpFetcher);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_THROTTLING_HTTP_FETCHER_H__
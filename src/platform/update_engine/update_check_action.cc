@@ -3,11 +3,10 @@
 // found in the LICENSE file.
 
 #include "update_engine/update_check_action.h"
+#include <string.h>
 #include <sstream>
 
 #include <libxml/parser.h>
-#include <libxml/xpath.h>
-#include <libxml/xpathInternals.h>
 
 #include "chromeos/obsolete_logging.h"
 #include "update_engine/action_pipe.h"
@@ -26,35 +25,36 @@ namespace {
 
 const string kGupdateVersion("ChromeOSUpdateEngine-0.1.0.0");
 
+const char* const kNsUrl("http://www.google.com/update2/response");
+
+// The elements, from the root down, whose attributes are wanted.
+const char* const kUpdatecheckPath[] = { "gupdate", "app", "updatecheck" };
+
 // This is handy for passing strings into libxml2
 #define ConstXMLStr(x) (reinterpret_cast<const xmlChar*>(x))
 
-// These are for scoped_ptr_malloc, which is like scoped_ptr, but allows
+// Returns an attribute value as passed to a SAX2 startElementNs callback,
+// which is length bytes long, as it would appear in a document tree. The
+// parser resolves all references but those to '&', which it leaves as
+// "&#38;".
+string DecodeAttributeValue(const xmlChar* value, int length) {
+  static const char kAmpersandRef[] = "&#38;";
+  string ret(reinterpret_cast<const char*>(value), length);
+  for (string::size_type pos = ret.find(kAmpersandRef);
+       pos != string::npos;
+       pos = ret.find(kAmpersandRef, pos + 1))
+    ret.replace(pos, strlen(kAmpersandRef), "&");
+  return ret;
+}
+
+// This is for scoped_ptr_malloc, which is like scoped_ptr, but allows
 // a custom free() function to be specified.
-class ScopedPtrXmlDocFree {
- public:
-  inline void operator()(void* x) const {
-    xmlFreeDoc(reinterpret_cast<xmlDoc*>(x));
-  }
-};
 class ScopedPtrXmlFree {
  public:
   inline void operator()(void* x) const {
     xmlFree(x);
   }
 };
-class ScopedPtrXmlXPathObjectFree {
- public:
-  inline void operator()(void* x) const {
-    xmlXPathFreeObject(reinterpret_cast<xmlXPathObject*>(x));
-  }
-};
-class ScopedPtrXmlXPathContextFree {
- public:
-  inline void operator()(void* x) const {
-    xmlXPathFreeContext(reinterpret_cast<xmlXPathContext*>(x));
-  }
-};
 
 // Returns a properly formatted omaha request for an update check
 string FormatRequest(const UpdateCheckParams& params) {
@@ -94,77 +94,143 @@ string XmlEncode(const string& input) {
 }
 
 UpdateCheckAction::UpdateCheckAction(HttpFetcher* http_fetcher)
-    : http_fetcher_(http_fetcher) {}
-
-UpdateCheckAction::~UpdateCheckAction() {}
+    : http_fetcher_(http_fetcher),
+      parser_context_(NULL),
+      response_size_(0),
+      element_depth_(0),
+      matched_depth_(0),
+      found_updatecheck_(false),
+      abort_source_id_(0) {}
+
+UpdateCheckAction::~UpdateCheckAction() {
+  if (abort_source_id_)
+    g_source_remove(abort_source_id_);
+  FreeParser();
+}
 
 void UpdateCheckAction::PerformAction() {
   CHECK(HasInputObject());
   params_ = GetInputObject();
+
+  response_size_ = 0;
+  element_depth_ = 0;
+  matched_depth_ = 0;
+  found_updatecheck_ = false;
+  updatecheck_attributes_.clear();
+  FreeParser();
+  xmlSAXHandler handler;
+  memset(&handler, 0, sizeof(handler));
+  handler.initialized = XML_SAX2_MAGIC;
+  handler.startElementNs = StaticStartElement;
+  handler.endElementNs = StaticEndElement;
+  parser_context_ = xmlCreatePushParserCtxt(&handler, this, NULL, 0, NULL);
+  CHECK(parser_context_);
+  // Never fetch anything the response refers to.
+  xmlCtxtUseOptions(parser_context_, XML_PARSE_NONET);
+
   http_fetcher_->set_delegate(this);
+  if (!no_update_etag_.empty())
+    http_fetcher_->SetIfNoneMatch(no_update_etag_);
   string request_post(FormatRequest(params_));
   http_fetcher_->SetPostData(request_post.data(), request_post.size());
+  AddBytesOut(request_post.size());
   http_fetcher_->BeginTransfer("https://tools.google.com/service/update2");
 }
 
 void UpdateCheckAction::TerminateProcessing() {
+  if (abort_source_id_) {
+    g_source_remove(abort_source_id_);
+    abort_source_id_ = 0;
+  }
   http_fetcher_->TerminateTransfer();
+  FreeParser();
 }
 
-// We just store the response in the buffer. Once we've received all bytes,
-// we'll look in the buffer and decide what to do.
+// Each chunk goes straight to the parser, which keeps only what it needs.
+// Once we've received all bytes, we'll decide what to do.
 void UpdateCheckAction::ReceivedBytes(HttpFetcher *fetcher,
                                    const char* bytes,
                                    int length) {
-  response_buffer_.reserve(response_buffer_.size() + length);
-  response_buffer_.insert(response_buffer_.end(), bytes, bytes + length);
+  AddBytesIn(length);
+  if (!parser_context_)
+    return;  // Already rejected.
+  response_size_ += length;
+  if (response_size_ > kMaxResponseSize) {
+    LOG(ERROR) << "Omaha response is over " << kMaxResponseSize << " bytes";
+  } else if (xmlParseChunk(parser_context_, bytes, length, 0) != 0) {
+    LOG(ERROR) << "Omaha response not valid XML";
+  } else {
+    return;
+  }
+  // There's no point in downloading the rest. The fetcher may not be
+  // stopped from inside its own callback, so that's done from the main loop.
+  FreeParser();
+  abort_source_id_ = g_idle_add(StaticAbortTransfer, this);
 }
 
-namespace {
-// If non-NULL response, caller is responsible for calling xmlXPathFreeObject()
-// on the returned object.
-// This code is roughly based on the libxml tutorial at:
-// http://xmlsoft.org/tutorial/apd.html
-xmlXPathObject* GetNodeSet(xmlDoc* doc, const xmlChar* xpath,
-                           const xmlChar* ns, const xmlChar* ns_url) {
-  xmlXPathObject* result = NULL;
-
-  scoped_ptr_malloc<xmlXPathContext, ScopedPtrXmlXPathContextFree> context(
-      xmlXPathNewContext(doc));
-  if (!context.get()) {
-    LOG(ERROR) << "xmlXPathNewContext() returned NULL";
-    return NULL;
-  }
-  if (xmlXPathRegisterNs(context.get(), ns, ns_url) < 0) {
-    LOG(ERROR) << "xmlXPathRegisterNs() returned error";
-    return NULL;
-  }
+void UpdateCheckAction::AbortTransfer() {
+  abort_source_id_ = 0;
+  http_fetcher_->TerminateTransfer();
+  processor_->ActionComplete(this, false);
+}
 
-  result = xmlXPathEvalExpression(xpath, context.get());
+void UpdateCheckAction::FreeParser() {
+  if (!parser_context_)
+    return;
+  xmlFreeParserCtxt(parser_context_);
+  parser_context_ = NULL;
+}
 
-  if (result == NULL) {
-    LOG(ERROR) << "xmlXPathEvalExpression returned error";
-    return NULL;
-  }
-  if(xmlXPathNodeSetIsEmpty(result->nodesetval)){
-    LOG(INFO) << "xpath not found in doc";
-    xmlXPathFreeObject(result);
-    return NULL;
+void UpdateCheckAction::StaticStartElement(void* ctx,
+                                           const xmlChar* localname,
+                                           const xmlChar* prefix,
+                                           const xmlChar* uri,
+                                           int nb_namespaces,
+                                           const xmlChar** namespaces,
+                                           int nb_attributes,
+                                           int nb_defaulted,
+                                           const xmlChar** attributes) {
+  UpdateCheckAction* self = reinterpret_cast<UpdateCheckAction*>(ctx);
+  const int depth = self->element_depth_++;
+  if (self->matched_depth_ != depth ||
+      depth >= static_cast<int>(arraysize(kUpdatecheckPath)) ||
+      !uri || !xmlStrEqual(uri, ConstXMLStr(kNsUrl)) ||
+      !xmlStrEqual(localname, ConstXMLStr(kUpdatecheckPath[depth])))
+    return;
+  self->matched_depth_++;
+  if (self->matched_depth_ < static_cast<int>(arraysize(kUpdatecheckPath)) ||
+      self->found_updatecheck_)
+    return;
+  // Only the first updatecheck counts. Its attributes come as (localname,
+  // prefix, URI, value, end of value) tuples.
+  self->found_updatecheck_ = true;
+  for (int i = 0; i < nb_attributes; i++) {
+    const xmlChar** attribute = &attributes[i * 5];
+    self->updatecheck_attributes_[reinterpret_cast<const char*>(
+        attribute[0])] = DecodeAttributeValue(attribute[3],
+                                              attribute[4] - attribute[3]);
   }
-  return result;
 }
 
-// Returns the string value of a named attribute on a node, or empty string
-// if no such node exists. If the attribute exists and has a value of
+void UpdateCheckAction::StaticEndElement(void* ctx,
+                                         const xmlChar* localname,
+                                         const xmlChar* prefix,
+                                         const xmlChar* uri) {
+  UpdateCheckAction* self = reinterpret_cast<UpdateCheckAction*>(ctx);
+  self->element_depth_--;
+  if (self->matched_depth_ > self->element_depth_)
+    self->matched_depth_ = self->element_depth_;
+}
+
+namespace {
+// Returns the value of the named attribute in attributes, or empty string
+// if there's no such attribute. If the attribute exists and has a value of
 // empty string, there's no way to distinguish that from the attribute
 // not existing.
-string XmlGetProperty(xmlNode* node, const char* name) {
-  if (!xmlHasProp(node, ConstXMLStr(name)))
-    return "";
-  scoped_ptr_malloc<xmlChar, ScopedPtrXmlFree> str(
-      xmlGetProp(node, ConstXMLStr(name)));
-  string ret(reinterpret_cast<const char *>(str.get()));
-  return ret;
+string GetAttribute(const std::map<string, string>& attributes,
+                    const char* name) {
+  std::map<string, string>::const_iterator it = attributes.find(name);
+  return it == attributes.end() ? "" : it->second;
 }
 
 // Parses a 64 bit base-10 int from a string and returns it. Returns 0
@@ -182,11 +248,18 @@ off_t ParseInt(const string& str) {
 }
 }  // namespace {}
 
-// If the transfer was successful, this uses libxml2 to parse the response
-// and fill in the appropriate fields of the output object. Also, notifies
+// If the transfer was successful, this finishes parsing the response and
+// fills in the appropriate fields of the output object. Also, notifies
 // the processor that we're done.
 void UpdateCheckAction::TransferComplete(HttpFetcher *fetcher,
                                          bool successful) {
+  if (abort_source_id_) {
+    // The response was rejected; AbortTransfer() would fail the action.
+    g_source_remove(abort_source_id_);
+    abort_source_id_ = 0;
+    processor_->ActionComplete(this, false);
+    return;
+  }
   ScopedActionCompleter completer(processor_, this);
   if (!successful)
     return;
@@ -197,39 +270,49 @@ void UpdateCheckAction::TransferComplete(HttpFetcher *fetcher,
     return;
   }
 
-  // parse our response and fill the fields in the output object
-  scoped_ptr_malloc<xmlDoc, ScopedPtrXmlDocFree> doc(
-      xmlParseMemory(&response_buffer_[0], response_buffer_.size()));
-  if (!doc.get()) {
+  UpdateCheckResponse output_object;
+  const int response_code = http_fetcher_->http_response_code();
+  // A server that follows RFC 7232 replies to a POST whose If-None-Match
+  // matches with 412 Precondition Failed rather than 304 Not Modified.
+  if (!no_update_etag_.empty() &&
+      (response_code == 304 || response_code == 412)) {
+    LOG(INFO) << "No update (response not modified).";
+    FreeParser();
+    output_object.update_exists = false;
+    output_object.etag = no_update_etag_;
+    SetOutputObject(output_object);
+    completer.set_success(true);
+    return;
+  }
+  if (response_code != 0 && (response_code < 200 || response_code >= 300)) {
+    LOG(ERROR) << "Omaha server replied with HTTP status " << response_code;
+    return;
+  }
+  output_object.etag = http_fetcher_->etag();
+
+  // Let the parser see the end of the document.
+  CHECK(parser_context_);
+  const bool valid_xml = xmlParseChunk(parser_context_, NULL, 0, 1) == 0 &&
+      parser_context_->wellFormed;
+  FreeParser();
+  if (!valid_xml) {
     LOG(ERROR) << "Omaha response not valid XML";
     return;
   }
 
-  static const char* kNamespace("x");
-  static const char* kUpdatecheckNodeXpath("/x:gupdate/x:app/x:updatecheck");
-  static const char* kNsUrl("http://www.google.com/update2/response");
-
-  scoped_ptr_malloc<xmlXPathObject, ScopedPtrXmlXPathObjectFree>
-      xpath_nodeset(GetNodeSet(doc.get(),
-                               ConstXMLStr(kUpdatecheckNodeXpath),
-                               ConstXMLStr(kNamespace),
-                               ConstXMLStr(kNsUrl)));
-  if (!xpath_nodeset.get()) {
+  if (!found_updatecheck_) {
+    LOG(INFO) << "updatecheck not found in response";
     return;
   }
-  xmlNodeSet* nodeset = xpath_nodeset->nodesetval;
-  CHECK(nodeset) << "XPath missing NodeSet";
-  CHECK_GE(nodeset->nodeNr, 1);
 
-  xmlNode* updatecheck_node = nodeset->nodeTab[0];
   // get status
-  if (!xmlHasProp(updatecheck_node, ConstXMLStr("status"))) {
+  if (updatecheck_attributes_.find("status") ==
+      updatecheck_attributes_.end()) {
     LOG(ERROR) << "Response missing status";
     return;
   }
 
-  const string status(XmlGetProperty(updatecheck_node, "status"));
-  UpdateCheckResponse output_object;
+  const string status(GetAttribute(updatecheck_attributes_, "status"));
   if (status == "noupdate") {
     LOG(INFO) << "No update.";
     output_object.update_exists = false;
@@ -249,14 +332,17 @@ void UpdateCheckAction::TransferComplete(HttpFetcher *fetcher,
   completer.set_success(true);
 
   output_object.display_version =
-      XmlGetProperty(updatecheck_node, "DisplayVersion");
-  output_object.codebase = XmlGetProperty(updatecheck_node, "codebase");
-  output_object.more_info_url = XmlGetProperty(updatecheck_node, "MoreInfo");
-  output_object.hash = XmlGetProperty(updatecheck_node, "hash");
-  output_object.size = ParseInt(XmlGetProperty(updatecheck_node, "size"));
+      GetAttribute(updatecheck_attributes_, "DisplayVersion");
+  output_object.codebase = GetAttribute(updatecheck_attributes_, "codebase");
+  output_object.more_info_url =
+      GetAttribute(updatecheck_attributes_, "MoreInfo");
+  output_object.hash = GetAttribute(updatecheck_attributes_, "hash");
+  output_object.size =
+      ParseInt(GetAttribute(updatecheck_attributes_, "size"));
   output_object.needs_admin =
-      XmlGetProperty(updatecheck_node, "needsadmin") == "true";
-  output_object.prompt = XmlGetProperty(updatecheck_node, "Prompt") == "true";
+      GetAttribute(updatecheck_attributes_, "needsadmin") == "true";
+  output_object.prompt =
+      GetAttribute(updatecheck_attributes_, "Prompt") == "true";
   SetOutputObject(output_object);
   return;
 }
@@ -9,9 +9,11 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+#include <map>
 #include <string>
 
 #include <curl/curl.h>
+#include <libxml/parser.h>
 
 #include "base/scoped_ptr.h"
 #include "action.h"
@@ -19,6 +21,11 @@
 
 // The Update Check action makes an update check request to Omaha and
 // can output the response on the output ActionPipe.
+//
+// The response is parsed as it arrives with a SAX parser, which keeps only
+// the attributes of the updatecheck element rather than the whole document.
+// A response of more than kMaxResponseSize bytes is rejected as soon as it
+// gets that big.
 
 namespace chromeos_update_engine {
 
@@ -74,6 +81,9 @@ struct UpdateCheckResponse {
   // True iff there is an update to be downloaded.
   bool update_exists;
 
+  // The ETag of the response, if it had one.
+  std::string etag;
+
   // These are only valid if update_exists is true:
   std::string display_version;
   std::string codebase;
@@ -113,6 +123,14 @@ class UpdateCheckAction : public Action<UpdateCheckAction>,
   void PerformAction();
   void TerminateProcessing();
 
+  // If set, the request asks the server not to send its response again if
+  // it's still the "no update" response that had this ETag. A reply of 304
+  // Not Modified, or 412 Precondition Failed, is then taken to mean that
+  // there's still no update.
+  void set_no_update_etag(const std::string& etag) {
+    no_update_etag_ = etag;
+  }
+
   // Debugging/logging
   static std::string StaticType() { return "UpdateCheckAction"; }
   std::string Type() const { return StaticType(); }
@@ -122,15 +140,64 @@ class UpdateCheckAction : public Action<UpdateCheckAction>,
                              const char* bytes, int length);
   virtual void TransferComplete(HttpFetcher *fetcher, bool successful);
 
+  // Omaha's responses are a few hundred bytes; anything much bigger isn't
+  // one.
+  static const int kMaxResponseSize = 64 * 1024;
+
  private:
+  // SAX callbacks. These track where the parser is in the document and
+  // record the attributes of /gupdate/app/updatecheck.
+  static void StaticStartElement(void* ctx,
+                                 const xmlChar* localname,
+                                 const xmlChar* prefix,
+                                 const xmlChar* uri,
+                                 int nb_namespaces,
+                                 const xmlChar** namespaces,
+                                 int nb_attributes,
+                                 int nb_defaulted,
+                                 const xmlChar** attributes);
+  static void StaticEndElement(void* ctx,
+                               const xmlChar* localname,
+                               const xmlChar* prefix,
+                               const xmlChar* uri);
+
+  // Gives up on the response: stops the transfer and fails the action.
+  void AbortTransfer();
+  static gboolean StaticAbortTransfer(gpointer data) {
+    reinterpret_cast<UpdateCheckAction*>(data)->AbortTransfer();
+    return FALSE;
+  }
+
+  // Frees parser_context_, if there is one.
+  void FreeParser();
+
   // These are data that are passed in the request to the Omaha server
   UpdateCheckParams params_;
 
   // pointer to the HttpFetcher that does the http work
   scoped_ptr<HttpFetcher> http_fetcher_;
 
-  // Stores the response from the omaha server
-  std::vector<char> response_buffer_;
+  // See set_no_update_etag().
+  std::string no_update_etag_;
+
+  // Parses the response from the omaha server as it comes in. NULL once the
+  // response has been rejected.
+  xmlParserCtxt* parser_context_;
+
+  // Bytes of response received so far.
+  int response_size_;
+
+  // How deep the parser is in the document, and how many of the elements it
+  // is in are, in turn, gupdate, app and updatecheck.
+  int element_depth_;
+  int matched_depth_;
+
+  // Whether an updatecheck element has been seen, and if so, its attributes.
+  bool found_updatecheck_;
+  std::map<std::string, std::string> updatecheck_attributes_;
+
+  // The main loop source that runs AbortTransfer(), if one is pending.
+  guint abort_source_id_;
 
   DISALLOW_COPY_AND_ASSIGN(UpdateCheckAction);
 };
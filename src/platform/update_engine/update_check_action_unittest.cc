@@ -93,6 +93,7 @@ class ActionTraits<OutputObjectCollectorAction> {
 
 class OutputObjectCollectorAction : public Action<OutputObjectCollectorAction> {
  public:
+  OutputObjectCollectorAction() : has_input_object_(false) {}
   void PerformAction() {
     // copy input object
     has_input_object_ = HasInputObject();
@@ -249,7 +250,7 @@ TEST(UpdateCheckActionTest, InvalidXmlTest) {
                            "en-US",
                            "unittest_track");
   UpdateCheckResponse response;
-  ASSERT_TRUE(
+  ASSERT_FALSE(
       TestUpdateCheckAction(params,
                             "invalid xml>",
                             false,
@@ -269,7 +270,7 @@ TEST(UpdateCheckActionTest, MissingStatusTest) {
                            "en-US",
                            "unittest_track");
   UpdateCheckResponse response;
-  ASSERT_TRUE(TestUpdateCheckAction(
+  ASSERT_FALSE(TestUpdateCheckAction(
       params,
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?><gupdate "
       "xmlns=\"http://www.google.com/update2/response\" protocol=\"2.0\"><app "
@@ -292,7 +293,7 @@ TEST(UpdateCheckActionTest, InvalidStatusTest) {
                            "en-US",
                            "unittest_track");
   UpdateCheckResponse response;
-  ASSERT_TRUE(TestUpdateCheckAction(
+  ASSERT_FALSE(TestUpdateCheckAction(
       params,
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?><gupdate "
       "xmlns=\"http://www.google.com/update2/response\" protocol=\"2.0\"><app "
@@ -315,7 +316,7 @@ TEST(UpdateCheckActionTest, MissingNodesetTest) {
                            "en-US",
                            "unittest_track");
   UpdateCheckResponse response;
-  ASSERT_TRUE(TestUpdateCheckAction(
+  ASSERT_FALSE(TestUpdateCheckAction(
       params,
       "<?xml version=\"1.0\" encoding=\"UTF-8\"?><gupdate "
       "xmlns=\"http://www.google.com/update2/response\" protocol=\"2.0\"><app "
@@ -366,6 +367,120 @@ TEST(UpdateCheckActionTest, MissingFieldTest) {
   EXPECT_FALSE(response.prompt);
 }
 
+TEST(UpdateCheckActionTest, ChunkedResponseTest) {
+  UpdateCheckParams params("machine_id",
+                           "user_id",
+                           UpdateCheckParams::kOsPlatform,
+                           UpdateCheckParams::kOsVersion,
+                           "service_pack",
+                           UpdateCheckParams::kAppId,
+                           "0.1.0.0",
+                           "en-US",
+                           "unittest_track");
+  const string http_response(GetUpdateResponse(UpdateCheckParams::kAppId,
+                                               "1.2.3.4",  // version
+                                               "http://more/info",
+                                               "true",  // prompt
+                                               "http://code/&amp;&#38;base",
+                                               "HASH1234=",  // checksum
+                                               "false",  // needs admin
+                                               "123"));  // size
+
+  // The fetcher sends nothing itself; the response is fed to the action a
+  // byte at a time, so that every token is split across calls.
+  MockHttpFetcher *fetcher = new MockHttpFetcher(NULL, 0);
+  ObjectFeederAction<UpdateCheckParams> feeder_action;
+  UpdateCheckAction action(fetcher);  // takes ownership of fetcher
+  ObjectCollectorAction<UpdateCheckResponse> collector_action;
+  ActionProcessor processor;
+  feeder_action.set_obj(params);
+  BondActions(&feeder_action, &action);
+  BondActions(&action, &collector_action);
+  processor.EnqueueAction(&feeder_action);
+  processor.EnqueueAction(&action);
+  processor.EnqueueAction(&collector_action);
+  processor.StartProcessing();
+  ASSERT_TRUE(action.IsRunning());
+  for (size_t i = 0; i < http_response.size(); i++)
+    action.ReceivedBytes(fetcher, &http_response[i], 1);
+  action.TransferComplete(fetcher, true);
+  EXPECT_FALSE(processor.IsRunning());
+
+  const UpdateCheckResponse& response = collector_action.object();
+  EXPECT_TRUE(response.update_exists);
+  EXPECT_EQ("1.2.3.4", response.display_version);
+  EXPECT_EQ("http://code/&&base", response.codebase);
+  EXPECT_EQ("http://more/info", response.more_info_url);
+  EXPECT_EQ("HASH1234=", response.hash);
+  EXPECT_EQ(123, response.size);
+  EXPECT_FALSE(response.needs_admin);
+  EXPECT_TRUE(response.prompt);
+}
+
+TEST(UpdateCheckActionTest, WrongNamespaceTest) {
+  UpdateCheckParams params("",  // machine_id
+                           "",  // user_id
+                           UpdateCheckParams::kOsPlatform,
+                           UpdateCheckParams::kOsVersion,
+                           "",  // os_sp
+                           UpdateCheckParams::kAppId,
+                           "0.1.0.0",
+                           "en-US",
+                           "unittest");
+  UpdateCheckResponse response;
+  // The updatecheck is in the request namespace, and the one in the right
+  // namespace is in the wrong place.
+  ASSERT_FALSE(
+      TestUpdateCheckAction(params,
+                            "<?xml version=\"1.0\" encoding=\"UTF-8\"?>"
+                            "<gupdate xmlns=\"http://www.google.com/update2/"
+                            "response\" xmlns:o=\"http://www.google.com/"
+                            "update2/request\" protocol=\"2.0\"><app><o:"
+                            "updatecheck status=\"noupdate\"/></app>"
+                            "<updatecheck status=\"noupdate\"/></gupdate>",
+                            false,
+                            &response,
+                            NULL));
+}
+
+TEST(UpdateCheckActionTest, OversizedResponseTest) {
+  UpdateCheckParams params("",  // machine_id
+                           "",  // user_id
+                           UpdateCheckParams::kOsPlatform,
+                           UpdateCheckParams::kOsVersion,
+                           "",  // os_sp
+                           UpdateCheckParams::kAppId,
+                           "0.1.0.0",
+                           "en-US",
+                           "unittest");
+  UpdateCheckResponse response;
+  // Valid, but padded with a long comment. It's rejected part way through,
+  // before the end arrives.
+  string http_response(GetNoUpdateResponse(UpdateCheckParams::kAppId));
+  http_response += "<!--" +
+      string(4 * UpdateCheckAction::kMaxResponseSize, ' ') + "-->";
+  ASSERT_FALSE(
+      TestUpdateCheckAction(params,
+                            http_response,
+                            false,
+                            &response,
+                            NULL));
+
+  // Right at the limit is fine.
+  http_response = GetNoUpdateResponse(UpdateCheckParams::kAppId);
+  http_response += "<!--" + string(UpdateCheckAction::kMaxResponseSize -
+                                   http_response.size() - 7, ' ') + "-->";
+  ASSERT_EQ(static_cast<size_t>(UpdateCheckAction::kMaxResponseSize),
+            http_response.size());
+  ASSERT_TRUE(
+      TestUpdateCheckAction(params,
+                            http_response,
+                            true,
+                            &response,
+                            NULL));
+  EXPECT_FALSE(response.update_exists);
+}
+
 namespace {
 class TerminateEarlyTestProcessorDelegate : public ActionProcessorDelegate {
  public:
@@ -435,7 +550,7 @@ TEST(UpdateCheckActionTest, XmlEncodeTest) {
                            "en-US",
                            "unittest_track");
   UpdateCheckResponse response;
-  ASSERT_TRUE(
+  ASSERT_FALSE(
       TestUpdateCheckAction(params,
                             "invalid xml>",
                             false,
@@ -0,0 +1,191 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include "update_engine/update_check_scheduler.h"
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include "chromeos/obsolete_logging.h"
+#include "update_engine/action_pipe.h"
+#include "update_engine/libcurl_http_fetcher.h"
+#include "update_engine/omaha_request_prep_action.h"
+
+using std::max;
+using std::min;
+using std::string;
+using std::tr1::shared_ptr;
+
+namespace chromeos_update_engine {
+
+namespace {
+class ResponseCollectorAction;
+}  // namespace {}
+
+template<>
+class ActionTraits<ResponseCollectorAction> {
+ public:
+  typedef UpdateCheckResponse InputObjectType;
+  typedef NoneType OutputObjectType;
+};
+
+namespace {
+// Takes the UpdateCheckAction's response off its output pipe.
+class ResponseCollectorAction : public Action<ResponseCollectorAction> {
+ public:
+  ResponseCollectorAction(bool* got_response, UpdateCheckResponse* response)
+      : got_response_(got_response), response_(response) {}
+  typedef ActionTraits<ResponseCollectorAction>::InputObjectType
+      InputObjectType;
+  typedef ActionTraits<ResponseCollectorAction>::OutputObjectType
+      OutputObjectType;
+  void PerformAction() {
+    CHECK(HasInputObject());
+    *response_ = GetInputObject();
+    *got_response_ = true;
+    processor_->ActionComplete(this, true);
+  }
+
+  // This is a synchronous action, and thus TerminateProcessing() should
+  // never be called
+  void TerminateProcessing() { CHECK(false); }
+
+  // Debugging/logging
+  static std::string StaticType() { return "ResponseCollectorAction"; }
+  std::string Type() const { return StaticType(); }
+
+ private:
+  bool* got_response_;
+  UpdateCheckResponse* response_;
+
+  DISALLOW_COPY_AND_ASSIGN(ResponseCollectorAction);
+};
+}  // namespace {}
+
+const int UpdateCheckScheduler::kInitialDelaySeconds;
+const int UpdateCheckScheduler::kInitialFuzzSeconds;
+const int UpdateCheckScheduler::kIntervalSeconds;
+const int UpdateCheckScheduler::kIntervalFuzzSeconds;
+const int UpdateCheckScheduler::kMaxBackoffSeconds;
+
+UpdateCheckScheduler::UpdateCheckScheduler(
+    UpdateCheckSchedulerDelegate* delegate)
+    : delegate_(delegate),
+      got_response_(false),
+      timeout_id_(0),
+      next_check_delay_(-1),
+      consecutive_failures_(0),
+      random_seed_(time(NULL) ^ getpid()) {
+  processor_.set_delegate(this);
+}
+
+UpdateCheckScheduler::~UpdateCheckScheduler() {
+  Stop();
+}
+
+void UpdateCheckScheduler::Start() {
+  CHECK(!timeout_id_);
+  CHECK(!processor_.IsRunning());
+  ScheduleCheck(kInitialDelaySeconds, kInitialFuzzSeconds);
+}
+
+void UpdateCheckScheduler::Stop() {
+  if (timeout_id_) {
+    RemoveTimeout(timeout_id_);
+    timeout_id_ = 0;
+  }
+  next_check_delay_ = -1;
+  if (processor_.IsRunning())
+    processor_.StopProcessing();
+  actions_.clear();
+}
+
+void UpdateCheckScheduler::UpdateAttemptDone(bool success) {
+  if (success) {
+    consecutive_failures_ = 0;
+  } else {
+    consecutive_failures_++;
+  }
+  ScheduleCheck(kIntervalSeconds, kIntervalFuzzSeconds);
+}
+
+guint UpdateCheckScheduler::AddTimeout(int seconds,
+                                       GSourceFunc function,
+                                       gpointer data) {
+  return g_timeout_add_seconds(seconds, function, data);
+}
+
+void UpdateCheckScheduler::RemoveTimeout(guint id) {
+  g_source_remove(id);
+}
+
+HttpFetcher* UpdateCheckScheduler::NewHttpFetcher() {
+  return new LibcurlHttpFetcher;
+}
+
+void UpdateCheckScheduler::ScheduleCheck(int base_seconds, int fuzz_seconds) {
+  CHECK(!timeout_id_);
+  int delay = base_seconds;
+  for (int i = 1; i < consecutive_failures_ && delay < kMaxBackoffSeconds; i++)
+    delay *= 2;
+  delay = min(delay, max(base_seconds, kMaxBackoffSeconds));
+  delay += rand_r(&random_seed_) % (fuzz_seconds + 1) - fuzz_seconds / 2;
+  delay = max(delay, 1);
+  LOG(INFO) << "Next update check in " << delay << " seconds";
+  next_check_delay_ = delay;
+  timeout_id_ = AddTimeout(delay, StaticCheck, this);
+}
+
+void UpdateCheckScheduler::Check() {
+  CHECK(!processor_.IsRunning());
+  next_check_delay_ = -1;
+  // The actions of the last check can't be deleted while they're running,
+  // which they are when ProcessingDone() is called.
+  actions_.clear();
+  got_response_ = false;
+
+  shared_ptr<OmahaRequestPrepAction> request_prep_action(
+      new OmahaRequestPrepAction(false));
+  request_prep_action->set_root(root_);
+  shared_ptr<UpdateCheckAction> update_check_action(
+      new UpdateCheckAction(NewHttpFetcher()));
+  update_check_action->set_no_update_etag(no_update_etag_);
+  shared_ptr<ResponseCollectorAction> response_collector_action(
+      new ResponseCollectorAction(&got_response_, &response_));
+
+  actions_.push_back(shared_ptr<AbstractAction>(request_prep_action));
+  actions_.push_back(shared_ptr<AbstractAction>(update_check_action));
+  actions_.push_back(shared_ptr<AbstractAction>(response_collector_action));
+  for (std::vector<shared_ptr<AbstractAction> >::iterator it =
+           actions_.begin(); it != actions_.end(); ++it) {
+    processor_.EnqueueAction(it->get());
+  }
+  BondActions(request_prep_action.get(), update_check_action.get());
+  BondActions(update_check_action.get(), response_collector_action.get());
+
+  processor_.StartProcessing();
+}
+
+void UpdateCheckScheduler::ProcessingDone(const ActionProcessor* processor,
+                                          bool success) {
+  if (!success || !got_response_) {
+    consecutive_failures_++;
+    LOG(ERROR) << "Update check failed (" << consecutive_failures_
+               << " in a row)";
+    ScheduleCheck(kIntervalSeconds, kIntervalFuzzSeconds);
+    return;
+  }
+  consecutive_failures_ = 0;
+  if (!response_.update_exists) {
+    // Omaha may well say the same thing next time.
+    no_update_etag_ = response_.etag;
+    ScheduleCheck(kIntervalSeconds, kIntervalFuzzSeconds);
+    return;
+  }
+  no_update_etag_.clear();
+  LOG(INFO) << "Update available";
+  delegate_->UpdateAvailable(this, response_);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,140 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_UPDATE_CHECK_SCHEDULER_H__
+#define CHROMEOS_PLATFORM_UPDATE_ENGINE_UPDATE_CHECK_SCHEDULER_H__
+
+#include <string>
+#include <tr1/memory>
+#include <vector>
+#include <glib.h>
+#include "base/basictypes.h"
+#include "update_engine/action_processor.h"
+#include "update_engine/http_fetcher.h"
+#include "update_engine/update_check_action.h"
+
+// UpdateCheckScheduler checks with Omaha for updates periodically, by
+// running an OmahaRequestPrepAction and an UpdateCheckAction on its own
+// ActionProcessor. When a check finds an update, it tells its delegate and
+// waits to be told how the update went before checking again.
+//
+// Checks are spread out so that a fleet of machines doesn't check at the
+// same moment: each delay is fuzzed by a random amount. While checks keep
+// failing, the delay doubles after each one, up to kMaxBackoffSeconds.
+//
+// The ETag of the last "no update" response is sent with the next check, so
+// that a server that supports it can reply 304 Not Modified instead of
+// sending the same answer again.
+
+namespace chromeos_update_engine {
+
+class UpdateCheckScheduler;
+
+class UpdateCheckSchedulerDelegate {
+ public:
+  virtual ~UpdateCheckSchedulerDelegate() {}
+
+  // Called when a check finds an update. No more checks are made until
+  // UpdateAttemptDone() is called.
+  virtual void UpdateAvailable(UpdateCheckScheduler* scheduler,
+                               const UpdateCheckResponse& response) = 0;
+};
+
+class UpdateCheckScheduler : public ActionProcessorDelegate {
+ public:
+  // The first check is made about kInitialDelaySeconds after Start(), and
+  // the others about kIntervalSeconds apart. Each delay is moved earlier or
+  // later by up to half of its fuzz.
+  static const int kInitialDelaySeconds = 7 * 60;
+  static const int kInitialFuzzSeconds = 3 * 60;
+  static const int kIntervalSeconds = 45 * 60;
+  static const int kIntervalFuzzSeconds = 10 * 60;
+  static const int kMaxBackoffSeconds = 4 * 60 * 60;
+
+  explicit UpdateCheckScheduler(UpdateCheckSchedulerDelegate* delegate);
+  virtual ~UpdateCheckScheduler();
+
+  // Schedules the first check.
+  void Start();
+
+  // Cancels the next check, and the one in progress, if any.
+  void Stop();
+
+  // Schedules the next check once an update that was reported to the
+  // delegate has been installed or has failed to be.
+  void UpdateAttemptDone(bool success);
+
+  // The delay before the next check, in seconds, or -1 if none is
+  // scheduled. For testing.
+  int next_check_delay() const { return next_check_delay_; }
+
+  // How many checks in a row have failed.
+  int consecutive_failures() const { return consecutive_failures_; }
+
+  // The ETag sent with the next check, if any.
+  const std::string& no_update_etag() const { return no_update_etag_; }
+
+  // For unit-tests: see OmahaRequestPrepAction::set_root().
+  void set_root(const std::string& root) { root_ = root; }
+
+  // ActionProcessorDelegate method:
+  void ProcessingDone(const ActionProcessor* processor, bool success);
+
+ protected:
+  // The clock and the network. Tests override these to run checks without
+  // waiting or connecting to anything.
+
+  // Calls function(data) once, seconds from now, until it's removed. Returns
+  // a nonzero id for RemoveTimeout().
+  virtual guint AddTimeout(int seconds, GSourceFunc function, gpointer data);
+  virtual void RemoveTimeout(guint id);
+
+  // Returns a new HttpFetcher for a check to use.
+  virtual HttpFetcher* NewHttpFetcher();
+
+ private:
+  // Schedules the next check base_seconds from now, give or take half of
+  // fuzz_seconds. base_seconds is doubled for each failure in a row after
+  // the first.
+  void ScheduleCheck(int base_seconds, int fuzz_seconds);
+
+  // Starts a check.
+  void Check();
+  static gboolean StaticCheck(gpointer data) {
+    UpdateCheckScheduler* self = reinterpret_cast<UpdateCheckScheduler*>(data);
+    self->timeout_id_ = 0;
+    self->Check();
+    return FALSE;
+  }
+
+  UpdateCheckSchedulerDelegate* delegate_;
+
+  // Runs the actions of the check in progress, if any.
+  ActionProcessor processor_;
+  std::vector<std::tr1::shared_ptr<AbstractAction> > actions_;
+
+  // What the check in progress got from Omaha, once it's been parsed.
+  bool got_response_;
+  UpdateCheckResponse response_;
+
+  // The pending timeout, if any, and how many seconds it was set for.
+  guint timeout_id_;
+  int next_check_delay_;
+
+  int consecutive_failures_;
+
+  // See UpdateCheckAction::set_no_update_etag().
+  std::string no_update_etag_;
+
+  // Seeds rand_r() for the fuzz.
+  unsigned int random_seed_;
+
+  std::string root_;
+
+  DISALLOW_COPY_AND_ASSIGN(UpdateCheckScheduler);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // CHROMEOS_PLATFORM_UPDATE_ENGINE_UPDATE_CHECK_SCHEDULER_H__
@@ -0,0 +1,289 @@
+// Copyright (c) 2010 The Chromium OS Authors. All rights reserved.
+// Use of this source code is governed by a BSD-style license that can be
+// found in the LICENSE file.
+
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include <glib.h>
+#include <gtest/gtest.h>
+#include "update_engine/mock_http_fetcher.h"
+#include "update_engine/test_utils.h"
+#include "update_engine/update_check_scheduler.h"
+#include "update_engine/utils.h"
+
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class UpdateCheckSchedulerTest : public ::testing::Test { };
+
+namespace {
+const char* const kTestDir = "update_check_scheduler-test";
+
+const char* const kEtag = "\"no-update\"";
+
+string GetNoUpdateResponse() {
+  return string(
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?><gupdate "
+      "xmlns=\"http://www.google.com/update2/response\" protocol=\"2.0\"><app "
+      "appid=\"") + UpdateCheckParams::kAppId + "\" status=\"ok\"><ping "
+      "status=\"ok\"/><updatecheck status=\"noupdate\"/></app></gupdate>";
+}
+
+string GetUpdateResponse() {
+  return string(
+      "<?xml version=\"1.0\" encoding=\"UTF-8\"?><gupdate "
+      "xmlns=\"http://www.google.com/update2/response\" protocol=\"2.0\"><app "
+      "appid=\"") + UpdateCheckParams::kAppId + "\" status=\"ok\"><ping "
+      "status=\"ok\"/><updatecheck codebase=\"http://code/base\" "
+      "hash=\"HASH1234=\" size=\"123\" status=\"ok\"/></app></gupdate>";
+}
+
+// Runs checks on a fake clock: timeouts only fire when the test says so.
+// Each check gets the next of the responses the test has queued up.
+class FakeClockScheduler : public UpdateCheckScheduler {
+ public:
+  explicit FakeClockScheduler(UpdateCheckSchedulerDelegate* delegate)
+      : UpdateCheckScheduler(delegate), update_available_(false),
+        not_modified_response_code_(304), next_timeout_id_(1),
+        last_fetcher_(NULL) {}
+
+  // The next check gets response, sent with etag if it's not empty.
+  void QueueResponse(const string& response, const string& etag) {
+    responses_.push_back(make_pair(response, etag));
+  }
+
+  // Fires the one pending timeout, which starts a check, and runs the main
+  // loop until the check is done. Returns false if no timeout was pending.
+  bool FireTimeout() {
+    if (timeouts_.size() != 1)
+      return false;
+    const Timeout timeout = timeouts_.begin()->second;
+    timeouts_.clear();
+    timeout.first(timeout.second);
+    while (next_check_delay() < 0 && !update_available_)
+      g_main_context_iteration(NULL, TRUE);
+    return true;
+  }
+
+  int pending_timeouts() const { return timeouts_.size(); }
+
+  // The fetcher the last check used. It's deleted by the next check.
+  MockHttpFetcher* last_fetcher() const { return last_fetcher_; }
+
+  // Set by the delegate.
+  bool update_available_;
+
+  // What the server replies when the ETag matches.
+  int not_modified_response_code_;
+
+ protected:
+  virtual guint AddTimeout(int seconds, GSourceFunc function, gpointer data) {
+    timeouts_[next_timeout_id_] = Timeout(function, data);
+    return next_timeout_id_++;
+  }
+
+  virtual void RemoveTimeout(guint id) {
+    EXPECT_EQ(1, timeouts_.erase(id));
+  }
+
+  virtual HttpFetcher* NewHttpFetcher() {
+    CHECK(!responses_.empty());
+    const std::pair<string, string> response = responses_.front();
+    responses_.erase(responses_.begin());
+    last_fetcher_ = new MockHttpFetcher(response.first.data(),
+                                        response.first.size());
+    last_fetcher_->SetResponseEtag(response.second);
+    last_fetcher_->SetNotModifiedResponseCode(not_modified_response_code_);
+    return last_fetcher_;
+  }
+
+ private:
+  typedef std::pair<GSourceFunc, gpointer> Timeout;
+  map<guint, Timeout> timeouts_;
+  guint next_timeout_id_;
+
+  vector<std::pair<string, string> > responses_;
+  MockHttpFetcher* last_fetcher_;
+};
+
+class UpdateCheckSchedulerTestDelegate : public UpdateCheckSchedulerDelegate {
+ public:
+  UpdateCheckSchedulerTestDelegate() : scheduler_(NULL) {}
+  void UpdateAvailable(UpdateCheckScheduler* scheduler,
+                       const UpdateCheckResponse& response) {
+    EXPECT_EQ(scheduler_, scheduler);
+    scheduler_->update_available_ = true;
+    response_ = response;
+  }
+  FakeClockScheduler* scheduler_;
+  UpdateCheckResponse response_;
+};
+
+// Sets up the files that OmahaRequestPrepAction reads.
+void SetUpTestDir() {
+  ASSERT_EQ(0, System(string("mkdir -p ") + kTestDir + "/etc"));
+  ASSERT_EQ(0, System(string("mkdir -p ") + kTestDir +
+                      utils::kStatefulPartition + "/etc"));
+  ASSERT_TRUE(WriteFileString(string(kTestDir) + "/etc/lsb-release",
+                              "GOOGLE_RELEASE=0.2.2.3\nGOOGLE_TRACK=track"));
+}
+
+// Expects delay to be base_seconds, give or take half of fuzz_seconds.
+void ExpectDelay(int base_seconds, int fuzz_seconds, int delay) {
+  EXPECT_GE(delay, base_seconds - fuzz_seconds / 2);
+  EXPECT_LE(delay, base_seconds + fuzz_seconds / 2);
+}
+}  // namespace {}
+
+TEST(UpdateCheckSchedulerTest, NoUpdateTest) {
+  SetUpTestDir();
+  UpdateCheckSchedulerTestDelegate delegate;
+  FakeClockScheduler scheduler(&delegate);
+  delegate.scheduler_ = &scheduler;
+  scheduler.set_root(string("./") + kTestDir);
+
+  scheduler.Start();
+  ExpectDelay(UpdateCheckScheduler::kInitialDelaySeconds,
+              UpdateCheckScheduler::kInitialFuzzSeconds,
+              scheduler.next_check_delay());
+
+  // The first response comes with an ETag...
+  scheduler.QueueResponse(GetNoUpdateResponse(), kEtag);
+  ASSERT_TRUE(scheduler.FireTimeout());
+  EXPECT_EQ("", scheduler.last_fetcher()->if_none_match());
+  EXPECT_EQ(kEtag, scheduler.no_update_etag());
+  EXPECT_EQ(0, scheduler.consecutive_failures());
+  ExpectDelay(UpdateCheckScheduler::kIntervalSeconds,
+              UpdateCheckScheduler::kIntervalFuzzSeconds,
+              scheduler.next_check_delay());
+
+  // ...which the second check sends back, and isn't sent the same thing
+  // again.
+  scheduler.QueueResponse(GetNoUpdateResponse(), kEtag);
+  ASSERT_TRUE(scheduler.FireTimeout());
+  EXPECT_EQ(kEtag, scheduler.last_fetcher()->if_none_match());
+  EXPECT_EQ(304, scheduler.last_fetcher()->http_response_code());
+  EXPECT_EQ(kEtag, scheduler.no_update_etag());
+  EXPECT_EQ(0, scheduler.consecutive_failures());
+  EXPECT_FALSE(scheduler.update_available_);
+  ExpectDelay(UpdateCheckScheduler::kIntervalSeconds,
+              UpdateCheckScheduler::kIntervalFuzzSeconds,
+              scheduler.next_check_delay());
+
+  // A response that's changed is parsed as usual.
+  scheduler.QueueResponse(GetNoUpdateResponse(), "\"something else\"");
+  ASSERT_TRUE(scheduler.FireTimeout());
+  EXPECT_EQ(200, scheduler.last_fetcher()->http_response_code());
+  EXPECT_EQ("\"something else\"", scheduler.no_update_etag());
+  EXPECT_FALSE(scheduler.update_available_);
+
+  // A server that follows RFC 7232 replies 412 Precondition Failed to a
+  // POST, which means the same as 304.
+  scheduler.not_modified_response_code_ = 412;
+  scheduler.QueueResponse(GetNoUpdateResponse(), "\"something else\"");
+  ASSERT_TRUE(scheduler.FireTimeout());
+  EXPECT_EQ(412, scheduler.last_fetcher()->http_response_code());
+  EXPECT_EQ("\"something else\"", scheduler.no_update_etag());
+  EXPECT_EQ(0, scheduler.consecutive_failures());
+  EXPECT_FALSE(scheduler.update_available_);
+
+  scheduler.Stop();
+  EXPECT_EQ(0, scheduler.pending_timeouts());
+  EXPECT_EQ(-1, scheduler.next_check_delay());
+  EXPECT_EQ(0, System(string("rm -rf ") + kTestDir));
+}
+
+TEST(UpdateCheckSchedulerTest, BackoffTest) {
+  SetUpTestDir();
+  UpdateCheckSchedulerTestDelegate delegate;
+  FakeClockScheduler scheduler(&delegate);
+  delegate.scheduler_ = &scheduler;
+  scheduler.set_root(string("./") + kTestDir);
+  scheduler.Start();
+
+  // Each failure doubles the delay, up to the limit.
+  const int kExpectedDelays[] = {
+    UpdateCheckScheduler::kIntervalSeconds,
+    2 * UpdateCheckScheduler::kIntervalSeconds,
+    4 * UpdateCheckScheduler::kIntervalSeconds,
+    UpdateCheckScheduler::kMaxBackoffSeconds,
+    UpdateCheckScheduler::kMaxBackoffSeconds
+  };
+  for (size_t i = 0; i < arraysize(kExpectedDelays); i++) {
+    scheduler.QueueResponse("invalid xml>", "");
+    ASSERT_TRUE(scheduler.FireTimeout());
+    EXPECT_EQ(i + 1, scheduler.consecutive_failures());
+    ExpectDelay(kExpectedDelays[i],
+                UpdateCheckScheduler::kIntervalFuzzSeconds,
+                scheduler.next_check_delay());
+  }
+
+  // One success is enough to go back to the usual interval.
+  scheduler.QueueResponse(GetNoUpdateResponse(), "");
+  ASSERT_TRUE(scheduler.FireTimeout());
+  EXPECT_EQ(0, scheduler.consecutive_failures());
+  EXPECT_EQ("", scheduler.no_update_etag());
+  ExpectDelay(UpdateCheckScheduler::kIntervalSeconds,
+              UpdateCheckScheduler::kIntervalFuzzSeconds,
+              scheduler.next_check_delay());
+  scheduler.Stop();
+  EXPECT_EQ(0, System(string("rm -rf ") + kTestDir));
+}
+
+TEST(UpdateCheckSchedulerTest, UpdateAvailableTest) {
+  SetUpTestDir();
+  UpdateCheckSchedulerTestDelegate delegate;
+  FakeClockScheduler scheduler(&delegate);
+  delegate.scheduler_ = &scheduler;
+  scheduler.set_root(string("./") + kTestDir);
+  scheduler.Start();
+
+  scheduler.QueueResponse(GetNoUpdateResponse(), kEtag);
+  ASSERT_TRUE(scheduler.FireTimeout());
+  EXPECT_EQ(kEtag, scheduler.no_update_etag());
+
+  // Nothing more is scheduled while the update is attempted.
+  scheduler.QueueResponse(GetUpdateResponse(), "\"update\"");
+  ASSERT_TRUE(scheduler.FireTimeout());
+  ASSERT_TRUE(scheduler.update_available_);
+  EXPECT_TRUE(delegate.response_.update_exists);
+  EXPECT_EQ("http://code/base", delegate.response_.codebase);
+  EXPECT_EQ("", scheduler.no_update_etag());
+  EXPECT_EQ(0, scheduler.pending_timeouts());
+  EXPECT_EQ(-1, scheduler.next_check_delay());
+
+  // A failed attempt counts as a failure.
+  scheduler.UpdateAttemptDone(false);
+  EXPECT_EQ(1, scheduler.consecutive_failures());
+  EXPECT_EQ(1, scheduler.pending_timeouts());
+  ExpectDelay(UpdateCheckScheduler::kIntervalSeconds,
+              UpdateCheckScheduler::kIntervalFuzzSeconds,
+              scheduler.next_check_delay());
+  scheduler.Stop();
+  EXPECT_EQ(0, System(string("rm -rf ") + kTestDir));
+}
+
+TEST(UpdateCheckSchedulerTest, FuzzTest) {
+  UpdateCheckSchedulerTestDelegate delegate;
+  FakeClockScheduler scheduler(&delegate);
+  delegate.scheduler_ = &scheduler;
+  set<int> delays;
+  for (int i = 0; i < 50; i++) {
+    scheduler.Start();
+    ExpectDelay(UpdateCheckScheduler::kInitialDelaySeconds,
+                UpdateCheckScheduler::kInitialFuzzSeconds,
+                scheduler.next_check_delay());
+    delays.insert(scheduler.next_check_delay());
+    scheduler.Stop();
+  }
+  // Machines that start at the same time don't all check at the same time.
+  EXPECT_GT(delays.size(), 10);
+}
+
+}  // namespace chromeos_update_engine
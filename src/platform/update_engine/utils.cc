@@ -35,6 +35,40 @@ bool WriteFile(const char* path, const char* data, int data_len) {
   return true;
 }
 
+bool WriteFileAtomically(const std::string& path, const char* data,
+                         size_t data_len) {
+  // mkstemp() creates the temporary file exclusively, so a file or symlink
+  // someone else planted next to |path| is never written through.
+  string temp_path;
+  int fd = -1;
+  TEST_AND_RETURN_FALSE(MakeTempFile(path + ".XXXXXX", &temp_path, &fd));
+  ScopedPathUnlinker temp_unlinker(temp_path);
+  {
+    ScopedFdCloser fd_closer(&fd);
+    TEST_AND_RETURN_FALSE_ERRNO(fchmod(fd, 0644) == 0);
+    size_t written = 0;
+    while (written < data_len) {
+      ssize_t rc = write(fd, data + written, data_len - written);
+      if (rc < 0 && errno == EINTR)
+        continue;
+      TEST_AND_RETURN_FALSE_ERRNO(rc > 0);
+      written += rc;
+    }
+    TEST_AND_RETURN_FALSE_ERRNO(fsync(fd) == 0);
+  }
+  TEST_AND_RETURN_FALSE_ERRNO(rename(temp_path.c_str(), path.c_str()) == 0);
+  temp_unlinker.set_should_remove(false);
+  // Make the rename itself durable.
+  const string::size_type last_slash = path.rfind('/');
+  const string dir = last_slash == string::npos ? "." :
+      (last_slash == 0 ? "/" : path.substr(0, last_slash));
+  int dir_fd = open(dir.c_str(), O_RDONLY);
+  TEST_AND_RETURN_FALSE_ERRNO(dir_fd >= 0);
+  ScopedFdCloser dir_fd_closer(&dir_fd);
+  TEST_AND_RETURN_FALSE_ERRNO(fsync(dir_fd) == 0);
+  return true;
+}
+
 bool ReadFile(const std::string& path, std::vector<char>* out) {
   CHECK(out);
   FILE* fp = fopen(path.c_str(), "r");
@@ -64,6 +98,43 @@ bool ReadFileToString(const std::string& path, std::string* out) {
   return true;
 }
 
+bool PReadAll(int fd, void* buf, size_t count, off_t offset,
+              ssize_t* out_bytes_read) {
+  char* c_buf = static_cast<char*>(buf);
+  ssize_t bytes_read = 0;
+  while (bytes_read < static_cast<ssize_t>(count)) {
+    ssize_t rc = pread(fd, c_buf + bytes_read, count - bytes_read,
+                       offset + bytes_read);
+    TEST_AND_RETURN_FALSE_ERRNO(rc >= 0);
+    if (rc == 0) {
+      break;
+    }
+    bytes_read += rc;
+  }
+  *out_bytes_read = bytes_read;
+  return true;
+}
+
+bool MakeTempFile(const std::string& filename_template,
+                  std::string* filename,
+                  int* fd) {
+  TEST_AND_RETURN_FALSE(StringHasSuffix(filename_template, "XXXXXX"));
+  TEST_AND_RETURN_FALSE(filename);
+  vector<char> buf(filename_template.size() + 1);
+  memcpy(&buf[0], filename_template.data(), filename_template.size());
+  buf[filename_template.size()] = '\0';
+
+  int mkstemp_fd = mkstemp(&buf[0]);
+  TEST_AND_RETURN_FALSE_ERRNO(mkstemp_fd >= 0);
+  *filename = &buf[0];
+  if (fd) {
+    *fd = mkstemp_fd;
+  } else {
+    close(mkstemp_fd);
+  }
+  return true;
+}
+
 void HexDumpArray(const unsigned char* const arr, const size_t length) {
   const unsigned char* const char_arr =
       reinterpret_cast<const unsigned char* const>(arr);
@@ -5,6 +5,8 @@
 #ifndef CHROMEOS_PLATFORM_UPDATE_ENGINE_UTILS_H__
 #define CHROMEOS_PLATFORM_UPDATE_ENGINE_UTILS_H__
 
+#include <errno.h>
+#include <unistd.h>
 #include <set>
 #include <string>
 #include <vector>
@@ -19,10 +21,29 @@ namespace utils {
 // exists. Returns true on success, false otherwise.
 bool WriteFile(const char* path, const char* data, int data_len);
 
+// Like WriteFile(), but the data is written to a temporary file that's
+// synced to disk and then renamed to path. After a crash, path holds either
+// its old contents or all of data. Returns true on success.
+bool WriteFileAtomically(const std::string& path, const char* data,
+                         size_t data_len);
+
 // Returns the entire contents of the file at path. Returns true on success.
 bool ReadFile(const std::string& path, std::vector<char>* out);
 bool ReadFileToString(const std::string& path, std::string* out);
 
+// Calls pread() repeatedly until count bytes are read or EOF is reached.
+// Returns number of bytes read in *bytes_read. Returns true on success.
+bool PReadAll(int fd, void* buf, size_t count, off_t offset,
+              ssize_t* out_bytes_read);
+
+// Creates a unique temporary file from filename_template, which must end
+// in "XXXXXX". The name of the new file is returned in *filename. If fd
+// is non-NULL, the open file descriptor is returned in *fd and the caller
+// must close it; otherwise, the file is closed. Returns true on success.
+bool MakeTempFile(const std::string& filename_template,
+                  std::string* filename,
+                  int* fd);
+
 std::string ErrnoNumberAsString(int err);
 
 // Strips duplicate slashes, and optionally removes all trailing slashes.
@@ -122,6 +143,26 @@ class ScopedFdCloser {
   bool should_close_;
 };
 
+// Utility class to delete a file when it goes out of scope.
+class ScopedPathUnlinker {
+ public:
+  explicit ScopedPathUnlinker(const std::string& path)
+      : path_(path),
+        should_remove_(true) {}
+  ~ScopedPathUnlinker() {
+    if (should_remove_ && unlink(path_.c_str()) < 0) {
+      std::string err_message = utils::ErrnoNumberAsString(errno);
+      LOG(ERROR) << "Unable to unlink path " << path_ << ": " << err_message;
+    }
+  }
+  void set_should_remove(bool should_remove) {
+    should_remove_ = should_remove;
+  }
+ private:
+  const std::string path_;
+  bool should_remove_;
+};
+
 // A little object to call ActionComplete on the ActionProcessor when
 // it's destructed.
 class ScopedActionCompleter {
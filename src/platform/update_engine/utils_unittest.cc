@@ -5,6 +5,8 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <string>
 #include <vector>
 #include <gtest/gtest.h>
@@ -51,6 +53,39 @@ TEST(UtilsTest, ReadFileFailure) {
   EXPECT_FALSE(utils::ReadFile("/this/doesn't/exist", &empty));
 }
 
+TEST(UtilsTest, WriteFileAtomicallyTest) {
+  char dir_template[] = "/tmp/WriteFileAtomicallyTest.XXXXXX";
+  ASSERT_TRUE(mkdtemp(dir_template) != NULL);
+  const string dir(dir_template);
+  const string path = dir + "/file";
+  const string victim = dir + "/victim";
+
+  // A symlink planted where the old code put its temporary file must not be
+  // written through.
+  EXPECT_TRUE(utils::WriteFile(victim.c_str(), "victim", 6));
+  EXPECT_EQ(0, symlink(victim.c_str(), (path + ".new").c_str()));
+
+  EXPECT_TRUE(utils::WriteFileAtomically(path, "old contents", 12));
+  EXPECT_TRUE(utils::WriteFileAtomically(path, "new", 3));
+  string contents;
+  EXPECT_TRUE(utils::ReadFileToString(path, &contents));
+  EXPECT_EQ("new", contents);
+  EXPECT_TRUE(utils::ReadFileToString(victim, &contents));
+  EXPECT_EQ("victim", contents);
+  struct stat stbuf;
+  EXPECT_EQ(0, stat(path.c_str(), &stbuf));
+  EXPECT_EQ(0644, stbuf.st_mode & 0777);
+
+  // No temporary files are left behind.
+  EXPECT_EQ(0, unlink(path.c_str()));
+  EXPECT_EQ(0, unlink((path + ".new").c_str()));
+  EXPECT_EQ(0, unlink(victim.c_str()));
+  EXPECT_EQ(0, rmdir(dir.c_str()));
+
+  EXPECT_FALSE(utils::WriteFileAtomically("/fake/dir/that/does/not/exist",
+                                          "x", 1));
+}
+
 TEST(UtilsTest, ErrnoNumberAsStringTest) {
   EXPECT_EQ("No such file or directory", utils::ErrnoNumberAsString(ENOENT));
 }
@@ -111,4 +146,22 @@ TEST(UtilsTest, TempFilenameTest) {
   EXPECT_FALSE(utils::StringHasSuffix(result, "XXXXXX"));
 }
 
+TEST(UtilsTest, MakeTempFileTest) {
+  string path;
+  int fd = -1;
+  EXPECT_TRUE(utils::MakeTempFile("/tmp/UtilsTest.XXXXXX", &path, &fd));
+  EXPECT_TRUE(utils::StringHasPrefix(path, "/tmp/UtilsTest."));
+  EXPECT_FALSE(utils::StringHasSuffix(path, "XXXXXX"));
+  EXPECT_GE(fd, 0);
+  EXPECT_EQ(4, write(fd, "test", 4));
+  ssize_t bytes_read = 0;
+  char buf[8];
+  EXPECT_TRUE(utils::PReadAll(fd, buf, sizeof(buf), 1, &bytes_read));
+  EXPECT_EQ(3, bytes_read);
+  EXPECT_EQ(0, memcmp(buf, "est", 3));
+  EXPECT_EQ(0, close(fd));
+  EXPECT_EQ(0, unlink(path.c_str()));
+  EXPECT_FALSE(utils::MakeTempFile("/tmp/UtilsTest.bad", &path, NULL));
+}
+
 }  // namespace chromeos_update_engine
@@ -142,7 +142,9 @@ class ClutterInterface {
   // using CompositorEventSource::StartSendingEventsForWindowToCompositor().
   virtual void HandleWindowConfigured(XWindow xid) = 0;
   virtual void HandleWindowDestroyed(XWindow xid) = 0;
-  virtual void HandleWindowDamaged(XWindow xid) = 0;
+  // The damaged area is given in the window's coordinates.
+  virtual void HandleWindowDamaged(XWindow xid,
+                                   int x, int y, int width, int height) = 0;
 
  private:
   DISALLOW_COPY_AND_ASSIGN(ClutterInterface);
@@ -310,7 +312,8 @@ class MockClutterInterface : public ClutterInterface {
   StageActor* GetDefaultStage() { return &default_stage_; }
   void HandleWindowConfigured(XWindow xid) {}
   void HandleWindowDestroyed(XWindow xid) {}
-  void HandleWindowDamaged(XWindow xid) {}
+  void HandleWindowDamaged(XWindow xid,
+                           int x, int y, int width, int height) {}
   // End ClutterInterface methods
 
  private:
@@ -35,6 +35,14 @@ class GLInterface : virtual public GLInterfaceBase {
   virtual GLXContext CreateGlxContext() = 0;
   virtual void DestroyGlxContext(GLXContext context) = 0;
   virtual void SwapGlxBuffers(GLXDrawable drawable) = 0;
+  // Sets the minimum number of vertical retraces between buffer swaps
+  // for the current context, if the driver supports it.
+  virtual void SetGlxSwapInterval(int interval) = 0;
+  // Copies part of the back buffer to the front buffer, with the origin at
+  // the bottom left.  Only available if HasGlxCopySubBuffer() is true.
+  virtual bool HasGlxCopySubBuffer() = 0;
+  virtual void CopyGlxSubBuffer(GLXDrawable drawable,
+                                int x, int y, int width, int height) = 0;
   virtual Bool MakeGlxCurrent(GLXDrawable drawable,
                               GLXContext ctx) = 0;
 
@@ -62,6 +70,8 @@ class GLInterface : virtual public GLInterfaceBase {
   virtual void Clear(GLbitfield mask) = 0;
   virtual void Color4f(GLfloat red, GLfloat green, GLfloat blue,
                        GLfloat alpha) = 0;
+  virtual void ColorPointer(GLint size, GLenum type, GLsizei stride,
+                            const GLvoid* pointer) = 0;
   virtual void DeleteBuffers(GLsizei n, const GLuint* buffers) = 0;
   virtual void DeleteTextures(GLsizei n, const GLuint* textures) = 0;
   virtual void DepthMask(GLboolean flag) = 0;
@@ -82,6 +92,7 @@ class GLInterface : virtual public GLInterfaceBase {
   virtual void PopMatrix() = 0;
   virtual void Rotatef(GLfloat angle, GLfloat x, GLfloat y, GLfloat z) = 0;
   virtual void Scalef(GLfloat x, GLfloat y, GLfloat z) = 0;
+  virtual void Scissor(GLint x, GLint y, GLsizei width, GLsizei height) = 0;
   virtual void TexCoordPointer(GLint size, GLenum type, GLsizei stride,
                                const GLvoid* pointer) = 0;
   virtual void TexParameteri(GLenum target, GLenum pname, GLint param) = 0;
@@ -12,6 +12,9 @@
 #include <GLES2/gl2.h>
 #include <GLES2/gl2ext.h>
 
+#include <cstddef>
+#include <vector>
+
 #include "base/logging.h"
 #include "window_manager/gles/shaders.h"
 #include "window_manager/gles/gles2_interface.h"
@@ -39,7 +42,13 @@ OpenGlesDrawVisitor::OpenGlesDrawVisitor(GLInterfaceBase* gl,
     : gl_(dynamic_cast<Gles2Interface*>(gl)),
       interface_(interface),
       stage_(stage),
-      x_connection_(interface_->x_conn()) {
+      x_connection_(interface_->x_conn()),
+      origin_x_(0.f),
+      origin_y_(0.f),
+      scale_x_(1.f),
+      scale_y_(1.f),
+      ancestor_opacity_(1.f),
+      vertex_buffer_object_(0) {
   CHECK(gl_);
   egl_display_ = gl_->egl_display();
 
@@ -82,17 +91,9 @@ OpenGlesDrawVisitor::OpenGlesDrawVisitor(GLInterfaceBase* gl,
   tex_color_shader_ = new TexColorShader();
   gl_->ReleaseShaderCompiler();
 
-  // TODO: Move away from one global Vertex Buffer Object
+  // The draw list is streamed into this each frame.
   gl_->GenBuffers(1, &vertex_buffer_object_);
   CHECK(vertex_buffer_object_ > 0) << "VBO allocation failed.";
-  gl_->BindBuffer(GL_ARRAY_BUFFER, vertex_buffer_object_);
-  static float kQuad[] = {
-    0.f, 0.f,
-    0.f, 1.f,
-    1.f, 0.f,
-    1.f, 1.f,
-  };
-  gl_->BufferData(GL_ARRAY_BUFFER, sizeof(kQuad), kQuad, GL_STATIC_DRAW);
 }
 
 OpenGlesDrawVisitor::~OpenGlesDrawVisitor() {
@@ -141,42 +142,78 @@ void OpenGlesDrawVisitor::VisitStage(TidyInterface::StageActor* actor) {
   perspective_ = Matrix4::orthographic(0, actor->width(), actor->height(), 0,
                                        TidyInterface::LayerVisitor::kMinDepth,
                                        TidyInterface::LayerVisitor::kMaxDepth);
-  model_view_ = Matrix4::identity();
 
   // Set the z-depths for the actors.
   TidyInterface::LayerVisitor layer_visitor(interface_->actor_count());
   actor->Accept(&layer_visitor);
 
+  // The stage's position and size don't affect its children.
+  origin_x_ = 0.f;
+  origin_y_ = 0.f;
+  scale_x_ = 1.f;
+  scale_y_ = 1.f;
+  ancestor_opacity_ = actor->opacity();
+  draw_list_.Clear();
+
+  // Back to front rendering
+  // TODO: Switch to two pass Z-buffered rendering
+  const TidyInterface::ActorVector children = actor->GetChildren();
+  for (TidyInterface::ActorVector::const_reverse_iterator i =
+       children.rbegin(); i != children.rend(); ++i) {
+    (*i)->Accept(this);
+  }
+  // Blending needs the quads drawn in order, so only neighbours with the
+  // same texture are drawn together.
+  draw_list_.EndGroup(false);
+  DrawQuads();
+
+  gl_->EglSwapBuffers(egl_display_, egl_surface_);
+}
+
+void OpenGlesDrawVisitor::DrawQuads() {
+  typedef TidyInterface::DrawList::Vertex Vertex;
+  const std::vector<Vertex>& vertices = draw_list_.vertices();
+  if (vertices.empty())
+    return;
+
   // Bind shader
   // TODO: Implement VertexAttribArray tracking in the shader objects.
   gl_->UseProgram(tex_color_shader_->program());
   gl_->BindBuffer(GL_ARRAY_BUFFER, vertex_buffer_object_);
+  gl_->BufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex),
+                  &vertices[0], GL_STREAM_DRAW);
   gl_->VertexAttribPointer(tex_color_shader_->PosLocation(),
-                           2, GL_FLOAT, GL_FALSE, 0, 0);
+                           3, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                           reinterpret_cast<void*>(offsetof(Vertex, x)));
   gl_->EnableVertexAttribArray(tex_color_shader_->PosLocation());
   gl_->VertexAttribPointer(tex_color_shader_->TexInLocation(),
-                        2, GL_FLOAT, GL_FALSE, 0, 0);
+                           2, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                           reinterpret_cast<void*>(offsetof(Vertex, s)));
   gl_->EnableVertexAttribArray(tex_color_shader_->TexInLocation());
+  gl_->VertexAttribPointer(tex_color_shader_->ColorInLocation(),
+                           4, GL_FLOAT, GL_FALSE, sizeof(Vertex),
+                           reinterpret_cast<void*>(offsetof(Vertex, red)));
+  gl_->EnableVertexAttribArray(tex_color_shader_->ColorInLocation());
 
-  ancestor_opacity_ = actor->opacity();
-
-  // Back to front rendering
-  // TODO: Switch to two pass Z-buffered rendering
+  // The vertices are already in stage coordinates.
+  gl_->UniformMatrix4fv(tex_color_shader_->MvpLocation(), 1, GL_FALSE,
+                        &perspective_[0][0]);
+  gl_->Uniform1i(tex_color_shader_->SamplerLocation(), 0);
   gl_->Enable(GL_BLEND);
 
-  // Back to front rendering
-  const TidyInterface::ActorVector children = actor->GetChildren();
-  for (TidyInterface::ActorVector::const_reverse_iterator i =
-       children.rbegin(); i != children.rend(); ++i) {
-    (*i)->Accept(this);
+  const std::vector<TidyInterface::DrawList::Batch>& batches =
+      draw_list_.batches();
+  for (size_t i = 0; i < batches.size(); ++i) {
+    if (i == 0 || batches[i].texture != batches[i - 1].texture)
+      gl_->BindTexture(GL_TEXTURE_2D, batches[i].texture);
+    gl_->DrawArrays(GL_TRIANGLES, batches[i].first_vertex,
+                    batches[i].num_vertices);
   }
-
-  gl_->EglSwapBuffers(egl_display_, egl_surface_);
 }
 
 void OpenGlesDrawVisitor::VisitTexturePixmap(
     TidyInterface::TexturePixmapActor* actor) {
-  OpenGlesEglImageData* image_data = dynamic_cast<OpenGlesEglImageData*>(
+  OpenGlesEglImageData* image_data = static_cast<OpenGlesEglImageData*>(
       actor->GetDrawingData(kEglImageData).get());
 
   if (!image_data) {
@@ -199,41 +236,33 @@ void OpenGlesDrawVisitor::VisitTexturePixmap(
 }
 
 void OpenGlesDrawVisitor::VisitQuad(TidyInterface::QuadActor* actor) {
-  // color
-  gl_->Uniform4f(tex_color_shader_->ColorLocation(), actor->color().red,
-                 actor->color().green, actor->color().blue,
-                 actor->opacity() * ancestor_opacity_);
-
   // texture
-  OpenGlesTextureData* texture_data = reinterpret_cast<OpenGlesTextureData*>(
+  OpenGlesTextureData* texture_data = static_cast<OpenGlesTextureData*>(
       actor->GetDrawingData(kTextureData).get());
-  gl_->BindTexture(GL_TEXTURE_2D, texture_data ? texture_data->texture() : 0);
-  gl_->Uniform1i(tex_color_shader_->SamplerLocation(), 0);
-
-  // mvp matrix
-  Matrix4 new_model_view = model_view_;
-  new_model_view *= Matrix4::translation(Vector3(actor->x(), actor->y(),
-                                                 actor->z()));
-  new_model_view *= Matrix4::scale(Vector3(actor->width() * actor->scale_x(),
-                                           actor->height() * actor->scale_y(),
-                                           1.f));
-  // Matrix4 mvp = new_model_view * perspective_;
-  Matrix4 mvp = perspective_ * new_model_view;
-  gl_->UniformMatrix4fv(tex_color_shader_->MvpLocation(), 1, GL_FALSE,
-                        &mvp[0][0]);
 
-  gl_->DrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+  // Position the quad on the stage.  The actors already have their
+  // absolute z values from the layer visitor.
+  const float left = origin_x_ + actor->x() * scale_x_;
+  const float top = origin_y_ + actor->y() * scale_y_;
+  draw_list_.AddQuad(texture_data ? texture_data->texture() : 0,
+                     left, top,
+                     left + actor->width() * actor->scale_x() * scale_x_,
+                     top + actor->height() * actor->scale_y() * scale_y_,
+                     actor->z(), actor->color(),
+                     actor->opacity() * ancestor_opacity_);
 }
 
 void OpenGlesDrawVisitor::VisitContainer(
     TidyInterface::ContainerActor* actor) {
   LOG(INFO) << "Visit container: " << actor->name();
-  Matrix4 old_model_view = model_view_;
-  model_view_ *= Matrix4::translation(Vector3(actor->x(), actor->y(),
-                                              actor->z()));
-  model_view_ *= Matrix4::scale(Vector3(actor->width() * actor->scale_x(),
-                                        actor->height() * actor->scale_y(),
-                                        1.f));
+  const float old_origin_x = origin_x_;
+  const float old_origin_y = origin_y_;
+  const float old_scale_x = scale_x_;
+  const float old_scale_y = scale_y_;
+  origin_x_ += actor->x() * scale_x_;
+  origin_y_ += actor->y() * scale_y_;
+  scale_x_ *= actor->width() * actor->scale_x();
+  scale_y_ *= actor->height() * actor->scale_y();
 
   const float original_opacity = ancestor_opacity_;
   ancestor_opacity_ *= actor->opacity();
@@ -247,8 +276,11 @@ void OpenGlesDrawVisitor::VisitContainer(
 
   // Reset opacity.
   ancestor_opacity_ = original_opacity;
-  // Pop matrix.
-  model_view_ = old_model_view;
+  // Pop transform.
+  origin_x_ = old_origin_x;
+  origin_y_ = old_origin_y;
+  scale_x_ = old_scale_x;
+  scale_y_ = old_scale_y;
 }
 
 OpenGlesTextureData::OpenGlesTextureData(Gles2Interface* gl)
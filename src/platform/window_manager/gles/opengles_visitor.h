@@ -47,6 +47,9 @@ class OpenGlesDrawVisitor
   virtual void VisitQuad(TidyInterface::QuadActor* actor);
 
  private:
+  // Uploads the draw list to the vertex buffer, and draws its batches.
+  void DrawQuads();
+
   Gles2Interface* gl_;  // Not owned.
   TidyInterface* interface_;  // Not owned.
   ClutterInterface::StageActor* stage_;  // Not owned.
@@ -60,12 +63,20 @@ class OpenGlesDrawVisitor
 
   // Matrix state
   Matrix4 perspective_;
-  Matrix4 model_view_;
+
+  // Maps the coordinates of the container being visited to the stage's
+  float origin_x_;
+  float origin_y_;
+  float scale_x_;
+  float scale_y_;
 
   // Cumulative opacity of the ancestors
   float ancestor_opacity_;
 
-  // global vertex buffer object
+  // Quads to draw in the current frame, in stage coordinates
+  TidyInterface::DrawList draw_list_;
+
+  // Vertex buffer object that the draw list is streamed into
   GLuint vertex_buffer_object_;
 
   DISALLOW_COPY_AND_ASSIGN(OpenGlesDrawVisitor);
@@ -88,7 +88,18 @@ namespace window_manager {
 
 MockGLInterface::MockGLInterface()
     : mock_context_(&kContextRec),
-      next_glx_pixmap_id_(1) {
+      next_glx_pixmap_id_(1),
+      next_texture_id_(1),
+      num_draw_arrays_calls_(0),
+      num_texture_binds_(0),
+      num_swaps_(0),
+      num_sub_buffer_copies_(0),
+      bound_texture_(0),
+      texture_2d_enabled_(false),
+      scissor_x_(0),
+      scissor_y_(0),
+      scissor_width_(0),
+      scissor_height_(0) {
   mock_configs_ = new GLXFBConfig[1];
   kConfigRec.depthBits = 32;
   kConfigRec.redBits = 8;
@@ -110,6 +121,11 @@ GLXPixmap MockGLInterface::CreateGlxPixmap(GLXFBConfig config,
   return next_glx_pixmap_id_++;
 }
 
+void MockGLInterface::GenTextures(GLsizei n, GLuint* textures) {
+  for (GLsizei i = 0; i < n; ++i)
+    textures[i] = next_texture_id_++;
+}
+
 GLXContext MockGLInterface::CreateGlxContext() {
   return mock_context_;
 }
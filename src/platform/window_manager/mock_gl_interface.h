@@ -5,6 +5,8 @@
 #ifndef WINDOW_MANAGER_MOCK_GL_INTERFACE_H_
 #define WINDOW_MANAGER_MOCK_GL_INTERFACE_H_
 
+#include <vector>
+
 #include "window_manager/gl_interface.h"
 
 namespace window_manager {
@@ -26,7 +28,13 @@ class MockGLInterface : public GLInterface {
   void DestroyGlxPixmap(GLXPixmap pixmap) {}
   GLXContext CreateGlxContext();
   void DestroyGlxContext(GLXContext context) {}
-  void SwapGlxBuffers(GLXDrawable drawable) {}
+  void SwapGlxBuffers(GLXDrawable drawable) { num_swaps_++; }
+  void SetGlxSwapInterval(int interval) {}
+  bool HasGlxCopySubBuffer() { return true; }
+  void CopyGlxSubBuffer(GLXDrawable drawable,
+                        int x, int y, int width, int height) {
+    num_sub_buffer_copies_++;
+  }
   Bool MakeGlxCurrent(GLXDrawable drawable,
                       GLXContext ctx);
   GLXFBConfig* GetGlxFbConfigs(int* nelements);
@@ -42,23 +50,37 @@ class MockGLInterface : public GLInterface {
 
   // GL functions we use.
   void BindBuffer(GLenum target, GLuint buffer) {}
-  void BindTexture(GLenum target, GLuint texture) {}
+  void BindTexture(GLenum target, GLuint texture) {
+    num_texture_binds_++;
+    bound_texture_ = texture;
+  }
   void BlendFunc(GLenum sfactor, GLenum dfactor) {}
   void BufferData(GLenum target, GLsizeiptr size, const GLvoid* data,
                   GLenum usage) {}
   void Clear(GLbitfield mask) {}
   void Color4f(GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha) {}
+  void ColorPointer(GLint size, GLenum type, GLsizei stride,
+                    const GLvoid* pointer) {}
   void DeleteBuffers(GLsizei n, const GLuint* buffers) {}
   void DeleteTextures(GLsizei n, const GLuint* textures) {}
   void DepthMask(GLboolean flag) {}
-  void Disable(GLenum cap) {}
+  void Disable(GLenum cap) {
+    if (cap == GL_TEXTURE_2D)
+      texture_2d_enabled_ = false;
+  }
   void DisableClientState(GLenum array) {}
-  void DrawArrays(GLenum mode, GLint first, GLsizei count) {}
-  void Enable(GLenum cap) {}
+  void DrawArrays(GLenum mode, GLint first, GLsizei count) {
+    num_draw_arrays_calls_++;
+    drawn_textures_.push_back(texture_2d_enabled_ ? bound_texture_ : 0);
+  }
+  void Enable(GLenum cap) {
+    if (cap == GL_TEXTURE_2D)
+      texture_2d_enabled_ = true;
+  }
   void EnableClientState(GLenum cap) {}
   void Finish() {}
   void GenBuffers(GLsizei n, GLuint* buffers) {}
-  void GenTextures(GLsizei n, GLuint* textures) {}
+  void GenTextures(GLsizei n, GLuint* textures);
   GLenum GetError() { return GL_NO_ERROR; }
   void LoadIdentity() {}
   void MatrixMode(GLenum mode) {}
@@ -68,6 +90,12 @@ class MockGLInterface : public GLInterface {
   void PopMatrix() {}
   void Rotatef(GLfloat angle, GLfloat x, GLfloat y, GLfloat z) {}
   void Scalef(GLfloat x, GLfloat y, GLfloat z ) {}
+  void Scissor(GLint x, GLint y, GLsizei width, GLsizei height) {
+    scissor_x_ = x;
+    scissor_y_ = y;
+    scissor_width_ = width;
+    scissor_height_ = height;
+  }
   void TexCoordPointer(GLint size, GLenum type, GLsizei stride,
                        const GLvoid* pointer) {}
   void TexParameteri(GLenum target, GLenum pname, GLint param) {}
@@ -85,6 +113,25 @@ class MockGLInterface : public GLInterface {
   void Translatef(GLfloat x, GLfloat y, GLfloat z) {}
   void VertexPointer(GLint size, GLenum type, GLsizei stride,
                      const GLvoid* pointer) {}
+  // Counts of calls that draw, for tests to check how much work a frame
+  // took.
+  int num_draw_arrays_calls() const { return num_draw_arrays_calls_; }
+  int num_texture_binds() const { return num_texture_binds_; }
+  int num_swaps() const { return num_swaps_; }
+  int num_sub_buffer_copies() const { return num_sub_buffer_copies_; }
+
+  // The texture that each DrawArrays() call drew with, or 0 if texturing
+  // was disabled.
+  const std::vector<GLuint>& drawn_textures() const {
+    return drawn_textures_;
+  }
+
+  // The arguments of the last call to Scissor().
+  int scissor_x() const { return scissor_x_; }
+  int scissor_y() const { return scissor_y_; }
+  int scissor_width() const { return scissor_width_; }
+  int scissor_height() const { return scissor_height_; }
+
  private:
   XVisualInfo mock_visual_info_;
   GLXFBConfig* mock_configs_;
@@ -93,6 +140,24 @@ class MockGLInterface : public GLInterface {
 
   // Next ID to hand out in CreateGlxPixmap().
   GLXPixmap next_glx_pixmap_id_;
+
+  // Next ID to hand out in GenTextures().
+  GLuint next_texture_id_;
+
+  int num_draw_arrays_calls_;
+  int num_texture_binds_;
+  int num_swaps_;
+  int num_sub_buffer_copies_;
+
+  // The texture last bound, and whether GL_TEXTURE_2D is enabled.
+  GLuint bound_texture_;
+  bool texture_2d_enabled_;
+  std::vector<GLuint> drawn_textures_;
+
+  int scissor_x_;
+  int scissor_y_;
+  int scissor_width_;
+  int scissor_height_;
 };
 
 }  // namespace window_manager
@@ -19,7 +19,9 @@
 #include <xcb/shape.h>
 
 #include <algorithm>
+#include <cstddef>
 #include <string>
+#include <vector>
 
 #include "base/logging.h"
 #include "window_manager/gl_interface.h"
@@ -82,7 +84,8 @@ OpenGlPixmapData::OpenGlPixmapData(GLInterface* gl_interface,
       pixmap_(XCB_NONE),
       glx_pixmap_(XCB_NONE),
       damage_(XCB_NONE),
-      has_alpha_(false) {}
+      has_alpha_(false),
+      stale_(false) {}
 
 OpenGlPixmapData::~OpenGlPixmapData() {
   if (damage_) {
@@ -104,6 +107,7 @@ OpenGlPixmapData::~OpenGlPixmapData() {
 }
 
 void OpenGlPixmapData::Refresh() {
+  stale_ = false;
   LOG_IF(ERROR, !texture_) << "Refreshing with no texture.";
   if (!texture_)
     return;
@@ -116,6 +120,13 @@ void OpenGlPixmapData::Refresh() {
   }
 }
 
+void OpenGlPixmapData::Invalidate() {
+  if (damage_) {
+    x_conn_->SubtractRegionFromDamage(damage_, XCB_NONE, XCB_NONE);
+  }
+  stale_ = true;
+}
+
 void OpenGlPixmapData::SetTexture(GLuint texture, bool has_alpha) {
   if (texture_ && texture_ != texture) {
     gl_interface_->DeleteTextures(1, &texture_);
@@ -173,8 +184,10 @@ bool OpenGlPixmapData::BindToPixmap(
   gl_interface->BindTexture(GL_TEXTURE_2D, data->texture_);
   gl_interface->TexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
   gl_interface->BindGlxTexImage(data->glx_pixmap_, GLX_FRONT_LEFT_EXT, NULL);
+  // We want to know which part of the window was damaged, so that only
+  // that part of the stage needs to be redrawn.
   data->damage_ = x_conn->CreateDamage(actor->texture_pixmap_window(),
-                                       XCB_DAMAGE_REPORT_LEVEL_NON_EMPTY);
+                                       XCB_DAMAGE_REPORT_LEVEL_BOUNDING_BOX);
   actor->SetDrawingData(OpenGlDrawVisitor::PIXMAP_DATA,
                         TidyInterface::DrawingDataPtr(data.release()));
   actor->set_dirty();
@@ -206,15 +219,25 @@ OpenGlDrawVisitor::OpenGlDrawVisitor(GLInterfaceBase* gl_interface,
     : gl_interface_(dynamic_cast<GLInterface*>(gl_interface)),
       interface_(interface),
       x_conn_(interface->x_conn()),
+      vertex_buffer_(0),
+      bound_texture_(kUnknownTexture),
       config_24_(0),
       config_32_(0),
       context_(0),
+      ancestor_opacity_(1.f),
+      origin_x_(0.f),
+      origin_y_(0.f),
+      scale_x_(1.f),
+      scale_y_(1.f),
       num_frames_drawn_(0) {
   CHECK(gl_interface_);
   context_ = gl_interface_->CreateGlxContext();
   CHECK(context_) << "Unable to create a context from the available visuals.";
 
   gl_interface_->MakeGlxCurrent(stage->GetStageXWindow(), context_);
+  // TidyInterface draws at most once per refresh; make sure that what
+  // it draws is shown on a refresh boundary, without tearing.
+  gl_interface_->SetGlxSwapInterval(1);
 
   int num_fb_configs;
   GLXFBConfig* fb_configs = gl_interface_->GetGlxFbConfigs(&num_fb_configs);
@@ -273,12 +296,15 @@ OpenGlDrawVisitor::OpenGlDrawVisitor(GLInterfaceBase* gl_interface,
   gl_interface_->BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
   quad_drawing_data_.reset(new OpenGlQuadDrawingData(gl_interface_));
+  gl_interface_->GenBuffers(1, &vertex_buffer_);
 }
 
 OpenGlDrawVisitor::~OpenGlDrawVisitor() {
   gl_interface_->Finish();
-  // Make sure the vertex buffer is deleted.
-  quad_drawing_data_ = TidyInterface::DrawingDataPtr();
+  // Make sure the vertex buffers are deleted.
+  quad_drawing_data_.reset();
+  if (vertex_buffer_)
+    gl_interface_->DeleteBuffers(1, &vertex_buffer_);
   CHECK_GL_ERROR();
   gl_interface_->MakeGlxCurrent(0, 0);
   if (context_) {
@@ -328,14 +354,20 @@ void OpenGlDrawVisitor::VisitActor(TidyInterface::Actor* actor) {
 
 void OpenGlDrawVisitor::VisitTexturePixmap(
     TidyInterface::TexturePixmapActor* actor) {
-  if (!actor->IsVisible()) return;
+  // Hidden windows don't need their pixmaps, so leave binding or
+  // refreshing them until they're shown.
+  if (!actor->IsVisible() || actor->is_occluded()) return;
   // Make sure there's a bound texture.
-  if (!actor->GetDrawingData(PIXMAP_DATA).get()) {
+  OpenGlPixmapData* pixmap_data = static_cast<OpenGlPixmapData*>(
+      actor->GetDrawingData(PIXMAP_DATA).get());
+  if (!pixmap_data) {
     if (!OpenGlPixmapData::BindToPixmap(this, actor)) {
       // We didn't find a bound pixmap, so let's just skip drawing this
       // actor.  (it's probably because it hasn't been mapped).
       return;
     }
+  } else if (pixmap_data->stale()) {
+    pixmap_data->Refresh();
   }
 
   // All texture pixmaps are also QuadActors, and so we let the
@@ -344,70 +376,100 @@ void OpenGlDrawVisitor::VisitTexturePixmap(
 }
 
 void OpenGlDrawVisitor::VisitQuad(TidyInterface::QuadActor* actor) {
-  if (!actor->IsVisible()) return;
+  if (!actor->IsVisible() || actor->is_occluded()) return;
+  // Skip actors that are entirely outside of the area being drawn.
+  if (!update_area_.empty() && !actor->bounds().Intersects(update_area_))
+    return;
 #ifdef EXTRA_LOGGING
   LOG(INFO) << "Drawing quad " << actor->name() << ".";
 #endif
-  OpenGlQuadDrawingData* draw_data = dynamic_cast<OpenGlQuadDrawingData*>(
-      actor->GetDrawingData(DRAWING_DATA).get());
-
-  if (!draw_data) {
-    // This actor hasn't been here before, so let's set the drawing
-    // data on it.
-    actor->SetDrawingData(DRAWING_DATA, quad_drawing_data_);
-    draw_data = dynamic_cast<OpenGlQuadDrawingData*>(quad_drawing_data_.get());
-  }
-
-  gl_interface_->BindBuffer(GL_ARRAY_BUFFER, draw_data->vertex_buffer());
-
-  gl_interface_->Color4f(actor->color().red,
-                         actor->color().green,
-                         actor->color().blue,
-                         actor->opacity() * ancestor_opacity_);
-
-  // Find out if this quad has pixmap or texture data to bind.
-  OpenGlPixmapData* pixmap_data = dynamic_cast<OpenGlPixmapData*>(
+  // Find out if this quad has pixmap or texture data to bind.  The IDs
+  // tell us what type the data is.
+  GLuint texture = 0;
+  OpenGlPixmapData* pixmap_data = static_cast<OpenGlPixmapData*>(
       actor->GetDrawingData(PIXMAP_DATA).get());
   if (pixmap_data && pixmap_data->texture()) {
-    // Actor has a pixmap texture to bind.
-    gl_interface_->Enable(GL_TEXTURE_2D);
-    gl_interface_->BindTexture(GL_TEXTURE_2D, pixmap_data->texture());
+    texture = pixmap_data->texture();
   } else {
-    OpenGlTextureData* texture_data = dynamic_cast<OpenGlTextureData*>(
+    OpenGlTextureData* texture_data = static_cast<OpenGlTextureData*>(
         actor->GetDrawingData(TEXTURE_DATA).get());
-    if (texture_data && texture_data->texture()) {
-      // Actor has a texture to bind.
-      gl_interface_->Enable(GL_TEXTURE_2D);
-      gl_interface_->BindTexture(GL_TEXTURE_2D, texture_data->texture());
-    } else {
-      // Actor has no texture.
-      gl_interface_->Disable(GL_TEXTURE_2D);
-    }
+    if (texture_data)
+      texture = texture_data->texture();
   }
-  gl_interface_->PushMatrix();
-  gl_interface_->Translatef(actor->x(), actor->y(), actor->z());
-  gl_interface_->Scalef(actor->width() * actor->scale_x(),
-                        actor->height() * actor->scale_y(), 1.f);
+
+  float left = origin_x_ + actor->x() * scale_x_;
+  float top = origin_y_ + actor->y() * scale_y_;
 #ifdef EXTRA_LOGGING
-  LOG(INFO) << "  at: (" << actor->x() << ", "  << actor->y()
+  LOG(INFO) << "  at: (" << left << ", "  << top
             << ", " << actor->z() << ") with scale: ("
             << actor->scale_x() << ", "  << actor->scale_y() << ") at size ("
             << actor->width() << "x"  << actor->height()
             << ") and opacity " << actor->opacity() * ancestor_opacity_;
 #endif
-  gl_interface_->DrawArrays(GL_TRIANGLE_STRIP, 0, 4);
-  gl_interface_->PopMatrix();
+  draw_list_.AddQuad(texture, left, top,
+                     left + actor->width() * actor->scale_x() * scale_x_,
+                     top + actor->height() * actor->scale_y() * scale_y_,
+                     actor->z(), actor->color(),
+                     actor->opacity() * ancestor_opacity_);
+}
+
+void OpenGlDrawVisitor::UploadDrawList() {
+  typedef TidyInterface::DrawList::Vertex Vertex;
+  const std::vector<Vertex>& vertices = draw_list_.vertices();
+  if (vertices.empty())
+    return;
+
+  // Replacing the whole buffer lets GL hand us new storage instead of
+  // waiting until it's done drawing last frame's.
+  gl_interface_->BindBuffer(GL_ARRAY_BUFFER, vertex_buffer_);
+  gl_interface_->BufferData(GL_ARRAY_BUFFER,
+                            vertices.size() * sizeof(Vertex),
+                            &vertices[0], GL_STREAM_DRAW);
+  gl_interface_->EnableClientState(GL_VERTEX_ARRAY);
+  gl_interface_->VertexPointer(
+      3, GL_FLOAT, sizeof(Vertex),
+      reinterpret_cast<GLvoid*>(offsetof(Vertex, x)));
+  gl_interface_->EnableClientState(GL_TEXTURE_COORD_ARRAY);
+  gl_interface_->TexCoordPointer(
+      2, GL_FLOAT, sizeof(Vertex),
+      reinterpret_cast<GLvoid*>(offsetof(Vertex, s)));
+  gl_interface_->EnableClientState(GL_COLOR_ARRAY);
+  gl_interface_->ColorPointer(
+      4, GL_FLOAT, sizeof(Vertex),
+      reinterpret_cast<GLvoid*>(offsetof(Vertex, red)));
+  CHECK_GL_ERROR();
+}
+
+void OpenGlDrawVisitor::DrawBatches(size_t begin, size_t end) {
+  const std::vector<TidyInterface::DrawList::Batch>& batches =
+      draw_list_.batches();
+  for (size_t i = begin; i < end; ++i) {
+    const TidyInterface::DrawList::Batch& batch = batches[i];
+    if (batch.texture != bound_texture_) {
+      if (!batch.texture) {
+        gl_interface_->Disable(GL_TEXTURE_2D);
+      } else {
+        if (!bound_texture_ || bound_texture_ == kUnknownTexture)
+          gl_interface_->Enable(GL_TEXTURE_2D);
+        gl_interface_->BindTexture(GL_TEXTURE_2D, batch.texture);
+      }
+      bound_texture_ = batch.texture;
+    }
+    gl_interface_->DrawArrays(GL_TRIANGLES, batch.first_vertex,
+                              batch.num_vertices);
+  }
   CHECK_GL_ERROR();
 }
 
 void OpenGlDrawVisitor::DrawNeedle() {
-  OpenGlQuadDrawingData* draw_data = dynamic_cast<OpenGlQuadDrawingData*>(
-      quad_drawing_data_.get());
-  gl_interface_->BindBuffer(GL_ARRAY_BUFFER, draw_data->vertex_buffer());
+  gl_interface_->BindBuffer(GL_ARRAY_BUFFER,
+                            quad_drawing_data_->vertex_buffer());
   gl_interface_->EnableClientState(GL_VERTEX_ARRAY);
   gl_interface_->VertexPointer(2, GL_FLOAT, 0, 0);
   gl_interface_->DisableClientState(GL_TEXTURE_COORD_ARRAY);
+  gl_interface_->DisableClientState(GL_COLOR_ARRAY);
   gl_interface_->Disable(GL_TEXTURE_2D);
+  bound_texture_ = 0;
   gl_interface_->PushMatrix();
   gl_interface_->Disable(GL_DEPTH_TEST);
   gl_interface_->Translatef(30, 30, 0);
@@ -423,8 +485,6 @@ void OpenGlDrawVisitor::VisitStage(TidyInterface::StageActor* actor) {
   if (!actor->IsVisible()) return;
 
   stage_ = actor;
-  OpenGlQuadDrawingData* draw_data = dynamic_cast<OpenGlQuadDrawingData*>(
-      quad_drawing_data_.get());
 
   gl_interface_->MatrixMode(GL_PROJECTION);
   gl_interface_->LoadIdentity();
@@ -433,49 +493,89 @@ void OpenGlDrawVisitor::VisitStage(TidyInterface::StageActor* actor) {
                        TidyInterface::LayerVisitor::kMaxDepth);
   gl_interface_->MatrixMode(GL_MODELVIEW);
   gl_interface_->LoadIdentity();
+
+  // Only draw the part of the stage that's being updated, if we can show
+  // just that part afterwards.
+  if (!update_area_.empty()) {
+    update_area_.Intersect(
+        TidyInterface::Rect(0, 0, actor->width(), actor->height()));
+    if (update_area_.empty() || !gl_interface_->HasGlxCopySubBuffer())
+      update_area_ = TidyInterface::Rect();
+  }
+  // GL puts the origin at the bottom left.
+  const int update_area_gl_y =
+      actor->height() - update_area_.y - update_area_.height;
+  if (!update_area_.empty()) {
+    gl_interface_->Enable(GL_SCISSOR_TEST);
+    gl_interface_->Scissor(update_area_.x, update_area_gl_y,
+                           update_area_.width, update_area_.height);
+  }
+
   gl_interface_->Clear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-  gl_interface_->BindBuffer(GL_ARRAY_BUFFER,
-                            draw_data->vertex_buffer());
-  gl_interface_->EnableClientState(GL_VERTEX_ARRAY);
-  gl_interface_->VertexPointer(2, GL_FLOAT, 0, 0);
-  gl_interface_->EnableClientState(GL_TEXTURE_COORD_ARRAY);
-  gl_interface_->TexCoordPointer(2, GL_FLOAT, 0, 0);
-  CHECK_GL_ERROR();
 
   // Set the z-depths for the actors, update is_opaque.
   TidyInterface::LayerVisitor layer_visitor(interface_->actor_count());
   actor->Accept(&layer_visitor);
 
+  // The stage's position and size don't affect its children.
+  origin_x_ = 0.f;
+  origin_y_ = 0.f;
+  scale_x_ = 1.f;
+  scale_y_ = 1.f;
+  draw_list_.Clear();
+
 #ifdef EXTRA_LOGGING
-  LOG(INFO) << "Starting OPAQUE pass.";
+  LOG(INFO) << "Collecting OPAQUE quads.";
 #endif
-  // Disable blending because these actors are all opaque, and we're
-  // drawing them front to back.
-  gl_interface_->Disable(GL_BLEND);
-
-  // For the first pass, we want to collect only opaque actors, in
-  // front to back order.
+  // For the first pass, we want to collect only opaque actors.  The
+  // z-buffer sorts them out, so they're drawn in texture order to keep
+  // the number of draw calls down.
   visit_opaque_ = true;
   VisitContainer(actor);
+  const size_t num_opaque_batches = draw_list_.EndGroup(true);
 
 #ifdef EXTRA_LOGGING
-  LOG(INFO) << "Ending OPAQUE pass.";
-  LOG(INFO) << "Starting TRANSPARENT pass.";
+  LOG(INFO) << "Collecting TRANSPARENT quads.";
 #endif
+  // Visiting back to front now.  These have to be drawn in this order
+  // for blending to work, so only neighbours with the same texture can
+  // be drawn together.
   ancestor_opacity_ = actor->opacity();
-  gl_interface_->DepthMask(GL_FALSE);
-  gl_interface_->Enable(GL_BLEND);
-
-  // Visiting back to front now, with no z-buffer, but with blending.
   visit_opaque_ = false;
   VisitContainer(actor);
+  const size_t num_batches = draw_list_.EndGroup(false);
+
+  UploadDrawList();
+
+  // Visiting the actors may have bound other textures, and so may anything
+  // that happened since the last frame.
+  bound_texture_ = kUnknownTexture;
+
+  // Disable blending because these actors are all opaque.
+  gl_interface_->Disable(GL_BLEND);
+  DrawBatches(0, num_opaque_batches);
+
+  // Draw the transparent ones with no z-buffer, but with blending.
+  gl_interface_->DepthMask(GL_FALSE);
+  gl_interface_->Enable(GL_BLEND);
+  DrawBatches(num_opaque_batches, num_batches);
   gl_interface_->DepthMask(GL_TRUE);
   CHECK_GL_ERROR();
 
   if (FLAGS_tidy_display_debug_needle) {
     DrawNeedle();
   }
-  gl_interface_->SwapGlxBuffers(actor->GetStageXWindow());
+  if (update_area_.empty()) {
+    gl_interface_->SwapGlxBuffers(actor->GetStageXWindow());
+  } else {
+    // The rest of the back buffer is stale, so only the part we drew can
+    // be shown.
+    gl_interface_->Disable(GL_SCISSOR_TEST);
+    gl_interface_->CopyGlxSubBuffer(actor->GetStageXWindow(),
+                                    update_area_.x, update_area_gl_y,
+                                    update_area_.width, update_area_.height);
+    update_area_ = TidyInterface::Rect();
+  }
   ++num_frames_drawn_;
 #ifdef EXTRA_LOGGING
   LOG(INFO) << "Ending TRANSPARENT pass.";
@@ -489,13 +589,18 @@ void OpenGlDrawVisitor::VisitContainer(
     return;
   }
 
+  // The children are positioned relative to the container.  Z isn't
+  // affected because the actors already have their absolute Z values
+  // from the layer calculation.
+  const float old_origin_x = origin_x_;
+  const float old_origin_y = origin_y_;
+  const float old_scale_x = scale_x_;
+  const float old_scale_y = scale_y_;
   if (actor != stage_) {
-    gl_interface_->PushMatrix();
-    // Don't translate by Z because the actors already have their
-    // absolute Z values from the layer calculation.
-    gl_interface_->Translatef(actor->x(), actor->y(), 0.0f);
-    gl_interface_->Scalef(actor->width() * actor->scale_x(),
-                          actor->height() * actor->scale_y(), 1.f);
+    origin_x_ += actor->x() * scale_x_;
+    origin_y_ += actor->y() * scale_y_;
+    scale_x_ *= actor->width() * actor->scale_x();
+    scale_y_ *= actor->height() * actor->scale_y();
   }
 
 #ifdef EXTRA_LOGGING
@@ -509,8 +614,7 @@ void OpenGlDrawVisitor::VisitContainer(
   if (visit_opaque_) {
     for (TidyInterface::ActorVector::const_iterator iterator = children.begin();
          iterator != children.end(); ++iterator) {
-      TidyInterface::Actor* child =
-          dynamic_cast<TidyInterface::Actor*>(*iterator);
+      TidyInterface::Actor* child = *iterator;
       // Only traverse if the child is visible, and opaque.
       if (child->IsVisible() && child->is_opaque()) {
 #ifdef EXTRA_LOGGING
@@ -536,8 +640,7 @@ void OpenGlDrawVisitor::VisitContainer(
     TidyInterface::ActorVector::const_reverse_iterator iterator;
     for (iterator = children.rbegin(); iterator != children.rend();
          ++iterator) {
-      TidyInterface::Actor* child =
-          dynamic_cast<TidyInterface::Actor*>(*iterator);
+      TidyInterface::Actor* child = *iterator;
       // Only traverse if child is visible, and either transparent or
       // has children that might be transparent.
       if (child->IsVisible() &&
@@ -567,9 +670,10 @@ void OpenGlDrawVisitor::VisitContainer(
     ancestor_opacity_ = original_opacity;
   }
 
-  if (actor != stage_) {
-    gl_interface_->PopMatrix();
-  }
+  origin_x_ = old_origin_x;
+  origin_y_ = old_origin_y;
+  scale_x_ = old_scale_x;
+  scale_y_ = old_scale_y;
 }
 
 }  // namespace window_manager
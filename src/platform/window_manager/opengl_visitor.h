@@ -44,8 +44,14 @@ class OpenGlPixmapData : public TidyInterface::DrawingData  {
                    XConnection* x_conn);
   virtual ~OpenGlPixmapData();
 
+  // Rebinds the texture to the pixmap, so it shows the window's
+  // current contents.
   void Refresh();
 
+  // Acknowledges damage to the window without rebinding the texture,
+  // which is left until the actor is drawn again.
+  void Invalidate();
+
   // This creates a new OpenGlTextureData for the given actor, setting
   // up the texture id on the texture data object, and attaching it to
   // the actor.  Returns false if texture cannot be bound.
@@ -58,6 +64,10 @@ class OpenGlPixmapData : public TidyInterface::DrawingData  {
   GLuint texture() const { return texture_; }
   bool has_alpha() const { return has_alpha_; }
 
+  // True if the window has been damaged since the texture was last
+  // rebound.
+  bool stale() const { return stale_; }
+
  private:
   // This is the gl interface to use for communicating with GL.
   GLInterface* gl_interface_;
@@ -79,6 +89,9 @@ class OpenGlPixmapData : public TidyInterface::DrawingData  {
 
   // Whether or not this pixmap has an alpha channel.
   bool has_alpha_;
+
+  // Whether or not the texture is behind the window's contents.
+  bool stale_;
 };
 
 class OpenGlTextureData : public TidyInterface::DrawingData  {
@@ -111,7 +124,6 @@ class OpenGlDrawVisitor
   enum DataId {
     TEXTURE_DATA = 1,
     PIXMAP_DATA = 2,
-    DRAWING_DATA = 3,
   };
 
   OpenGlDrawVisitor(GLInterfaceBase* gl_interface,
@@ -122,6 +134,14 @@ class OpenGlDrawVisitor
   void BindImage(const ImageContainer* container,
                  TidyInterface::QuadActor* actor);
 
+  // Limits the next frame to the given area of the stage, e.g. because
+  // nothing else has changed since the last one.  If the GL
+  // implementation can't show part of a frame, the whole stage is drawn
+  // anyway.
+  void set_update_area(const TidyInterface::Rect& area) {
+    update_area_ = area;
+  }
+
   virtual void VisitActor(TidyInterface::Actor* actor);
   virtual void VisitStage(TidyInterface::StageActor* actor);
   virtual void VisitContainer(TidyInterface::ContainerActor* actor);
@@ -133,6 +153,17 @@ class OpenGlDrawVisitor
   // So it can get access to the config data.
   friend class OpenGlPixmapData;
 
+  // A value for bound_texture_ that matches no batch, so that the first
+  // batch drawn sets up texturing from scratch.
+  static const GLuint kUnknownTexture = static_cast<GLuint>(-1);
+
+  // This uploads the draw list to the vertex buffer, and points GL at
+  // it.
+  void UploadDrawList();
+
+  // This draws the draw list's batches from 'begin' up to 'end'.
+  void DrawBatches(size_t begin, size_t end);
+
   // This draws a debugging "needle" in the upper left corner.
   void DrawNeedle();
 
@@ -141,15 +172,31 @@ class OpenGlDrawVisitor
   XConnection* x_conn_;  // Not owned.
   TidyInterface::StageActor* stage_; // Not owned.
 
-  // This holds the drawing data used for quads.  Note that only
-  // QuadActors use this drawing data, and they all share the same
-  // one (to keep from allocating a lot of quad vertex buffers).
-  TidyInterface::DrawingDataPtr quad_drawing_data_;
+  // This holds the unit quad used to draw the debugging needle.
+  scoped_ptr<OpenGlQuadDrawingData> quad_drawing_data_;
+
+  // This holds the quads to draw in the frame being drawn.  It's filled
+  // in while visiting the actors.
+  TidyInterface::DrawList draw_list_;
+
+  // This is the vertex buffer that the draw list is streamed into each
+  // frame.
+  GLuint vertex_buffer_;
+
+  // This is the texture bound by DrawBatches() (0 if texturing is
+  // disabled), so that it's only changed when it has to be.  Pixmaps and
+  // images bind their own textures outside of DrawBatches(), so this is
+  // reset to kUnknownTexture before each frame's batches are drawn.
+  GLuint bound_texture_;
 
   GLXFBConfig config_24_;
   GLXFBConfig config_32_;
   GLXContext context_;
 
+  // This is the part of the stage that the frame being drawn covers, or
+  // empty if it covers the whole stage.
+  TidyInterface::Rect update_area_;
+
   // If set to true, this indicates that we will be visiting only
   // opaque actors (in front to back order), and if false, only (at
   // least partially) transparent ones (in back to front order).
@@ -160,6 +207,14 @@ class OpenGlDrawVisitor
   // leave a container node.
   float ancestor_opacity_;
 
+  // This maps the coordinates of the container being visited to the
+  // stage's, so that the quads can be added to the draw list in stage
+  // coordinates.
+  float origin_x_;
+  float origin_y_;
+  float scale_x_;
+  float scale_y_;
+
   // This keeps track of the number of frames drawn so we can draw the
   // debugging needle.
   int num_frames_drawn_;
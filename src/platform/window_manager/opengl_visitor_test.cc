@@ -131,8 +131,8 @@ class OpenGlVisitorTestTree : public OpenGlVisitorTest {
 };
 
 TEST_F(OpenGlVisitorTestTree, LayerDepth) {
-  int32 count = 0;
-  stage_->Update(&count, 0LL);
+  interface()->Draw();
+  int32 count = interface()->actor_count();
   EXPECT_EQ(8, count);
   interface()->set_actor_count(count);
 
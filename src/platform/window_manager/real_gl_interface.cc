@@ -14,6 +14,8 @@ static PFNGLXBINDTEXIMAGEEXTPROC _gl_bind_tex_image = NULL;
 static PFNGLXRELEASETEXIMAGEEXTPROC _gl_release_tex_image = NULL;
 static PFNGLXCREATEPIXMAPPROC _gl_create_pixmap = NULL;
 static PFNGLXDESTROYPIXMAPPROC _gl_destroy_pixmap = NULL;
+static PFNGLXSWAPINTERVALSGIPROC _gl_swap_interval = NULL;
+static PFNGLXCOPYSUBBUFFERMESAPROC _gl_copy_sub_buffer = NULL;
 
 void RealGLInterface::GlxFree(void* item) {
   XFree(item);
@@ -64,6 +66,24 @@ RealGLInterface::RealGLInterface(RealXConnection* connection)
   } else {
     CHECK(false) << "FBConfig not supported on this device.";
   }
+  if (kGlxExtensions.find("GLX_SGI_swap_control") != std::string::npos) {
+    if (_gl_swap_interval == NULL) {
+      _gl_swap_interval = reinterpret_cast<PFNGLXSWAPINTERVALSGIPROC>(
+          glXGetProcAddress(
+              reinterpret_cast<const GLubyte*>("glXSwapIntervalSGI")));
+    }
+    LOG_IF(WARNING, !_gl_swap_interval)
+        << "Unable to find proc address for glXSwapIntervalSGI";
+  }
+  if (kGlxExtensions.find("GLX_MESA_copy_sub_buffer") != std::string::npos) {
+    if (_gl_copy_sub_buffer == NULL) {
+      _gl_copy_sub_buffer = reinterpret_cast<PFNGLXCOPYSUBBUFFERMESAPROC>(
+          glXGetProcAddress(
+              reinterpret_cast<const GLubyte*>("glXCopySubBufferMESA")));
+    }
+    LOG_IF(WARNING, !_gl_copy_sub_buffer)
+        << "Unable to find proc address for glXCopySubBufferMESA";
+  }
 }
 
 GLXPixmap RealGLInterface::CreateGlxPixmap(GLXFBConfig config,
@@ -136,6 +156,30 @@ void RealGLInterface::SwapGlxBuffers(GLXDrawable drawable) {
   }
 }
 
+void RealGLInterface::SetGlxSwapInterval(int interval) {
+  if (!_gl_swap_interval) {
+    LOG(WARNING) << "Unable to set the swap interval; buffer swaps won't be "
+                 << "synced to the display's refresh";
+    return;
+  }
+  _gl_swap_interval(interval);
+}
+
+bool RealGLInterface::HasGlxCopySubBuffer() {
+  return _gl_copy_sub_buffer != NULL;
+}
+
+void RealGLInterface::CopyGlxSubBuffer(GLXDrawable drawable,
+                                       int x, int y, int width, int height) {
+  CHECK(_gl_copy_sub_buffer);
+  xconn_->TrapErrors();
+  _gl_copy_sub_buffer(xconn_->GetDisplay(), drawable, x, y, width, height);
+  if (int error = xconn_->UntrapErrors()) {
+    LOG(WARNING) << "Got X error while copying part of the back buffer: "
+                 << xconn_->GetErrorText(error);
+  }
+}
+
 Bool RealGLInterface::MakeGlxCurrent(GLXDrawable drawable,
                                      GLXContext ctx) {
   xconn_->TrapErrors();
@@ -239,6 +283,11 @@ void RealGLInterface::Color4f(GLfloat red, GLfloat green, GLfloat blue,
   glColor4f(red, green, blue, alpha);
 }
 
+void RealGLInterface::ColorPointer(GLint size, GLenum type,
+                                   GLsizei stride, const GLvoid* pointer) {
+  glColorPointer(size, type, stride, pointer);
+}
+
 void RealGLInterface::DeleteBuffers(GLsizei n, const GLuint* buffers) {
   glDeleteBuffers(n, buffers);
 }
@@ -317,6 +366,11 @@ void RealGLInterface::Scalef(GLfloat x, GLfloat y, GLfloat z ) {
   glScalef(x, y, z);
 }
 
+void RealGLInterface::Scissor(GLint x, GLint y,
+                              GLsizei width, GLsizei height) {
+  glScissor(x, y, width, height);
+}
+
 void RealGLInterface::TexCoordPointer(GLint size, GLenum type,
                                       GLsizei stride, const GLvoid* pointer) {
   glTexCoordPointer(size, type, stride, pointer);
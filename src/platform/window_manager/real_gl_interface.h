@@ -26,6 +26,10 @@ class RealGLInterface : public GLInterface {
   GLXContext CreateGlxContext();
   void DestroyGlxContext(GLXContext context);
   void SwapGlxBuffers(GLXDrawable drawable);
+  void SetGlxSwapInterval(int interval);
+  bool HasGlxCopySubBuffer();
+  void CopyGlxSubBuffer(GLXDrawable drawable,
+                        int x, int y, int width, int height);
   Bool MakeGlxCurrent(GLXDrawable drawable,
                     GLXContext ctx);
   GLXFBConfig* GetGlxFbConfigs(int* nelements);
@@ -47,6 +51,8 @@ class RealGLInterface : public GLInterface {
                   GLenum usage);
   void Clear(GLbitfield mask);
   void Color4f(GLfloat red, GLfloat green, GLfloat blue, GLfloat alpha);
+  void ColorPointer(GLint size, GLenum type, GLsizei stride,
+                    const GLvoid* pointer);
   void DeleteBuffers(GLsizei n, const GLuint* buffers);
   void DeleteTextures(GLsizei n, const GLuint* textures);
   void DepthMask(GLboolean flag);
@@ -67,6 +73,7 @@ class RealGLInterface : public GLInterface {
   void PopMatrix();
   void Rotatef(GLfloat angle, GLfloat x, GLfloat y, GLfloat z);
   void Scalef(GLfloat x, GLfloat y, GLfloat z);
+  void Scissor(GLint x, GLint y, GLsizei width, GLsizei height);
   void TexCoordPointer(GLint size, GLenum type, GLsizei stride,
                        const GLvoid* pointer);
   void TexParameteri(GLenum target, GLenum pname, GLint param);
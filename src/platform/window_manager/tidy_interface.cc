@@ -30,6 +30,9 @@ using std::tr1::shared_ptr;
 DEFINE_bool(tidy_display_debug_needle, false,
             "Specify this to turn on a debugging aid for seeing when "
             "frames are being drawn.");
+DEFINE_int32(tidy_refresh_rate, 60,
+             "Refresh rate of the display, in Hz.  Frames are drawn at most "
+             "this often.");
 
 // Turn this on if you want to debug the visitor traversal.
 #undef EXTRA_LOGGING
@@ -39,51 +42,243 @@ namespace window_manager {
 const float TidyInterface::LayerVisitor::kMinDepth = -2048.0f;
 const float TidyInterface::LayerVisitor::kMaxDepth = 2048.0f;
 
-TidyInterface::AnimationBase::AnimationBase(AnimationTime start_time,
-                                            AnimationTime end_time)
-    : start_time_(start_time),
-      end_time_(end_time),
-      ease_factor_(M_PI / (end_time - start_time)) {
+void TidyInterface::Rect::Merge(const Rect& other) {
+  if (other.empty())
+    return;
+  if (empty()) {
+    *this = other;
+    return;
+  }
+  int right = std::max(x + width, other.x + other.width);
+  int bottom = std::max(y + height, other.y + other.height);
+  x = std::min(x, other.x);
+  y = std::min(y, other.y);
+  width = right - x;
+  height = bottom - y;
+}
+
+void TidyInterface::Rect::Intersect(const Rect& other) {
+  int right = std::min(x + width, other.x + other.width);
+  int bottom = std::min(y + height, other.y + other.height);
+  x = std::max(x, other.x);
+  y = std::max(y, other.y);
+  width = std::max(right - x, 0);
+  height = std::max(bottom - y, 0);
+}
+
+bool TidyInterface::Rect::Intersects(const Rect& other) const {
+  return !empty() && !other.empty() &&
+         x < other.x + other.width && other.x < x + width &&
+         y < other.y + other.height && other.y < y + height;
+}
+
+bool TidyInterface::Rect::Contains(const Rect& other) const {
+  return !empty() && !other.empty() &&
+         x <= other.x && other.x + other.width <= x + width &&
+         y <= other.y && other.y + other.height <= y + height;
+}
+
+const int TidyInterface::DrawList::kVerticesPerQuad;
+
+void TidyInterface::DrawList::Clear() {
+  quads_.clear();
+  group_start_ = 0;
+  vertices_.clear();
+  batches_.clear();
+}
+
+void TidyInterface::DrawList::AddQuad(uint32 texture,
+                                      float left, float top,
+                                      float right, float bottom, float z,
+                                      const ClutterInterface::Color& color,
+                                      float alpha) {
+  Quad quad;
+  quad.texture = texture;
+  quad.left = left;
+  quad.top = top;
+  quad.right = right;
+  quad.bottom = bottom;
+  quad.z = z;
+  quad.red = color.red;
+  quad.green = color.green;
+  quad.blue = color.blue;
+  quad.alpha = alpha;
+  quads_.push_back(quad);
+}
+
+size_t TidyInterface::DrawList::EndGroup(bool sort_by_texture) {
+  // The corners of the two triangles, in texture coordinates.
+  static const float kCorners[kVerticesPerQuad][2] = {
+    { 0.f, 0.f }, { 0.f, 1.f }, { 1.f, 0.f },
+    { 1.f, 0.f }, { 0.f, 1.f }, { 1.f, 1.f },
+  };
+
+  std::vector<Quad>::iterator quad = quads_.begin() + group_start_;
+  if (sort_by_texture)
+    std::sort(quad, quads_.end(), &QuadLess);
+
+  // Groups are drawn with different state, so a batch never spans two.
+  bool new_batch = true;
+  for (; quad != quads_.end(); ++quad) {
+    if (new_batch || batches_.back().texture != quad->texture) {
+      Batch batch;
+      batch.texture = quad->texture;
+      batch.first_vertex = vertices_.size();
+      batch.num_vertices = 0;
+      batches_.push_back(batch);
+      new_batch = false;
+    }
+    for (int i = 0; i < kVerticesPerQuad; ++i) {
+      Vertex vertex;
+      vertex.x = kCorners[i][0] ? quad->right : quad->left;
+      vertex.y = kCorners[i][1] ? quad->bottom : quad->top;
+      vertex.z = quad->z;
+      vertex.s = kCorners[i][0];
+      vertex.t = kCorners[i][1];
+      vertex.red = quad->red;
+      vertex.green = quad->green;
+      vertex.blue = quad->blue;
+      vertex.alpha = quad->alpha;
+      vertices_.push_back(vertex);
+    }
+    batches_.back().num_vertices += kVerticesPerQuad;
+  }
+  group_start_ = quads_.size();
+  return batches_.size();
 }
 
-TidyInterface::FloatAnimation::FloatAnimation(float* field,
-                                              float end_value,
-                                              AnimationTime start_time,
-                                              AnimationTime end_time)
-    : TidyInterface::AnimationBase(start_time, end_time),
-      field_(field),
-      start_value_(*field),
-      end_value_(end_value) {
+// static
+bool TidyInterface::DrawList::QuadLess(const Quad& a, const Quad& b) {
+  if (a.texture != b.texture)
+    return a.texture < b.texture;
+  // Actors in front have larger z values.
+  return a.z > b.z;
 }
 
-bool TidyInterface::FloatAnimation::Eval(AnimationTime current_time) {
-  if (current_time >= end_time_) {
-    *field_ = end_value_;
-    return true;
-  }
-  float x = (1.0f - cosf(ease_factor_ * (current_time - start_time_))) / 2.0f;
-  *field_ = start_value_ + x * (end_value_ - start_value_);
-  return false;
+void TidyInterface::Animator::AnimateFloat(Actor* actor,
+                                           float* field,
+                                           float end_value,
+                                           AnimationTime start_time,
+                                           AnimationTime end_time) {
+  Start(Find(actor, field, NULL), *field, end_value, start_time, end_time);
 }
 
-TidyInterface::IntAnimation::IntAnimation(int* field,
-                                          int end_value,
-                                          AnimationTime start_time,
-                                          AnimationTime end_time)
-    : TidyInterface::AnimationBase(start_time, end_time),
-      field_(field),
-      start_value_(*field),
-      end_value_(end_value) {
+void TidyInterface::Animator::AnimateInt(Actor* actor,
+                                         int* field,
+                                         int end_value,
+                                         AnimationTime start_time,
+                                         AnimationTime end_time) {
+  Start(Find(actor, NULL, field), *field, end_value, start_time, end_time);
 }
 
-bool TidyInterface::IntAnimation::Eval(AnimationTime current_time) {
-  if (current_time >= end_time_) {
-    *field_ = end_value_;
-    return true;
+void TidyInterface::Animator::RemoveActor(Actor* actor) {
+  if (!actor->num_animations_)
+    return;
+  size_t kept = 0;
+  for (size_t i = 0; i < actors_.size(); ++i) {
+    if (actors_[i] != actor)
+      Move(i, kept++);
+    else
+      indices_.erase(field(i));
   }
-  float x = (1.0f - cosf(ease_factor_ * (current_time - start_time_))) / 2.0f;
-  *field_ = start_value_ + x * (end_value_ - start_value_);
-  return false;
+  Truncate(kept);
+  actor->num_animations_ = 0;
+}
+
+void TidyInterface::Animator::Update(AnimationTime now) {
+  const size_t count = actors_.size();
+  elapsed_.resize(count);
+  progress_.resize(count);
+
+  for (size_t i = 0; i < count; ++i)
+    elapsed_[i] = static_cast<float>(now - start_times_[i]);
+
+  // This is the expensive part, so it's kept to plain float arrays that
+  // the compiler can vectorize.
+  for (size_t i = 0; i < count; ++i) {
+    float t = std::min(elapsed_[i], durations_[i]);
+    progress_[i] = (1.0f - cosf(ease_factors_[i] * t)) / 2.0f;
+  }
+
+  size_t kept = 0;
+  for (size_t i = 0; i < count; ++i) {
+    bool done = elapsed_[i] >= durations_[i];
+    float value = done ? end_values_[i] :
+        start_values_[i] + progress_[i] * (end_values_[i] - start_values_[i]);
+    if (float_fields_[i])
+      *float_fields_[i] = value;
+    else
+      *int_fields_[i] = static_cast<int>(value);
+    if (done) {
+      actors_[i]->num_animations_--;
+      indices_.erase(field(i));
+    } else {
+      Move(i, kept++);
+    }
+  }
+  Truncate(kept);
+}
+
+size_t TidyInterface::Animator::Find(Actor* actor,
+                                     float* float_field,
+                                     int* int_field) {
+  void* key = float_field ?
+      static_cast<void*>(float_field) : static_cast<void*>(int_field);
+  if (actor->num_animations_) {
+    std::map<void*, size_t>::const_iterator it = indices_.find(key);
+    if (it != indices_.end())
+      return it->second;
+  }
+  indices_[key] = actors_.size();
+  actor->num_animations_++;
+  actors_.push_back(actor);
+  float_fields_.push_back(float_field);
+  int_fields_.push_back(int_field);
+  start_times_.push_back(0);
+  durations_.push_back(0.0f);
+  ease_factors_.push_back(0.0f);
+  start_values_.push_back(0.0f);
+  end_values_.push_back(0.0f);
+  return actors_.size() - 1;
+}
+
+void TidyInterface::Animator::Start(size_t index,
+                                    float start_value,
+                                    float end_value,
+                                    AnimationTime start_time,
+                                    AnimationTime end_time) {
+  start_times_[index] = start_time;
+  durations_[index] = static_cast<float>(end_time - start_time);
+  ease_factors_[index] =
+      end_time > start_time ? M_PI / (end_time - start_time) : 0.0f;
+  start_values_[index] = start_value;
+  end_values_[index] = end_value;
+}
+
+void TidyInterface::Animator::Move(size_t from, size_t to) {
+  if (from == to)
+    return;
+  actors_[to] = actors_[from];
+  float_fields_[to] = float_fields_[from];
+  int_fields_[to] = int_fields_[from];
+  start_times_[to] = start_times_[from];
+  durations_[to] = durations_[from];
+  ease_factors_[to] = ease_factors_[from];
+  start_values_[to] = start_values_[from];
+  end_values_[to] = end_values_[from];
+  indices_[field(to)] = to;
+}
+
+void TidyInterface::Animator::Truncate(size_t size) {
+  // Shrinking a vector keeps its memory, so this doesn't free anything.
+  actors_.resize(size);
+  float_fields_.resize(size);
+  int_fields_.resize(size);
+  start_times_.resize(size);
+  durations_.resize(size);
+  ease_factors_.resize(size);
+  start_values_.resize(size);
+  end_values_.resize(size);
 }
 
 void TidyInterface::ActorVisitor::VisitContainer(ContainerActor* actor) {
@@ -109,13 +304,15 @@ void TidyInterface::LayerVisitor::VisitQuad(TidyInterface::QuadActor* actor) {
   if (data) {
     actor->set_is_opaque(actor->is_opaque() && !data->has_alpha());
   }
+  UpdateOcclusion(actor, actor->is_opaque());
 #endif
 }
 
 void TidyInterface::LayerVisitor::VisitTexturePixmap(
     TidyInterface::TexturePixmapActor* actor) {
-  // Do all the regular Quad stuff.
-  this->VisitQuad(actor);
+  // Do all the regular actor stuff.  Texture pixmaps don't have
+  // texture data, so there's nothing else to take from VisitQuad().
+  this->VisitActor(actor);
 
 #ifdef TIDY_OPENGL
   OpenGlPixmapData* data  = static_cast<OpenGlPixmapData*>(
@@ -123,6 +320,9 @@ void TidyInterface::LayerVisitor::VisitTexturePixmap(
   if (data) {
     actor->set_is_opaque(actor->is_opaque() && !data->has_alpha());
   }
+  // Until it's bound to a pixmap, we don't know if the actor will be
+  // drawn at all, so it can't hide anything.
+  UpdateOcclusion(actor, data && actor->is_opaque());
 #endif
 }
 
@@ -130,11 +330,47 @@ void TidyInterface::LayerVisitor::VisitActor(TidyInterface::Actor* actor) {
   actor->set_z(depth_);
   depth_ += layer_thickness_;
   actor->set_is_opaque(actor->opacity() > 0.999f);
+  actor->set_is_occluded(false);
+
+  float left, top, right, bottom;
+  GetStageEdges(actor, &left, &top, &right, &bottom);
+  int x = static_cast<int>(floorf(std::min(left, right)));
+  int y = static_cast<int>(floorf(std::min(top, bottom)));
+  actor->set_bounds(
+      Rect(x, y,
+           static_cast<int>(ceilf(std::max(left, right))) - x,
+           static_cast<int>(ceilf(std::max(top, bottom))) - y));
 }
 
 void TidyInterface::LayerVisitor::VisitContainer(
     TidyInterface::ContainerActor* actor) {
   CHECK(actor);
+  // The children are positioned relative to the container.
+  float old_origin_x = origin_x_;
+  float old_origin_y = origin_y_;
+  float old_scale_x = scale_x_;
+  float old_scale_y = scale_y_;
+  float old_ancestor_opacity = ancestor_opacity_;
+  origin_x_ += actor->x() * scale_x_;
+  origin_y_ += actor->y() * scale_y_;
+  scale_x_ *= actor->width() * actor->scale_x();
+  scale_y_ *= actor->height() * actor->scale_y();
+  ancestor_opacity_ *= actor->IsVisible() ? actor->opacity() : 0.0f;
+
+  VisitChildren(actor);
+
+  origin_x_ = old_origin_x;
+  origin_y_ = old_origin_y;
+  scale_x_ = old_scale_x;
+  scale_y_ = old_scale_y;
+  ancestor_opacity_ = old_ancestor_opacity;
+
+  // The containers should be "closer" than all their children.
+  this->VisitActor(actor);
+}
+
+void TidyInterface::LayerVisitor::VisitChildren(
+    TidyInterface::ContainerActor* actor) {
   ActorVector children = actor->GetChildren();
   TidyInterface::ActorVector::const_iterator iterator = children.begin();
   while (iterator != children.end()) {
@@ -143,9 +379,78 @@ void TidyInterface::LayerVisitor::VisitContainer(
     }
     ++iterator;
   }
+}
 
-  // The containers should be "closer" than all their children.
-  this->VisitActor(actor);
+void TidyInterface::LayerVisitor::GetStageEdges(TidyInterface::Actor* actor,
+                                                float* left, float* top,
+                                                float* right,
+                                                float* bottom) const {
+  *left = origin_x_ + actor->x() * scale_x_;
+  *top = origin_y_ + actor->y() * scale_y_;
+  *right = *left + actor->width() * actor->scale_x() * scale_x_;
+  *bottom = *top + actor->height() * actor->scale_y() * scale_y_;
+}
+
+void TidyInterface::LayerVisitor::UpdateOcclusion(TidyInterface::Actor* actor,
+                                                  bool covers) {
+  // Actors that aren't drawn don't hide anything, and there's no point
+  // in counting them.
+  if (!actor->IsVisible() || ancestor_opacity_ <= 0.001f)
+    return;
+
+  if (IsCovered(actor->bounds(), 0)) {
+    actor->set_is_occluded(true);
+    ++num_occluded_actors_;
+    return;
+  }
+
+  // Actors are only drawn as opaque if their ancestors are, too.
+  if (!covers || ancestor_opacity_ <= 0.999f)
+    return;
+
+  // The bounds include the pixels the actor only partly covers, which
+  // it doesn't hide.
+  float left, top, right, bottom;
+  GetStageEdges(actor, &left, &top, &right, &bottom);
+  int x = static_cast<int>(ceilf(std::min(left, right)));
+  int y = static_cast<int>(ceilf(std::min(top, bottom)));
+  Rect inside(x, y,
+              static_cast<int>(floorf(std::max(left, right))) - x,
+              static_cast<int>(floorf(std::max(top, bottom))) - y);
+  if (!inside.empty())
+    coverage_.push_back(inside);
+}
+
+bool TidyInterface::LayerVisitor::IsCovered(const Rect& rect,
+                                            size_t first) const {
+  for (size_t i = first; i < coverage_.size(); ++i) {
+    const Rect& cover = coverage_[i];
+    if (!cover.Intersects(rect))
+      continue;
+    if (cover.Contains(rect))
+      return true;
+
+    // Check the parts of the rectangle around this cover against the
+    // remaining ones.
+    Rect inside(rect);
+    inside.Intersect(cover);
+    const int right = rect.x + rect.width;
+    const int bottom = rect.y + rect.height;
+    const int inside_right = inside.x + inside.width;
+    const int inside_bottom = inside.y + inside.height;
+    const Rect outside[] = {
+      Rect(rect.x, rect.y, rect.width, inside.y - rect.y),
+      Rect(rect.x, inside_bottom, rect.width, bottom - inside_bottom),
+      Rect(rect.x, inside.y, inside.x - rect.x, inside.height),
+      Rect(inside_right, inside.y, right - inside_right, inside.height),
+    };
+    for (size_t j = 0; j < arraysize(outside); ++j) {
+      if (!outside[j].empty() && !IsCovered(outside[j], i + 1))
+        return false;
+    }
+    return true;
+  }
+  return false;
 }
 
 void TidyInterface::LayerVisitor::VisitStage(TidyInterface::StageActor* actor) {
@@ -166,10 +471,20 @@ void TidyInterface::LayerVisitor::VisitStage(TidyInterface::StageActor* actor) {
   // Don't start at the very edge of the z-buffer depth.
   depth_ = kMaxDepth + layer_thickness_;
 
-  VisitContainer(actor);
+  // The stage's position and size don't affect its children.
+  origin_x_ = 0.0f;
+  origin_y_ = 0.0f;
+  scale_x_ = 1.0f;
+  scale_y_ = 1.0f;
+  ancestor_opacity_ = actor->IsVisible() ? actor->opacity() : 0.0f;
+  coverage_.clear();
+  num_occluded_actors_ = 0;
+  VisitChildren(actor);
+  this->VisitActor(actor);
 }
 
 TidyInterface::Actor::~Actor() {
+  interface_->animator_.RemoveActor(this);
   if (parent_) {
     parent_->RemoveActor(this);
   }
@@ -188,8 +503,10 @@ TidyInterface::Actor::Actor(TidyInterface* interface)
       scale_y_(1.f),
       opacity_(1.f),
       is_opaque_(true),
+      is_occluded_(false),
       has_children_(false),
-      visible_(true) {
+      visible_(true),
+      num_animations_(0) {
   interface_->AddActor(this);
 }
 
@@ -281,45 +598,36 @@ TidyInterface::DrawingDataPtr TidyInterface::Actor::GetDrawingData(
   return DrawingDataPtr();
 }
 
-void TidyInterface::Actor::Update(int* count,
-                                  AnimationBase::AnimationTime now) {
-  (*count)++;
-  AnimationList::iterator iterator = animations_.begin();
-  if (!animations_.empty()) set_dirty();
-  while (iterator != animations_.end()) {
-    bool done = (*iterator)->Eval(now);
-    if (done) {
-      iterator = animations_.erase(iterator);
-    } else {
-      ++iterator;
-    }
-  }
-}
-
 void TidyInterface::Actor::AnimateFloat(float* field, float value,
                                         int duration_ms) {
+  AnimationTime now = interface_->GetAnimationStartTime();
   if (duration_ms > 0) {
-    AnimationBase::AnimationTime now = interface_->GetCurrentTime();
-    shared_ptr<AnimationBase> animation(
-        new FloatAnimation(field, value, now, now + duration_ms));
-    animations_.push_back(animation);
+    interface_->animator_.AnimateFloat(this, field, value,
+                                       now, now + duration_ms);
   } else {
+    // Replace any animation on the field with one that's already done,
+    // so that it doesn't move the field away from the new value.
+    if (num_animations_)
+      interface_->animator_.AnimateFloat(this, field, value, now, now);
     *field = value;
-    set_dirty();
   }
+  set_dirty();
 }
 
 void TidyInterface::Actor::AnimateInt(int* field, int value,
                                       int duration_ms) {
+  AnimationTime now = interface_->GetAnimationStartTime();
   if (duration_ms > 0) {
-    AnimationBase::AnimationTime now = interface_->GetCurrentTime();
-    shared_ptr<AnimationBase> animation(
-        new IntAnimation(field, value, now, now + duration_ms));
-    animations_.push_back(animation);
+    interface_->animator_.AnimateInt(this, field, value,
+                                     now, now + duration_ms);
   } else {
+    // Replace any animation on the field with one that's already done,
+    // so that it doesn't move the field away from the new value.
+    if (num_animations_)
+      interface_->animator_.AnimateInt(this, field, value, now, now);
     *field = value;
-    set_dirty();
   }
+  set_dirty();
 }
 
 void TidyInterface::ContainerActor::AddActor(
@@ -346,15 +654,6 @@ void TidyInterface::ContainerActor::RemoveActor(
   }
 }
 
-void TidyInterface::ContainerActor::Update(
-    int* count, AnimationBase::AnimationTime now) {
-  for (ActorVector::iterator iterator = children_.begin();
-       iterator != children_.end(); ++iterator) {
-    dynamic_cast<TidyInterface::Actor*>(*iterator)->Update(count, now);
-  }
-  TidyInterface::Actor::Update(count, now);
-}
-
 void TidyInterface::ContainerActor::RaiseChild(
     TidyInterface::Actor* child, TidyInterface::Actor* above) {
   CHECK(child) << "Tried to raise a NULL child.";
@@ -509,19 +808,23 @@ bool TidyInterface::TexturePixmapActor::HasPixmapDrawingData() {
 
 void TidyInterface::TexturePixmapActor::RefreshPixmap() {
 #ifdef TIDY_OPENGL
-  OpenGlPixmapData* data  = dynamic_cast<OpenGlPixmapData*>(
+  OpenGlPixmapData* data = static_cast<OpenGlPixmapData*>(
       GetDrawingData(OpenGlDrawVisitor::PIXMAP_DATA).get());
-  if (data)
-    data->Refresh();
+  if (data) {
+    // There's no need to update the texture while nobody can see it.
+    if (is_occluded())
+      data->Invalidate();
+    else
+      data->Refresh();
+  }
 #endif
   // TODO: Lift common damage and pixmap creation code to TidyInterface
 #ifdef TIDY_OPENGLES
-  OpenGlesEglImageData* data = dynamic_cast<OpenGlesEglImageData*>(
+  OpenGlesEglImageData* data = static_cast<OpenGlesEglImageData*>(
       GetDrawingData(OpenGlesDrawVisitor::kEglImageData).get());
   if (data)
     data->Refresh();
 #endif
-  set_dirty();
 }
 
 TidyInterface::StageActor::StageActor(TidyInterface* an_interface,
@@ -549,15 +852,16 @@ void TidyInterface::StageActor::SetSizeImpl(int* width, int* height) {
   interface()->x_conn()->ResizeWindow(window_, *width, *height);
 }
 
-static gboolean DrawInterface(void* data) {
-  reinterpret_cast<TidyInterface*>(data)->Draw();
-  return TRUE;
-}
-
 TidyInterface::TidyInterface(XConnection* xconn,
                              GLInterfaceBase* gl_interface)
     : event_source_(NULL),
       dirty_(true),
+      drawing_(false),
+      draw_timer_id_(0),
+      frame_interval_ms_(1000 / std::max(FLAGS_tidy_refresh_rate, 1)),
+      last_frame_time_(0),
+      frame_continues_animation_(false),
+      missed_frames_(0),
       xconn_(xconn),
       actor_count_(0) {
   CHECK(xconn_);
@@ -580,12 +884,13 @@ TidyInterface::TidyInterface(XConnection* xconn,
                                           default_stage_.get());
 #endif
 
-  // TODO: Remove this lovely hack, and replace it with something that
-  // knows more about keeping a consistent frame rate.
-  g_timeout_add(20, window_manager::DrawInterface, this);
+  // Draw the initial frame.
+  ScheduleDraw();
 }
 
 TidyInterface::~TidyInterface() {
+  if (draw_timer_id_)
+    g_source_remove(draw_timer_id_);
   delete draw_visitor_;
 }
 
@@ -663,13 +968,44 @@ void TidyInterface::HandleWindowDestroyed(XWindow xid) {
     actor->Reset();
 }
 
-void TidyInterface::HandleWindowDamaged(XWindow xid) {
+void TidyInterface::HandleWindowDamaged(XWindow xid,
+                                        int x, int y,
+                                        int width, int height) {
   TexturePixmapActor* actor =
       FindWithDefault(texture_pixmaps_,
                       xid,
                       static_cast<TexturePixmapActor*>(NULL));
-  if (actor)
-    actor->RefreshPixmap();
+  if (!actor)
+    return;
+  actor->RefreshPixmap();
+
+  // Damage to a window that's hidden behind others doesn't show.  If
+  // that changes, the stage is dirty anyway.
+  if (actor->is_occluded())
+    return;
+
+  // If the actor hasn't been laid out yet, we don't know where it is.
+  const Rect& bounds = actor->bounds();
+  if (bounds.empty() || actor->width() <= 0 || actor->height() <= 0) {
+    SetDirty();
+    return;
+  }
+
+  // Map the damaged part of the window to the stage.  The window's
+  // contents are stretched to fill the actor.
+  float scale_x = static_cast<float>(bounds.width) / actor->width();
+  float scale_y = static_cast<float>(bounds.height) / actor->height();
+  int left = bounds.x + static_cast<int>(floorf(x * scale_x));
+  int top = bounds.y + static_cast<int>(floorf(y * scale_y));
+  int right = bounds.x + static_cast<int>(ceilf((x + width) * scale_x));
+  int bottom = bounds.y + static_cast<int>(ceilf((y + height) * scale_y));
+  Rect area(left, top, right - left, bottom - top);
+  area.Intersect(bounds);
+  if (area.empty())
+    return;
+  damaged_area_.Merge(area);
+  if (!drawing_)
+    ScheduleDraw();
 }
 
 void TidyInterface::RemoveActor(Actor* actor) {
@@ -696,17 +1032,71 @@ void TidyInterface::StopMonitoringWindowForChanges(
   event_source_->StopSendingEventsForWindowToCompositor(xid);
 }
 
+void TidyInterface::SetDirty() {
+  dirty_ = true;
+  if (!drawing_)
+    ScheduleDraw();
+}
+
+TidyInterface::AnimationTime TidyInterface::GetAnimationStartTime() {
+  if (animator_.empty() && !drawing_)
+    now_ = GetCurrentRealTime();
+  return now_;
+}
+
 void TidyInterface::Draw() {
+  drawing_ = true;
   now_ = GetCurrentRealTime();
-  actor_count_ = 0;
-  default_stage_->Update(&actor_count_, now_);
-  if (dirty_) {
+  actor_count_ = actors_.size();
+  if (!animator_.empty()) {
+    animator_.Update(now_);
+    dirty_ = true;
+  }
+  if (dirty_ || !damaged_area_.empty()) {
+#ifdef TIDY_OPENGL
+    // If all that's changed is the contents of some windows, only the
+    // part of the stage that they cover needs to be redrawn.
+    draw_visitor_->set_update_area(dirty_ ? Rect() : damaged_area_);
+#endif
     default_stage_->Accept(draw_visitor_);
     dirty_ = false;
+    damaged_area_ = Rect();
+  }
+  last_frame_time_ = now_;
+  drawing_ = false;
+
+  frame_continues_animation_ = !animator_.empty();
+  if (frame_continues_animation_)
+    ScheduleDraw();
+}
+
+void TidyInterface::ScheduleDraw() {
+  if (draw_timer_id_)
+    return;
+  // Clamp the delay in case the clock has been changed.
+  AnimationTime delay_ms =
+      last_frame_time_ + frame_interval_ms_ - GetCurrentRealTime();
+  if (delay_ms < 0)
+    delay_ms = 0;
+  else if (delay_ms > frame_interval_ms_)
+    delay_ms = frame_interval_ms_;
+  draw_timer_id_ = g_timeout_add(delay_ms, &HandleDrawTimerThunk, this);
+}
+
+void TidyInterface::HandleDrawTimer() {
+  draw_timer_id_ = 0;
+  if (frame_continues_animation_) {
+    // Any refreshes between the last frame and this one went by without
+    // anything new being shown.
+    int refreshes = static_cast<int>(
+        (GetCurrentRealTime() - last_frame_time_) / frame_interval_ms_);
+    if (refreshes > 1)
+      missed_frames_ += refreshes - 1;
   }
+  Draw();
 }
 
-TidyInterface::AnimationBase::AnimationTime
+TidyInterface::AnimationTime
 TidyInterface::GetCurrentRealTime() {
   struct timeval tv;
   gettimeofday(&tv, NULL);
@@ -5,7 +5,6 @@
 #ifndef WINDOW_MANAGER_TIDY_INTERFACE_H_
 #define WINDOW_MANAGER_TIDY_INTERFACE_H_
 
-#include <list>
 #include <map>
 #include <string>
 #include <tr1/memory>
@@ -34,7 +33,6 @@ class XConnection;
 class TidyInterface : public ClutterInterface {
  public:
   class Actor;
-  class AnimationBase;
   class ContainerActor;
   class DrawingData;
   class QuadActor;
@@ -42,10 +40,103 @@ class TidyInterface : public ClutterInterface {
   class TexturePixmapActor;
 
   typedef std::vector<Actor*> ActorVector;
-  typedef std::list<std::tr1::shared_ptr<AnimationBase> > AnimationList;
   typedef std::tr1::shared_ptr<DrawingData> DrawingDataPtr;
   typedef std::map<int32, DrawingDataPtr> DrawingDataMap;
 
+  // This is in milliseconds.
+  typedef int64 AnimationTime;
+
+  // A rectangle on the stage, in pixels.
+  struct Rect {
+    Rect() : x(0), y(0), width(0), height(0) {}
+    Rect(int x, int y, int width, int height)
+        : x(x), y(y), width(width), height(height) {}
+
+    bool empty() const { return width <= 0 || height <= 0; }
+
+    // Grows this rectangle so it also covers 'other'.
+    void Merge(const Rect& other);
+
+    // Shrinks this rectangle to the part that's also in 'other'.
+    void Intersect(const Rect& other);
+
+    bool Intersects(const Rect& other) const;
+
+    // True if all of 'other' is inside this rectangle.
+    bool Contains(const Rect& other) const;
+
+    int x;
+    int y;
+    int width;
+    int height;
+  };
+
+  // This collects the quads that make up a frame, with their corners
+  // already mapped to the stage, so that the draw visitors can upload
+  // them all at once and draw them with one call per texture instead of
+  // one per actor.
+  class DrawList {
+   public:
+    // Each quad is drawn as two triangles.
+    static const int kVerticesPerQuad = 6;
+
+    // This is laid out so that it can be handed straight to GL.
+    struct Vertex {
+      float x, y, z;
+      float s, t;
+      float red, green, blue, alpha;
+    };
+
+    // This is a run of vertices that share a texture (0 for untextured
+    // quads), and so can be drawn with one call.
+    struct Batch {
+      uint32 texture;
+      int first_vertex;
+      int num_vertices;
+    };
+
+    DrawList() : group_start_(0) {}
+
+    // Empties the list, but keeps the memory for the next frame.
+    void Clear();
+
+    // Adds a quad covering the given part of the stage.
+    void AddQuad(uint32 texture,
+                 float left, float top, float right, float bottom, float z,
+                 const ClutterInterface::Color& color, float alpha);
+
+    // Turns the quads added since the last call into batches, and
+    // returns the total number of batches.  Only consecutive quads with
+    // the same texture can share a batch, so if the order the quads are
+    // drawn in doesn't matter (e.g. they're opaque, and the depth buffer
+    // sorts them out), pass true for 'sort_by_texture' to group them.
+    size_t EndGroup(bool sort_by_texture);
+
+    const std::vector<Vertex>& vertices() const { return vertices_; }
+    const std::vector<Batch>& batches() const { return batches_; }
+
+   private:
+    struct Quad {
+      uint32 texture;
+      float left, top, right, bottom, z;
+      float red, green, blue, alpha;
+    };
+
+    // Orders quads by texture, and then from front to back.
+    static bool QuadLess(const Quad& a, const Quad& b);
+
+    std::vector<Quad> quads_;
+
+    // This is the index in quads_ of the first quad of the group being
+    // added.
+    size_t group_start_;
+
+    std::vector<Vertex> vertices_;
+    std::vector<Batch> batches_;
+
+    DISALLOW_COPY_AND_ASSIGN(DrawList);
+  };
+
   // Base class for memento storage on the actors.
   class DrawingData {
    public:
@@ -53,52 +144,80 @@ class TidyInterface : public ClutterInterface {
     virtual ~DrawingData() {}
   };
 
-  class AnimationBase {
+  // This runs the animations that are in progress on all of the
+  // actors.  They're kept in parallel arrays with no gaps between them,
+  // so that a frame's worth can be evaluated in a few tight loops over
+  // contiguous memory, and once the arrays have grown to fit, starting
+  // or finishing an animation doesn't allocate anything.
+  class Animator {
    public:
-    // This is in milliseconds.
-    typedef int64 AnimationTime;
-    AnimationBase(AnimationTime start_time, AnimationTime end_time);
-    virtual ~AnimationBase() {}
-    // Evaluate the animation at the passed-in time and update the
-    // field associated with it.  It returns true when the animation
-    // is finished.
-    virtual bool Eval(AnimationTime current_time) = 0;
+    Animator() {}
 
-   protected:
-    AnimationTime start_time_;
-    AnimationTime end_time_;
-    float ease_factor_;
+    // Animates 'field', which belongs to 'actor', from its current value
+    // to 'end_value' between the two times.  This replaces any animation
+    // that's already running on the field.
+    void AnimateFloat(Actor* actor, float* field, float end_value,
+                      AnimationTime start_time, AnimationTime end_time);
+    void AnimateInt(Actor* actor, int* field, int end_value,
+                    AnimationTime start_time, AnimationTime end_time);
 
-   private:
-    DISALLOW_COPY_AND_ASSIGN(AnimationBase);
-  };
+    // Drops all of the actor's animations, leaving its fields wherever
+    // they are.
+    void RemoveActor(Actor* actor);
 
-  class FloatAnimation : public AnimationBase {
-   public:
-    FloatAnimation(float* field, float end_value,
-                   AnimationTime start_time, AnimationTime end_time);
-    bool Eval(AnimationTime current_time);
+    // Sets the animated fields to their values at time 'now', and drops
+    // the animations that are finished.
+    void Update(AnimationTime now);
+
+    // The number of animations in progress.
+    size_t size() const { return actors_.size(); }
+    bool empty() const { return actors_.empty(); }
 
    private:
-    float* field_;
-    float start_value_;
-    float end_value_;
+    // Returns the index of the animation on the given field (exactly one
+    // of 'float_field' and 'int_field' is set), adding one if there isn't
+    // one yet.
+    size_t Find(Actor* actor, float* float_field, int* int_field);
+
+    // Sets up the animation at 'index' to run from 'start_value'.
+    void Start(size_t index, float start_value, float end_value,
+               AnimationTime start_time, AnimationTime end_time);
+
+    // Moves the animation at 'from' into the slot at 'to'.
+    void Move(size_t from, size_t to);
+
+    // Drops the animations at 'size' and beyond.
+    void Truncate(size_t size);
+
+    // The field that the animation at 'index' sets.
+    void* field(size_t index) const {
+      return float_fields_[index] ?
+          static_cast<void*>(float_fields_[index]) :
+          static_cast<void*>(int_fields_[index]);
+    }
 
-    DISALLOW_COPY_AND_ASSIGN(FloatAnimation);
-  };
+    // The index of the animation on each field, so that Find() doesn't
+    // have to look through all of them.
+    std::map<void*, size_t> indices_;
 
-  class IntAnimation : public AnimationBase {
-   public:
-    IntAnimation(int* field, int end_value,
-                 AnimationTime start_time, AnimationTime end_time);
-    bool Eval(AnimationTime current_time);
+    std::vector<Actor*> actors_;
 
-   private:
-    int* field_;
-    int start_value_;
-    int end_value_;
+    // The field that each animation sets.  One of these is NULL.
+    std::vector<float*> float_fields_;
+    std::vector<int*> int_fields_;
+
+    std::vector<AnimationTime> start_times_;
+    std::vector<float> durations_;
+    std::vector<float> ease_factors_;
+    std::vector<float> start_values_;
+    std::vector<float> end_values_;
+
+    // Scratch space for Update(): the time since each animation started,
+    // and how far along its easing curve it is, from 0 to 1.
+    std::vector<float> elapsed_;
+    std::vector<float> progress_;
 
-    DISALLOW_COPY_AND_ASSIGN(IntAnimation);
+    DISALLOW_COPY_AND_ASSIGN(Animator);
   };
 
   class ActorVisitor {
@@ -144,7 +263,13 @@ class TidyInterface : public ClutterInterface {
     LayerVisitor(int32 count)
         : depth_(0.0f),
           layer_thickness_(0.0f),
-          count_(count) {}
+          count_(count),
+          origin_x_(0.0f),
+          origin_y_(0.0f),
+          scale_x_(1.0f),
+          scale_y_(1.0f),
+          ancestor_opacity_(1.0f),
+          num_occluded_actors_(0) {}
     virtual ~LayerVisitor() {}
 
     virtual void VisitActor(TidyInterface::Actor* actor);
@@ -153,11 +278,51 @@ class TidyInterface : public ClutterInterface {
     virtual void VisitQuad(TidyInterface::QuadActor* actor);
     virtual void VisitTexturePixmap(TidyInterface::TexturePixmapActor* actor);
 
+    // This is the number of actors found to be hidden behind opaque
+    // actors in front of them.
+    int num_occluded_actors() const { return num_occluded_actors_; }
+
    private:
+    // Visits the container's children, from front to back.
+    void VisitChildren(TidyInterface::ContainerActor* actor);
+
+    // Finds the edges of the actor in stage coordinates.
+    void GetStageEdges(TidyInterface::Actor* actor,
+                       float* left, float* top,
+                       float* right, float* bottom) const;
+
+    // Marks the actor as occluded if the actors visited before it hide
+    // all of it.  Otherwise, if 'covers' is true (meaning that the actor
+    // is opaque and will be drawn as such), adds the actor to the area
+    // hiding the ones behind it.
+    void UpdateOcclusion(TidyInterface::Actor* actor, bool covers);
+
+    // Returns true if 'rect' is entirely covered by coverage_, only
+    // looking at the entries starting at 'first'.
+    bool IsCovered(const Rect& rect, size_t first) const;
+
     float depth_;
     float layer_thickness_;
     int32 count_;
 
+    // This maps the coordinates of the container being visited to the
+    // stage's, the same way the draw visitors' transforms do.
+    float origin_x_;
+    float origin_y_;
+    float scale_x_;
+    float scale_y_;
+
+    // This is the product of the opacities of the ancestors of the
+    // actor being visited, or 0 if one of them is hidden.
+    float ancestor_opacity_;
+
+    // These are the parts of the stage hidden by the opaque actors
+    // visited so far.  Since actors are visited from front to back, an
+    // actor entirely within them won't be seen.
+    std::vector<Rect> coverage_;
+
+    int num_occluded_actors_;
+
     DISALLOW_COPY_AND_ASSIGN(LayerVisitor);
   };
 
@@ -208,10 +373,6 @@ class TidyInterface : public ClutterInterface {
     void LowerToBottom();
     // End ClutterInterface::Actor methods
 
-    // Updates the actor in response to time passing, and counts the
-    // number of actors as it goes.
-    virtual void Update(int32* count, AnimationBase::AnimationTime now);
-
     // Regular actors have no children, but we want to be able to
     // avoid a virtual function call to determine this while
     // traversing.
@@ -235,11 +396,21 @@ class TidyInterface : public ClutterInterface {
     // flag.
     bool is_opaque() const { return is_opaque_; }
 
+    // This is the area of the stage that the actor covers.  Like
+    // is_opaque, it's calculated by the LayerVisitor, and is empty
+    // until then.
+    const Rect& bounds() const { return bounds_; }
+
+    // This is true if the actor is entirely hidden behind opaque actors,
+    // so it doesn't need to be drawn.  It's also calculated by the
+    // LayerVisitor.
+    bool is_occluded() const { return is_occluded_; }
+
     bool IsVisible() const { return visible_ && opacity_ > 0.001; }
     float opacity() const { return opacity_; }
     float scale_x() const { return scale_x_; }
     float scale_y() const { return scale_y_; }
-    void set_dirty() { interface_->dirty_ = true; }
+    void set_dirty() { interface_->SetDirty(); }
 
     // Sets the drawing data of the given type on this object.
     void SetDrawingData(int32 id, DrawingDataPtr data) {
@@ -255,6 +426,8 @@ class TidyInterface : public ClutterInterface {
    protected:
     // So it can update the opacity flag.
     friend class TidyInterface::LayerVisitor;
+    // So it can keep track of how many animations the actor has.
+    friend class TidyInterface::Animator;
 
     TidyInterface* interface() { return interface_; }
 
@@ -266,6 +439,8 @@ class TidyInterface : public ClutterInterface {
 
     void set_has_children(bool has_children) { has_children_ = has_children; }
     void set_is_opaque(bool opaque) { is_opaque_ = opaque; }
+    void set_bounds(const Rect& bounds) { bounds_ = bounds; }
+    void set_is_occluded(bool occluded) { is_occluded_ = occluded; }
 
    private:
     TidyInterface* interface_;
@@ -298,6 +473,15 @@ class TidyInterface : public ClutterInterface {
     // if this object is opaque for traversal purposes.
     bool is_opaque_;
 
+    // Calculated during the layer visitor pass.  This is used to find
+    // which part of the stage needs to be redrawn when the actor is
+    // damaged.
+    Rect bounds_;
+
+    // Calculated during the layer visitor pass.  Occluded actors are
+    // skipped when drawing.
+    bool is_occluded_;
+
     // This indicates if this actor has any children (false for all
     // but containers).  This is here so we can avoid a virtual
     // function call to determine this during the drawing traversal.
@@ -310,8 +494,10 @@ class TidyInterface : public ClutterInterface {
     // debugging).
     std::string name_;
 
-    // This is a list of animations that are active on this actor.
-    AnimationList animations_;
+    // This is the number of animations on this actor in the interface's
+    // Animator, so that actors that aren't animating can skip looking
+    // there.
+    int num_animations_;
 
     // This keeps a mapping of int32 id to drawing data pointer.
     // The id space is maintained by the visitor implementation.
@@ -338,7 +524,6 @@ class TidyInterface : public ClutterInterface {
 
     void AddActor(ClutterInterface::Actor* actor);
     void RemoveActor(ClutterInterface::Actor* actor);
-    virtual void Update(int32* count, AnimationBase::AnimationTime now);
 
     // Raise one child over another.  Raise to top if "above" is NULL.
     void RaiseChild(TidyInterface::Actor* child,
@@ -489,28 +674,60 @@ class TidyInterface : public ClutterInterface {
   StageActor* GetDefaultStage() { return default_stage_.get(); }
   void HandleWindowConfigured(XWindow xid);
   void HandleWindowDestroyed(XWindow xid);
-  void HandleWindowDamaged(XWindow xid);
+  void HandleWindowDamaged(XWindow xid, int x, int y, int width, int height);
   // End ClutterInterface methods
 
   void AddActor(Actor* actor) { actors_.push_back(actor); }
   void RemoveActor(Actor* actor);
 
-  AnimationBase::AnimationTime GetCurrentTime() { return now_; }
+  AnimationTime GetCurrentTime() { return now_; }
+
+  // Returns the time that an animation that's starting now starts at.
+  // While animations are running, this is the time of the last frame, so
+  // that animations started together stay in step.  Otherwise, the last
+  // frame may have been long ago, so the clock is read again.
+  AnimationTime GetAnimationStartTime();
   int actor_count() { return actor_count_; }
   bool dirty() const { return dirty_; }
 
+  // Is a frame scheduled to be drawn?  This is false while nothing is
+  // changing, so we don't wake up until there's something new to show.
+  bool draw_pending() const { return draw_timer_id_ != 0; }
+
+  // The number of refreshes that went by without a frame while we were
+  // animating.
+  int missed_frames() const { return missed_frames_; }
+
+  // Marks the interface as needing to be redrawn, and schedules a frame
+  // for the next refresh if there isn't one already.
+  void SetDirty();
+
   void Draw();
 
   XConnection* x_conn() const { return xconn_; }
 
+ protected:
+  // Returns the real current time, for updating animation time.  Virtual
+  // so that tests can control the clock.
+  virtual AnimationTime GetCurrentRealTime();
+
  private:
   FRIEND_TEST(OpenGlVisitorTestTree, LayerDepth);  // sets actor count
 
   // Used by tests.
   void set_actor_count(int count) { actor_count_ = count; }
 
-  // Returns the real current time, for updating animation time.
-  AnimationBase::AnimationTime GetCurrentRealTime();
+  // Schedules HandleDrawTimer() for the next refresh, unless it's already
+  // scheduled.  Frames are never drawn more than once per refresh, so
+  // changes that come in before then are drawn together.
+  void ScheduleDraw();
+
+  // Draws a frame and, if anything is still animating, schedules the next.
+  static int HandleDrawTimerThunk(void* self) {
+    reinterpret_cast<TidyInterface*>(self)->HandleDrawTimer();
+    return false;
+  }
+  void HandleDrawTimer();
 
   // This is called when we start monitoring for changes, and sets up
   // redirection for the supplied window.
@@ -529,17 +746,47 @@ class TidyInterface : public ClutterInterface {
   // This indicates if the interface is dirty and needs to be redrawn.
   bool dirty_;
 
+  // This is the part of the stage that's been damaged since the last
+  // frame.  If nothing else has changed, only this part is redrawn.
+  Rect damaged_area_;
+
+  // True while Draw() is running.  Actors are marked dirty while they're
+  // updated and drawn, but that's taken care of by the frame in progress
+  // and shouldn't schedule another.
+  bool drawing_;
+
+  // The ID of the timer that runs HandleDrawTimer(), or 0 if no frame is
+  // scheduled.
+  unsigned int draw_timer_id_;
+
+  // How long a refresh lasts, in milliseconds.
+  int frame_interval_ms_;
+
+  // When the last frame was drawn.
+  AnimationTime last_frame_time_;
+
+  // True if the scheduled frame continues an animation, as opposed to
+  // being the first frame after an idle period.
+  bool frame_continues_animation_;
+
+  // The number of refreshes missed while animating.
+  int missed_frames_;
+
   // This is the X connection to use, and is not owned.
   XConnection* xconn_;
 
   // This is the list of actors to display.
   ActorVector actors_;
 
+  // This runs the actors' animations.  It's declared before the stage so
+  // that it outlives it.
+  Animator animator_;
+
   // This is the default stage where the actors are placed.
   scoped_ptr<StageActor> default_stage_;
 
   // This is the current time used to evaluate the currently active animations.
-  AnimationBase::AnimationTime now_;
+  AnimationTime now_;
 
   typedef base::hash_map<XWindow, TexturePixmapActor*>
   XIDToTexturePixmapActorMap;
@@ -548,9 +795,10 @@ class TidyInterface : public ClutterInterface {
   // with an XWindow.
   XIDToTexturePixmapActorMap texture_pixmaps_;
 
-  // This is the count of actors in the tree as of the last time
-  // Update was called.  It is used to compute the depth delta for
-  // layer depth calculations.
+  // This is the number of actors as of the last frame.  It is used to
+  // compute the depth delta for layer depth calculations.  It counts
+  // actors that aren't on the stage too, which only makes the layers a
+  // bit thinner, but saves walking the tree to count them.
   int32 actor_count_;
 
 #ifdef TIDY_OPENGL
@@ -10,6 +10,7 @@
 #include <vector>
 
 #include <gflags/gflags.h>
+#include <glib.h>
 #include <gtest/gtest.h>
 
 #include "base/command_line.h"
@@ -19,6 +20,7 @@
 #include "window_manager/compositor_event_source.h"
 #include "window_manager/mock_gl_interface.h"
 #include "window_manager/mock_x_connection.h"
+#include "window_manager/opengl_visitor.h"
 #include "window_manager/test_lib.h"
 #include "window_manager/tidy_interface.h"
 #include "window_manager/util.h"
@@ -26,6 +28,8 @@
 DEFINE_bool(logtostderr, false,
             "Print debugging messages to stderr (suppressed otherwise)");
 
+DECLARE_int32(tidy_refresh_rate);
+
 using std::set;
 using std::string;
 using std::vector;
@@ -35,8 +39,20 @@ namespace window_manager {
 class TestInterface : virtual public TidyInterface {
  public:
   TestInterface(XConnection* xconnection, GLInterface* gl_interface)
-      : TidyInterface(xconnection, gl_interface) {}
+      : TidyInterface(xconnection, gl_interface),
+        now_ms_(0) {}
+
+  // Makes the interface see the given time, instead of the real time.
+  void set_now_ms(AnimationTime now_ms) { now_ms_ = now_ms; }
+
+ protected:
+  AnimationTime GetCurrentRealTime() {
+    return now_ms_ ? now_ms_ : TidyInterface::GetCurrentRealTime();
+  }
+
  private:
+  AnimationTime now_ms_;
+
   DISALLOW_COPY_AND_ASSIGN(TestInterface);
 };
 
@@ -80,12 +96,20 @@ class TidyTest : public ::testing::Test {
   }
 
   TidyInterface* interface() { return interface_.get(); }
+  TestInterface* test_interface() { return interface_.get(); }
+  MockGLInterface* gl_interface() { return gl_interface_.get(); }
   MockXConnection* x_connection() { return x_connection_.get(); }
   TestCompositorEventSource* event_source() { return event_source_.get(); }
 
+  // Waits for the scheduled frame and draws it.
+  void DrawPendingFrame() {
+    ASSERT_TRUE(interface_->draw_pending());
+    g_main_context_iteration(NULL, TRUE);
+  }
+
  private:
-  scoped_ptr<TidyInterface> interface_;
-  scoped_ptr<GLInterface> gl_interface_;
+  scoped_ptr<TestInterface> interface_;
+  scoped_ptr<MockGLInterface> gl_interface_;
   scoped_ptr<MockXConnection> x_connection_;
   scoped_ptr<TestCompositorEventSource> event_source_;
 };
@@ -167,8 +191,8 @@ class TidyTestTree : public TidyTest {
 
 TEST_F(TidyTestTree, LayerDepth) {
   // Test lower-level layer-setting routines
-  int32 count = 0;
-  stage_->Update(&count, 0LL);
+  interface()->Draw();
+  int32 count = interface()->actor_count();
   EXPECT_EQ(8, count);
   TidyInterface::ActorVector actors;
 
@@ -250,8 +274,8 @@ TEST_F(TidyTestTree, LayerDepthWithOpacity) {
   rect2_->SetOpacity(0.5f, 0);
 
   // Test lower-level layer-setting routines
-  int32 count = 0;
-  stage_->Update(&count, 0LL);
+  interface()->Draw();
+  int32 count = interface()->actor_count();
   EXPECT_EQ(8, count);
   TidyInterface::ActorVector actors;
 
@@ -484,37 +508,360 @@ TEST_F(TidyTestTree, ContainerActorAttributes) {
   EXPECT_TRUE(rect1_->IsVisible());
 }
 
+TEST_F(TidyTestTree, ActorBounds) {
+  group1_->Move(10, 20, 0);
+  group1_->Scale(2.0, 2.0, 0);
+  rect1_->Move(5, 5, 0);
+  rect1_->SetSize(30, 40);
+  rect2_->Move(100, 200, 0);
+  rect2_->SetSize(50, 60);
+  rect2_->Scale(0.5, 0.5, 0);
+
+  TidyInterface::LayerVisitor layer_visitor(interface()->actor_count());
+  stage_->Accept(&layer_visitor);
+
+  // Containers scale and move their children.
+  const TidyInterface::Rect& bounds1 = rect1_->bounds();
+  EXPECT_EQ(20, bounds1.x);
+  EXPECT_EQ(30, bounds1.y);
+  EXPECT_EQ(60, bounds1.width);
+  EXPECT_EQ(80, bounds1.height);
+
+  const TidyInterface::Rect& bounds2 = rect2_->bounds();
+  EXPECT_EQ(100, bounds2.x);
+  EXPECT_EQ(200, bounds2.y);
+  EXPECT_EQ(25, bounds2.width);
+  EXPECT_EQ(30, bounds2.height);
+}
+
+TEST_F(TidyTestTree, LayerOcclusion) {
+  // rect3 is in front of rect2, which is in front of rect1.
+  rect3_->SetSize(100, 100);
+  rect2_->Move(10, 10, 0);
+  rect2_->SetSize(50, 50);
+  rect1_->Move(50, 50, 0);
+  rect1_->SetSize(100, 100);
+
+  TidyInterface::LayerVisitor layer_visitor(interface()->actor_count());
+  stage_->Accept(&layer_visitor);
+  EXPECT_FALSE(rect3_->is_occluded());
+  EXPECT_TRUE(rect2_->is_occluded());
+  EXPECT_FALSE(rect1_->is_occluded());
+  EXPECT_FALSE(group1_->is_occluded());
+  EXPECT_EQ(1, layer_visitor.num_occluded_actors());
+
+  // Actors can be hidden by several others together.
+  rect2_->Move(100, 0, 0);
+  rect2_->SetSize(100, 100);
+  rect1_->Move(50, 10, 0);
+  rect1_->SetSize(100, 50);
+  stage_->Accept(&layer_visitor);
+  EXPECT_FALSE(rect2_->is_occluded());
+  EXPECT_TRUE(rect1_->is_occluded());
+  EXPECT_EQ(1, layer_visitor.num_occluded_actors());
+
+  // Actors that aren't drawn as opaque don't hide anything.
+  group3_->SetOpacity(0.5f, 0);
+  stage_->Accept(&layer_visitor);
+  EXPECT_FALSE(rect1_->is_occluded());
+  EXPECT_EQ(0, layer_visitor.num_occluded_actors());
+
+  group3_->SetOpacity(1.0f, 0);
+  group3_->SetVisibility(false);
+  stage_->Accept(&layer_visitor);
+  EXPECT_FALSE(rect1_->is_occluded());
+
+  group3_->SetVisibility(true);
+  rect3_->SetOpacity(0.5f, 0);
+  stage_->Accept(&layer_visitor);
+  EXPECT_FALSE(rect1_->is_occluded());
+
+  // Pixels that are only partly covered aren't hidden.
+  rect3_->SetOpacity(1.0f, 0);
+  rect3_->Scale(0.995f, 1.0f, 0);
+  stage_->Accept(&layer_visitor);
+  EXPECT_FALSE(rect1_->is_occluded());
+
+  rect3_->Scale(1.0f, 1.0f, 0);
+  stage_->Accept(&layer_visitor);
+  EXPECT_TRUE(rect1_->is_occluded());
+}
+
+TEST_F(TidyTest, Rect) {
+  TidyInterface::Rect rect;
+  EXPECT_TRUE(rect.empty());
+  rect.Merge(TidyInterface::Rect(10, 20, 30, 40));
+  EXPECT_EQ(10, rect.x);
+  EXPECT_EQ(20, rect.y);
+  EXPECT_EQ(30, rect.width);
+  EXPECT_EQ(40, rect.height);
+
+  rect.Merge(TidyInterface::Rect(0, 50, 5, 20));
+  EXPECT_EQ(0, rect.x);
+  EXPECT_EQ(20, rect.y);
+  EXPECT_EQ(40, rect.width);
+  EXPECT_EQ(50, rect.height);
+
+  EXPECT_TRUE(rect.Intersects(TidyInterface::Rect(39, 69, 10, 10)));
+  EXPECT_FALSE(rect.Intersects(TidyInterface::Rect(40, 20, 10, 10)));
+  EXPECT_FALSE(rect.Intersects(TidyInterface::Rect()));
+
+  rect.Intersect(TidyInterface::Rect(30, 0, 100, 30));
+  EXPECT_EQ(30, rect.x);
+  EXPECT_EQ(20, rect.y);
+  EXPECT_EQ(10, rect.width);
+  EXPECT_EQ(10, rect.height);
+
+  rect.Intersect(TidyInterface::Rect(0, 0, 10, 10));
+  EXPECT_TRUE(rect.empty());
+}
+
+TEST_F(TidyTest, DrawList) {
+  TidyInterface::DrawList draw_list;
+  ClutterInterface::Color color(0.25f, 0.5f, 0.75f);
+
+  // Quads that can be drawn in any order are grouped by texture.
+  draw_list.AddQuad(2, 0.f, 0.f, 10.f, 20.f, 5.f, color, 1.f);
+  draw_list.AddQuad(1, 5.f, 5.f, 15.f, 25.f, 4.f, color, 1.f);
+  draw_list.AddQuad(2, 10.f, 10.f, 20.f, 30.f, 3.f, color, 1.f);
+  EXPECT_EQ(static_cast<size_t>(2), draw_list.EndGroup(true));
+
+  // Others are only merged with their neighbours, and never with the
+  // previous group.
+  draw_list.AddQuad(2, 0.f, 0.f, 1.f, 1.f, 2.f, color, 0.5f);
+  draw_list.AddQuad(2, 0.f, 0.f, 1.f, 1.f, 1.f, color, 0.5f);
+  draw_list.AddQuad(0, 0.f, 0.f, 1.f, 1.f, 0.f, color, 0.5f);
+  draw_list.AddQuad(2, 0.f, 0.f, 1.f, 1.f, -1.f, color, 0.5f);
+  EXPECT_EQ(static_cast<size_t>(5), draw_list.EndGroup(false));
+
+  const int kVerticesPerQuad = TidyInterface::DrawList::kVerticesPerQuad;
+  const vector<TidyInterface::DrawList::Batch>& batches = draw_list.batches();
+  const uint32 kTextures[] = { 1, 2, 2, 0, 2 };
+  const int kNumQuads[] = { 1, 2, 2, 1, 1 };
+  int first_vertex = 0;
+  for (size_t i = 0; i < batches.size(); ++i) {
+    EXPECT_EQ(kTextures[i], batches[i].texture);
+    EXPECT_EQ(first_vertex, batches[i].first_vertex);
+    EXPECT_EQ(kNumQuads[i] * kVerticesPerQuad, batches[i].num_vertices);
+    first_vertex += batches[i].num_vertices;
+  }
+  EXPECT_EQ(static_cast<size_t>(7 * kVerticesPerQuad),
+            draw_list.vertices().size());
+
+  // Within a texture, the quads are sorted from front to back.
+  const vector<TidyInterface::DrawList::Vertex>& vertices =
+      draw_list.vertices();
+  EXPECT_FLOAT_EQ(5.f, vertices[kVerticesPerQuad].z);
+  EXPECT_FLOAT_EQ(3.f, vertices[2 * kVerticesPerQuad].z);
+
+  // The corners of a quad are mapped to the corners of its texture.
+  const TidyInterface::DrawList::Vertex& top_left = vertices[0];
+  EXPECT_FLOAT_EQ(5.f, top_left.x);
+  EXPECT_FLOAT_EQ(5.f, top_left.y);
+  EXPECT_FLOAT_EQ(4.f, top_left.z);
+  EXPECT_FLOAT_EQ(0.f, top_left.s);
+  EXPECT_FLOAT_EQ(0.f, top_left.t);
+  EXPECT_FLOAT_EQ(0.25f, top_left.red);
+  EXPECT_FLOAT_EQ(0.5f, top_left.green);
+  EXPECT_FLOAT_EQ(0.75f, top_left.blue);
+  EXPECT_FLOAT_EQ(1.f, top_left.alpha);
+  const TidyInterface::DrawList::Vertex& bottom_right =
+      vertices[kVerticesPerQuad - 1];
+  EXPECT_FLOAT_EQ(15.f, bottom_right.x);
+  EXPECT_FLOAT_EQ(25.f, bottom_right.y);
+  EXPECT_FLOAT_EQ(1.f, bottom_right.s);
+  EXPECT_FLOAT_EQ(1.f, bottom_right.t);
+
+  draw_list.Clear();
+  EXPECT_TRUE(draw_list.batches().empty());
+  EXPECT_TRUE(draw_list.vertices().empty());
+}
+
 TEST_F(TidyTest, FloatAnimation) {
+  scoped_ptr<TidyInterface::Actor> actor(
+      interface()->CreateRectangle(ClutterInterface::Color(),
+                                   ClutterInterface::Color(), 0));
+  TidyInterface::Animator animator;
   float value = -10.0f;
-  TidyInterface::FloatAnimation anim(&value, 10.0f, 0, 20);
-  EXPECT_FALSE(anim.Eval(0));
+  animator.AnimateFloat(actor.get(), &value, 10.0f, 0, 20);
+  animator.Update(0);
   EXPECT_FLOAT_EQ(-10.0f, value);
-  EXPECT_FALSE(anim.Eval(5));
+  animator.Update(5);
   EXPECT_FLOAT_EQ(-sqrt(50.0f), value);
-  EXPECT_FALSE(anim.Eval(10));
+  animator.Update(10);
 
   // The standard epsilon is just a little too small here..
   EXPECT_NEAR(0.0f, value, 1.0e-6);
 
-  EXPECT_FALSE(anim.Eval(15));
+  animator.Update(15);
   EXPECT_FLOAT_EQ(sqrt(50.0f), value);
-  EXPECT_TRUE(anim.Eval(20));
+  EXPECT_EQ(static_cast<size_t>(1), animator.size());
+  animator.Update(20);
   EXPECT_FLOAT_EQ(10.0f, value);
+  EXPECT_TRUE(animator.empty());
 }
 
 TEST_F(TidyTest, IntAnimation) {
+  scoped_ptr<TidyInterface::Actor> actor(
+      interface()->CreateRectangle(ClutterInterface::Color(),
+                                   ClutterInterface::Color(), 0));
+  TidyInterface::Animator animator;
   int value = -10;
-  TidyInterface::IntAnimation anim(&value, 10, 0, 20);
-  EXPECT_FALSE(anim.Eval(0));
+  animator.AnimateInt(actor.get(), &value, 10, 0, 20);
+  animator.Update(0);
   EXPECT_EQ(-10, value);
-  EXPECT_FALSE(anim.Eval(5));
+  animator.Update(5);
   EXPECT_EQ(-7, value);
-  EXPECT_FALSE(anim.Eval(10));
+  animator.Update(10);
   EXPECT_EQ(0, value);
-  EXPECT_FALSE(anim.Eval(15));
+  animator.Update(15);
   EXPECT_EQ(7, value);
-  EXPECT_TRUE(anim.Eval(20));
+  EXPECT_EQ(static_cast<size_t>(1), animator.size());
+  animator.Update(20);
   EXPECT_EQ(10, value);
+  EXPECT_TRUE(animator.empty());
+}
+
+TEST_F(TidyTest, AnimatorReplacesAndRemoves) {
+  scoped_ptr<TidyInterface::Actor> actor1(
+      interface()->CreateRectangle(ClutterInterface::Color(),
+                                   ClutterInterface::Color(), 0));
+  scoped_ptr<TidyInterface::Actor> actor2(
+      interface()->CreateRectangle(ClutterInterface::Color(),
+                                   ClutterInterface::Color(), 0));
+  TidyInterface::Animator animator;
+  float value1 = 0.0f, value2 = 0.0f;
+  int value3 = 0;
+  animator.AnimateFloat(actor1.get(), &value1, 10.0f, 0, 20);
+  animator.AnimateInt(actor1.get(), &value3, 10, 0, 20);
+  animator.AnimateFloat(actor2.get(), &value2, 10.0f, 0, 20);
+  EXPECT_EQ(static_cast<size_t>(3), animator.size());
+
+  // Animating a field again replaces its animation, starting from where
+  // the field is now.
+  animator.Update(10);
+  EXPECT_FLOAT_EQ(5.0f, value1);
+  animator.AnimateFloat(actor1.get(), &value1, -5.0f, 10, 30);
+  EXPECT_EQ(static_cast<size_t>(3), animator.size());
+  animator.Update(20);
+  EXPECT_FLOAT_EQ(0.0f, value1);
+  EXPECT_FLOAT_EQ(10.0f, value2);
+  EXPECT_EQ(10, value3);
+  EXPECT_EQ(static_cast<size_t>(1), animator.size());
+
+  // Removing an actor drops its animations and leaves the rest alone.
+  animator.AnimateFloat(actor2.get(), &value2, 0.0f, 20, 40);
+  animator.RemoveActor(actor1.get());
+  EXPECT_EQ(static_cast<size_t>(1), animator.size());
+  animator.Update(30);
+  EXPECT_FLOAT_EQ(0.0f, value1);
+  EXPECT_FLOAT_EQ(5.0f, value2);
+
+  // The animation that moved into actor1's place is still found there.
+  animator.AnimateFloat(actor2.get(), &value2, 10.0f, 30, 40);
+  EXPECT_EQ(static_cast<size_t>(1), animator.size());
+  animator.Update(40);
+  EXPECT_FLOAT_EQ(10.0f, value2);
+  EXPECT_TRUE(animator.empty());
+}
+
+TEST_F(TidyTest, ActorAnimations) {
+  test_interface()->set_now_ms(1000);
+  DrawPendingFrame();
+  scoped_ptr<TidyInterface::Actor> rect(
+      interface()->CreateRectangle(ClutterInterface::Color(),
+                                   ClutterInterface::Color(), 0));
+  interface()->GetDefaultStage()->AddActor(rect.get());
+  rect->Move(100, 200, 100);
+  rect->SetOpacity(0.0, 100);
+  test_interface()->set_now_ms(1050);
+  interface()->Draw();
+  EXPECT_EQ(50, rect->x());
+  EXPECT_EQ(100, rect->y());
+  EXPECT_FLOAT_EQ(0.5f, rect->opacity());
+
+  // Setting a field right away stops its animation, but not the others.
+  rect->MoveX(20, 0);
+  EXPECT_EQ(20, rect->x());
+  test_interface()->set_now_ms(1100);
+  interface()->Draw();
+  EXPECT_EQ(20, rect->x());
+  EXPECT_EQ(200, rect->y());
+  EXPECT_FLOAT_EQ(0.0f, rect->opacity());
+
+  // An actor that's deleted while it's animating is dropped.
+  rect->Move(0, 0, 100);
+  rect.reset();
+  test_interface()->set_now_ms(1150);
+  DrawPendingFrame();
+  EXPECT_FALSE(interface()->draw_pending());
+}
+
+// Test that an animation started after nothing has been drawn for a while
+// starts from the real time, not from when the last frame was drawn.
+TEST_F(TidyTest, AnimationAfterIdle) {
+  test_interface()->set_now_ms(1000);
+  scoped_ptr<TidyInterface::Actor> rect(
+      interface()->CreateRectangle(ClutterInterface::Color(),
+                                   ClutterInterface::Color(), 0));
+  interface()->GetDefaultStage()->AddActor(rect.get());
+  DrawPendingFrame();
+  EXPECT_FALSE(interface()->draw_pending());
+
+  test_interface()->set_now_ms(5000);
+  rect->Move(100, 200, 100);
+  test_interface()->set_now_ms(5050);
+  DrawPendingFrame();
+  EXPECT_EQ(50, rect->x());
+  EXPECT_EQ(100, rect->y());
+
+  // Animations started while others run keep to the frame clock.
+  test_interface()->set_now_ms(5060);
+  rect->SetOpacity(0.0, 50);
+  test_interface()->set_now_ms(5075);
+  DrawPendingFrame();
+  EXPECT_FLOAT_EQ(0.5f, rect->opacity());
+}
+
+// Run a frame's worth of updates for lots of actors at once, and report
+// how long it takes.
+TEST_F(TidyTest, ManyAnimations) {
+  const int kNumActors = 2000;
+  const int kNumFrames = 100;
+  vector<TidyInterface::Actor*> actors;
+  for (int i = 0; i < kNumActors; ++i) {
+    actors.push_back(
+        interface()->CreateRectangle(ClutterInterface::Color(),
+                                     ClutterInterface::Color(), 0));
+  }
+  TidyInterface::Animator animator;
+  vector<float> opacities(kNumActors, 0.0f);
+  vector<int> xs(kNumActors, 0), ys(kNumActors, 0);
+  for (int i = 0; i < kNumActors; ++i) {
+    // Stagger the ends, so that animations finish on every frame.
+    animator.AnimateInt(actors[i], &xs[i], i, 0, kNumFrames + i % 50);
+    animator.AnimateInt(actors[i], &ys[i], -i, 0, kNumFrames + i % 50);
+    animator.AnimateFloat(actors[i], &opacities[i], 1.0f,
+                          0, kNumFrames + i % 50);
+  }
+  EXPECT_EQ(static_cast<size_t>(3 * kNumActors), animator.size());
+
+  double start_time = GetCurrentTime();
+  int frames = 0;
+  for (; !animator.empty(); ++frames)
+    animator.Update(frames);
+  double elapsed_ms = 1000.0 * (GetCurrentTime() - start_time);
+  LOG(INFO) << "Ran " << 3 * kNumActors << " animations over " << frames
+            << " frames in " << elapsed_ms << " ms ("
+            << elapsed_ms / frames << " ms per frame)";
+
+  EXPECT_EQ(kNumFrames + 50, frames);
+  for (int i = 0; i < kNumActors; ++i) {
+    EXPECT_EQ(i, xs[i]);
+    EXPECT_EQ(-i, ys[i]);
+    EXPECT_FLOAT_EQ(1.0f, opacities[i]);
+    delete actors[i];
+  }
 }
 
 TEST_F(TidyTestTree, CloneTest) {
@@ -527,7 +874,273 @@ TEST_F(TidyTestTree, CloneTest) {
   EXPECT_EQ(200, clone->height());
 }
 
-// Test TidyInterface's handling of X events concerning composited windows.
+// Test that frames are drawn only when something has changed, and that
+// refreshes missed during an animation are counted.
+TEST_F(TidyTest, FrameScheduling) {
+  const int frame_interval_ms = 1000 / FLAGS_tidy_refresh_rate;
+  test_interface()->set_now_ms(1000);
+
+  // The initial frame is drawn, and then nothing more is scheduled.
+  DrawPendingFrame();
+  EXPECT_FALSE(interface()->dirty());
+  EXPECT_FALSE(interface()->draw_pending());
+
+  // Changing an actor schedules a single frame.
+  scoped_ptr<TidyInterface::Actor> rect(
+      interface()->CreateRectangle(ClutterInterface::Color(),
+                                   ClutterInterface::Color(), 0));
+  interface()->GetDefaultStage()->AddActor(rect.get());
+  EXPECT_TRUE(interface()->draw_pending());
+  rect->SetSize(10, 10);
+  rect->SetOpacity(0.5, 0);
+  DrawPendingFrame();
+  EXPECT_FALSE(interface()->dirty());
+  EXPECT_FALSE(interface()->draw_pending());
+
+  // Frames keep coming while an animation is running.
+  rect->Move(100, 0, 100 * frame_interval_ms);
+  EXPECT_TRUE(interface()->draw_pending());
+  DrawPendingFrame();
+  EXPECT_TRUE(interface()->draw_pending());
+  test_interface()->set_now_ms(1000 + frame_interval_ms);
+  DrawPendingFrame();
+  EXPECT_TRUE(interface()->draw_pending());
+  EXPECT_EQ(0, interface()->missed_frames());
+
+  // If we fall behind, the refreshes in between are counted as missed.
+  test_interface()->set_now_ms(1000 + 5 * frame_interval_ms);
+  DrawPendingFrame();
+  EXPECT_TRUE(interface()->draw_pending());
+  EXPECT_EQ(3, interface()->missed_frames());
+
+  // Once the animation is done, we stop drawing.
+  test_interface()->set_now_ms(1000 + 100 * frame_interval_ms);
+  DrawPendingFrame();
+  EXPECT_EQ(100, rect->x());
+  EXPECT_FALSE(interface()->draw_pending());
+}
+
+// Test that when only the contents of a window change, just the part of
+// the stage that they cover is redrawn.
+TEST_F(TidyTest, DrawDamagedArea) {
+  TidyInterface::StageActor* stage = interface()->GetDefaultStage();
+  XWindow xids[2];
+  scoped_ptr<TidyInterface::TexturePixmapActor> actors[2];
+  for (int i = 0; i < 2; ++i) {
+    xids[i] = x_connection()->CreateWindow(
+        x_connection()->GetRootWindow(), 0, 0, 200, 100, false, false, 0);
+    x_connection()->GetWindowInfoOrDie(xids[i])->compositing_pixmap = 123;
+    actors[i].reset(interface()->CreateTexturePixmap());
+    actors[i]->SetTexturePixmapWindow(xids[i]);
+    actors[i]->SetSize(200, 100);
+    actors[i]->Move(300 * i, 50, 0);
+    stage->AddActor(actors[i].get());
+  }
+
+  // The first frame draws everything.
+  interface()->Draw();
+  EXPECT_EQ(1, gl_interface()->num_swaps());
+  EXPECT_EQ(0, gl_interface()->num_sub_buffer_copies());
+  int full_frame_draws = gl_interface()->num_draw_arrays_calls();
+  EXPECT_EQ(2, full_frame_draws);
+
+  // Damage part of the second window.  A frame is scheduled, but the
+  // stage as a whole isn't dirty.
+  interface()->HandleWindowDamaged(xids[1], 10, 20, 30, 40);
+  EXPECT_FALSE(interface()->dirty());
+  EXPECT_TRUE(interface()->draw_pending());
+
+  // Only the damaged area is drawn and shown.
+  interface()->Draw();
+  EXPECT_EQ(1, gl_interface()->num_swaps());
+  EXPECT_EQ(1, gl_interface()->num_sub_buffer_copies());
+  EXPECT_EQ(310, gl_interface()->scissor_x());
+  EXPECT_EQ(stage->height() - 70 - 40, gl_interface()->scissor_y());
+  EXPECT_EQ(30, gl_interface()->scissor_width());
+  EXPECT_EQ(40, gl_interface()->scissor_height());
+  EXPECT_EQ(full_frame_draws + 1, gl_interface()->num_draw_arrays_calls());
+
+  // Damage in both windows is drawn together.
+  interface()->HandleWindowDamaged(xids[0], 0, 0, 10, 10);
+  interface()->HandleWindowDamaged(xids[1], 190, 90, 10, 10);
+  interface()->Draw();
+  EXPECT_EQ(2, gl_interface()->num_sub_buffer_copies());
+  EXPECT_EQ(0, gl_interface()->scissor_x());
+  EXPECT_EQ(stage->height() - 150, gl_interface()->scissor_y());
+  EXPECT_EQ(500, gl_interface()->scissor_width());
+  EXPECT_EQ(100, gl_interface()->scissor_height());
+
+  // Any other change redraws the whole stage.
+  actors[0]->Move(10, 50, 0);
+  interface()->HandleWindowDamaged(xids[1], 0, 0, 10, 10);
+  interface()->Draw();
+  EXPECT_EQ(2, gl_interface()->num_swaps());
+  EXPECT_EQ(2, gl_interface()->num_sub_buffer_copies());
+}
+
+// Check that quads that share a texture are drawn together.
+TEST_F(TidyTest, BatchedDrawing) {
+  TidyInterface::StageActor* stage = interface()->GetDefaultStage();
+  const int kNumRects = 20;
+  scoped_ptr<TidyInterface::Actor> rects[kNumRects];
+  for (int i = 0; i < kNumRects; ++i) {
+    rects[i].reset(interface()->CreateRectangle(
+        ClutterInterface::Color(0.1f * (i % 10), 0.f, 0.f),
+        ClutterInterface::Color(), 0));
+    rects[i]->SetSize(10, 10);
+    rects[i]->Move(10 * i, 0, 0);
+    stage->AddActor(rects[i].get());
+  }
+
+  // This took one call per actor when each quad was drawn by itself.
+  interface()->Draw();
+  EXPECT_EQ(1, gl_interface()->num_draw_arrays_calls());
+  EXPECT_EQ(0, gl_interface()->num_texture_binds());
+
+  // Transparent quads are drawn separately, after the opaque ones.
+  for (int i = 0; i < kNumRects; i += 2)
+    rects[i]->SetOpacity(0.5f, 0);
+  interface()->Draw();
+  EXPECT_EQ(3, gl_interface()->num_draw_arrays_calls());
+
+  // Windows have textures of their own, so a window in between the
+  // transparent quads splits them up.
+  XWindow xid = x_connection()->CreateWindow(
+      x_connection()->GetRootWindow(), 0, 0, 200, 100, false, false, 0);
+  x_connection()->GetWindowInfoOrDie(xid)->compositing_pixmap = 123;
+  scoped_ptr<TidyInterface::TexturePixmapActor> window(
+      interface()->CreateTexturePixmap());
+  window->SetTexturePixmapWindow(xid);
+  window->SetSize(200, 100);
+  window->SetOpacity(0.5f, 0);
+  stage->AddActor(window.get());
+  window->Lower(rects[kNumRects / 2].get());
+  int num_draws = gl_interface()->num_draw_arrays_calls();
+  int num_binds = gl_interface()->num_texture_binds();
+  interface()->Draw();
+  EXPECT_EQ(num_draws + 4, gl_interface()->num_draw_arrays_calls());
+  // One bind is for setting up the window's texture.
+  EXPECT_EQ(num_binds + 2, gl_interface()->num_texture_binds());
+}
+
+// Check that a texture bound outside of drawing, such as when a window's
+// pixmap is refreshed, doesn't make the next frame draw with the wrong one.
+TEST_F(TidyTest, TextureBindingAcrossFrames) {
+  TidyInterface::StageActor* stage = interface()->GetDefaultStage();
+  XWindow xids[2];
+  scoped_ptr<TidyInterface::TexturePixmapActor> actors[2];
+  for (int i = 0; i < 2; ++i) {
+    xids[i] = x_connection()->CreateWindow(
+        x_connection()->GetRootWindow(), 0, 0, 200, 100, false, false, 0);
+    x_connection()->GetWindowInfoOrDie(xids[i])->compositing_pixmap = 123;
+    actors[i].reset(interface()->CreateTexturePixmap());
+    actors[i]->SetTexturePixmapWindow(xids[i]);
+    actors[i]->SetSize(200, 100);
+    actors[i]->Move(300 * i, 50, 0);
+    stage->AddActor(actors[i].get());
+  }
+
+  interface()->Draw();
+  GLuint textures[2];
+  for (int i = 0; i < 2; ++i) {
+    OpenGlPixmapData* data = static_cast<OpenGlPixmapData*>(
+        actors[i]->GetDrawingData(OpenGlDrawVisitor::PIXMAP_DATA).get());
+    ASSERT_TRUE(data);
+    textures[i] = data->texture();
+  }
+  const vector<GLuint>& drawn = gl_interface()->drawn_textures();
+  ASSERT_EQ(static_cast<size_t>(2), drawn.size());
+  EXPECT_NE(drawn[0], drawn[1]);
+  // The window drawn last is the one whose texture is still bound.
+  const int last = drawn[1] == textures[0] ? 0 : 1;
+  EXPECT_EQ(textures[last], drawn[1]);
+
+  // Refreshing the other window binds its texture.  With that window
+  // hidden, the next frame only draws the first one, which has to bind
+  // its texture again.
+  interface()->HandleWindowDamaged(xids[1 - last], 0, 0, 10, 10);
+  actors[1 - last]->SetVisibility(false);
+  interface()->Draw();
+  ASSERT_EQ(static_cast<size_t>(3), drawn.size());
+  EXPECT_EQ(textures[last], drawn[2]);
+
+  // Untextured quads are drawn with texturing disabled, even when
+  // something else (like loading an image) enabled it since the last
+  // frame.
+  scoped_ptr<TidyInterface::Actor> rect(
+      interface()->CreateRectangle(ClutterInterface::Color(),
+                                   ClutterInterface::Color(), 0));
+  rect->SetSize(10, 10);
+  stage->AddActor(rect.get());
+  actors[last]->SetVisibility(false);
+  interface()->Draw();
+  ASSERT_EQ(static_cast<size_t>(4), drawn.size());
+  EXPECT_EQ(static_cast<GLuint>(0), drawn[3]);
+  gl_interface()->Enable(GL_TEXTURE_2D);
+  gl_interface()->BindTexture(GL_TEXTURE_2D, textures[last]);
+  interface()->SetDirty();
+  interface()->Draw();
+  ASSERT_EQ(static_cast<size_t>(5), drawn.size());
+  EXPECT_EQ(static_cast<GLuint>(0), drawn[4]);
+}
+
+// Check that windows hidden behind other windows aren't drawn or updated.
+TEST_F(TidyTest, DrawOccluded) {
+  TidyInterface::StageActor* stage = interface()->GetDefaultStage();
+  XWindow xids[3];
+  scoped_ptr<TidyInterface::TexturePixmapActor> actors[3];
+  for (int i = 0; i < 3; ++i) {
+    xids[i] = x_connection()->CreateWindow(
+        x_connection()->GetRootWindow(), 0, 0, 200, 100, false, false, 0);
+    x_connection()->GetWindowInfoOrDie(xids[i])->compositing_pixmap = 123;
+    actors[i].reset(interface()->CreateTexturePixmap());
+    actors[i]->SetSize(200, 100);
+  }
+  // The second window is in front of the first.
+  for (int i = 0; i < 2; ++i) {
+    actors[i]->SetTexturePixmapWindow(xids[i]);
+    stage->AddActor(actors[i].get());
+  }
+
+  // Until the front window has a pixmap, we don't know that it hides
+  // anything.
+  interface()->Draw();
+  EXPECT_FALSE(actors[0]->is_occluded());
+  EXPECT_EQ(2, gl_interface()->num_draw_arrays_calls());
+
+  interface()->SetDirty();
+  interface()->Draw();
+  EXPECT_TRUE(actors[0]->is_occluded());
+  EXPECT_EQ(3, gl_interface()->num_draw_arrays_calls());
+
+  // Damage to the hidden window isn't drawn, or bound to its texture.
+  interface()->HandleWindowDamaged(xids[0], 0, 0, 10, 10);
+  interface()->Draw();
+  EXPECT_EQ(3, gl_interface()->num_draw_arrays_calls());
+  OpenGlPixmapData* data = dynamic_cast<OpenGlPixmapData*>(
+      actors[0]->GetDrawingData(OpenGlDrawVisitor::PIXMAP_DATA).get());
+  ASSERT_TRUE(data);
+  EXPECT_TRUE(data->stale());
+
+  // A window that's hidden from the start isn't bound to its pixmap.
+  actors[2]->SetTexturePixmapWindow(xids[2]);
+  stage->AddActor(actors[2].get());
+  actors[2]->LowerToBottom();
+  interface()->Draw();
+  EXPECT_TRUE(actors[2]->is_occluded());
+  EXPECT_FALSE(actors[2]->GetDrawingData(OpenGlDrawVisitor::PIXMAP_DATA));
+  EXPECT_EQ(4, gl_interface()->num_draw_arrays_calls());
+
+  // Once the first window is uncovered, its texture is brought up to
+  // date.
+  actors[1]->Move(300, 0, 0);
+  interface()->Draw();
+  EXPECT_FALSE(actors[0]->is_occluded());
+  EXPECT_TRUE(actors[2]->is_occluded());
+  EXPECT_FALSE(data->stale());
+  EXPECT_EQ(6, gl_interface()->num_draw_arrays_calls());
+}
+
 TEST_F(TidyTest, HandleXEvents) {
   // The interface shouldn't be asking for events about any windows at first.
   EXPECT_TRUE(event_source()->tracked_xids.empty());
@@ -1169,7 +1169,8 @@ void WindowManager::HandleCreateNotify(const XCreateWindowEvent& e) {
 
 void WindowManager::HandleDamageNotify(const XDamageNotifyEvent& e) {
   if (xids_tracked_by_compositor_.count(e.drawable))
-    clutter_->HandleWindowDamaged(e.drawable);
+    clutter_->HandleWindowDamaged(e.drawable, e.area.x, e.area.y,
+                                  e.area.width, e.area.height);
 }
 
 void WindowManager::HandleDestroyNotify(const XDestroyWindowEvent& e) {